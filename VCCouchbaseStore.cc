@@ -8,23 +8,120 @@
  */
 
 #include "VCCouchbaseStore.h"
+#include "abstraction/vcengineregistry.h"
 #include <iostream>
 #include <vector>
 #include <map>
-#include <sstream>
+#include <algorithm>
 #include <cassert>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <unistd.h>
 
-extern "C" {
-    static void error_handler(lcb_t inst, lcb_error_t err, const char *info) {
-        std::cerr << "FATAL: We received an error: "
-                  << lcb_strerror(inst, err);
-        if (info) {
-            std::cerr << " " << info;
+struct VCCouchbaseStore::operation {
+    enum kind_t { LOAD, SAVE, REMOVE, RELOAD };
+
+    operation(kind_t k, VCookie *c, bool heap)
+        : kind(k), cookie(c), merged(NULL), items(NULL), done(NULL),
+          processed(NULL), context(NULL), connection(0), attempts(0),
+          resends(0), owned(heap), submitted(false), resend(false),
+          finished(false), success(false)
+    {
+    }
+
+    // the copy being loaded or saved: the caller's cookie, or once a save
+    // has conflicted, the visitor reloaded with the cookie's changes
+    // replayed on it
+    VCookie *Target() {
+        return merged != NULL ? merged : cookie;
+    }
+
+    kind_t kind;                            // RELOAD is a SAVE that conflicted
+    VCookie *cookie;
+    VCookie *merged;
+    batch *items;                           // stands for a batch
+    VCookieCompletion done;                 // from SubmitLoad/SubmitSave
+    VCookieProcessedCallback processed;     // from the batch calls
+    void *context;
+    unsigned connection;                    // sent on
+    unsigned attempts;                      // retries after a conflict
+    unsigned resends;                       // after a temporary failure
+    bool owned;                             // deleted once complete
+    bool submitted;                         // mark the cookie loaded
+    bool resend;                            // the backoff timer resends
+    bool finished;
+    bool success;
+};
+
+/**
+ * The operations of one LoadVCookies or SaveVCookies call. A multi-command
+ * call hands the same cookie (the batch's tag) back for every command, so
+ * a response is matched to its operation by key: the keys are the first
+ * part of the arena, key i at i * keySize, and order sorts the
+ * operations by them.
+ */
+struct VCCouchbaseStore::batch {
+    batch(std::vector<operation> &ops, const char *keys, size_t keySize)
+        : tag(operation::LOAD, NULL, false), ops(ops), keys(keys),
+          keySize(keySize), order(ops.size())
+    {
+        tag.items = this;
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = i;
         }
-        std::cerr << std::endl
-                  << "       TODO: add recovery. " << std::endl;
+        std::sort(order.begin(), order.end(), by_key(keys, keySize));
+    }
 
-        exit(EXIT_FAILURE);
+    struct by_key {
+        by_key(const char *k, size_t size) : keys(k), keySize(size) {}
+        bool operator()(size_t a, size_t b) const {
+            return memcmp(keys + a * keySize, keys + b * keySize, keySize) < 0;
+        }
+        const char *keys;
+        size_t keySize;
+    };
+
+    // the first operation for the key still waiting for its response on
+    // the connection, the same visitor may be in a batch twice (a retried
+    // or resent one gets its own responses)
+    operation *Find(unsigned connection, const void *key, size_t nkey) {
+        if (nkey != keySize) {
+            return NULL;
+        }
+        size_t low = 0, high = order.size();
+        while (low < high) {
+            size_t middle = (low + high) / 2;
+            if (memcmp(keys + order[middle] * keySize, key, keySize) < 0) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        for (; low < order.size() &&
+                 memcmp(keys + order[low] * keySize, key, keySize) == 0; ++low) {
+            const operation &op = ops[order[low]];
+            if (!op.finished && op.attempts == 0 && op.resends == 0 &&
+                op.connection == connection) {
+                return &ops[order[low]];
+            }
+        }
+        return NULL;
+    }
+
+    operation tag;
+    std::vector<operation> &ops;
+    const char *keys;
+    size_t keySize;
+    std::vector<size_t> order;
+};
+
+extern "C" {
+    static void error_handler(lcb_t instance, lcb_error_t err, const char *info) {
+        VCCouchbaseStore *store = (VCCouchbaseStore*)lcb_get_cookie(instance);
+        store->InstanceError(instance, err, info);
     }
 
     static void store_handler(lcb_t instance, const void *cookie,
@@ -32,260 +129,901 @@ extern "C" {
                               lcb_error_t error,
                               const lcb_store_resp_t *resp)
     {
-        bool *retval = (bool*)cookie;
-        if (error == LCB_SUCCESS) {
-            *retval = true;
+        VCCouchbaseStore *store = (VCCouchbaseStore*)lcb_get_cookie(instance);
+        VCCouchbaseStore::operation *op =
+            store->Resolve(instance, cookie, resp->v.v0.key, resp->v.v0.nkey);
+        if (op == NULL) {
+            store->Unmatched(instance);
+            return;
+        } else if (error == LCB_SUCCESS) {
+            store->Stored(op, resp->v.v0.cas);
+        } else if ((error == LCB_KEY_EEXISTS || error == LCB_KEY_ENOENT) &&
+                   store->KeepsMutationLog()) {
+            // saved by someone else since it was loaded, or gone (expired
+            // or deleted) since
+            store->Conflict(op);
+            return;
+        } else if (store->Retry(op, error)) {
+            return;
         } else {
             std::cerr << "Failed to store object: "
                       << lcb_strerror(instance, error) << std::endl;
-            *retval = false;
         }
+        store->Complete(op, error == LCB_SUCCESS);
     }
 
-    struct get_cookie {
-        std::vector<char> buffer;
-        lcb_error_t error;
-    };
-
     static void get_handler(lcb_t instance, const void *cookie,
                             lcb_error_t error,
                             const lcb_get_resp_t *resp)
     {
-        get_cookie *gc = (get_cookie*)cookie;
-        gc->error = error;
-        if (error == LCB_SUCCESS) {
-            gc->buffer.resize(resp->v.v0.nbytes);
-            std::memcpy(&gc->buffer[0], (char*)resp->v.v0.bytes,
-                        resp->v.v0.nbytes);
+        VCCouchbaseStore *store = (VCCouchbaseStore*)lcb_get_cookie(instance);
+        VCCouchbaseStore::operation *op =
+            store->Resolve(instance, cookie, resp->v.v0.key, resp->v.v0.nkey);
+        bool found = false;
+        if (op == NULL) {
+            store->Unmatched(instance);
+            return;
+        } else if (error == LCB_SUCCESS) {
+            std::vector<char> buffer((const char*)resp->v.v0.bytes,
+                                     (const char*)resp->v.v0.bytes + resp->v.v0.nbytes);
+            found = VCookieStore::Deserialize(*op->Target(), buffer);
+            if (found) {
+                op->Target()->SetCas(resp->v.v0.cas);
+                op->Target()->SetExpiry(store->Expiry(*op->Target()));
+            }
+        } else if (error == LCB_KEY_ENOENT) {
+            op->Target()->SetCas(VCCouchbaseStore::CAS_MISSING);
+        } else if (store->Retry(op, error)) {
+            return;
+        } else {
+            std::cerr << "Failed to get item: "
+                      << lcb_strerror(instance, error) << std::endl;
+        }
+        if (op->kind == VCCouchbaseStore::operation::RELOAD) {
+            store->Reloaded(op);
+        } else {
+            store->Complete(op, found);
         }
     }
 
     static void remove_handler(lcb_t instance, const void *cookie,
                                lcb_error_t error,
-                               const lcb_remove_resp_t *)
+                               const lcb_remove_resp_t *resp)
     {
-        bool *retval = (bool*)cookie;
-        if (error == LCB_SUCCESS) {
-            *retval = true;
-        } else {
+        VCCouchbaseStore *store = (VCCouchbaseStore*)lcb_get_cookie(instance);
+        VCCouchbaseStore::operation *op =
+            store->Resolve(instance, cookie, resp->v.v0.key, resp->v.v0.nkey);
+        if (op == NULL) {
+            store->Unmatched(instance);
+            return;
+        }
+        if (error != LCB_SUCCESS && error != LCB_KEY_ENOENT) {
+            if (store->Retry(op, error)) {
+                return;
+            }
             std::cerr << "Failed to remove object: "
                       << lcb_strerror(instance, error) << std::endl;
-            *retval = false;
         }
+        store->Complete(op, error == LCB_SUCCESS);
+    }
+
+    static void poll_timer_handler(lcb_timer_t, lcb_t instance, const void *)
+    {
+        VCCouchbaseStore *store = (VCCouchbaseStore*)lcb_get_cookie(instance);
+        store->PollTimerFired();
+    }
+
+    static void retry_timer_handler(lcb_timer_t, lcb_t instance, const void *cookie)
+    {
+        VCCouchbaseStore *store = (VCCouchbaseStore*)lcb_get_cookie(instance);
+        store->RetryTimerFired((VCCouchbaseStore::operation*)cookie);
+    }
+}
+
+static const VCEngineOption couchbase_options[] = {
+    { "host", "10.46.20.12:8091", "cluster node(s) to bootstrap from, host:port;host:port" },
+    { "user", "", "bucket user, empty for none" },
+    { "password", "", "bucket password" },
+    { "bucket", "default", "bucket holding the cookies" },
+    { "connections", "1", "libcouchbase instances per thread, sharing its event loop" },
+    { "dispatch", "round-robin", "which connection an operation goes to: round-robin or least-outstanding" },
+    { "timeout-us", "2500000", "an operation with no response by then fails (and a load is retried)" },
+    { "retries", "3", "sends of an operation after a temporary failure, and connection attempts, before giving up" },
+    { "retry-backoff-us", "1000", "wait before the first retry, doubled for each one after" },
+    { "window", "256", "most operations a thread keeps in flight" },
+    { "key", "base64", "document key encoding: binary, hex or base64" },
+    { "key-prefix", "", "put in front of every key, to keep runs apart in one bucket" },
+    { "cas", "on", "save with the CAS from the load and merge on a conflict: on or off" },
+    { "cas-retries", "5", "conflicts on one save before it fails" },
+    { "cas-backoff-us", "100", "wait before the first retry after a conflict, doubled for each one after" },
+    { "ttl", "off", "expire each visitor retention seconds after its last hit: on or off" },
+    { "retention", "31536000", "seconds a visitor is kept after its last hit, with ttl on" },
+    { NULL, NULL, NULL }
+};
+
+VC_REGISTER_ENGINE_FACTORY(VCCouchbaseStore, "couchbase", VCCouchbaseStore::Create,
+                           VC_ENGINE_PERSISTS, couchbase_options,
+                           "libcouchbase, connections= instances per thread");
+
+// an on/off option, false (after saying why) if it's neither
+static bool parse_switch(const VCEngineOptions &options, const char *name,
+                         bool &value)
+{
+    const std::string &text = options.find(name)->second;
+    if (text != "on" && text != "off") {
+        std::cerr << "Unknown " << name << " setting \"" << text
+                  << "\", use on or off" << std::endl;
+        return false;
     }
+    value = text == "on";
+    return true;
 }
 
-VCCouchbaseStore::VCCouchbaseStore()
+VCookieStore *VCCouchbaseStore::Create(const VCEngineOptions &options)
 {
-    lcb_create_st options("10.46.20.12:8091", NULL, NULL, "default");
-    lcb_error_t error = lcb_create(&instance, &options);
+    // Configure() has filled in every option
+    unsigned window = strtoul(options.find("window")->second.c_str(), NULL, 10);
+    VCookieKey::Encoding encoding;
+    if (!VCookieKey::ParseEncoding(options.find("key")->second, encoding)) {
+        std::cerr << "Unknown key encoding \"" << options.find("key")->second
+                  << "\", use binary, hex or base64" << std::endl;
+        return NULL;
+    }
+    bool cas, ttl;
+    if (!parse_switch(options, "cas", cas) || !parse_switch(options, "ttl", ttl)) {
+        return NULL;
+    }
+    const std::string &dispatch = options.find("dispatch")->second;
+    if (dispatch != "round-robin" && dispatch != "least-outstanding") {
+        std::cerr << "Unknown dispatch setting \"" << dispatch
+                  << "\", use round-robin or least-outstanding" << std::endl;
+        return NULL;
+    }
+    unsigned connections = strtoul(options.find("connections")->second.c_str(), NULL, 10);
+
+    VCCouchbaseStore *store =
+        new VCCouchbaseStore(window ? window : 1,
+                             VCookieKey(encoding, options.find("key-prefix")->second),
+                             cas,
+                             strtoul(options.find("cas-retries")->second.c_str(), NULL, 10),
+                             strtoul(options.find("cas-backoff-us")->second.c_str(), NULL, 10),
+                             ttl,
+                             strtoul(options.find("retention")->second.c_str(), NULL, 10),
+                             dispatch == "round-robin" ? ROUND_ROBIN : LEAST_OUTSTANDING,
+                             strtoul(options.find("retries")->second.c_str(), NULL, 10),
+                             strtoul(options.find("retry-backoff-us")->second.c_str(), NULL, 10));
+    if (!store->Connect(options.find("host")->second,
+                        options.find("user")->second,
+                        options.find("password")->second,
+                        options.find("bucket")->second,
+                        connections ? connections : 1,
+                        strtoul(options.find("timeout-us")->second.c_str(), NULL, 10))) {
+        delete store;
+        return NULL;
+    }
+    return store;
+}
+
+VCCouchbaseStore::VCCouchbaseStore(unsigned window,
+                                   const VCookieKey &key,
+                                   bool cas,
+                                   unsigned casRetries,
+                                   unsigned casBackoffUS,
+                                   bool ttl,
+                                   unsigned long retention,
+                                   dispatch_t dispatch,
+                                   unsigned resendLimit,
+                                   unsigned resendBackoffUS)
+    : io(NULL), waiting(NULL), dispatch(dispatch), next(0), key(key),
+      window(window), outstanding(0), completed(0), breakOn(NULL),
+      breakAt(ULLONG_MAX), running(false), pollTimer(NULL), cas(cas),
+      casRetries(casRetries), casBackoffUS(casBackoffUS), casWrites(0),
+      conflicts(0), retries(0), casFailures(0), ttl(ttl),
+      retention(retention), ttlWrites(0), ttlChanges(0), ttlExpired(0),
+      resendLimit(resendLimit), resendBackoffUS(resendBackoffUS),
+      resends(0), resendFailures(0), instanceErrors(0)
+{
+}
+
+bool VCCouchbaseStore::Connect(const std::string &host,
+                               const std::string &user,
+                               const std::string &password,
+                               const std::string &bucket,
+                               unsigned count,
+                               unsigned timeoutUS)
+{
+    // one event loop for every instance, so waiting on any of them
+    // moves them all along
+    lcb_error_t error = lcb_create_io_ops(&io, NULL);
     if (error != LCB_SUCCESS) {
-        std::cerr << "Failed to create instance: "
+        std::cerr << "Failed to create the event loop: "
                   << lcb_strerror(NULL, error) << std::endl;
-        exit(EXIT_FAILURE);
+        io = NULL;
+        return false;
     }
-    lcb_set_error_callback(instance, error_handler);
-    lcb_set_store_callback(instance, store_handler);
-    lcb_set_get_callback(instance, get_handler);
-    lcb_set_remove_callback(instance, remove_handler);
-    lcb_behavior_set_syncmode(instance, LCB_SYNCHRONOUS);
 
-    if ((error = lcb_connect(instance)) != LCB_SUCCESS) {
-        std::cerr << "Failed to connect to cluster: "
-                  << lcb_strerror(NULL, error) << std::endl;
+    lcb_create_st options(host.c_str(),
+                          user.empty() ? NULL : user.c_str(),
+                          password.empty() ? NULL : password.c_str(),
+                          bucket.c_str(), io);
+    while (connections.size() < count) {
+        for (unsigned attempt = 0; ; ++attempt) {
+            lcb_t instance;
+            if ((error = lcb_create(&instance, &options)) != LCB_SUCCESS) {
+                std::cerr << "Failed to create instance: "
+                          << lcb_strerror(NULL, error) << std::endl;
+                return false;
+            }
+            lcb_set_cookie(instance, this);
+            lcb_set_error_callback(instance, error_handler);
+            lcb_set_store_callback(instance, store_handler);
+            lcb_set_get_callback(instance, get_handler);
+            lcb_set_remove_callback(instance, remove_handler);
+            lcb_set_timeout(instance, timeoutUS);
+
+            // asynchronous: the connection is made by the event loop, and
+            // the error handler hears if it can't be
+            unsigned long long errorsBefore = instanceErrors;
+            if ((error = lcb_connect(instance)) != LCB_SUCCESS) {
+                std::cerr << "Failed to connect to cluster: "
+                          << lcb_strerror(NULL, error) << std::endl;
+            } else {
+                lcb_wait(instance);
+                if (instanceErrors == errorsBefore) {
+                    connection c = { instance, 0, 0 };
+                    connections.push_back(c);
+                    break;
+                }
+            }
+            lcb_destroy(instance);
+            if (attempt >= resendLimit) {
+                std::cerr << "Failed to connect to " << host << " after "
+                          << attempt + 1 << " attempts" << std::endl;
+                return false;
+            }
+            usleep(resendBackoffUS << std::min(attempt, 16U));
+        }
     }
+    return true;
 }
 
 VCCouchbaseStore::~VCCouchbaseStore()
 {
-    lcb_destroy(instance);
+    Wait();
+    for (size_t i = 0; i < connections.size(); ++i) {
+        lcb_destroy(connections[i].instance);
+    }
+    if (io != NULL) {
+        lcb_destroy_io_ops(io);
+    }
 }
 
-bool VCCouchbaseStore::SaveVCookie(VCookie const &vcookie)
+void VCCouchbaseStore::InstanceError(lcb_t instance, lcb_error_t error,
+                                     const char *info)
 {
-    std::vector<char> buffer;
-    Serialize(vcookie, buffer);
+    ++instanceErrors;
+    std::cerr << "Couchbase error: " << lcb_strerror(instance, error);
+    if (info != NULL) {
+        std::cerr << " " << info;
+    }
+    std::cerr << std::endl;
+}
 
-    std::stringstream ss;
-    ss << vcookie.GetUser();
-    std::string key = ss.str();
+bool VCCouchbaseStore::Submit(operation *op, const VCookie &vcookie,
+                              const std::vector<char> *value)
+{
+    MakeRoom(1);
 
-    lcb_store_cmd_t cmd(LCB_SET,
-                        key.data(), key.length(),
-                        &buffer[0], buffer.size());
-    const lcb_store_cmd_t * const commands[] = { &cmd };
-    bool retval;
-    lcb_error_t error = lcb_store(instance, &retval, 1, commands);
+    // scheduled after the wait, the completions run by it may submit too
+    op->connection = Pick(1);
+    lcb_error_t error = Schedule(op, vcookie, value);
     if (error != LCB_SUCCESS) {
-        std::cerr << "Failed to store item: "
-                  << lcb_strerror(instance, error) << std::endl;
+        std::cerr << "Failed to schedule operation: "
+                  << lcb_strerror(connections[op->connection].instance, error)
+                  << std::endl;
+        if (op->owned) {
+            delete op;
+        }
         return false;
     }
+    ++outstanding;
+    ++connections[op->connection].outstanding;
+    return true;
+}
 
-    return retval;
+// the connection for the next ops operations (one, or a batch sent in
+// one call)
+unsigned VCCouchbaseStore::Pick(unsigned ops)
+{
+    unsigned pick = next;
+    next = (next + 1) % connections.size();
+    if (dispatch == LEAST_OUTSTANDING) {
+        // ties go round, or an idle store would only ever use the first
+        for (unsigned i = 0; i < connections.size(); ++i) {
+            unsigned c = (next + i) % connections.size();
+            if (connections[c].outstanding < connections[pick].outstanding) {
+                pick = c;
+            }
+        }
+    }
+    connections[pick].dispatched += ops;
+    return pick;
 }
 
-bool VCCouchbaseStore::LoadVCookie(VCookie &vcookie)
+// stop the event loop, which only the instance waited on can do
+void VCCouchbaseStore::Breakout()
 {
-    std::stringstream ss;
-    ss << vcookie.GetUser();
-    std::string key = ss.str();
+    if (waiting != NULL) {
+        lcb_breakout(waiting);
+    }
+}
 
-    lcb_get_cmd_t cmd(key.data(), key.length());
-    const lcb_get_cmd_t * const commands[] = { &cmd };
-    struct get_cookie gc;
-    lcb_error_t error = lcb_get(instance, &gc, 1, commands);
-    if (error != LCB_SUCCESS) {
-        std::cerr << "Failed to get item: "
-                  << lcb_strerror(instance, error) << std::endl;
-        return false;
+// the command for the operation on its connection, not counted as
+// outstanding (a retry already is)
+lcb_error_t VCCouchbaseStore::Schedule(operation *op, const VCookie &vcookie,
+                                       const std::vector<char> *value)
+{
+    lcb_t instance = connections[op->connection].instance;
+
+    // the commands are copied into the output buffers as they're
+    // scheduled, so one key buffer does for every operation
+    VC_STAGE_TIMER(keyTimer, VC_STAGE_KEY);
+    key.Encode(vcookie);
+    VC_STAGE_STOP(keyTimer);
+
+    switch (op->kind) {
+    case operation::LOAD:
+    case operation::RELOAD: {
+        lcb_get_cmd_t cmd(key.Data(), key.Size());
+        const lcb_get_cmd_t * const commands[] = { &cmd };
+        return lcb_get(instance, op, 1, commands);
+    }
+    case operation::SAVE: {
+        lcb_store_cmd_t cmd(LCB_SET, key.Data(), key.Size(),
+                            &(*value)[0], value->size());
+        UseCas(cmd, vcookie);
+        UseExpiry(cmd, vcookie);
+        const lcb_store_cmd_t * const commands[] = { &cmd };
+        return lcb_store(instance, op, 1, commands);
+    }
+    default: {
+        lcb_remove_cmd_t cmd(key.Data(), key.Size());
+        const lcb_remove_cmd_t * const commands[] = { &cmd };
+        return lcb_remove(instance, op, 1, commands);
     }
+    }
+}
 
-    if (gc.error == LCB_SUCCESS) {
-        Deserialize(vcookie, gc.buffer);
-        return true;
+// a cookie that was loaded is saved only over the copy it was loaded
+// from, one that was looked for and not found only if it still isn't
+// there; a cookie the store never loaded is simply set
+void VCCouchbaseStore::UseCas(lcb_store_cmd_t &cmd, const VCookie &vcookie)
+{
+    unsigned long long loaded = vcookie.GetCas();
+    if (!cas || loaded == 0) {
+        return;
+    }
+    if (loaded == CAS_MISSING) {
+        cmd.v.v0.operation = LCB_ADD;
     } else {
-        if (gc.error != LCB_KEY_ENOENT) {
-            std::cerr << "Failed to get item: "
-                      << lcb_strerror(instance, gc.error) << std::endl;
+        cmd.v.v0.cas = loaded;
+    }
+}
+
+time_t VCCouchbaseStore::Expiry(const VCookie &vcookie) const
+{
+    // past 30 days the server takes an expiry as an absolute time, which
+    // any real hit time plus the retention is
+    if (!ttl || vcookie.GetLastHitTimeGMT() <= 0) {
+        return 0;
+    }
+    return vcookie.GetLastHitTimeGMT() + (time_t)retention;
+}
+
+void VCCouchbaseStore::UseExpiry(lcb_store_cmd_t &cmd, const VCookie &vcookie)
+{
+    if (ttl) {
+        cmd.v.v0.exptime = (lcb_time_t)Expiry(vcookie);
+    }
+}
+
+// the cookie remembers the CAS and expiry of the copy it was loaded from
+// (or last saved), so only a save that went through changes them, and
+// is counted
+void VCCouchbaseStore::Stored(operation *op, unsigned long long newCas)
+{
+    VCookie &saved = *op->Target();
+    if (cas && saved.GetCas() != 0) {
+        ++casWrites;
+    }
+    if (ttl) {
+        // what UseExpiry sent, the cookie hasn't changed since
+        time_t expiry = Expiry(saved);
+        ++ttlWrites;
+        if (expiry != saved.GetExpiry()) {
+            ++ttlChanges;
+            saved.SetExpiry(expiry);
+        }
+        if (expiry != 0 && expiry <= time(NULL)) {
+            // replayed hits older than the retention: gone as soon as saved
+            ++ttlExpired;
+        }
+    }
+    saved.SetCas(newCas);
+}
+
+// wait for completions until count more operations fit in the window
+void VCCouchbaseStore::MakeRoom(unsigned count)
+{
+    // a completion submitting more can't wait, the loop is already running
+    if (!running && outstanding > 0 && outstanding + count > window) {
+        unsigned over = outstanding + count - window;
+        Run(NULL, completed + std::min(over, outstanding));
+    }
+}
+
+VCCouchbaseStore::operation *VCCouchbaseStore::Resolve(lcb_t instance,
+                                                       const void *cookie,
+                                                       const void *key,
+                                                       size_t nkey)
+{
+    operation *op = (operation*)cookie;
+    if (op->items == NULL) {
+        return op;
+    }
+    unsigned c = 0;
+    while (c < connections.size() && connections[c].instance != instance) {
+        ++c;
+    }
+    return op->items->Find(c, key, nkey);
+}
+
+void VCCouchbaseStore::Unmatched(lcb_t instance)
+{
+    std::cerr << "Response for a key not in its batch" << std::endl;
+    --outstanding;
+    ++completed;
+    for (size_t i = 0; i < connections.size(); ++i) {
+        if (connections[i].instance == instance) {
+            --connections[i].outstanding;
+        }
+    }
+    if (completed >= breakAt) {
+        Breakout();
+    }
+}
+
+void VCCouchbaseStore::Complete(operation *op, bool success)
+{
+    --outstanding;
+    --connections[op->connection].outstanding;
+    ++completed;
+    op->finished = true;
+    op->success = success;
+
+    if (op->kind == operation::LOAD && op->submitted) {
+        op->cookie->Loaded(success);
+    }
+    if (op->merged != NULL) {
+        if (success) {
+            // the caller's cookie becomes the merged visitor it saved
+            Serialize(*op->merged, blob);
+            op->cookie->Reset(op->cookie->GetUser(), op->cookie->GetVisIdHigh(),
+                              op->cookie->GetVisIdLow());
+            Deserialize(*op->cookie, blob);
+            op->cookie->Saved();
+            op->cookie->SetCas(op->merged->GetCas());
+            op->cookie->SetExpiry(op->merged->GetExpiry());
         }
+        op->merged->Saved();        // or its destructor saves it
+        delete op->merged;
+        op->merged = NULL;
+    }
+    if (op->done != NULL) {
+        op->done(success, *op->cookie, op->context);
+    }
+    if (op->processed != NULL) {
+        op->processed(success, *op->cookie);
+    }
+
+    if (op == breakOn || completed >= breakAt) {
+        Breakout();
+    }
+    if (op->owned) {
+        delete op;
+    }
+}
+
+// run the event loop until the operation completes, or the count of
+// completions reaches target, or nothing is left in flight
+void VCCouchbaseStore::Run(operation *until, unsigned long long target)
+{
+    breakOn = until;
+    breakAt = target;
+    running = true;
+    while (outstanding > 0 && completed < target &&
+           (until == NULL || !until->finished)) {
+        // lcb_wait returns once the instance waited on has nothing in
+        // flight, whatever the others still have
+        connection *c = until != NULL ? &connections[until->connection] : NULL;
+        for (size_t i = 0; i < connections.size() &&
+                 (c == NULL || c->outstanding == 0); ++i) {
+            c = &connections[i];
+        }
+        waiting = c->instance;
+        lcb_wait(waiting);
+        waiting = NULL;
+    }
+    running = false;
+    breakOn = NULL;
+    breakAt = ULLONG_MAX;
+}
+
+bool VCCouchbaseStore::SubmitLoad(VCookie &vcookie, VCookieCompletion done,
+                                  void *context)
+{
+    operation *op = new operation(operation::LOAD, &vcookie, true);
+    op->done = done;
+    op->context = context;
+    op->submitted = true;
+    return Submit(op, vcookie, NULL);
+}
+
+bool VCCouchbaseStore::SubmitSave(VCookie &vcookie, VCookieCompletion done,
+                                  void *context)
+{
+    std::vector<char> buffer;
+    Serialize(vcookie, buffer);
+
+    operation *op = new operation(operation::SAVE, &vcookie, true);
+    op->done = done;
+    op->context = context;
+    op->submitted = true;
+    return Submit(op, vcookie, &buffer);
+}
+
+void VCCouchbaseStore::Conflict(operation *op)
+{
+    ++conflicts;
+    if (op->attempts >= casRetries) {
+        ++casFailures;
+        std::cerr << "Failed to store object: still conflicting after "
+                  << op->attempts << " retries" << std::endl;
+        Complete(op, false);
+        return;
+    }
+
+    // back off, so writers in step with each other fall out of it
+    ++op->attempts;
+    ++retries;
+    lcb_error_t error;
+    unsigned delay = casBackoffUS << std::min(op->attempts - 1, 16U);
+    if (lcb_timer_create(connections[op->connection].instance, op, delay, 0,
+                         retry_timer_handler, &error) == NULL) {
+        RetryTimerFired(op);
+    }
+}
+
+// Only what the server turned away is sure not to have happened: a timeout
+// or a lost connection may come after a save or delete was done, and
+// doing it again could undo a later one, so those are retried for loads
+// alone
+static bool transient(lcb_error_t error, bool idempotent)
+{
+    switch (error) {
+    case LCB_ETMPFAIL:
+    case LCB_CLIENT_ETMPFAIL:
+    case LCB_BUSY:
+        return true;
+    case LCB_ETIMEDOUT:
+    case LCB_NETWORK_ERROR:
+        return idempotent;
+    default:
         return false;
     }
 }
 
-bool VCCouchbaseStore::DeleteVCookie(VCookie &vcookie)
+bool VCCouchbaseStore::Retry(operation *op, lcb_error_t error)
 {
-    std::stringstream ss;
-    ss << vcookie.GetUser();
-    std::string key = ss.str();
+    bool load = op->kind == operation::LOAD || op->kind == operation::RELOAD;
+    if (!transient(error, load)) {
+        return false;
+    }
+    if (op->resends >= resendLimit) {
+        ++resendFailures;
+        return false;
+    }
+
+    ++op->resends;
+    ++resends;
+    op->resend = true;
+    lcb_error_t timerError;
+    unsigned delay = resendBackoffUS << std::min(op->resends - 1, 16U);
+    if (lcb_timer_create(connections[op->connection].instance, op, delay, 0,
+                         retry_timer_handler, &timerError) == NULL) {
+        RetryTimerFired(op);
+    }
+    return true;
+}
+
+// the operation again as it was, on the same connection
+void VCCouchbaseStore::Resend(operation *op)
+{
+    const std::vector<char> *value = NULL;
+    if (op->kind == operation::SAVE) {
+        // the batch's arena or the submitter's buffer may be gone
+        Serialize(*op->Target(), blob);
+        value = &blob;
+    }
+    lcb_error_t error = Schedule(op, *op->Target(), value);
+    if (error != LCB_SUCCESS) {
+        std::cerr << "Failed to schedule operation: "
+                  << lcb_strerror(connections[op->connection].instance, error)
+                  << std::endl;
+        if (op->kind == operation::RELOAD) {
+            op->kind = operation::SAVE;
+        }
+        Complete(op, false);
+    }
+}
+
+void VCCouchbaseStore::RetryTimerFired(operation *op)
+{
+    if (op->resend) {
+        op->resend = false;
+        Resend(op);
+        return;
+    }
+
+    VCookie &cookie = *op->cookie;
+    if (op->merged == NULL) {
+        op->merged = new VCookie(cookie.GetUser(), cookie.GetVisIdHigh(),
+                                 cookie.GetVisIdLow(), true, *this);
+    } else {
+        op->merged->Reset(cookie.GetUser(), cookie.GetVisIdHigh(),
+                          cookie.GetVisIdLow());
+    }
+
+    op->kind = operation::RELOAD;
+    lcb_error_t error = Schedule(op, *op->merged, NULL);
+    if (error != LCB_SUCCESS) {
+        std::cerr << "Failed to schedule operation: "
+                  << lcb_strerror(connections[op->connection].instance, error)
+                  << std::endl;
+        op->kind = operation::SAVE;
+        Complete(op, false);
+    }
+}
+
+void VCCouchbaseStore::Reloaded(operation *op)
+{
+    op->kind = operation::SAVE;
+    if (op->merged->GetCas() == 0) {
+        // the get failed, not knowing what's there a save could lose it
+        Complete(op, false);
+        return;
+    }
 
-    lcb_remove_cmd_t cmd(key.data(), key.length());
-    const lcb_remove_cmd_t * const commands[] = { &cmd };
-    bool retval;
-    lcb_error_t error = lcb_remove(instance, &retval, 1, commands);
+    if (op->merged->GetCas() == CAS_MISSING) {
+        // gone: added back whole, its changes alone would lose the rest
+        Serialize(*op->cookie, blob);
+        Deserialize(*op->merged, blob);
+    } else {
+        op->cookie->ReplayLog(*op->merged);
+        Serialize(*op->merged, blob);
+    }
+    lcb_error_t error = Schedule(op, *op->merged, &blob);
     if (error != LCB_SUCCESS) {
-        std::cerr << "Failed to remove item: "
-                  << lcb_strerror(instance, error) << std::endl;
+        std::cerr << "Failed to schedule operation: "
+                  << lcb_strerror(connections[op->connection].instance, error)
+                  << std::endl;
+        Complete(op, false);
+    }
+}
+
+void VCCouchbaseStore::PollTimerFired()
+{
+    pollTimer = NULL;       // libcouchbase frees a one-shot timer after it fires
+    Breakout();
+}
+
+unsigned VCCouchbaseStore::Poll()
+{
+    if (outstanding == 0 || running) {
+        return 0;
+    }
+
+    // one pass of the event loop: an immediate timer breaks it out again
+    unsigned long long before = completed;
+    lcb_error_t error;
+    lcb_t instance = connections[0].instance;
+    pollTimer = lcb_timer_create(instance, NULL, 0, 0, poll_timer_handler, &error);
+    if (pollTimer == NULL) {
+        return 0;
+    }
+    running = true;
+    waiting = instance;
+    lcb_wait(instance);
+    waiting = NULL;
+    running = false;
+    if (pollTimer != NULL) {
+        lcb_timer_destroy(instance, pollTimer);
+        pollTimer = NULL;
+    }
+    return (unsigned)(completed - before);
+}
+
+unsigned VCCouchbaseStore::Wait(unsigned count)
+{
+    if (running) {
+        return 0;
+    }
+    unsigned long long before = completed;
+    Run(NULL, count ? completed + count : ULLONG_MAX);
+    return (unsigned)(completed - before);
+}
+
+unsigned VCCouchbaseStore::Outstanding() const
+{
+    return outstanding;
+}
+
+bool VCCouchbaseStore::SaveVCookie(VCookie const &vcookie)
+{
+    std::vector<char> buffer;
+    Serialize(vcookie, buffer);
+
+    VC_STAGE_TIMER(setTimer, VC_STAGE_SET);
+    operation op(operation::SAVE, const_cast<VCookie*>(&vcookie), false);
+    if (!Submit(&op, vcookie, &buffer)) {
         return false;
     }
+    Run(&op, ULLONG_MAX);
+    return op.success;
+}
 
-    return retval;
+bool VCCouchbaseStore::LoadVCookie(VCookie &vcookie)
+{
+    VC_STAGE_TIMER(getTimer, VC_STAGE_GET);
+    operation op(operation::LOAD, &vcookie, false);
+    if (!Submit(&op, vcookie, NULL)) {
+        return false;
+    }
+    Run(&op, ULLONG_MAX);
+    return op.success;
 }
 
-struct bulk_cookie {
-    std::map<std::string, VCookie*> objects;
-    VCookieProcessedCallback callback;
-};
+bool VCCouchbaseStore::DeleteVCookie(VCookie &vcookie)
+{
+    operation op(operation::REMOVE, &vcookie, false);
+    if (!Submit(&op, vcookie, NULL)) {
+        return false;
+    }
+    Run(&op, ULLONG_MAX);
+    return op.success;
+}
 
-extern "C" {
-    static void bulk_get_handler(lcb_t instance, const void *cookie,
-                                 lcb_error_t status,
-                                 const lcb_get_resp_t *resp)
-    {
-        std::string key((const char*)resp->v.v0.key, resp->v.v0.nkey);
-        bulk_cookie *gc = (bulk_cookie*)cookie;
-        VCookie *obj = gc->objects[key];
-        assert(obj != NULL);
-
-        if (status == LCB_SUCCESS) {
-            std::vector<char> buffer;
-            buffer.resize(resp->v.v0.nbytes);
-            std::memcpy(&buffer[0], (const char*)resp->v.v0.bytes,
-                        resp->v.v0.nbytes);
-            VCookieStore::Deserialize(*obj, buffer);
-        }
+// the keys of the batch into the start of the arena, and an operation
+// for each cookie
+template <typename T>
+void VCCouchbaseStore::StartBatch(std::vector<T*> &cookies,
+                                  int kind,
+                                  VCookieProcessedCallback callback,
+                                  std::vector<operation> &ops)
+{
+    size_t keySize = key.Size();
+    arena.resize(cookies.size() * keySize);
+    ops.reserve(cookies.size());
+    for (size_t i = 0; i < cookies.size(); ++i) {
+        key.Encode(*cookies[i]);
+        memcpy(&arena[i * keySize], key.Data(), keySize);
+        ops.push_back(operation((operation::kind_t)kind,
+                                const_cast<VCookie*>(cookies[i]), false));
+        ops.back().processed = callback;
+    }
+}
 
-        if (gc->callback != NULL) {
-            gc->callback((status == LCB_SUCCESS), *obj);
-        }
+// schedule the commands of a batch, spread evenly over the connections
+// and up to window of them in each call, then wait for all of them
+template <typename C>
+void VCCouchbaseStore::RunBatch(batch &items, std::vector<C> &commands,
+                                lcb_error_t (*schedule)(lcb_t, const void*,
+                                                        lcb_size_t,
+                                                        const C *const *))
+{
+    std::vector<const C*> pointers(commands.size());
+    for (size_t i = 0; i < commands.size(); ++i) {
+        pointers[i] = &commands[i];
     }
 
-    static void bulk_store_handler(lcb_t instance, const void *cookie,
-                                   lcb_storage_t operation,
-                                   lcb_error_t error,
-                                   const lcb_store_resp_t *resp)
-    {
-        bool *retval = (bool*)cookie;
-        if (error == LCB_SUCCESS) {
-            *retval = true;
-        } else {
-            std::cerr << "Failed to store object: "
+    size_t share = (commands.size() + connections.size() - 1) / connections.size();
+    share = std::min<size_t>(share, window);
+    for (size_t first = 0; first < commands.size(); first += share) {
+        unsigned count = (unsigned)std::min<size_t>(share, commands.size() - first);
+        MakeRoom(count);
+        unsigned c = Pick(count);
+        for (size_t i = first; i < first + count; ++i) {
+            items.ops[i].connection = c;
+        }
+        lcb_t instance = connections[c].instance;
+        lcb_error_t error = schedule(instance, &items.tag, count, &pointers[first]);
+        if (error != LCB_SUCCESS) {
+            std::cerr << "Failed to schedule batch: "
                       << lcb_strerror(instance, error) << std::endl;
-            *retval = false;
+            for (size_t i = first; i < first + count; ++i) {
+                operation &op = items.ops[i];
+                op.finished = true;
+                if (op.processed != NULL) {
+                    op.processed(false, *op.cookie);
+                }
+            }
+            continue;
         }
+        outstanding += count;
+        connections[c].outstanding += count;
     }
+
+    // the operations live on the caller's stack
+    Wait();
 }
 
 void VCCouchbaseStore::LoadVCookies(std::vector<VCookie*> &cookies,
                                     VCookieProcessedCallback callback)
 {
-    lcb_behavior_set_syncmode(instance, LCB_ASYNCHRONOUS);
-    lcb_set_get_callback(instance, bulk_get_handler);
-
-    struct bulk_cookie bc;
-    bc.callback = callback;
-    lcb_get_cmd_t *cmds;
-    lcb_get_cmd_t **commands;
+    if (cookies.empty()) {
+        return;
+    }
 
-    cmds = (lcb_get_cmd_t*)calloc(cookies.size(), sizeof(lcb_get_cmd_t));
-    commands = (lcb_get_cmd_t**)calloc(cookies.size(), sizeof(lcb_get_cmd_t*));
+    std::vector<operation> ops;
+    StartBatch(cookies, operation::LOAD, callback, ops);
 
-    std::vector<VCookie*>::iterator ii;
-    int idx;
-    for (idx = 0, ii = cookies.begin(); ii != cookies.end(); ++ii, ++idx) {
-        VCookie *cookie = *ii;
-        std::stringstream ss;
-        ss << cookie->GetUser();
-        std::string key = ss.str();
-        bc.objects[key] = cookie;
-        cmds[idx].v.v0.key = key.data();
-        cmds[idx].v.v0.nkey = key.length();
-        commands[idx] = cmds + idx;
+    size_t keySize = key.Size();
+    std::vector<lcb_get_cmd_t> commands(cookies.size());
+    for (size_t i = 0; i < cookies.size(); ++i) {
+        commands[i] = lcb_get_cmd_t(&arena[i * keySize], keySize);
     }
 
-    lcb_error_t error = lcb_get(instance, &bc, cookies.size(), commands);
-    assert(error == LCB_SUCCESS);
-
-    lcb_wait(instance);
-    free(cmds);
-    free(commands);
-    lcb_behavior_set_syncmode(instance, LCB_SYNCHRONOUS);
-    lcb_set_get_callback(instance, get_handler);
+    batch items(ops, &arena[0], keySize);
+    RunBatch(items, commands, lcb_get);
 }
 
 void VCCouchbaseStore::SaveVCookies(std::vector<const VCookie*> &cookies,
                                     VCookieProcessedCallback callback)
 {
-    lcb_behavior_set_syncmode(instance, LCB_ASYNCHRONOUS);
-    lcb_set_store_callback(instance, bulk_store_handler);
-
-    struct bulk_cookie bc;
-    bc.callback = callback;
-    std::vector<const VCookie*>::iterator ii;
-    for (ii = cookies.begin(); ii != cookies.end(); ++ii) {
-        const VCookie *cookie = *ii;
-        std::stringstream ss;
-        ss << cookie->GetUser();
-        std::string key = ss.str();
-        bc.objects[key] = const_cast<VCookie*>(cookie);
+    if (cookies.empty()) {
+        return;
+    }
 
-        std::vector<char> buffer;
-        Serialize(*cookie, buffer);
+    std::vector<operation> ops;
+    StartBatch(cookies, operation::SAVE, callback, ops);
 
-        lcb_store_cmd_t cmd(LCB_SET, key.data(), key.length(),
-                            &buffer[0], buffer.size());
+    // the blobs after the keys; pointers into the arena once it's done
+    // growing
+    std::vector<size_t> offsets(cookies.size() + 1);
+    for (size_t i = 0; i < cookies.size(); ++i) {
+        offsets[i] = arena.size();
+        Serialize(*cookies[i], blob);
+        arena.insert(arena.end(), blob.begin(), blob.end());
+    }
+    offsets[cookies.size()] = arena.size();
 
-        const lcb_store_cmd_t * const commands[] = { &cmd };
-        bool retval;
-        lcb_error_t error = lcb_store(instance, &retval, 1, commands);
-        assert(error == LCB_SUCCESS);
+    size_t keySize = key.Size();
+    std::vector<lcb_store_cmd_t> commands(cookies.size());
+    for (size_t i = 0; i < cookies.size(); ++i) {
+        commands[i] = lcb_store_cmd_t(LCB_SET, &arena[i * keySize], keySize,
+                                      &arena[offsets[i]],
+                                      offsets[i + 1] - offsets[i]);
+        UseCas(commands[i], *cookies[i]);
+        UseExpiry(commands[i], *cookies[i]);
     }
 
-    lcb_wait(instance);
-    lcb_behavior_set_syncmode(instance, LCB_SYNCHRONOUS);
-    lcb_set_store_callback(instance, store_handler);
+    batch items(ops, &arena[0], keySize);
+    RunBatch(items, commands, lcb_store);
 }
 
+// nothing to do: with ttl on the server expires the visitors the purge
+// would delete (those retention seconds past their last hit) by itself,
+// and a bucket can't be scanned for them at any reasonable cost
 unsigned long long VCCouchbaseStore::DeleteOldVCookies(time_t t)
 {
     return 0;
@@ -301,3 +1039,33 @@ bool VCCouchbaseStore::GetVCookie(VCookie &vcookie,
 {
         return false;
 }
+
+void VCCouchbaseStore::GetStats(std::map<std::string, unsigned long long> &stats) const
+{
+    stats["retry.resends"] += resends;
+    stats["retry.failures"] += resendFailures;
+    stats["instance.errors"] += instanceErrors;
+    if (connections.size() > 1) {
+        for (size_t i = 0; i < connections.size(); ++i) {
+            std::ostringstream name;
+            name << "connection." << i << ".ops";
+            stats[name.str()] += connections[i].dispatched;
+        }
+    }
+    if (cas) {
+        stats["cas.writes"] += casWrites;
+        stats["cas.conflicts"] += conflicts;
+        stats["cas.retries"] += retries;
+        stats["cas.failures"] += casFailures;
+    }
+    if (ttl) {
+        stats["ttl.writes"] += ttlWrites;
+        stats["ttl.changes"] += ttlChanges;
+        stats["ttl.expired"] += ttlExpired;
+    }
+}
+
+bool VCCouchbaseStore::KeepsMutationLog() const
+{
+    return cas;
+}
@@ -4,6 +4,40 @@
  * Implementation of the VCookieStore that utilize Couchbase to store the
  * objects in.
  *
+ * Every operation goes through asynchronous libcouchbase instances, as
+ * many as connections says, sharing one event loop: the Submit calls
+ * schedule a command on one of them (in turn, or the one with the fewest
+ * in flight, as dispatch says) and return, up to a window of commands are
+ * in flight across them all, and the event loop runs (delivering the
+ * completions) inside Poll, Wait and the synchronous calls, which are a
+ * submit followed by a wait for that one operation. The batch calls
+ * encode every key (and blob) into one arena and spread the batch over
+ * the connections with one multi-command call each. Completions must not
+ * call the synchronous or batch methods, they would run the event loop
+ * from inside itself.
+ *
+ * An operation the server turns away for now (temporary failure, busy)
+ * is sent again after a backoff that doubles each time, up to retries
+ * times; so is a load that timed out or lost its connection. A save or
+ * delete that did either may have been done, so it fails instead. Errors
+ * of an instance (a node lost, the bucket refused) are reported and
+ * counted, and connecting is retried the same way before Create gives up.
+ *
+ * With cas on, a cookie remembers the CAS it was loaded with and is saved
+ * with it (added, if the load found nothing), so a save can't silently
+ * overwrite what another writer saved in between. When it would, the
+ * store waits a little, loads the visitor again, replays the cookie's
+ * mutation log on top and tries again with the new CAS, up to
+ * cas-retries times. The cookie ends up holding the merged visitor. A
+ * visitor that expired or was deleted since the load is added back as
+ * the cookie has it, the same way.
+ *
+ * A bucket can't be scanned for old visitors at any reasonable cost, so
+ * with ttl on every save sets the document's expiry to retention seconds
+ * after the visitor's last hit and the server drops idle visitors by
+ * itself. DeleteOldVCookies does nothing either way: set retention to
+ * the age the purge would have used.
+ *
  * @author Trond Norbye
  */
 #ifndef LCB_STORE_H
@@ -11,20 +45,44 @@
 
 #include "abstraction/vcookie.h"
 #include "abstraction/vcookiestore.h"
+#include "abstraction/vcengineregistry.h"
+#include "abstraction/vcookiekey.h"
 #include <libcouchbase/couchbase.h>
 
 class VCCouchbaseStore: public VCookieStore
 {
 public:
-    VCCouchbaseStore();
+    enum dispatch_t { ROUND_ROBIN, LEAST_OUTSTANDING };
+
+    VCCouchbaseStore(unsigned window, const VCookieKey &key, bool cas,
+                     unsigned casRetries, unsigned casBackoffUS, bool ttl,
+                     unsigned long retention, dispatch_t dispatch,
+                     unsigned resendLimit, unsigned resendBackoffUS);
     virtual ~VCCouchbaseStore();
 
+    // make the connections; false (after saying why) if one of them can't
+    // be made in retries attempts
+    bool Connect(const std::string &host, const std::string &user,
+                 const std::string &password, const std::string &bucket,
+                 unsigned connections, unsigned timeoutUS);
+
+    // engine.couchbase.host=, user=, password=, bucket=, connections=,
+    // dispatch=, timeout-us=, retries=, retry-backoff-us=, window=, key=,
+    // key-prefix=, cas=, cas-retries=, cas-backoff-us=, ttl=, retention=
+    static VCookieStore *Create(const VCEngineOptions &options);
+
 
     void SaveVCookies(std::vector<const VCookie*> &cookies,
                       VCookieProcessedCallback callback);
     virtual void LoadVCookies(std::vector<VCookie*> &cookies,
                               VCookieProcessedCallback callback);
 
+    virtual bool SubmitLoad(VCookie &vcookie, VCookieCompletion done, void *context);
+    virtual bool SubmitSave(VCookie &vcookie, VCookieCompletion done, void *context);
+    virtual unsigned Poll();
+    virtual unsigned Wait(unsigned count = 0);
+    virtual unsigned Outstanding() const;
+
 	virtual bool SaveVCookie(VCookie const &vcookie);
 	virtual bool LoadVCookie(VCookie &vcookie);
 	virtual bool DeleteVCookie(VCookie &vcookie);
@@ -32,8 +90,124 @@ public:
 	virtual unsigned long long GetVCookieCount() const;
 	virtual bool GetVCookie(VCookie &vcookie, unsigned long long index) const;
 
+    // retry.resends, retry.failures, instance.errors, and
+    // connection.<n>.ops with more than one connection; cas.writes,
+    // cas.conflicts, cas.retries, cas.failures when cas is on, ttl.writes,
+    // ttl.changes, ttl.expired when ttl is
+    virtual void GetStats(std::map<std::string, unsigned long long> &stats) const;
+    virtual bool KeepsMutationLog() const;
+
+    // a cookie's CAS when its load found nothing: saved with an add
+    static const unsigned long long CAS_MISSING = ~0ULL;
+
+    // when the server expires the visitor, as saved now: an absolute
+    // time, or 0 for never (ttl off, or no hit time to go by)
+    time_t Expiry(const VCookie &vcookie) const;
+
+    /**
+     * An operation in flight, the cookie libcouchbase hands back to the
+     * response handlers
+     */
+    struct operation;
+
+    // from the response handlers: the operation a response on the
+    // instance is for, NULL if it can't be found
+    operation *Resolve(lcb_t instance, const void *cookie, const void *key,
+                       size_t nkey);
+
+    // from the response handlers: the operation is over
+    void Complete(operation *op, bool success);
+
+    // from the response handlers: a response Resolve found no operation for
+    void Unmatched(lcb_t instance);
+
+    // from the response handlers: true if the failure is worth another
+    // try and one is on its way, the operation isn't over
+    bool Retry(operation *op, lcb_error_t error);
+
+    // from the error handler
+    void InstanceError(lcb_t instance, lcb_error_t error, const char *info);
+
+    // from the store response handler: the save went through with newCas
+    void Stored(operation *op, unsigned long long newCas);
+
+    // from the store response handler: the save lost to another writer,
+    // or what it was loaded from is gone
+    void Conflict(operation *op);
+
+    // from the get response handler: the visitor to merge with is loaded
+    void Reloaded(operation *op);
+
+    // from the Poll timer
+    void PollTimerFired();
+
+    // from the backoff timer of a conflict or a retry
+    void RetryTimerFired(operation *op);
+
 private:
-    lcb_t instance;
+    bool Submit(operation *op, const VCookie &vcookie,
+                const std::vector<char> *value);
+    lcb_error_t Schedule(operation *op, const VCookie &vcookie,
+                         const std::vector<char> *value);
+    void UseCas(lcb_store_cmd_t &cmd, const VCookie &vcookie);
+    void UseExpiry(lcb_store_cmd_t &cmd, const VCookie &vcookie);
+    void Resend(operation *op);
+    void Run(operation *until, unsigned long long target);
+    void MakeRoom(unsigned count);
+    unsigned Pick(unsigned ops);
+    void Breakout();
+
+    struct batch;
+    template <typename T>
+    void StartBatch(std::vector<T*> &cookies, int kind,
+                    VCookieProcessedCallback callback,
+                    std::vector<operation> &ops);
+    template <typename C>
+    void RunBatch(batch &items, std::vector<C> &commands,
+                  lcb_error_t (*schedule)(lcb_t, const void*, lcb_size_t,
+                                          const C *const *));
+
+    struct connection {
+        lcb_t instance;
+        unsigned outstanding;
+        unsigned long long dispatched;  // operations sent on it
+    };
+    std::vector<connection> connections;
+    lcb_io_opt_t io;                // the event loop they share
+    lcb_t waiting;                  // in lcb_wait, for Breakout
+    dispatch_t dispatch;
+    unsigned next;                  // round robin
+
+    VCookieKey key;                 // of the operation being submitted
+    std::vector<char> arena;        // a batch's keys, then its blobs
+    std::vector<char> blob;         // one cookie serialized
+    unsigned window;                // most operations in flight
+    unsigned outstanding;
+    unsigned long long completed;   // operations completed so far
+    operation *breakOn;             // Run stops when this one completes
+    unsigned long long breakAt;     // or completed reaches this
+    bool running;                   // inside the event loop
+    lcb_timer_t pollTimer;          // until it fires
+
+    bool cas;                       // save with the CAS, merge on conflict
+    unsigned casRetries;            // conflicts before a save fails
+    unsigned casBackoffUS;          // before the first retry, then doubled
+    unsigned long long casWrites;   // saves checked against a CAS, done
+    unsigned long long conflicts;
+    unsigned long long retries;
+    unsigned long long casFailures; // saves given up on
+
+    bool ttl;                       // saves set the expiry
+    unsigned long retention;        // seconds from the last hit to expiry
+    unsigned long long ttlWrites;   // saves with an expiry, done
+    unsigned long long ttlChanges;  // that moved it (or set the first)
+    unsigned long long ttlExpired;  // that were already past it
+
+    unsigned resendLimit;           // sends of one operation after the first
+    unsigned resendBackoffUS;       // before the first, then doubled
+    unsigned long long resends;
+    unsigned long long resendFailures;  // operations failed after them
+    unsigned long long instanceErrors;  // from the error handler
 };
 
 #endif
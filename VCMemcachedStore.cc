@@ -0,0 +1,365 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * Implementation of the VCookieStore that keeps the objects on a server
+ * speaking the memcached binary protocol.
+ */
+
+#include "VCMemcachedStore.h"
+#include "memcachedProtocol.h"
+#include "VCStoreDecoratorUtil.h"
+#include <iostream>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+static const VCEngineOption memcached_options[] = {
+    { "host", "127.0.0.1:11211", "server to connect to, host:port" },
+    { "window", "64", "most requests a thread keeps on the wire" },
+    { "retries", "3", "temporary failures of one request before it fails" },
+    { "retry-backoff-us", "100", "wait before the first retry, doubled for each one after" },
+    { "timeout-ms", "2500", "longest wait for the server before the connection is dropped" },
+    { "key", "base64", "key encoding: binary, hex or base64" },
+    { "key-prefix", "", "put in front of every key, to keep runs apart on one server" },
+    { NULL, NULL, NULL }
+};
+
+VC_REGISTER_ENGINE_FACTORY(VCMemcachedStore, "memcached", VCMemcachedStore::Create,
+                           VC_ENGINE_PERSISTS, memcached_options,
+                           "memcached binary protocol, one connection per thread");
+
+// connect to host:port, -1 (after saying why) if it can't
+static int connect_to(const std::string &host, unsigned timeoutMS)
+{
+    std::string name = host;
+    std::string service = "11211";
+    std::string::size_type colon = host.rfind(':');
+    if (colon != std::string::npos) {
+        name = host.substr(0, colon);
+        service = host.substr(colon + 1);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses;
+    int error = getaddrinfo(name.c_str(), service.c_str(), &hints, &addresses);
+    if (error != 0) {
+        std::cerr << "Failed to resolve " << host << ": "
+                  << gai_strerror(error) << std::endl;
+        return -1;
+    }
+
+    int fd = -1;
+    for (struct addrinfo *a = addresses; a != NULL && fd == -1; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd != -1 && connect(fd, a->ai_addr, a->ai_addrlen) == -1) {
+            error = errno;
+            close(fd);
+            fd = -1;
+            errno = error;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd == -1) {
+        std::cerr << "Failed to connect to " << host << ": "
+                  << strerror(errno) << std::endl;
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    struct timeval timeout;
+    timeout.tv_sec = timeoutMS / 1000;
+    timeout.tv_usec = (timeoutMS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+VCookieStore *VCMemcachedStore::Create(const VCEngineOptions &options)
+{
+    // Configure() has filled in every option
+    unsigned window = strtoul(options.find("window")->second.c_str(), NULL, 10);
+    VCookieKey::Encoding encoding;
+    if (!VCookieKey::ParseEncoding(options.find("key")->second, encoding)) {
+        std::cerr << "Unknown key encoding \"" << options.find("key")->second
+                  << "\", use binary, hex or base64" << std::endl;
+        return NULL;
+    }
+    int fd = connect_to(options.find("host")->second,
+                        strtoul(options.find("timeout-ms")->second.c_str(), NULL, 10));
+    if (fd == -1) {
+        return NULL;
+    }
+    return new VCMemcachedStore(fd, window ? window : 1,
+                                strtoul(options.find("retries")->second.c_str(), NULL, 10),
+                                strtoul(options.find("retry-backoff-us")->second.c_str(), NULL, 10),
+                                VCookieKey(encoding, options.find("key-prefix")->second));
+}
+
+VCMemcachedStore::VCMemcachedStore(int fd, unsigned window, unsigned retries,
+                                   unsigned retryBackoffUS,
+                                   const VCookieKey &key)
+    : fd(fd), window(window), retries(retries),
+      retryBackoffUS(retryBackoffUS), key(key), sent(0), retried(0),
+      failures(0)
+{
+}
+
+VCMemcachedStore::~VCMemcachedStore()
+{
+    if (fd != -1) {
+        close(fd);
+    }
+}
+
+void VCMemcachedStore::Disconnect(const char *why)
+{
+    std::cerr << "Lost the memcached connection: " << why << std::endl;
+    close(fd);
+    fd = -1;
+}
+
+void VCMemcachedStore::Append(const request &r, unsigned opaque)
+{
+    VC_STAGE_TIMER(keyTimer, VC_STAGE_KEY);
+    key.Encode(*r.cookie);
+    VC_STAGE_STOP(keyTimer);
+
+    size_t extras = 0;
+    size_t value = 0;
+    if (r.opcode == MC_SET) {
+        Serialize(*r.cookie, blob);
+        extras = 8;                 // flags and expiry, both 0
+        value = blob.size();
+    }
+
+    size_t at = out.size();
+    out.resize(at + MC_HEADER_SIZE + extras + key.Size() + value);
+    unsigned char *p = (unsigned char*)&out[at];
+    memset(p, 0, MC_HEADER_SIZE + extras);
+    p[MC_HEADER_MAGIC] = MC_REQUEST;
+    p[MC_HEADER_OPCODE] = r.opcode;
+    McPut(p + MC_HEADER_KEYLEN, 2, key.Size());
+    p[MC_HEADER_EXTLEN] = (unsigned char)extras;
+    McPut(p + MC_HEADER_BODYLEN, 4, extras + key.Size() + value);
+    McPut(p + MC_HEADER_OPAQUE, 4, opaque);
+    p += MC_HEADER_SIZE + extras;
+    memcpy(p, key.Data(), key.Size());
+    if (value != 0) {
+        memcpy(p + key.Size(), &blob[0], value);
+    }
+    ++sent;
+}
+
+// read a response's header into header and its body into body
+bool VCMemcachedStore::Receive(unsigned char *header)
+{
+    size_t got = 0;
+    size_t size = MC_HEADER_SIZE;
+    char *into = (char*)header;
+    for (int part = 0; part < 2; ++part) {
+        while (got < size) {
+            ssize_t n = recv(fd, into + got, size - got, 0);
+            if (n > 0) {
+                got += n;
+            } else if (n == 0) {
+                Disconnect("closed by the server");
+                return false;
+            } else if (errno != EINTR) {
+                Disconnect(errno == EAGAIN || errno == EWOULDBLOCK ?
+                           "timed out" : strerror(errno));
+                return false;
+            }
+        }
+        if (part == 0) {
+            if (header[MC_HEADER_MAGIC] != MC_RESPONSE) {
+                Disconnect("not a memcached response");
+                return false;
+            }
+            body.resize(McGet(header + MC_HEADER_BODYLEN, 4));
+            got = 0;
+            size = body.size();
+            into = body.empty() ? NULL : &body[0];
+        }
+    }
+    return true;
+}
+
+void VCMemcachedStore::Execute(std::vector<request> &requests)
+{
+    // the requests waiting out a backoff: when they go again, which
+    std::vector<std::pair<unsigned long long, size_t> > waiting;
+    size_t next = 0;                // the first request never sent
+    unsigned inFlight = 0;
+
+    while (fd != -1 && (next < requests.size() || inFlight != 0 || !waiting.empty())) {
+        // fill the window: retries that are due first, then new requests
+        out.clear();
+        unsigned long long now = monotonic_us();
+        unsigned long long soonest = ~0ULL;
+        for (size_t i = 0; i < waiting.size() && inFlight < window; ) {
+            if (waiting[i].first <= now) {
+                Append(requests[waiting[i].second], waiting[i].second);
+                ++inFlight;
+                waiting.erase(waiting.begin() + i);
+            } else {
+                soonest = std::min(soonest, waiting[i].first);
+                ++i;
+            }
+        }
+        for (; next < requests.size() && inFlight < window; ++next) {
+            Append(requests[next], next);
+            ++inFlight;
+        }
+        for (size_t done = 0; done < out.size(); ) {
+            ssize_t n = send(fd, &out[done], out.size() - done, MSG_NOSIGNAL);
+            if (n > 0) {
+                done += n;
+            } else if (n == -1 && errno != EINTR) {
+                Disconnect(errno == EAGAIN || errno == EWOULDBLOCK ?
+                           "timed out" : strerror(errno));
+                break;
+            }
+        }
+        if (fd == -1) {
+            break;
+        }
+        if (inFlight == 0) {
+            // only retries left, none of them due yet
+            usleep(soonest - now);
+            continue;
+        }
+
+        unsigned char header[MC_HEADER_SIZE];
+        if (!Receive(header)) {
+            break;
+        }
+        --inFlight;
+        size_t index = McGet(header + MC_HEADER_OPAQUE, 4);
+        if (index >= requests.size()) {
+            Disconnect("a response to no request");
+            break;
+        }
+        request &r = requests[index];
+        unsigned status = McGet(header + MC_HEADER_STATUS, 2);
+        if (status == MC_ETMPFAIL && r.attempts < retries) {
+            unsigned shift = r.attempts < 16 ? r.attempts : 16;
+            ++r.attempts;
+            ++retried;
+            waiting.push_back(std::make_pair(monotonic_us() +
+                                             ((unsigned long long)retryBackoffUS << shift),
+                                             index));
+            continue;
+        }
+
+        if (status == MC_SUCCESS) {
+            r.success = true;
+            if (r.opcode == MC_GET) {
+                size_t skip = header[MC_HEADER_EXTLEN] + McGet(header + MC_HEADER_KEYLEN, 2);
+                blob.assign(body.begin() + std::min(skip, body.size()), body.end());
+                r.success = Deserialize(*r.cookie, blob);
+            }
+        } else if (status != MC_KEY_ENOENT) {
+            ++failures;
+        }
+    }
+
+    if (fd == -1) {
+        // whatever didn't get an answer failed with the connection
+        failures += requests.size() - next + inFlight + waiting.size();
+    }
+}
+
+void VCMemcachedStore::SaveVCookies(std::vector<const VCookie*> &cookies,
+                                    VCookieProcessedCallback callback)
+{
+    std::vector<request> requests(cookies.size());
+    for (size_t i = 0; i < cookies.size(); ++i) {
+        request r = { MC_SET, const_cast<VCookie*>(cookies[i]), 0, false };
+        requests[i] = r;
+    }
+    Execute(requests);
+    for (size_t i = 0; callback != NULL && i < cookies.size(); ++i) {
+        callback(requests[i].success, *cookies[i]);
+    }
+}
+
+void VCMemcachedStore::LoadVCookies(std::vector<VCookie*> &cookies,
+                                    VCookieProcessedCallback callback)
+{
+    std::vector<request> requests(cookies.size());
+    for (size_t i = 0; i < cookies.size(); ++i) {
+        request r = { MC_GET, cookies[i], 0, false };
+        requests[i] = r;
+    }
+    Execute(requests);
+    for (size_t i = 0; callback != NULL && i < cookies.size(); ++i) {
+        callback(requests[i].success, *cookies[i]);
+    }
+}
+
+bool VCMemcachedStore::SaveVCookie(VCookie const &vcookie)
+{
+    VC_STAGE_TIMER(setTimer, VC_STAGE_SET);
+    std::vector<request> requests(1);
+    request r = { MC_SET, const_cast<VCookie*>(&vcookie), 0, false };
+    requests[0] = r;
+    Execute(requests);
+    return requests[0].success;
+}
+
+bool VCMemcachedStore::LoadVCookie(VCookie &vcookie)
+{
+    VC_STAGE_TIMER(getTimer, VC_STAGE_GET);
+    std::vector<request> requests(1);
+    request r = { MC_GET, &vcookie, 0, false };
+    requests[0] = r;
+    Execute(requests);
+    return requests[0].success;
+}
+
+bool VCMemcachedStore::DeleteVCookie(VCookie &vcookie)
+{
+    std::vector<request> requests(1);
+    request r = { MC_DELETE, &vcookie, 0, false };
+    requests[0] = r;
+    Execute(requests);
+    return requests[0].success;
+}
+
+unsigned long long VCMemcachedStore::DeleteOldVCookies(time_t)
+{
+    // memcached can't be scanned
+    return 0;
+}
+
+unsigned long long VCMemcachedStore::GetVCookieCount() const
+{
+    return 0;
+}
+
+bool VCMemcachedStore::GetVCookie(VCookie &, unsigned long long) const
+{
+    return false;
+}
+
+void VCMemcachedStore::GetStats(std::map<std::string, unsigned long long> &stats) const
+{
+    stats["memcached.requests"] += sent;
+    stats["memcached.retries"] += retried;
+    stats["memcached.failures"] += failures;
+}
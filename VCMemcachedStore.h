@@ -0,0 +1,81 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * Implementation of the VCookieStore that keeps the objects on a server
+ * speaking the memcached binary protocol: memcached itself, the data port
+ * of a Couchbase node (11210, default bucket) or the stand-in server in
+ * memcachedMock.h. Needs no client library, so it's linked into every
+ * harness, and with the stand-in the network path runs on a laptop.
+ *
+ * Each store (one per thread) has its own connection. The batch calls
+ * pipeline: up to window requests are on the wire at once, each tagged
+ * with its place in the batch so the responses can be matched as they
+ * come. A temporary failure (the server busy, or a fault injected by the
+ * stand-in) is retried after a backoff that doubles each time, up to
+ * retries times. A connection that fails or times out is closed, and
+ * every call after that fails.
+ */
+#ifndef VC_MEMCACHED_STORE_H
+#define VC_MEMCACHED_STORE_H
+
+#include "abstraction/vcookie.h"
+#include "abstraction/vcookiestore.h"
+#include "abstraction/vcengineregistry.h"
+#include "abstraction/vcookiekey.h"
+
+class VCMemcachedStore: public VCookieStore
+{
+public:
+    VCMemcachedStore(int fd, unsigned window, unsigned retries,
+                     unsigned retryBackoffUS, const VCookieKey &key);
+    virtual ~VCMemcachedStore();
+
+    // engine.memcached.host=, window=, retries=, retry-backoff-us=,
+    // timeout-ms=, key=, key-prefix=
+    static VCookieStore *Create(const VCEngineOptions &options);
+
+    virtual void SaveVCookies(std::vector<const VCookie*> &cookies,
+                              VCookieProcessedCallback callback);
+    virtual void LoadVCookies(std::vector<VCookie*> &cookies,
+                              VCookieProcessedCallback callback);
+
+    virtual bool SaveVCookie(VCookie const &vcookie);
+    virtual bool LoadVCookie(VCookie &vcookie);
+    virtual bool DeleteVCookie(VCookie &vcookie);
+    virtual unsigned long long DeleteOldVCookies(time_t t);
+    virtual unsigned long long GetVCookieCount() const;
+    virtual bool GetVCookie(VCookie &vcookie, unsigned long long index) const;
+
+    // memcached.requests (retries included), memcached.retries,
+    // memcached.failures
+    virtual void GetStats(std::map<std::string, unsigned long long> &stats) const;
+
+private:
+    struct request {
+        unsigned char opcode;       // MC_GET, MC_SET or MC_DELETE
+        VCookie *cookie;
+        unsigned attempts;          // retries so far
+        bool success;               // for a get: found and loaded
+    };
+
+    // send the requests, up to window at a time, and read every response
+    void Execute(std::vector<request> &requests);
+    void Append(const request &r, unsigned opaque);
+    bool Receive(unsigned char *header);
+    void Disconnect(const char *why);
+
+    int fd;                         // -1 once the connection is lost
+    unsigned window;
+    unsigned retries;
+    unsigned retryBackoffUS;
+    VCookieKey key;
+    std::vector<char> out;          // requests not sent yet
+    std::vector<char> body;         // of the response being read
+    std::vector<char> blob;         // one cookie serialized
+
+    unsigned long long sent;
+    unsigned long long retried;
+    unsigned long long failures;
+};
+
+#endif
@@ -0,0 +1,436 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * A W-TinyLFU read cache in front of another store.
+ */
+
+#include "VCStoreCache.h"
+#include "VCStoreDecoratorUtil.h"
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+
+static const VCEngineOption cache_options[] = {
+    { "memory-mb", "64", "most memory the cached visitors take, per thread" },
+    { "window-percent", "1", "of the memory for the LRU window new visitors go into" },
+    { "max-age-ms", "0", "oldest cached copy a load returns, 0 for any" },
+    { "write", "through", "through: saves update the cache, around: saves drop the entry" },
+    { NULL, NULL, NULL }
+};
+
+VC_REGISTER_DECORATOR(VCStoreCache, "cache", VCStoreCache::Create, cache_options,
+                      "W-TinyLFU cache of recent visitors in front of the store under it");
+
+// the share of the main part kept for visitors seen again while in it
+static const unsigned PROTECTED_PERCENT = 80;
+
+// what an entry costs beyond its blob: the entry, its list and map nodes
+static const size_t ENTRY_OVERHEAD = 128;
+
+typedef VCBatchContext<VCStoreCache> batch_context;
+
+// splitmix64's finalizer
+static unsigned long long mix(unsigned long long x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static unsigned long long hash_visitor(const VCookie &vcookie)
+{
+    return mix(mix(vcookie.GetUser() ^ vcookie.GetVisIdHigh()) ^ vcookie.GetVisIdLow());
+}
+
+VCookieStore *VCStoreCache::Create(VCookieStore *inner, const VCEngineOptions &options)
+{
+    // Configure() has filled in every option
+    unsigned long memoryMB = strtoul(options.find("memory-mb")->second.c_str(), NULL, 10);
+    unsigned windowPercent = strtoul(options.find("window-percent")->second.c_str(), NULL, 10);
+    const std::string &write = options.find("write")->second;
+    if (memoryMB == 0 || windowPercent == 0 || windowPercent >= 100) {
+        std::cerr << "cache: memory-mb must be more than 0, window-percent from 1 to 99" << std::endl;
+        delete inner;
+        return NULL;
+    }
+    if (write != "through" && write != "around") {
+        std::cerr << "cache: unknown write \"" << write << "\", use through or around" << std::endl;
+        delete inner;
+        return NULL;
+    }
+    return new VCStoreCache(inner, memoryMB << 20, windowPercent,
+                            strtoul(options.find("max-age-ms")->second.c_str(), NULL, 10),
+                            write == "through");
+}
+
+VCStoreCache::VCStoreCache(VCookieStore *inner, size_t capacity, unsigned windowPercent,
+                           unsigned maxAgeMS, bool writeThrough)
+    : VCStoreDecorator(inner), maxAgeMS(maxAgeMS), writeThrough(writeThrough),
+      frequency(capacity / 1024), hits(0), misses(0), evictions(0), rejections(0),
+      expired(0), invalidations(0)
+{
+    budget[WINDOW] = capacity / 100 * windowPercent;
+    budget[PROTECTED] = (capacity - budget[WINDOW]) / 100 * PROTECTED_PERCENT;
+    budget[PROBATION] = capacity - budget[WINDOW] - budget[PROTECTED];
+    for (int s = 0; s < SEGMENTS; ++s) {
+        bytes[s] = 0;
+    }
+}
+
+VCStoreCache::sketch::sketch(size_t width)
+    : additions(0)
+{
+    // about a counter per entry the cache can hold, a power of 2
+    size_t w = 1024;
+    while (w < width) {
+        w <<= 1;
+    }
+    counters.resize(4 * w);
+    mask = w - 1;
+    period = 10ULL * w;
+}
+
+size_t VCStoreCache::sketch::Slot(unsigned long long hash, unsigned row) const
+{
+    return row * (mask + 1) + (mix(hash + (row + 1) * 0x9e3779b97f4a7c15ULL) & mask);
+}
+
+unsigned VCStoreCache::sketch::Estimate(unsigned long long hash) const
+{
+    unsigned estimate = 15;
+    for (unsigned row = 0; row < 4; ++row) {
+        estimate = std::min(estimate, (unsigned) counters[Slot(hash, row)]);
+    }
+    return estimate;
+}
+
+void VCStoreCache::sketch::Add(unsigned long long hash)
+{
+    // conservative update: only the counters at the minimum go up
+    unsigned estimate = Estimate(hash);
+    if (estimate < 15) {
+        for (unsigned row = 0; row < 4; ++row) {
+            unsigned char &counter = counters[Slot(hash, row)];
+            if (counter == estimate) {
+                ++counter;
+            }
+        }
+    }
+    if (++additions == period) {
+        for (size_t i = 0; i < counters.size(); ++i) {
+            counters[i] >>= 1;
+        }
+        additions /= 2;
+    }
+}
+
+size_t VCStoreCache::Cost(const entry &e) const
+{
+    return e.blob.capacity() + ENTRY_OVERHEAD;
+}
+
+void VCStoreCache::Move(lru_t::iterator e, segment_t to)
+{
+    size_t cost = Cost(*e);
+    bytes[e->segment] -= cost;
+    lru[to].splice(lru[to].begin(), lru[e->segment], e);
+    e->segment = to;
+    bytes[to] += cost;
+}
+
+void VCStoreCache::Remove(lru_t::iterator e)
+{
+    bytes[e->segment] -= Cost(*e);
+    index.erase(e->id);
+    lru[e->segment].erase(e);
+}
+
+void VCStoreCache::Touch(lru_t::iterator e)
+{
+    // seen again while on probation: it's earned a place in the protected part
+    Move(e, e->segment == PROBATION ? PROTECTED : e->segment);
+    Balance();
+}
+
+void VCStoreCache::Balance()
+{
+    // the protected part's least recent go back on probation
+    while (bytes[PROTECTED] > budget[PROTECTED]) {
+        Move(--lru[PROTECTED].end(), PROBATION);
+    }
+
+    // what falls out of the window only gets into the main part if it's
+    // been seen more often than the entry the main part would lose first.
+    // That's the one comparison: nothing is evicted for a candidate until
+    // it has won, and one that wins gets whatever room it needs
+    size_t main = budget[PROBATION] + budget[PROTECTED];
+    while (bytes[WINDOW] > budget[WINDOW]) {
+        lru_t::iterator candidate = --lru[WINDOW].end();
+        size_t cost = Cost(*candidate);
+        bool admit = cost <= main;
+        if (admit && bytes[PROBATION] + bytes[PROTECTED] + cost > main) {
+            admit = frequency.Estimate(candidate->hash) > frequency.Estimate(Victim()->hash);
+        }
+        if (!admit) {
+            Remove(candidate);
+            ++rejections;
+            continue;
+        }
+        while (bytes[PROBATION] + bytes[PROTECTED] + cost > main) {
+            Remove(Victim());
+            ++evictions;
+        }
+        Move(candidate, PROBATION);
+    }
+
+    // a save that made an entry bigger
+    while (bytes[PROBATION] + bytes[PROTECTED] > main) {
+        Remove(Victim());
+        ++evictions;
+    }
+}
+
+VCStoreCache::lru_t::iterator VCStoreCache::Victim()
+{
+    // the least recent on probation, the protected part's once it's empty
+    segment_t from = lru[PROBATION].empty() ? PROTECTED : PROBATION;
+    return --lru[from].end();
+}
+
+bool VCStoreCache::Hit(VCookie &vcookie)
+{
+    unsigned long long hash = hash_visitor(vcookie);
+    frequency.Add(hash);
+
+    index_t::iterator i = index.find(visitor_id(vcookie));
+    if (i == index.end()) {
+        ++misses;
+        return false;
+    }
+    lru_t::iterator e = i->second;
+    if ((maxAgeMS != 0 && monotonic_ms() - e->stamp > maxAgeMS) ||
+        (e->expiry != 0 && e->expiry <= time(NULL))) {
+        Remove(e);
+        ++expired;
+        ++misses;
+        return false;
+    }
+    if (!Deserialize(vcookie, e->blob)) {
+        Remove(e);
+        ++misses;
+        return false;
+    }
+    vcookie.SetCas(e->cas);
+    vcookie.SetExpiry(e->expiry);
+    ++hits;
+    Touch(e);
+    return true;
+}
+
+void VCStoreCache::Put(const VCookie &vcookie)
+{
+    Serialize(vcookie, buffer);
+
+    VCookieId id = visitor_id(vcookie);
+    index_t::iterator i = index.find(id);
+    lru_t::iterator e;
+    if (i == index.end()) {
+        lru[WINDOW].push_front(entry(id));
+        e = lru[WINDOW].begin();
+        e->hash = hash_visitor(vcookie);
+        index.insert(std::make_pair(id, e));
+    }
+    else {
+        e = i->second;
+        bytes[e->segment] -= Cost(*e);
+    }
+
+    // the old blob's memory is serialized into next time
+    e->blob.swap(buffer);
+    e->cas = vcookie.GetCas();
+    e->expiry = vcookie.GetExpiry();
+    e->stamp = monotonic_ms();
+    e->lastHit = vcookie.GetLastHitTimeGMT();
+    bytes[e->segment] += Cost(*e);
+    Balance();
+}
+
+void VCStoreCache::Invalidate(const VCookie &vcookie)
+{
+    index_t::iterator i = index.find(visitor_id(vcookie));
+    if (i != index.end()) {
+        Remove(i->second);
+        ++invalidations;
+    }
+}
+
+void VCStoreCache::Written(bool success, const VCookie &vcookie)
+{
+    // only visitors a load found are cached, so the cache holds nothing
+    // the engine under it wouldn't return
+    if (success && writeThrough && index.find(visitor_id(vcookie)) != index.end()) {
+        Put(vcookie);
+    }
+    else {
+        Invalidate(vcookie);
+    }
+}
+
+bool VCStoreCache::LoadVCookie(VCookie &vcookie)
+{
+    if (Hit(vcookie)) {
+        return true;
+    }
+    bool found = inner->LoadVCookie(vcookie);
+    if (found) {
+        Put(vcookie);
+    }
+    return found;
+}
+
+bool VCStoreCache::SaveVCookie(VCookie const &vcookie)
+{
+    bool saved = inner->SaveVCookie(vcookie);
+    Written(saved, vcookie);
+    return saved;
+}
+
+bool VCStoreCache::DeleteVCookie(VCookie &vcookie)
+{
+    Invalidate(vcookie);
+    return inner->DeleteVCookie(vcookie);
+}
+
+unsigned long long VCStoreCache::DeleteOldVCookies(time_t t)
+{
+    for (int s = 0; s < SEGMENTS; ++s) {
+        lru_t::iterator e = lru[s].begin();
+        while (e != lru[s].end()) {
+            if (e->lastHit < t) {
+                Remove(e++);
+            }
+            else {
+                ++e;
+            }
+        }
+    }
+    return inner->DeleteOldVCookies(t);
+}
+
+void VCStoreCache::BatchLoaded(bool found, const VCookie &cookie)
+{
+    if (found) {
+        batch_context::Store()->Put(cookie);
+    }
+    if (batch_context::Callback() != NULL) {
+        batch_context::Callback()(found, cookie);
+    }
+}
+
+void VCStoreCache::BatchSaved(bool success, const VCookie &cookie)
+{
+    batch_context::Store()->Written(success, cookie);
+    if (batch_context::Callback() != NULL) {
+        batch_context::Callback()(success, cookie);
+    }
+}
+
+void VCStoreCache::LoadVCookies(std::vector<VCookie*> &cookies,
+                                VCookieProcessedCallback callback)
+{
+    // the hits are done here, only the misses go to the inner store
+    std::vector<VCookie*> missed;
+    for (std::vector<VCookie*>::iterator ii = cookies.begin(); ii != cookies.end(); ++ii) {
+        if (!Hit(**ii)) {
+            missed.push_back(*ii);
+        }
+        else if (callback != NULL) {
+            callback(true, **ii);
+        }
+    }
+    if (missed.empty()) {
+        return;
+    }
+
+    batch_context batch(this, callback);
+    inner->LoadVCookies(missed, BatchLoaded);
+}
+
+void VCStoreCache::SaveVCookies(std::vector<const VCookie*> &cookies,
+                                VCookieProcessedCallback callback)
+{
+    batch_context batch(this, callback);
+    inner->SaveVCookies(cookies, BatchSaved);
+}
+
+void VCStoreCache::SubmitLoaded(bool found, VCookie &cookie, void *context)
+{
+    submitted *s = static_cast<submitted*>(context);
+    if (found) {
+        s->cache->Put(cookie);
+    }
+    if (s->done != NULL) {
+        s->done(found, cookie, s->context);
+    }
+    delete s;
+}
+
+void VCStoreCache::SubmitSaved(bool success, VCookie &cookie, void *context)
+{
+    submitted *s = static_cast<submitted*>(context);
+    s->cache->Written(success, cookie);
+    if (s->done != NULL) {
+        s->done(success, cookie, s->context);
+    }
+    delete s;
+}
+
+bool VCStoreCache::SubmitLoad(VCookie &vcookie, VCookieCompletion done, void *context)
+{
+    // a hit completes inside Submit, as it would with an engine in memory
+    if (Hit(vcookie)) {
+        vcookie.Loaded(true);
+        if (done != NULL) {
+            done(true, vcookie, context);
+        }
+        return true;
+    }
+    submitted *s = new submitted;
+    s->cache = this;
+    s->done = done;
+    s->context = context;
+    if (!inner->SubmitLoad(vcookie, SubmitLoaded, s)) {
+        delete s;
+        return false;
+    }
+    return true;
+}
+
+bool VCStoreCache::SubmitSave(VCookie &vcookie, VCookieCompletion done, void *context)
+{
+    submitted *s = new submitted;
+    s->cache = this;
+    s->done = done;
+    s->context = context;
+    if (!inner->SubmitSave(vcookie, SubmitSaved, s)) {
+        delete s;
+        return false;
+    }
+    return true;
+}
+
+void VCStoreCache::GetStats(std::map<std::string, unsigned long long> &stats) const
+{
+    inner->GetStats(stats);
+    stats["cache.hits"] += hits;
+    stats["cache.misses"] += misses;
+    stats["cache.evictions"] += evictions;
+    stats["cache.rejections"] += rejections;
+    stats["cache.expired"] += expired;
+    stats["cache.invalidations"] += invalidations;
+    stats["cache.entries"] += index.size();
+    stats["cache.bytes"] += bytes[WINDOW] + bytes[PROBATION] + bytes[PROTECTED];
+}
@@ -0,0 +1,151 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * A read cache in front of another store: the visitors a thread saw
+ * recently are kept in memory, serialized, so a returning visitor is
+ * loaded without a round trip to the engine under it.
+ *
+ * The cache holds at most memory-mb (per thread, like every store). What
+ * stays is chosen by W-TinyLFU: a new visitor goes into a small LRU
+ * window, and when it falls out of that it only displaces a visitor in
+ * the main part (a segmented LRU) if it has been seen more often, by a
+ * count-min sketch of recent accesses. A scan of one-hit visitors so
+ * goes through the window without flushing the visitors that keep
+ * coming back.
+ *
+ * A visitor is cached when a load finds it in the engine, so a new one
+ * seen only once never takes any room. Saves are written through: the
+ * engine saves first, and on success a cached entry is replaced by the
+ * saved copy (with the CAS and expiry the engine gave it). With
+ * write=around the entry is dropped instead. A failed save always drops
+ * it. Deferring the writes is left to a decorator under this one.
+ *
+ * Each thread's cache only sees its own writes. When a visitor's hits
+ * can reach several threads or processes, a cached copy can be older
+ * than the stored one:
+ *  - max-age-ms bounds how old a copy a load can return;
+ *  - under an engine that checks CAS (KeepsMutationLog), a save from a
+ *    stale copy conflicts and is merged with the stored one, and the
+ *    merged copy is what gets cached, so no hit is lost;
+ *  - otherwise send each visitor to one process and thread (by visitor
+ *    id), which is what a cache like this needs to be worth having.
+ */
+#ifndef VC_STORE_CACHE_H
+#define VC_STORE_CACHE_H
+
+#include "abstraction/vcookie.h"
+#include "abstraction/vcstoredecorator.h"
+#include "abstraction/vcengineregistry.h"
+#include "VCStoreInMemory.h"
+
+#include <list>
+#include <map>
+#include <vector>
+
+class VCStoreCache: public VCStoreDecorator
+{
+public:
+    VCStoreCache(VCookieStore *inner, size_t capacity, unsigned windowPercent,
+                 unsigned maxAgeMS, bool writeThrough);
+
+    // engine.cache.memory-mb=, window-percent=, max-age-ms=, write=
+    static VCookieStore *Create(VCookieStore *inner, const VCEngineOptions &options);
+
+    virtual void SaveVCookies(std::vector<const VCookie*> &cookies,
+                              VCookieProcessedCallback callback);
+    virtual void LoadVCookies(std::vector<VCookie*> &cookies,
+                              VCookieProcessedCallback callback);
+
+    virtual bool SubmitLoad(VCookie &vcookie, VCookieCompletion done, void *context);
+    virtual bool SubmitSave(VCookie &vcookie, VCookieCompletion done, void *context);
+
+    virtual bool SaveVCookie(VCookie const &vcookie);
+    virtual bool LoadVCookie(VCookie &vcookie);
+    virtual bool DeleteVCookie(VCookie &vcookie);
+    virtual unsigned long long DeleteOldVCookies(time_t t);
+
+    // cache.hits, cache.misses, cache.evictions, cache.rejections,
+    // cache.expired, cache.invalidations, cache.entries, cache.bytes,
+    // then the inner store's
+    virtual void GetStats(std::map<std::string, unsigned long long> &stats) const;
+
+private:
+    enum segment_t { WINDOW, PROBATION, PROTECTED, SEGMENTS };
+
+    struct entry {
+        entry(const VCookieId &id) : id(id), cas(0), expiry(0), hash(0), stamp(0),
+                                     lastHit(0), segment(WINDOW) {}
+        VCookieId id;
+        std::vector<char> blob;     // the serialized cookie
+        unsigned long long cas;
+        time_t expiry;
+        unsigned long long hash;
+        unsigned long long stamp;   // when cached, ms, for max-age-ms
+        time_t lastHit;             // for DeleteOldVCookies
+        segment_t segment;
+    };
+    typedef std::list<entry> lru_t;                 // most recent first
+    typedef std::map<VCookieId, lru_t::iterator> index_t;
+
+    // how often each visitor was seen lately, 4 rows of 4 bit counters,
+    // all halved every 10 * width additions so old popularity fades
+    class sketch {
+    public:
+        explicit sketch(size_t width);
+        void Add(unsigned long long hash);
+        unsigned Estimate(unsigned long long hash) const;
+    private:
+        size_t Slot(unsigned long long hash, unsigned row) const;
+        std::vector<unsigned char> counters;
+        size_t mask;
+        unsigned long long additions;
+        unsigned long long period;
+    };
+
+    struct submitted {
+        VCStoreCache *cache;
+        VCookieCompletion done;
+        void *context;
+    };
+
+    // load the cached copy, moved up as a hit; false if there's none
+    // (or it's too old to use)
+    bool Hit(VCookie &vcookie);
+    // cache the cookie as it is now
+    void Put(const VCookie &vcookie);
+    // after the inner store saved (or failed to save) the cookie
+    void Written(bool success, const VCookie &vcookie);
+    void Invalidate(const VCookie &vcookie);
+    void Remove(lru_t::iterator e);
+    void Touch(lru_t::iterator e);
+    void Move(lru_t::iterator e, segment_t to);
+    // evict until every segment fits its share
+    void Balance();
+    // the main part's next to go, which must not be empty
+    lru_t::iterator Victim();
+    size_t Cost(const entry &e) const;
+
+    // the batch and submit completions from the inner store
+    static void BatchLoaded(bool found, const VCookie &cookie);
+    static void BatchSaved(bool success, const VCookie &cookie);
+    static void SubmitLoaded(bool found, VCookie &cookie, void *context);
+    static void SubmitSaved(bool success, VCookie &cookie, void *context);
+
+    size_t budget[SEGMENTS];
+    size_t bytes[SEGMENTS];
+    unsigned maxAgeMS;
+    bool writeThrough;
+    lru_t lru[SEGMENTS];
+    index_t index;
+    sketch frequency;
+    std::vector<char> buffer;
+
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long rejections;
+    unsigned long long expired;
+    unsigned long long invalidations;
+};
+
+#endif
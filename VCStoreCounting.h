@@ -0,0 +1,100 @@
+#ifndef Vcookie_VCStoreCounting_h
+#define Vcookie_VCStoreCounting_h
+
+#include "abstraction/vcstoredecorator.h"
+#include "abstraction/vcengineregistry.h"
+
+// Counts the calls that reach the store it wraps and reports them with
+// the store stats ("calls.load", ...). Put it under another decorator
+// (engine-decorator=counting, then the other one) to see how much of the
+// traffic that one lets through to the engine.
+class VCStoreCounting: public VCStoreDecorator
+{
+public:
+    explicit VCStoreCounting (VCookieStore *inner)
+    : VCStoreDecorator (inner), loads (0), loadHits (0), saves (0), deletes (0),
+      purges (0), purged (0), batchLoads (0), batchLoadCookies (0), batchSaves (0), batchSaveCookies (0),
+      submitLoads (0), submitSaves (0)
+    {
+    }
+
+    virtual void SaveVCookies (std::vector<const VCookie*> &cookies, VCookieProcessedCallback callback)
+    {
+        ++batchSaves;
+        batchSaveCookies += cookies.size();
+        inner->SaveVCookies (cookies, callback);
+    }
+    virtual void LoadVCookies (std::vector<VCookie*> &cookies, VCookieProcessedCallback callback)
+    {
+        ++batchLoads;
+        batchLoadCookies += cookies.size();
+        inner->LoadVCookies (cookies, callback);
+    }
+
+    virtual bool SubmitLoad (VCookie &vcookie, VCookieCompletion done, void *context)
+    {
+        ++submitLoads;
+        return inner->SubmitLoad (vcookie, done, context);
+    }
+    virtual bool SubmitSave (VCookie &vcookie, VCookieCompletion done, void *context)
+    {
+        ++submitSaves;
+        return inner->SubmitSave (vcookie, done, context);
+    }
+
+    virtual bool SaveVCookie (VCookie const &vcookie)
+    {
+        ++saves;
+        return inner->SaveVCookie (vcookie);
+    }
+    virtual bool LoadVCookie (VCookie &vcookie)
+    {
+        ++loads;
+        bool found = inner->LoadVCookie (vcookie);
+        if (found) {
+            ++loadHits;
+        }
+        return found;
+    }
+    virtual bool DeleteVCookie (VCookie &vcookie)
+    {
+        ++deletes;
+        return inner->DeleteVCookie (vcookie);
+    }
+    virtual unsigned long long DeleteOldVCookies (time_t t)
+    {
+        ++purges;
+        unsigned long long deleted = inner->DeleteOldVCookies (t);
+        purged += deleted;
+        return deleted;
+    }
+
+    virtual void GetStats (std::map<std::string, unsigned long long> &stats) const
+    {
+        inner->GetStats (stats);
+        stats["calls.load"] += loads;
+        stats["calls.loadHit"] += loadHits;
+        stats["calls.save"] += saves;
+        stats["calls.delete"] += deletes;
+        stats["calls.purge"] += purges;
+        stats["calls.purged"] += purged;
+        stats["calls.batchLoad"] += batchLoads;
+        stats["calls.batchLoadCookies"] += batchLoadCookies;
+        stats["calls.batchSave"] += batchSaves;
+        stats["calls.batchSaveCookies"] += batchSaveCookies;
+        stats["calls.submitLoad"] += submitLoads;
+        stats["calls.submitSave"] += submitSaves;
+    }
+
+    static VCookieStore *Create (VCookieStore *inner, VCEngineOptions const &)
+    {
+        return new VCStoreCounting (inner);
+    }
+
+private:
+    unsigned long long loads, loadHits, saves, deletes, purges, purged;
+    unsigned long long batchLoads, batchLoadCookies, batchSaves, batchSaveCookies;
+    unsigned long long submitLoads, submitSaves;
+};
+
+#endif
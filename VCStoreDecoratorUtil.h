@@ -0,0 +1,73 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * What the decorators that keep visitors in memory (VCStoreCache,
+ * VCStoreWriteBehind) share, and the clock VCMemcachedStore uses too.
+ */
+#ifndef VC_STORE_DECORATOR_UTIL_H
+#define VC_STORE_DECORATOR_UTIL_H
+
+#include "abstraction/vcookie.h"
+#include "abstraction/vcookiestore.h"
+#include "VCStoreInMemory.h"         // VCookieId
+
+#include <ctime>
+
+inline unsigned long long monotonic_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+inline unsigned long long monotonic_ms()
+{
+    return monotonic_us() / 1000;
+}
+
+inline VCookieId visitor_id(const VCookie &vcookie)
+{
+    return VCookieId(vcookie.GetUser(), vcookie.GetVisIdHigh(), vcookie.GetVisIdLow());
+}
+
+// The Decorator whose batch call into its inner store is running on this
+// thread, and the callback that call was given: batch callbacks carry no
+// context, and a store is only used by one thread. Set for the length of
+// the call, the outer one is back after it, so the same decorator can be
+// stacked twice.
+template <class Decorator>
+class VCBatchContext
+{
+public:
+    VCBatchContext(Decorator *store, VCookieProcessedCallback callback)
+        : outerStore(current), outerCallback(currentCallback)
+    {
+        current = store;
+        currentCallback = callback;
+    }
+    ~VCBatchContext()
+    {
+        current = outerStore;
+        currentCallback = outerCallback;
+    }
+
+    static Decorator *Store()                   { return current; }
+    static VCookieProcessedCallback Callback()  { return currentCallback; }
+
+private:
+    Decorator *outerStore;
+    VCookieProcessedCallback outerCallback;
+
+    static __thread Decorator *current;
+    static __thread VCookieProcessedCallback currentCallback;
+
+    VCBatchContext(VCBatchContext const &);
+    VCBatchContext &operator=(VCBatchContext const &);
+};
+
+template <class Decorator>
+__thread Decorator *VCBatchContext<Decorator>::current = NULL;
+template <class Decorator>
+__thread VCookieProcessedCallback VCBatchContext<Decorator>::currentCallback = NULL;
+
+#endif
@@ -32,16 +32,20 @@ public:
     unsigned long long GetVisIdHigh () const    { return visid_high; }
     unsigned long long GetVisIdLow () const     { return visid_low; }
     
+    // ordered by user, then visitor id: std::map needs a strict weak ordering
     bool operator < (const VCookieId &b) const
     {
-        return (userid < b.userid || visid_high < b.visid_high || visid_low < b.visid_low);
+        if (userid != b.userid) {
+            return userid < b.userid;
+        }
+        if (visid_high != b.visid_high) {
+            return visid_high < b.visid_high;
+        }
+        return visid_low < b.visid_low;
     }
     bool operator >= (const VCookieId &b) const { return !operator < (b); }
-    bool operator <= (const VCookieId &b) const
-    {
-        return (userid <= b.userid || visid_high <= b.visid_high || visid_low <= b.visid_low);
-    }
-    bool operator > (const VCookieId &b) const { return !operator <= (b); }
+    bool operator > (const VCookieId &b) const  { return b.operator < (*this); }
+    bool operator <= (const VCookieId &b) const { return !operator > (b); }
 private:
     const unsigned userid;
     const unsigned long long visid_high;
@@ -51,25 +55,37 @@ private:
 class VCStoreInMemory: public VCookieStore
 {
 public:
+    VCStoreInMemory () : bytes (0) {}
    
 	virtual bool SaveVCookie (VCookie const &vcookie)
     {
+        VC_STAGE_TIMER (keyTimer, VC_STAGE_KEY);
         VCookieId vid (vcookie.GetUser(), vcookie.GetVisIdHigh(), vcookie.GetVisIdLow());
+        VC_STAGE_STOP (keyTimer);
+
+        VC_STAGE_TIMER (setTimer, VC_STAGE_SET);
         std::vector<char> dummy; // use a dummy vector, because the map::insert call copies the vector data.
         time_t t = vcookie.GetLastHitTimeGMT();
         StoreRet r = store.insert (StorePair (vid, ValuePair (t, dummy)));
+        VC_STAGE_STOP (setTimer);
+        bytes -= r.first->second.second.size();
         Serialize(vcookie, r.first->second.second, false); // fill in the map vector with the vcookie data
+        bytes += r.first->second.second.size();
         r.first->second.first = t;
         return true;
     }
 	virtual bool LoadVCookie (VCookie &vcookie)
     {
+        VC_STAGE_TIMER (keyTimer, VC_STAGE_KEY);
         VCookieId vid (vcookie.GetUser(), vcookie.GetVisIdHigh(), vcookie.GetVisIdLow());
+        VC_STAGE_STOP (keyTimer);
         
+        VC_STAGE_TIMER (getTimer, VC_STAGE_GET);
         StoreMap::const_iterator v = store.find(vid);
         if (v == store.end()) {
             return false;
         }
+        VC_STAGE_STOP (getTimer);
         
         vcookie.SetLastHitTimeGMT(v->second.first);
         return Deserialize(vcookie, v->second.second);
@@ -78,8 +94,13 @@ public:
     {
         VCookieId vid (vcookie.GetUser(), vcookie.GetVisIdHigh(), vcookie.GetVisIdLow());
         
-        size_t s = store.erase (vid);
-        return (s > 0);
+        StoreMap::iterator v = store.find(vid);
+        if (v == store.end()) {
+            return false;
+        }
+        bytes -= v->second.second.size();
+        store.erase (v);
+        return true;
     }
     virtual unsigned long long DeleteOldVCookies (time_t t)
     {
@@ -87,6 +108,7 @@ public:
         StoreMap::iterator v=store.begin();
         while (v != store.end()) {
             if (v->second.first < t) {
+                bytes -= v->second.second.size();
                 store.erase(v++);
                 ++deleted;
             }
@@ -112,12 +134,19 @@ public:
         // but this interface is strictly for testing and should never have more than a few nodes
         while (i < index) {
             ++v;
+            ++i;
         }
         vcookie.Reset (v->first.GetUser(), v->first.GetVisIdHigh(), v->first.GetVisIdLow());
         
         vcookie.SetLastHitTimeGMT(v->second.first);
         return Deserialize(vcookie, v->second.second);
     }
+    // cheap enough to call while running, the byte count is kept as cookies change
+    virtual void GetStats (std::map<std::string, unsigned long long> &stats) const
+    {
+        stats["cookies"] += store.size();
+        stats["bytes"] += bytes;
+    }
 private:
     typedef std::pair<time_t, std::vector<char> > ValuePair;
     typedef std::map<VCookieId, ValuePair > StoreMap;
@@ -125,6 +154,7 @@ private:
     typedef std::pair<StoreMap::iterator, bool> StoreRet;
                       
     StoreMap store;
+    unsigned long long bytes;       // serialized bytes held in store
 };
 
 #endif
@@ -0,0 +1,528 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * Write-behind, coalescing saves, in front of another store.
+ */
+
+#include "VCStoreWriteBehind.h"
+#include "VCStoreDecoratorUtil.h"
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static const VCEngineOption writebehind_options[] = {
+    { "max-dirty-ms", "1000", "longest a save waits to be written" },
+    { "max-dirty", "10000", "most visitors waiting to be written, per thread" },
+    { "max-dirty-mb", "16", "most memory the visitors waiting take, per thread" },
+    { "flush-batch", "64", "visitors written with each SaveVCookies" },
+    { "journal", "", "append every save to this file (.<n> for each thread) until it's written" },
+    { "journal-sync", "off", "on: sync the journal to disk after every save" },
+    { NULL, NULL, NULL }
+};
+
+// loads see the saves not written yet, so over an engine that drops them
+// the stack would look like it keeps them for a while
+VC_REGISTER_DECORATOR_NEEDING(VCStoreWriteBehind, "writebehind", VCStoreWriteBehind::Create,
+                              VC_ENGINE_PERSISTS, writebehind_options,
+                              "holds saves back and writes each visitor once, in batches");
+
+// the journal is rewritten once it's this much bigger than twice what's dirty
+static const unsigned long long JOURNAL_SLACK = 1 << 20;
+
+// ahead of each save in the journal, its serialized cookie follows
+struct journal_record {
+    unsigned size;
+    unsigned user;
+    unsigned long long visidHigh;
+    unsigned long long visidLow;
+};
+
+typedef VCBatchContext<VCStoreWriteBehind> batch_context;
+
+// false if it all couldn't be written
+static bool write_record(int fd, const VCookie &vcookie, const std::vector<char> &blob,
+                         unsigned long long &written)
+{
+    journal_record record;
+    record.size = blob.size();
+    record.user = vcookie.GetUser();
+    record.visidHigh = vcookie.GetVisIdHigh();
+    record.visidLow = vcookie.GetVisIdLow();
+
+    struct iovec iov[2];
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(record);
+    iov[1].iov_base = const_cast<char*>(&blob[0]);
+    iov[1].iov_len = blob.size();
+    ssize_t n = writev(fd, iov, 2);
+    if (n != (ssize_t) (sizeof(record) + blob.size())) {
+        if (n >= 0) {
+            errno = ENOSPC;
+        }
+        return false;
+    }
+    written += n;
+    return true;
+}
+
+VCookieStore *VCStoreWriteBehind::Create(VCookieStore *inner, const VCEngineOptions &options)
+{
+    // Configure() has filled in every option
+    unsigned long maxDirty = strtoul(options.find("max-dirty")->second.c_str(), NULL, 10);
+    unsigned long maxDirtyMB = strtoul(options.find("max-dirty-mb")->second.c_str(), NULL, 10);
+    unsigned long flushBatch = strtoul(options.find("flush-batch")->second.c_str(), NULL, 10);
+    const std::string &sync = options.find("journal-sync")->second;
+    if (maxDirty == 0 || maxDirtyMB == 0 || flushBatch == 0) {
+        std::cerr << "writebehind: max-dirty, max-dirty-mb and flush-batch must be more than 0"
+                  << std::endl;
+        delete inner;
+        return NULL;
+    }
+    if (sync != "on" && sync != "off") {
+        std::cerr << "writebehind: journal-sync is on or off" << std::endl;
+        delete inner;
+        return NULL;
+    }
+
+    VCStoreWriteBehind *store =
+        new VCStoreWriteBehind(inner, strtoul(options.find("max-dirty-ms")->second.c_str(), NULL, 10),
+                               maxDirty, maxDirtyMB << 20, flushBatch);
+    const std::string &journal = options.find("journal")->second;
+    if (!journal.empty()) {
+        // the same names each run, so a run after a crash finds the files
+        static unsigned journals = 0;
+        std::ostringstream path;
+        path << journal << "." << __sync_fetch_and_add(&journals, 1);
+        if (!store->Journal(path.str(), sync == "on")) {
+            delete store;
+            return NULL;
+        }
+    }
+    return store;
+}
+
+VCStoreWriteBehind::VCStoreWriteBehind(VCookieStore *inner, unsigned maxDirtyMS, size_t maxDirty,
+                                       size_t maxDirtyBytes, size_t flushBatch)
+    : VCStoreDecorator(inner), maxDirtyMS(maxDirtyMS), maxDirty(maxDirty),
+      maxDirtyBytes(maxDirtyBytes), flushBatch(flushBatch), dirtyBytes(0), spare(NULL),
+      journal(-1), journalSync(false), journalBytes(0), saves(0), coalesced(0), writes(0),
+      flushes(0), failures(0), loadHits(0), recovered(0)
+{
+}
+
+VCStoreWriteBehind::~VCStoreWriteBehind()
+{
+    Flush(true);
+    if (!order.empty()) {
+        std::cerr << "writebehind: " << order.size() << " visitors couldn't be written"
+                  << (journal != -1 ? ", they're still in " + journalPath : std::string())
+                  << std::endl;
+    }
+    bool clean = order.empty();
+    while (!order.empty()) {
+        Drop(order.begin());
+    }
+    delete spare;
+
+    if (journal != -1) {
+        close(journal);
+        if (clean) {
+            unlink(journalPath.c_str());
+        }
+    }
+}
+
+bool VCStoreWriteBehind::Journal(const std::string &path, bool sync)
+{
+    journalPath = path;
+    journalSync = sync;
+
+    // what a store that died didn't get to write, the last save of each visitor
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd != -1) {
+        std::map<VCookieId, std::vector<char> > left;
+        journal_record record;
+        while (read(fd, &record, sizeof(record)) == (ssize_t) sizeof(record)) {
+            std::vector<char> blob(record.size);
+            if (record.size == 0 ||
+                read(fd, &blob[0], record.size) != (ssize_t) record.size) {
+                break;      // torn by the crash
+            }
+            left[VCookieId(record.user, record.visidHigh, record.visidLow)].swap(blob);
+        }
+        close(fd);
+
+        unsigned long long lost = 0;
+        for (std::map<VCookieId, std::vector<char> >::iterator l = left.begin(); l != left.end(); ++l) {
+            VCookie vcookie(l->first.GetUser(), l->first.GetVisIdHigh(), l->first.GetVisIdLow(),
+                            true, *inner);
+            if (Deserialize(vcookie, l->second) && inner->SaveVCookie(vcookie)) {
+                ++recovered;
+            }
+            else {
+                ++lost;
+            }
+            vcookie.Saved();
+        }
+        if (!left.empty()) {
+            std::cerr << "writebehind: wrote " << recovered << " visitors left in " << path;
+            if (lost) {
+                std::cerr << ", " << lost << " couldn't be";
+            }
+            std::cerr << std::endl;
+        }
+    }
+
+    journal = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (journal == -1) {
+        std::cerr << "writebehind: can't open " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void VCStoreWriteBehind::CloseJournal(const char *why)
+{
+    std::cerr << "writebehind: " << why << " " << journalPath << ": " << strerror(errno)
+              << ", saves aren't journaled any more" << std::endl;
+    close(journal);
+    journal = -1;
+}
+
+void VCStoreWriteBehind::Append(const VCookie &vcookie, const std::vector<char> &blob)
+{
+    if (!write_record(journal, vcookie, blob, journalBytes)) {
+        CloseJournal("can't write");
+    }
+    else if (journalSync && fdatasync(journal) != 0) {
+        CloseJournal("can't sync");
+    }
+}
+
+void VCStoreWriteBehind::Checkpoint()
+{
+    if (order.empty()) {
+        // O_APPEND, so the next save goes at the start again
+        if (ftruncate(journal, 0) != 0) {
+            CloseJournal("can't truncate");
+            return;
+        }
+        journalBytes = 0;
+        return;
+    }
+
+    std::string temporary = journalPath + ".new";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd == -1) {
+        CloseJournal("can't rewrite");
+        return;
+    }
+    unsigned long long written = 0;
+    for (order_t::iterator e = order.begin(); e != order.end(); ++e) {
+        Serialize(*e->cookie, buffer);
+        if (!write_record(fd, *e->cookie, buffer, written)) {
+            close(fd);
+            unlink(temporary.c_str());
+            CloseJournal("can't rewrite");
+            return;
+        }
+    }
+    if ((journalSync && fdatasync(fd) != 0) || rename(temporary.c_str(), journalPath.c_str()) != 0) {
+        close(fd);
+        unlink(temporary.c_str());
+        CloseJournal("can't replace");
+        return;
+    }
+    close(journal);
+    journal = fd;
+    journalBytes = written;
+}
+
+void VCStoreWriteBehind::Coalesce(const VCookie &vcookie)
+{
+    ++saves;
+    VCookieId id = visitor_id(vcookie);
+    index_t::iterator i = index.find(id);
+
+    bool loaded = !vcookie.IsNewCookie() || vcookie.GetCas() != 0;
+    if (i != index.end() && inner->KeepsMutationLog() && loaded) {
+        // the save needn't be from the copy as it is now (two cookies
+        // loaded the visitor before either saved), so its changes are
+        // made again to the copy, as the engine would on a conflict; the
+        // copy logs them too, for when it's written
+        order_t::iterator e = i->second;
+        vcookie.ReplayLog(*e->cookie);
+        Serialize(*e->cookie, buffer);
+
+        // and the caller's cookie becomes the merged visitor, as it would
+        VCookie &saved = const_cast<VCookie&>(vcookie);
+        saved.Reset(vcookie.GetUser(), vcookie.GetVisIdHigh(), vcookie.GetVisIdLow());
+        Deserialize(saved, buffer);
+        saved.Saved();
+        saved.SetCas(e->cookie->GetCas());
+        saved.SetExpiry(e->cookie->GetExpiry());
+        dirtyBytes += buffer.size();
+        dirtyBytes -= e->bytes;
+        e->bytes = buffer.size();
+        ++coalesced;
+    }
+    else {
+        // the new copy is this save's visitor
+        Serialize(vcookie, buffer);
+        if (spare == NULL) {
+            spare = new VCookie(vcookie.GetUser(), vcookie.GetVisIdHigh(), vcookie.GetVisIdLow(),
+                                true, *inner);
+        }
+        else {
+            spare->Reset(vcookie.GetUser(), vcookie.GetVisIdHigh(), vcookie.GetVisIdLow());
+        }
+        Deserialize(*spare, buffer);
+        spare->Saved();
+        spare->SetCas(vcookie.GetCas());
+        spare->SetExpiry(vcookie.GetExpiry());
+
+        if (i == index.end()) {
+            entry e;
+            e.cookie = spare;
+            e.bytes = buffer.size();
+            e.since = monotonic_ms();
+            e.written = false;
+            order.push_back(e);
+            index.insert(std::make_pair(id, --order.end()));
+            dirtyBytes += e.bytes;
+            spare = NULL;
+            order.back().cookie->AppendLog(vcookie);
+        }
+        else {
+            // the last save wins, as it would in the engine: it keeps no
+            // log, or the cookie was never loaded
+            order_t::iterator e = i->second;
+            spare->AppendLog(*e->cookie);
+            spare->AppendLog(vcookie);
+            std::swap(spare, e->cookie);
+            dirtyBytes += buffer.size();
+            dirtyBytes -= e->bytes;
+            e->bytes = buffer.size();
+            ++coalesced;
+        }
+    }
+
+    if (journal != -1) {
+        Append(vcookie, buffer);
+    }
+}
+
+bool VCStoreWriteBehind::Dirty(VCookie &vcookie)
+{
+    index_t::iterator i = index.find(visitor_id(vcookie));
+    if (i == index.end()) {
+        return false;
+    }
+    const VCookie &copy = *i->second->cookie;
+    Serialize(copy, buffer);
+    if (!Deserialize(vcookie, buffer)) {
+        return false;
+    }
+    vcookie.SetCas(copy.GetCas());
+    vcookie.SetExpiry(copy.GetExpiry());
+    ++loadHits;
+    return true;
+}
+
+void VCStoreWriteBehind::Drop(order_t::iterator e)
+{
+    index.erase(visitor_id(*e->cookie));
+    dirtyBytes -= e->bytes;
+    e->cookie->Saved();         // or its destructor saves it
+    delete e->cookie;
+    order.erase(e);
+}
+
+void VCStoreWriteBehind::Written(bool success, const VCookie &cookie)
+{
+    index_t &index = batch_context::Store()->index;
+    index_t::iterator i = index.find(visitor_id(cookie));
+    if (i != index.end()) {
+        i->second->written = success;
+    }
+}
+
+size_t VCStoreWriteBehind::Write(size_t count)
+{
+    std::vector<const VCookie*> batch;
+    for (order_t::iterator e = order.begin(); e != order.end() && batch.size() < count; ++e) {
+        e->written = false;
+        batch.push_back(e->cookie);
+    }
+
+    {
+        batch_context context(this, NULL);
+        inner->SaveVCookies(batch, Written);
+    }
+    ++flushes;
+
+    // the batch is at the front: what was written goes, what wasn't waits
+    // at the back to be tried again
+    size_t written = 0;
+    unsigned long long now = monotonic_ms();
+    for (size_t n = 0; n < batch.size(); ++n) {
+        order_t::iterator e = order.begin();
+        if (e->written) {
+            Drop(e);
+            ++written;
+        }
+        else {
+            e->since = now;
+            order.splice(order.end(), order, e);
+            ++failures;
+        }
+    }
+    writes += written;
+    return written;
+}
+
+void VCStoreWriteBehind::Flush(bool everything)
+{
+    unsigned long long now = monotonic_ms();
+    while (!order.empty()) {
+        bool due = everything || order.size() > maxDirty || dirtyBytes > maxDirtyBytes ||
+                   now - order.front().since >= maxDirtyMS;
+        if (!due || Write(flushBatch) == 0) {
+            break;
+        }
+    }
+    if (journal != -1 && journalBytes > 2ULL * dirtyBytes + JOURNAL_SLACK) {
+        Checkpoint();
+    }
+}
+
+bool VCStoreWriteBehind::SaveVCookie(VCookie const &vcookie)
+{
+    Coalesce(vcookie);
+    Flush();
+    return true;
+}
+
+bool VCStoreWriteBehind::LoadVCookie(VCookie &vcookie)
+{
+    Flush();
+    if (Dirty(vcookie)) {
+        return true;
+    }
+    return inner->LoadVCookie(vcookie);
+}
+
+void VCStoreWriteBehind::SaveVCookies(std::vector<const VCookie*> &cookies,
+                                      VCookieProcessedCallback callback)
+{
+    for (std::vector<const VCookie*>::iterator ii = cookies.begin(); ii != cookies.end(); ++ii) {
+        Coalesce(**ii);
+        if (callback != NULL) {
+            callback(true, **ii);
+        }
+    }
+    Flush();
+}
+
+void VCStoreWriteBehind::LoadVCookies(std::vector<VCookie*> &cookies,
+                                      VCookieProcessedCallback callback)
+{
+    Flush();
+    std::vector<VCookie*> clean;
+    for (std::vector<VCookie*>::iterator ii = cookies.begin(); ii != cookies.end(); ++ii) {
+        if (!Dirty(**ii)) {
+            clean.push_back(*ii);
+        }
+        else if (callback != NULL) {
+            callback(true, **ii);
+        }
+    }
+    if (!clean.empty()) {
+        inner->LoadVCookies(clean, callback);
+    }
+}
+
+bool VCStoreWriteBehind::SubmitLoad(VCookie &vcookie, VCookieCompletion done, void *context)
+{
+    Flush();
+    if (Dirty(vcookie)) {
+        vcookie.Loaded(true);
+        if (done != NULL) {
+            done(true, vcookie, context);
+        }
+        return true;
+    }
+    return inner->SubmitLoad(vcookie, done, context);
+}
+
+bool VCStoreWriteBehind::SubmitSave(VCookie &vcookie, VCookieCompletion done, void *context)
+{
+    Coalesce(vcookie);
+    Flush();
+    if (done != NULL) {
+        done(true, vcookie, context);
+    }
+    return true;
+}
+
+unsigned VCStoreWriteBehind::Poll()
+{
+    Flush();
+    return inner->Poll();
+}
+
+bool VCStoreWriteBehind::DeleteVCookie(VCookie &vcookie)
+{
+    bool dirty = false;
+    index_t::iterator i = index.find(visitor_id(vcookie));
+    if (i != index.end()) {
+        Drop(i->second);
+        dirty = true;
+    }
+    return inner->DeleteVCookie(vcookie) || dirty;
+}
+
+unsigned long long VCStoreWriteBehind::DeleteOldVCookies(time_t t)
+{
+    Flush(true);
+    return inner->DeleteOldVCookies(t);
+}
+
+// these two are for testing: what's dirty is written first, so the
+// engine has every visitor
+unsigned long long VCStoreWriteBehind::GetVCookieCount() const
+{
+    const_cast<VCStoreWriteBehind*>(this)->Flush(true);
+    return inner->GetVCookieCount();
+}
+
+bool VCStoreWriteBehind::GetVCookie(VCookie &vcookie, unsigned long long index) const
+{
+    const_cast<VCStoreWriteBehind*>(this)->Flush(true);
+    return inner->GetVCookie(vcookie, index);
+}
+
+void VCStoreWriteBehind::GetStats(std::map<std::string, unsigned long long> &stats) const
+{
+    inner->GetStats(stats);
+    stats["writebehind.saves"] += saves;
+    stats["writebehind.coalesced"] += coalesced;
+    stats["writebehind.writes"] += writes;
+    stats["writebehind.flushes"] += flushes;
+    stats["writebehind.failures"] += failures;
+    stats["writebehind.dirty"] += order.size();
+    stats["writebehind.dirtyBytes"] += dirtyBytes;
+    stats["writebehind.loadHits"] += loadHits;
+    stats["writebehind.journalBytes"] += journalBytes;
+    stats["writebehind.recovered"] += recovered;
+}
@@ -0,0 +1,134 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+/**
+ * Write-behind in front of another store: a save only updates a copy of
+ * the visitor kept in memory, and the dirty copies are written to the
+ * engine later, together, through its batched SaveVCookies. A visitor
+ * saved again before its copy is written costs nothing more, so a burst
+ * of hits from one visitor becomes one write.
+ *
+ * A dirty visitor is written at most max-dirty-ms after the first save
+ * that made it dirty (checked on every call to the store, so a thread
+ * that stops calling stops writing), sooner if more than max-dirty
+ * visitors or max-dirty-mb are waiting, and when the store is deleted.
+ * Writes go oldest first, flush-batch at a time. One that fails stays
+ * dirty and is tried again max-dirty-ms later.
+ *
+ * Loads see the dirty copies. Under an engine that checks CAS, a save
+ * into a dirty copy makes its changes again to the copy (VCookie::
+ * ReplayLog), as the engine would merge it, and the copy keeps the
+ * changes of every save it stands for, so if another writer got there
+ * first they are merged as the hits would have been one at a time. That
+ * merge happens when the copy is written, so unlike a save straight to
+ * the engine it doesn't change the cookies that were saved.
+ *
+ * What's dirty is lost if the process dies, unless journal= names a
+ * file: each save is appended to <journal>.<n> (n for each store in the
+ * process) before it returns, and a store that finds the file left by
+ * one that died writes what's in it to the engine first. The file is
+ * rewritten with just the dirty visitors as it grows, and removed when
+ * the store is deleted with nothing left to write. journal-sync=on
+ * also syncs every save to disk, to survive the machine going down.
+ */
+#ifndef VC_STORE_WRITE_BEHIND_H
+#define VC_STORE_WRITE_BEHIND_H
+
+#include "abstraction/vcookie.h"
+#include "abstraction/vcstoredecorator.h"
+#include "abstraction/vcengineregistry.h"
+#include "VCStoreInMemory.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+
+class VCStoreWriteBehind: public VCStoreDecorator
+{
+public:
+    VCStoreWriteBehind(VCookieStore *inner, unsigned maxDirtyMS, size_t maxDirty,
+                       size_t maxDirtyBytes, size_t flushBatch);
+    virtual ~VCStoreWriteBehind();
+
+    // engine.writebehind.max-dirty-ms=, max-dirty=, max-dirty-mb=,
+    // flush-batch=, journal=, journal-sync=
+    static VCookieStore *Create(VCookieStore *inner, const VCEngineOptions &options);
+
+    // write what a store that died left in the journal at path, then
+    // append to it; false (after saying why) if it can't be opened
+    bool Journal(const std::string &path, bool sync);
+
+    virtual void SaveVCookies(std::vector<const VCookie*> &cookies,
+                              VCookieProcessedCallback callback);
+    virtual void LoadVCookies(std::vector<VCookie*> &cookies,
+                              VCookieProcessedCallback callback);
+
+    virtual bool SubmitLoad(VCookie &vcookie, VCookieCompletion done, void *context);
+    virtual bool SubmitSave(VCookie &vcookie, VCookieCompletion done, void *context);
+    virtual unsigned Poll();
+
+    virtual bool SaveVCookie(VCookie const &vcookie);
+    virtual bool LoadVCookie(VCookie &vcookie);
+    virtual bool DeleteVCookie(VCookie &vcookie);
+    virtual unsigned long long DeleteOldVCookies(time_t t);
+    virtual unsigned long long GetVCookieCount() const;
+    virtual bool GetVCookie(VCookie &vcookie, unsigned long long index) const;
+
+    // writebehind.saves, writebehind.coalesced, writebehind.writes,
+    // writebehind.flushes, writebehind.failures, writebehind.dirty,
+    // writebehind.dirtyBytes, writebehind.loadHits, writebehind.journalBytes,
+    // writebehind.recovered, then the inner store's
+    virtual void GetStats(std::map<std::string, unsigned long long> &stats) const;
+
+private:
+    struct entry {
+        VCookie *cookie;            // the latest copy, with every save's log
+        size_t bytes;               // serialized
+        unsigned long long since;   // ms, of the first save not written yet
+        bool written;
+    };
+    typedef std::list<entry> order_t;       // oldest first
+    typedef std::map<VCookieId, order_t::iterator> index_t;
+
+    // take a save into the dirty copies
+    void Coalesce(const VCookie &vcookie);
+    // load the dirty copy, if there is one
+    bool Dirty(VCookie &vcookie);
+    // write whatever is due; all of it if everything
+    void Flush(bool everything = false);
+    // write the count oldest, returns how many were written
+    size_t Write(size_t count);
+    void Drop(order_t::iterator e);
+
+    void Append(const VCookie &vcookie, const std::vector<char> &blob);
+    // the journal again, with just what's dirty
+    void Checkpoint();
+    void CloseJournal(const char *why);
+
+    static void Written(bool success, const VCookie &cookie);
+
+    unsigned maxDirtyMS;
+    size_t maxDirty;
+    size_t maxDirtyBytes;
+    size_t flushBatch;
+    order_t order;
+    index_t index;
+    size_t dirtyBytes;
+    VCookie *spare;                 // the next copy, reused
+    std::vector<char> buffer;
+
+    std::string journalPath;
+    int journal;                    // -1 if none
+    bool journalSync;
+    unsigned long long journalBytes;
+
+    unsigned long long saves;
+    unsigned long long coalesced;
+    unsigned long long writes;
+    unsigned long long flushes;
+    unsigned long long failures;
+    unsigned long long loadHits;
+    unsigned long long recovered;
+};
+
+#endif
@@ -0,0 +1,609 @@
+//
+//  bench.cpp
+//  Vcookie
+//
+//  Micro-benchmarks for VCookie and the serializer (make bench).
+//
+//  Each benchmark runs one operation on cookies of a few shapes (number
+//  of evars, linear depth, string length) and reports ns/op plus the
+//  heap allocations and bytes allocated per op, counted by replacing the
+//  global operator new. Results can be saved as a baseline and a later
+//  run compared against it; anything slower by more than the threshold,
+//  or allocating more, is flagged and the exit status is 1.
+//
+//  The store key encodings (vcookiekey.h) are timed the same way, and
+//  --spread prints how evenly each one spreads visitors over the
+//  vbuckets of a Couchbase cluster.
+//
+//    vcookie_bench [--filter text] [--min-time s] [--shape evars,depth,length]
+//                  [--save file] [--compare file] [--threshold percent]
+//                  [--spread visitors] [--vbuckets n]
+//
+
+#include "VCStoreInMemory.h"
+#include "vcookie.h"
+#include "vcookiekey.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <new>
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+
+// ---- allocation counting ----------------------------------------
+
+namespace {
+    unsigned long long allocCount = 0;
+    unsigned long long allocBytes = 0;
+}
+
+void *operator new (size_t size)
+{
+    ++allocCount;
+    allocBytes += size;
+    void *p = malloc (size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc ();
+    }
+    return p;
+}
+void *operator new[] (size_t size)
+{
+    return operator new (size);
+}
+// Once the deletes are inlined gcc sees free () called on memory from
+// operator new and warns, not knowing these replacements got it from
+// malloc. The pairing is right, so the warning is off just here.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void operator delete (void *p) throw ()
+{
+    free (p);
+}
+void operator delete[] (void *p) throw ()
+{
+    free (p);
+}
+void operator delete (void *p, size_t) throw ()
+{
+    free (p);
+}
+void operator delete[] (void *p, size_t) throw ()
+{
+    free (p);
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+namespace {
+
+// ---- cookie shapes ----------------------------------------------
+
+struct Shape {
+    unsigned evars;         // evars set
+    unsigned depth;         // values kept by each linear evar (1 = no linear evars)
+    unsigned length;        // length of each evar value and of the url/referrer/pagename
+
+    std::string Name () const
+    {
+        std::ostringstream os;
+        os << "e" << evars << "/d" << depth << "/s" << length;
+        return os.str ();
+    }
+};
+
+const time_t BASE_TIME = 1350000000;
+
+std::string Value (unsigned length, unsigned seed)
+{
+    std::string s (length, 'a');
+    for (unsigned i = 0; i < length; ++i) {
+        s[i] = char ('a' + (seed * 7 + i * 13) % 26);
+    }
+    return s;
+}
+
+// every other evar is linear (when depth > 1) and filled to its depth
+void FillVCookie (VCookie &vc, Shape const &shape)
+{
+    vc.SetFirstHitTimeGMT (BASE_TIME);
+    vc.SetLastHitTimeGMT (BASE_TIME + 1000);
+    vc.SetLastHitTimeVisitorLocal (BASE_TIME + 1000 - 7*60*60);
+    vc.SetLastVisitNum (12);
+    vc.SetFirstHitReferrer (Value (shape.length, 1));
+    vc.SetFirstHitUrl (Value (shape.length, 2));
+    vc.SetFirstHitPagename (Value (shape.length, 3));
+    vc.SetLastPurchaseTimeGMT (BASE_TIME + 500);
+    vc.SetLastPurchaseNum (3);
+    for (unsigned i = 0; i < NUM_SAVED_PURCHASE_IDS; ++i) {
+        vc.SetPurchaseId (Value (8, 100 + i));
+    }
+
+    for (unsigned e = 0; e < shape.evars; ++e) {
+        VCookie::RelationId rid = static_cast<VCookie::RelationId> ((e * 37) % 75 + (e / 75) * 75);
+        if (shape.depth > 1 && e % 2) {
+            for (unsigned d = 0; d < shape.depth; ++d) {
+                vc.SetVar (rid, Value (shape.length, e * 100 + d), BASE_TIME + d, 1, ALLOC_TYPE_LINEAR, shape.depth);
+            }
+        }
+        else {
+            vc.SetVar (rid, Value (shape.length, e), BASE_TIME, 1, ALLOC_TYPE_FIRST);
+        }
+    }
+}
+
+// ---- timing -----------------------------------------------------
+
+unsigned long long NowNS ()
+{
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+struct Result {
+    std::string name;
+    double nsPerOp;
+    double allocsPerOp;
+    double bytesPerOp;
+};
+
+// A benchmark is a functor: Setup () once, then operator () (i) per op.
+// The op count is grown until a run takes minTime, then the median of
+// REPEATS runs of that length is reported.
+const unsigned REPEATS = 5;
+
+template <typename B>
+Result Run (std::string const &name, B &bench, double minTime)
+{
+    bench.Setup ();
+
+    unsigned long long ops = 1;
+    for (;;) {
+        unsigned long long start = NowNS ();
+        for (unsigned long long i = 0; i < ops; ++i) {
+            bench (i);
+        }
+        double elapsed = (NowNS () - start) / 1e9;
+        if (elapsed >= minTime / REPEATS || ops >= (1ULL << 32)) {
+            break;
+        }
+        ops = elapsed > 0 ? std::max (ops * 2, (unsigned long long) (ops * (minTime / REPEATS) / elapsed * 1.2)) : ops * 10;
+    }
+
+    std::vector<double> ns;
+    unsigned long long allocs = 0, bytes = 0;
+    for (unsigned r = 0; r < REPEATS; ++r) {
+        unsigned long long count0 = allocCount, bytes0 = allocBytes;
+        unsigned long long start = NowNS ();
+        for (unsigned long long i = 0; i < ops; ++i) {
+            bench (i);
+        }
+        ns.push_back (double (NowNS () - start) / ops);
+        allocs += allocCount - count0;
+        bytes += allocBytes - bytes0;
+    }
+    std::sort (ns.begin (), ns.end ());
+
+    Result result;
+    result.name = name;
+    result.nsPerOp = ns[REPEATS / 2];
+    result.allocsPerOp = double (allocs) / (ops * REPEATS);
+    result.bytesPerOp = double (bytes) / (ops * REPEATS);
+    return result;
+}
+
+// ---- the benchmarks ---------------------------------------------
+
+VCStoreInMemory store;
+
+struct SerializeBench {
+    Shape shape;
+    VCookie vc;
+    std::vector<char> buffer;
+
+    SerializeBench (Shape const &s) : shape (s), vc (1, 2, 3, true, store) {}
+    void Setup () { FillVCookie (vc, shape); }
+    void operator () (unsigned long long)
+    {
+        VCookieStore::Serialize (vc, buffer, false);
+    }
+};
+
+struct DeserializeBench {
+    Shape shape;
+    VCookie vc;
+    std::vector<char> buffer;
+
+    DeserializeBench (Shape const &s) : shape (s), vc (1, 2, 3, true, store) {}
+    void Setup ()
+    {
+        FillVCookie (vc, shape);
+        VCookieStore::Serialize (vc, buffer, false);
+    }
+    // as a store does it: a reset cookie filled from the blob
+    void operator () (unsigned long long)
+    {
+        vc.Reset (1, 2, 3);
+        VCookieStore::Deserialize (vc, buffer);
+    }
+};
+
+// a hit changing an ALLOC_TYPE_LAST evar: same slot, new value
+struct SetVarBench {
+    Shape shape;
+    VCookie vc;
+    std::vector<std::string> values;
+
+    SetVarBench (Shape const &s) : shape (s), vc (1, 2, 3, true, store) {}
+    void Setup ()
+    {
+        FillVCookie (vc, shape);
+        for (unsigned i = 0; i < 16; ++i) {
+            values.push_back (Value (shape.length, 1000 + i));
+        }
+    }
+    void operator () (unsigned long long i)
+    {
+        vc.SetVar (0, values[i % values.size ()], BASE_TIME + i, 1, ALLOC_TYPE_LAST);
+    }
+};
+
+// a hit appending to a full linear evar: the oldest value drops off
+struct SetVarLinearBench {
+    Shape shape;
+    VCookie vc;
+    std::vector<std::string> values;
+
+    SetVarLinearBench (Shape const &s) : shape (s), vc (1, 2, 3, true, store) {}
+    void Setup ()
+    {
+        FillVCookie (vc, shape);
+        for (unsigned i = 0; i < 16; ++i) {
+            values.push_back (Value (shape.length, 2000 + i));
+        }
+    }
+    void operator () (unsigned long long i)
+    {
+        vc.SetVar (74, values[i % values.size ()], BASE_TIME + i, 1, ALLOC_TYPE_LINEAR, shape.depth);
+    }
+};
+
+// cycles through more ids than are kept, so most calls add one and drop the oldest
+struct SetPurchaseIdBench {
+    Shape shape;
+    VCookie vc;
+    std::vector<std::string> ids;
+
+    SetPurchaseIdBench (Shape const &s) : shape (s), vc (1, 2, 3, true, store) {}
+    void Setup ()
+    {
+        FillVCookie (vc, shape);
+        for (unsigned i = 0; i < NUM_SAVED_PURCHASE_IDS * 2 + 1; ++i) {
+            ids.push_back (Value (8, 3000 + i));
+        }
+    }
+    void operator () (unsigned long long i)
+    {
+        vc.SetPurchaseId (ids[i % ids.size ()]);
+    }
+};
+
+// FindRelationPos is private; GetVarElementCount is the thinnest public
+// call on top of it (binary search plus a bounds check)
+struct FindRelationBench {
+    Shape shape;
+    VCookie vc;
+    unsigned long long found;
+
+    FindRelationBench (Shape const &s) : shape (s), vc (1, 2, 3, true, store), found (0) {}
+    void Setup () { FillVCookie (vc, shape); }
+    void operator () (unsigned long long i)
+    {
+        found += vc.GetVarElementCount (static_cast<VCookie::RelationId> (i % 75));
+    }
+};
+
+// ---- store keys -------------------------------------------------
+
+// a visitor id per op from a small ring, so the ids aren't constant
+struct KeyIds {
+    unsigned long long high[64], low[64];
+
+    KeyIds ()
+    {
+        unsigned long long x = 88172645463325252ULL;
+        for (unsigned i = 0; i < 64; ++i) {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            high[i] = x;
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            low[i] = x;
+        }
+    }
+};
+
+// how the Couchbase engine built its keys before VCookieKey
+struct KeyStreamBench {
+    KeyIds ids;
+    size_t bytes;
+
+    KeyStreamBench () : bytes (0) {}
+    void Setup () {}
+    void operator () (unsigned long long i)
+    {
+        std::stringstream ss;
+        ss << 12345u << ':' << std::hex << ids.high[i % 64] << ':' << ids.low[i % 64];
+        bytes += ss.str ().size ();
+    }
+};
+
+struct KeyEncodeBench {
+    KeyIds ids;
+    VCookieKey key;
+    size_t bytes;
+
+    KeyEncodeBench (VCookieKey::Encoding encoding) : key (encoding, "vc:"), bytes (0) {}
+    void Setup () {}
+    void operator () (unsigned long long i)
+    {
+        key.Encode (12345, ids.high[i % 64], ids.low[i % 64]);
+        bytes += key.Data ()[key.Size () - 1];
+    }
+};
+
+// Keys per vbucket for a number of visitors of one report suite, with
+// random visitor ids and with sequential ones. max/mean is what the
+// busiest node sees over a perfect spread.
+void PrintSpread (unsigned visitors, unsigned vbuckets)
+{
+    printf ("\n%-24s %6s %10s %8s %8s %8s %9s\n", "key (visitors)", "bytes", "vbuckets", "min", "max", "max/mean", "stddev");
+
+    for (unsigned sequential = 0; sequential < 2; ++sequential) {
+        for (int format = -1; format <= VCookieKey::VC_KEY_BASE64; ++format) {
+            std::vector<unsigned> counts (vbuckets);
+            VCookieKey key (VCookieKey::Encoding (format < 0 ? 0 : format));
+            std::string name;
+            size_t bytes = 0;
+
+            unsigned long long x = 88172645463325252ULL;
+            for (unsigned v = 0; v < visitors; ++v) {
+                unsigned long long high, low;
+                if (sequential) {
+                    high = 0x2a3f9c0000000000ULL;
+                    low = v;
+                }
+                else {
+                    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+                    high = x;
+                    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+                    low = x;
+                }
+
+                if (format < 0) {
+                    // the report suite alone, as the engine once keyed
+                    name = "user only";
+                    std::stringstream ss;
+                    ss << 12345u;
+                    bytes = ss.str ().size ();
+                    ++counts[VCookieKey::VBucket (ss.str ().data (), bytes, vbuckets)];
+                }
+                else {
+                    name = format == VCookieKey::VC_KEY_BINARY ? "binary" : format == VCookieKey::VC_KEY_HEX ? "hex" : "base64";
+                    key.Encode (12345, high, low);
+                    bytes = key.Size ();
+                    ++counts[VCookieKey::VBucket (key.Data (), bytes, vbuckets)];
+                }
+            }
+
+            unsigned used = 0, least = visitors, most = 0;
+            double mean = double (visitors) / vbuckets, sum = 0;
+            for (unsigned b = 0; b < vbuckets; ++b) {
+                used += counts[b] != 0;
+                least = std::min (least, counts[b]);
+                most = std::max (most, counts[b]);
+                sum += (counts[b] - mean) * (counts[b] - mean);
+            }
+            name += sequential ? " (sequential)" : " (random)";
+            printf ("%-24s %6u %10u %8u %8u %8.2f %9.1f\n", name.c_str (), (unsigned) bytes, used, least, most,
+                    most / mean, sqrt (sum / vbuckets));
+        }
+    }
+}
+
+// ---- baselines --------------------------------------------------
+
+// name ns/op allocs/op bytes/op, one benchmark per line
+bool SaveBaseline (std::string const &filename, std::vector<Result> const &results)
+{
+    std::ofstream out (filename.c_str ());
+    for (unsigned i = 0; i < results.size (); ++i) {
+        out << results[i].name << " " << results[i].nsPerOp << " "
+            << results[i].allocsPerOp << " " << results[i].bytesPerOp << "\n";
+    }
+    out.close ();
+    return !out.fail ();
+}
+
+bool LoadBaseline (std::string const &filename, std::map<std::string, Result> &baseline)
+{
+    std::ifstream in (filename.c_str ());
+    if (!in) {
+        return false;
+    }
+    Result r;
+    while (in >> r.name >> r.nsPerOp >> r.allocsPerOp >> r.bytesPerOp) {
+        baseline[r.name] = r;
+    }
+    return true;
+}
+
+// one line of the report; false for a regression against the baseline
+bool PrintResult (Result const &r, std::map<std::string, Result> const &baseline, double threshold)
+{
+    bool ok = true;
+    printf ("%-36s %12.1f %12.2f %12.1f", r.name.c_str (), r.nsPerOp, r.allocsPerOp, r.bytesPerOp);
+
+    std::map<std::string, Result>::const_iterator b = baseline.find (r.name);
+    if (b != baseline.end ()) {
+        double change = b->second.nsPerOp > 0 ? (r.nsPerOp / b->second.nsPerOp - 1) * 100 : 0;
+        // half an allocation either way is noise from the op count rounding
+        bool slower = change > threshold;
+        bool moreAllocs = r.allocsPerOp > b->second.allocsPerOp + 0.5;
+        printf (" %+9.1f%%", change);
+        if (slower || moreAllocs) {
+            printf ("  REGRESSION%s", moreAllocs ? " (allocs)" : "");
+            ok = false;
+        }
+    }
+    printf ("\n");
+    return ok;
+}
+
+void Usage ()
+{
+    printf ("usage: vcookie_bench [--filter text] [--min-time seconds] [--shape evars,depth,length]...\n"
+            "                     [--save file] [--compare file] [--threshold percent]\n"
+            "                     [--spread visitors] [--vbuckets n]\n");
+}
+
+} // end anonymous namespace
+
+
+int main (int argc, char *argv[])
+{
+    std::string filter, saveFile, compareFile;
+    double minTime = 0.5;
+    double threshold = 10;
+    unsigned spread = 0, vbuckets = 1024;
+    std::vector<Shape> shapes;
+
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        bool hasValue = a + 1 < argc;
+
+        if (arg == "--filter" && hasValue) {
+            filter = argv[++a];
+        }
+        else if (arg == "--min-time" && hasValue) {
+            minTime = atof (argv[++a]);
+        }
+        else if (arg == "--save" && hasValue) {
+            saveFile = argv[++a];
+        }
+        else if (arg == "--compare" && hasValue) {
+            compareFile = argv[++a];
+        }
+        else if (arg == "--threshold" && hasValue) {
+            threshold = atof (argv[++a]);
+        }
+        else if (arg == "--spread" && hasValue) {
+            spread = strtoul (argv[++a], NULL, 10);
+        }
+        else if (arg == "--vbuckets" && hasValue) {
+            vbuckets = strtoul (argv[++a], NULL, 10);
+            if (vbuckets == 0 || (vbuckets & (vbuckets - 1))) {
+                Usage ();
+                return 2;
+            }
+        }
+        else if (arg == "--shape" && hasValue) {
+            Shape s;
+            if (sscanf (argv[++a], "%u,%u,%u", &s.evars, &s.depth, &s.length) != 3 || s.depth == 0) {
+                Usage ();
+                return 2;
+            }
+            shapes.push_back (s);
+        }
+        else {
+            Usage ();
+            return arg == "--help" ? 0 : 2;
+        }
+    }
+
+    if (shapes.empty ()) {
+        // a new visitor, a typical returning one, and one with every evar set
+        Shape small = { 4, 1, 8 }, typical = { 20, 5, 24 }, large = { 75, 10, 64 };
+        shapes.push_back (small);
+        shapes.push_back (typical);
+        shapes.push_back (large);
+    }
+
+    std::map<std::string, Result> baseline;
+    if (!compareFile.empty () && !LoadBaseline (compareFile, baseline)) {
+        printf ("can't read baseline %s\n", compareFile.c_str ());
+        return 2;
+    }
+
+    printf ("%-36s %12s %12s %12s", "benchmark", "ns/op", "allocs/op", "bytes/op");
+    if (!baseline.empty ()) {
+        printf (" %10s", "vs base");
+    }
+    printf ("\n");
+
+    std::vector<Result> results;
+    unsigned regressions = 0;
+
+    for (unsigned s = 0; s < shapes.size (); ++s) {
+        Shape const &shape = shapes[s];
+        std::vector<Result> shapeResults;
+
+        #define BENCH(name, type) \
+            if (filter.empty () || (std::string (name) + "/" + shape.Name ()).find (filter) != std::string::npos) { \
+                type bench (shape); \
+                shapeResults.push_back (Run (std::string (name) + "/" + shape.Name (), bench, minTime)); \
+            }
+        BENCH ("Serialize", SerializeBench);
+        BENCH ("Deserialize", DeserializeBench);
+        BENCH ("SetVar", SetVarBench);
+        if (shape.depth > 1) {
+            BENCH ("SetVarLinear", SetVarLinearBench);
+        }
+        BENCH ("SetPurchaseId", SetPurchaseIdBench);
+        BENCH ("FindRelation", FindRelationBench);
+        #undef BENCH
+
+        for (unsigned i = 0; i < shapeResults.size (); ++i) {
+            regressions += !PrintResult (shapeResults[i], baseline, threshold);
+            results.push_back (shapeResults[i]);
+        }
+    }
+
+    // the keys don't depend on the cookie shape
+    #define KEY_BENCH(name, type, args) \
+        if (filter.empty () || std::string (name).find (filter) != std::string::npos) { \
+            type bench args; \
+            results.push_back (Run (name, bench, minTime)); \
+            regressions += !PrintResult (results.back (), baseline, threshold); \
+        }
+    KEY_BENCH ("Key/stringstream", KeyStreamBench, );
+    KEY_BENCH ("Key/binary", KeyEncodeBench, (VCookieKey::VC_KEY_BINARY));
+    KEY_BENCH ("Key/hex", KeyEncodeBench, (VCookieKey::VC_KEY_HEX));
+    KEY_BENCH ("Key/base64", KeyEncodeBench, (VCookieKey::VC_KEY_BASE64));
+    #undef KEY_BENCH
+
+    if (spread) {
+        PrintSpread (spread, vbuckets);
+    }
+
+    if (!saveFile.empty () && !SaveBaseline (saveFile, results)) {
+        printf ("can't write baseline %s\n", saveFile.c_str ());
+        return 2;
+    }
+
+    if (regressions) {
+        printf ("%u regression%s over %.0f%%\n", regressions, regressions == 1 ? "" : "s", threshold);
+        return 1;
+    }
+    return 0;
+}
@@ -1,6 +1,8 @@
 #include "VCStoreInMemory.h"
 #include "vcookie.h"
+#include "vcookiekey.h"
 #include <time.h>
+#include <string.h>
 
 #include "fct.h"
 
@@ -54,6 +56,13 @@ void SetupVCookie (VCookie &vc)
 }
 
 
+// an in-memory store whose cookies keep a mutation log
+class LoggingStore : public VCStoreInMemory
+{
+public:
+    virtual bool KeepsMutationLog () const { return true; }
+};
+
 #define CHK(a) if (a) ; else return false;
 
 bool CheckVar (VCookie const &vc, VCookie::RelationId rid, std::string value, time_t t, unsigned char revision, char start, unsigned count=1)
@@ -179,6 +188,117 @@ FCT_BGN()
                 fct_chk (pvcs->GetVCookieCount() == 75);
             }
             FCT_TEST_END();
+
+            FCT_TEST_BGN(ReplayLog)
+            {
+                LoggingStore logging;
+                {
+                    VCookie vc(12345, 6789, 9876, true, logging);
+                    SetupVCookie (vc);
+                }
+
+                // two writers load the same visitor, theirs saves first
+                VCookie mine(12345, 6789, 9876, false, logging);
+                VCookie theirs(12345, 6789, 9876, false, logging);
+                fct_chk (mine.GetMutationCount() == 0);
+                time_t t = mine.GetLastHitTimeGMT();
+
+                mine.SetFirstHitTimeGMT(t - 200000);
+                mine.SetFirstHitPagename("Earlier Page");
+                mine.SetLastHitTimeGMT(t + 10);
+                mine.SetLastVisitNum(mine.GetLastVisitNum() + 1);
+                mine.AddLastPurchaseNum(1);
+                mine.SetVar(9, "Var9i", t+10, 89, ALLOC_TYPE_LINEAR, 5);
+                mine.ClearVar(1);
+                fct_chk (mine.GetMutationCount() == 7);
+
+                theirs.SetLastHitTimeGMT(t + 20);
+                theirs.AddLastPurchaseNum(2);
+                theirs.SetVar(9, "Var9j", t+20, 99, ALLOC_TYPE_LINEAR, 5);
+                theirs.Store();
+                fct_chk (theirs.GetMutationCount() == 0);
+
+                mine.ReplayLog(theirs);
+                fct_chk (theirs.GetFirstHitTimeGMT() == t - 200000);
+                fct_chk (theirs.GetFirstHitPagename() == "Earlier Page");
+                fct_chk (theirs.GetLastHitTimeGMT() == t + 20);
+                fct_chk (theirs.GetLastVisitNum() == mine.GetLastVisitNum());
+                fct_chk (theirs.GetLastPurchaseNum() == 5 + 2 + 1);
+                fct_chk (theirs.GetVarElementCount(9) == 5);
+                fct_chk (theirs.GetVar((VCookie::RelationId) 9, 3)->value == "Var9j");
+                fct_chk (theirs.GetVar((VCookie::RelationId) 9, 4)->value == "Var9i");
+                fct_chk (theirs.GetVarElementCount(1) == 0);
+                mine.Saved();
+            }
+            FCT_TEST_END();
+
+            FCT_TEST_BGN(AppendLog)
+            {
+                LoggingStore logging;
+                {
+                    VCookie vc(12345, 6789, 9876, true, logging);
+                    SetupVCookie (vc);
+                }
+
+                // two hits held back by a write-behind store, then written
+                // over a copy another writer saved in the meantime
+                VCookie first(12345, 6789, 9876, false, logging);
+                time_t t = first.GetLastHitTimeGMT();
+                first.SetLastHitTimeGMT(t + 10);
+                first.AddLastPurchaseNum(1);
+                VCookie second(12345, 6789, 9876, false, logging);
+                second.AddLastPurchaseNum(2);
+
+                VCookie held(12345, 6789, 9876, true, logging);
+                held.AppendLog(first);
+                held.AppendLog(second);
+                fct_chk (held.GetMutationCount() == 3);
+                fct_chk (!held.IsModified());
+
+                VCookie theirs(12345, 6789, 9876, false, logging);
+                theirs.SetLastHitTimeGMT(t + 20);
+                theirs.Store();
+
+                held.ReplayLog(theirs);
+                fct_chk (theirs.GetLastHitTimeGMT() == t + 20);
+                fct_chk (theirs.GetLastPurchaseNum() == 5 + 1 + 2);
+                first.Saved();
+                second.Saved();
+                theirs.Saved();
+            }
+            FCT_TEST_END();
+
+            FCT_TEST_BGN(VCookieKeys)
+            {
+                VCookieKey hex (VCookieKey::VC_KEY_HEX, "run1:");
+                hex.Encode (0x01020304, 0x1122334455667788ULL, 0x99aabbccddeeff00ULL);
+                fct_chk (hex.Size() == 5 + 40);
+                fct_chk (std::string (hex.Data(), hex.Size()) == "run1:010203041122334455667788" "99aabbccddeeff00");
+
+                VCookieKey base64;
+                base64.Encode (0, 0, 0);
+                fct_chk (std::string (base64.Data(), base64.Size()) == "AAAAAAAAAAAAAAAAAAAAAAAAAAA");
+                base64.Encode (0xffffffff, ~0ULL, ~0ULL);
+                fct_chk (std::string (base64.Data(), base64.Size()) == "__________________________8");
+
+                // binary keys sort like VCookieId: user, then visid_high, then visid_low
+                VCookieKey a (VCookieKey::VC_KEY_BINARY), b (VCookieKey::VC_KEY_BINARY);
+                a.Encode (1, 2, ~0ULL);
+                b.Encode (1, 3, 0);
+                fct_chk (a.Size() == VCookieKey::RAW_SIZE);
+                fct_chk (memcmp (a.Data(), b.Data(), a.Size()) < 0);
+                b.Encode (2, 0, 0);
+                a.Encode (1, ~0ULL, ~0ULL);
+                fct_chk (memcmp (a.Data(), b.Data(), a.Size()) < 0);
+
+                VCookie vc (12345, 6789, 9876, true, *pvcs);
+                b.Encode (vc);
+                a.Encode (12345, 6789, 9876);
+                fct_chk (memcmp (a.Data(), b.Data(), a.Size()) == 0);
+                // the CRC-32 check value is 0xcbf43926
+                fct_chk (VCookieKey::VBucket ("123456789", 9, 1024) == (0x4bf4 & 1023));
+            }
+            FCT_TEST_END();
         }
         FCT_FIXTURE_SUITE_END();
     }
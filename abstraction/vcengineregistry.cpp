@@ -0,0 +1,169 @@
+//
+//  vcengineregistry.cpp
+//  Vcookie
+//
+
+#include "vcengineregistry.h"
+#include "vcookiestore.h"
+#include <dlfcn.h>
+
+std::map<std::string, VCEngineRegistry::Engine> &VCEngineRegistry::Engines ()
+{
+    static std::map<std::string, Engine> engines;
+    return engines;
+}
+
+bool VCEngineRegistry::Add (Engine const &engine, VCEngineOption const *options)
+{
+    std::pair<std::map<std::string, Engine>::iterator, bool> added =
+        Engines().insert (std::make_pair (engine.name, engine));
+
+    for (; added.second && options && options->name; ++options) {
+        added.first->second.options.push_back (*options);
+    }
+    return added.second;
+}
+
+bool VCEngineRegistry::Register (std::string const &name, Factory factory, unsigned capabilities,
+                                 VCEngineOption const *options, std::string const &description)
+{
+    Engine engine;
+    engine.name = name;
+    engine.description = description;
+    engine.factory = factory;
+    engine.decorate = NULL;
+    engine.capabilities = capabilities;
+
+    return Add (engine, options);
+}
+
+bool VCEngineRegistry::RegisterDecorator (std::string const &name, DecoratorFactory decorate,
+                                          VCEngineOption const *options, std::string const &description,
+                                          unsigned needs)
+{
+    Engine engine;
+    engine.name = name;
+    engine.description = description;
+    engine.factory = NULL;
+    engine.decorate = decorate;
+    engine.capabilities = needs;
+
+    return Add (engine, options);
+}
+
+VCEngineRegistry::Engine const *VCEngineRegistry::Find (std::string const &name)
+{
+    std::map<std::string, Engine>::const_iterator i = Engines().find (name);
+    return i == Engines().end() ? NULL : &i->second;
+}
+
+std::vector<std::string> VCEngineRegistry::Names (bool decorators)
+{
+    std::vector<std::string> names;
+    std::map<std::string, Engine>::const_iterator i;
+    for (i = Engines().begin(); i != Engines().end(); ++i) {
+        if ((i->second.decorate != NULL) == decorators) {
+            names.push_back (i->first);
+        }
+    }
+    return names;
+}
+
+bool VCEngineRegistry::LoadPlugin (std::string const &path, std::string &error)
+{
+    // never closed: the engines' code has to stay mapped while they are registered
+    if (dlopen (path.c_str(), RTLD_NOW | RTLD_GLOBAL) == NULL) {
+        error = dlerror();
+        return false;
+    }
+    return true;
+}
+
+bool VCEngineRegistry::Configure (std::string const &engine, std::vector<std::string> const &decorators,
+                                  VCStackOptions &options, std::string &error)
+{
+    Engine const *base = Find (engine);
+    if (base == NULL || base->factory == NULL) {
+        error = "no engine '" + engine + "'";
+        return false;
+    }
+
+    std::vector<Engine const *> stack (1, base);
+    for (size_t i = 0; i < decorators.size(); ++i) {
+        Engine const *decorator = Find (decorators[i]);
+        if (decorator == NULL || decorator->decorate == NULL) {
+            error = "no decorator '" + decorators[i] + "'";
+            return false;
+        }
+        if ((base->capabilities & decorator->capabilities) != decorator->capabilities) {
+            error = "'" + decorators[i] + "' needs more than engine '" + engine + "' does";
+            return false;
+        }
+        stack.push_back (decorator);
+    }
+
+    // options for something that isn't in the stack are a mistake too
+    for (VCStackOptions::const_iterator o = options.begin(); o != options.end(); ++o) {
+        size_t i = 0;
+        while (i < stack.size() && stack[i]->name != o->first) {
+            ++i;
+        }
+        if (i == stack.size()) {
+            error = "options given for '" + o->first + "', which isn't being used";
+            return false;
+        }
+    }
+
+    for (size_t i = 0; i < stack.size(); ++i) {
+        VCEngineOptions &given = options[stack[i]->name];
+        std::vector<VCEngineOption> const &declared = stack[i]->options;
+
+        for (VCEngineOptions::const_iterator g = given.begin(); g != given.end(); ++g) {
+            size_t d = 0;
+            while (d < declared.size() && g->first != declared[d].name) {
+                ++d;
+            }
+            if (d == declared.size()) {
+                error = "'" + stack[i]->name + "' has no option '" + g->first + "'";
+                return false;
+            }
+        }
+        for (size_t d = 0; d < declared.size(); ++d) {
+            given.insert (std::make_pair (std::string (declared[d].name), std::string (declared[d].defaultValue)));
+        }
+    }
+    return true;
+}
+
+VCookieStore *VCEngineRegistry::Create (std::string const &engine, std::vector<std::string> const &decorators,
+                                        VCStackOptions const &options)
+{
+    static const VCEngineOptions none;
+
+    Engine const *base = Find (engine);
+    if (base == NULL || base->factory == NULL) {
+        return NULL;
+    }
+    VCStackOptions::const_iterator o = options.find (engine);
+    VCookieStore *store = base->factory (o == options.end() ? none : o->second);
+
+    for (size_t i = 0; store && i < decorators.size(); ++i) {
+        Engine const *decorator = Find (decorators[i]);
+        if (decorator == NULL || decorator->decorate == NULL) {
+            delete store;
+            return NULL;
+        }
+        o = options.find (decorators[i]);
+        store = decorator->decorate (store, o == options.end() ? none : o->second);
+    }
+    return store;
+}
+
+std::string VCEngineRegistry::StackName (std::string const &engine, std::vector<std::string> const &decorators)
+{
+    std::string name;
+    for (size_t i = decorators.size(); i-- > 0; ) {
+        name += decorators[i] + "+";
+    }
+    return name + engine;
+}
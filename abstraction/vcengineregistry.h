@@ -0,0 +1,120 @@
+#ifndef VCOOKIE_ENGINE_REGISTRY_HDR
+#define VCOOKIE_ENGINE_REGISTRY_HDR
+
+#include <map>
+#include <string>
+#include <vector>
+
+class VCookieStore;
+
+// Settings for one engine, e.g. "host" -> "10.46.20.12:8091". Every
+// option the engine declared is present, with its default if it wasn't
+// given.
+typedef std::map<std::string, std::string> VCEngineOptions;
+
+// Settings for a stack of decorators over an engine, by engine or
+// decorator name: "couchbase" -> ("host" -> ...)
+typedef std::map<std::string, VCEngineOptions> VCStackOptions;
+
+// What an engine promises to do with the cookies it is given, so a
+// test driver knows which checks apply to it.
+enum VCEngineCapability {
+    VC_ENGINE_PERSISTS   = 1,   // a saved cookie loads back (everything but NOP)
+    VC_ENGINE_ENUMERATES = 2,   // GetVCookieCount and GetVCookie work
+    VC_ENGINE_PURGES     = 4    // DeleteOldVCookies deletes and counts
+};
+
+// An option an engine accepts, set in the harness config as
+// engine.<engine name>.<option name>=value. Tables end with a NULL name.
+struct VCEngineOption {
+    const char *name;
+    const char *defaultValue;
+    const char *description;
+};
+
+// Engines and decorators register themselves under a name when the
+// program (or a plugin) is loaded, see VC_REGISTER_ENGINE, so a driver
+// can build any of them by name instead of having one picked at compile
+// time. A decorator wraps another store (a cache in front of it, say)
+// and takes ownership of it.
+class VCEngineRegistry {
+public:
+    typedef VCookieStore *(*Factory) (VCEngineOptions const &options);
+    typedef VCookieStore *(*DecoratorFactory) (VCookieStore *inner, VCEngineOptions const &options);
+
+    struct Engine {
+        std::string name;
+        std::string description;
+        Factory     factory;        // NULL for a decorator
+        DecoratorFactory decorate;  // NULL for an engine
+        unsigned    capabilities;   // VCEngineCapability bits: an engine's, or what a decorator
+                                    // needs of the engine under it (it keeps that engine's)
+        std::vector<VCEngineOption> options;
+    };
+
+    // false if the name is already taken
+    static bool Register (std::string const &name, Factory factory, unsigned capabilities,
+                          VCEngineOption const *options, std::string const &description);
+    static bool RegisterDecorator (std::string const &name, DecoratorFactory decorate,
+                                   VCEngineOption const *options, std::string const &description,
+                                   unsigned needs = 0);
+
+    // NULL if there is none of that name
+    static Engine const *Find (std::string const &name);
+
+    // registered engines (or decorators), in alphabetical order
+    static std::vector<std::string> Names (bool decorators = false);
+
+    // dlopen a shared object whose engines register themselves as it
+    // loads; false with the reason in error if it can't be loaded
+    static bool LoadPlugin (std::string const &path, std::string &error);
+
+    // Check a stack (decorators listed innermost first) and its options:
+    // every name must be registered, every decorator's needs met by the
+    // engine and every option one it declared.
+    // Fills in the defaults; false with the reason in error.
+    static bool Configure (std::string const &engine, std::vector<std::string> const &decorators,
+                           VCStackOptions &options, std::string &error);
+
+    // a new store from a Configure()d stack, NULL if the engine fails
+    static VCookieStore *Create (std::string const &engine, std::vector<std::string> const &decorators,
+                                 VCStackOptions const &options);
+
+    // "cache+memory": outermost first
+    static std::string StackName (std::string const &engine, std::vector<std::string> const &decorators);
+
+private:
+    static bool Add (Engine const &engine, VCEngineOption const *options);
+
+    // constructed on first use, registrations run before main in no
+    // particular order
+    static std::map<std::string, Engine> &Engines ();
+};
+
+// factory for engines that take no options
+template <class T>
+VCookieStore *VCEngineCreate (VCEngineOptions const &)
+{
+    return new T ();
+}
+
+// at namespace scope in the engine's source file:
+//   VC_REGISTER_ENGINE (VCStoreNOP, "nop", 0, "does nothing");
+#define VC_REGISTER_ENGINE(type, name, capabilities, description) \
+    VC_REGISTER_ENGINE_FACTORY (type, name, VCEngineCreate<type>, capabilities, NULL, description)
+
+// for an engine with its own factory and options, id is any name unique to the file
+#define VC_REGISTER_ENGINE_FACTORY(id, name, factory, capabilities, options, description) \
+    static bool vcEngineRegistered_##id __attribute__ ((unused)) = \
+        VCEngineRegistry::Register (name, factory, capabilities, options, description)
+
+#define VC_REGISTER_DECORATOR(id, name, factory, options, description) \
+    static bool vcEngineRegistered_##id __attribute__ ((unused)) = \
+        VCEngineRegistry::RegisterDecorator (name, factory, options, description)
+
+// for a decorator that only makes sense over an engine with these capabilities
+#define VC_REGISTER_DECORATOR_NEEDING(id, name, factory, needs, options, description) \
+    static bool vcEngineRegistered_##id __attribute__ ((unused)) = \
+        VCEngineRegistry::RegisterDecorator (name, factory, options, description, needs)
+
+#endif // VCOOKIE_ENGINE_REGISTRY_HDR
@@ -34,6 +34,26 @@ public:
     typedef unsigned short RelationId;
     static const RelationId INVALID_RID = static_cast<RelationId>(-1);
 
+    // One change made through a setter, kept (when the store asks for it,
+    // see VCookieStore::KeepsMutationLog) so the hit's changes can be made
+    // again to a newer copy of the visitor that another writer saved
+    // first. See ReplayLog for how each kind merges.
+    struct Mutation {
+        enum Kind {
+            FIRST_HIT_TIME, LAST_HIT_TIME, LAST_HIT_TIME_LOCAL, LAST_VISIT_NUM,
+            LAST_PURCHASE_TIME, FIRST_HIT_REFERRER, FIRST_HIT_URL, FIRST_HIT_PAGENAME,
+            LAST_PURCHASE_NUM, ADD_PURCHASE_NUM, MERCHANDISING, PURCHASE_ID,
+            SET_VAR, CLEAR_VAR
+        };
+        Kind            kind;
+        time_t          time;           // the times, a var's timestamp
+        unsigned        number;         // the numbers, a var's maxLinear
+        std::string     value;          // the strings, a var's value
+        RelationId      relation_id;
+        unsigned char   revision;
+        AllocationType  allocType;
+    };
+
     VCookie (
         const unsigned _userid,
         const unsigned long long _visid_high,
@@ -51,6 +71,9 @@ public:
         lastVisitNum (0),
         lastPurchaseTimeGMT (0),
         lastPurchaseNum (0),
+        cas (0),
+        expiry (0),
+        logging (store.KeepsMutationLog ()),
         vstore (store)
     {
         
@@ -58,6 +81,7 @@ public:
             newCookie = !vstore.LoadVCookie (*this);
         }
         modified = trafficModified = ecommerceModified = merchandisingModified = relVarModified = false;
+        mutations.clear();
 
     }
     
@@ -75,12 +99,116 @@ public:
 			retVal = vstore.SaveVCookie(*this);
 			// and mark it unmodified
 			modified = trafficModified = ecommerceModified = merchandisingModified = relVarModified = false;			
+			mutations.clear();
 		}
 		catch (...) {}
 		
 		return retVal;
 	}
 	
+    // should only be used by VCookieStore implemenations, not by elevator:
+    // a load submitted with VCookieStore::SubmitLoad has finished
+    void Loaded (bool found)
+    {
+        newCookie = !found;
+        modified = trafficModified = ecommerceModified = merchandisingModified = relVarModified = false;
+        mutations.clear();
+    }
+
+    // written by a batch save (VCookieStore::SaveVCookies): nothing for
+    // Store or the destructor to do
+    void Saved ()
+    {
+        modified = trafficModified = ecommerceModified = merchandisingModified = relVarModified = false;
+        mutations.clear();
+    }
+
+    // should only be used by VCookieStore implemenations: the version of
+    // the stored copy this one was loaded from or last saved as (a
+    // Couchbase CAS), 0 if the store doesn't know
+    unsigned long long GetCas () const                   { return cas; }
+    void    SetCas (unsigned long long c)                { cas = c; }
+
+    // should only be used by VCookieStore implemenations: when a store
+    // that expires visitors will expire the stored copy, 0 if never or
+    // not known
+    time_t  GetExpiry () const                           { return expiry; }
+    void    SetExpiry (time_t t)                         { expiry = t; }
+
+    // should only be used by VCookieStore implemenations: make the changes
+    // logged since the load again to target, a newer copy of this
+    // visitor. Times and the visit number only move forward, the first
+    // hit fields are kept from whichever copy saw the earlier first hit,
+    // the purchase count adds what this hit added and everything else is
+    // set again the way the hit set it.
+    void ReplayLog (VCookie &target) const
+    {
+        bool firstHit = target.firstHitTimeGMT == 0;
+        for (MutationLog::const_iterator m = mutations.begin(); m != mutations.end(); ++m) {
+            if (m->kind == Mutation::FIRST_HIT_TIME && m->time < target.firstHitTimeGMT) {
+                firstHit = true;
+            }
+        }
+
+        for (MutationLog::const_iterator m = mutations.begin(); m != mutations.end(); ++m) {
+            switch (m->kind) {
+            case Mutation::FIRST_HIT_TIME:
+                if (firstHit) target.SetFirstHitTimeGMT (m->time);
+                break;
+            case Mutation::FIRST_HIT_REFERRER:
+                if (firstHit) target.SetFirstHitReferrer (m->value);
+                break;
+            case Mutation::FIRST_HIT_URL:
+                if (firstHit) target.SetFirstHitUrl (m->value);
+                break;
+            case Mutation::FIRST_HIT_PAGENAME:
+                if (firstHit) target.SetFirstHitPagename (m->value);
+                break;
+            case Mutation::LAST_HIT_TIME:
+                if (m->time > target.lastHitTimeGMT) target.SetLastHitTimeGMT (m->time);
+                break;
+            case Mutation::LAST_HIT_TIME_LOCAL:
+                if (m->time > target.lastHitTimeVisitorLocal) target.SetLastHitTimeVisitorLocal (m->time);
+                break;
+            case Mutation::LAST_VISIT_NUM:
+                if (m->number > target.lastVisitNum) target.SetLastVisitNum (m->number);
+                break;
+            case Mutation::LAST_PURCHASE_TIME:
+                if (m->time > target.lastPurchaseTimeGMT) target.SetLastPurchaseTimeGMT (m->time);
+                break;
+            case Mutation::LAST_PURCHASE_NUM:
+                if (m->number > target.lastPurchaseNum) target.SetLastPurchaseNum (m->number);
+                break;
+            case Mutation::ADD_PURCHASE_NUM:
+                target.AddLastPurchaseNum (m->number);
+                break;
+            case Mutation::MERCHANDISING:
+                target.SetMerchandising (m->value);
+                break;
+            case Mutation::PURCHASE_ID:
+                target.SetPurchaseId (m->value);
+                break;
+            case Mutation::SET_VAR:
+                target.SetVar (m->relation_id, m->value, m->time, m->revision, m->allocType, m->number);
+                break;
+            case Mutation::CLEAR_VAR:
+                target.ClearVar (m->relation_id);
+                break;
+            }
+        }
+    }
+
+    // should only be used by VCookieStore implemenations: add the changes
+    // logged by from, a later copy of this visitor, to this one's log, so
+    // replaying this one makes the changes of both
+    void AppendLog (VCookie const &from)
+    {
+        mutations.insert (mutations.end(), from.mutations.begin(), from.mutations.end());
+    }
+
+    // should only be used by VCookieStore implemenations
+    unsigned GetMutationCount () const                       { return static_cast<unsigned> (mutations.size()); }
+
     // should only be used by VCookieStore implemenations, not by elevator
     void Reset (unsigned user, unsigned long long vid_high, unsigned long long vid_low)
     {
@@ -106,6 +234,10 @@ public:
         
         relVar.clear();
         relVarSort.clear();
+
+        cas = 0;
+        expiry = 0;
+        mutations.clear();
     }
     
     bool    IsNewCookie () const                         { return newCookie; }
@@ -115,22 +247,26 @@ public:
     bool    IsMerchandisingModified () const             { return merchandisingModified; }
     bool    IsRelVarModified () const                    { return relVarModified; }
     
-    void    SetFirstHitTimeGMT (time_t t)                { modified = trafficModified = true;    firstHitTimeGMT = t; }
-    void    SetLastHitTimeGMT (time_t t)                 { modified = trafficModified = true;    lastHitTimeGMT = t; }
-    void    SetLastHitTimeVisitorLocal (time_t t)        { modified = trafficModified = true;    lastHitTimeVisitorLocal = t; }
-    void    SetLastVisitNum (unsigned i)                 { modified = trafficModified = true;    lastVisitNum = i; }
-
-    void    SetLastPurchaseTimeGMT (time_t t)            { modified = ecommerceModified = true;    lastPurchaseTimeGMT = t; }
-    void    SetFirstHitReferrer (std::string const &s)   { modified = ecommerceModified = true;    firstHitReferrer = s; }
-    void    SetFirstHitUrl (std::string const &s)        { modified = ecommerceModified = true;    firstHitPageUrl = s; }
-    void    SetFirstHitPagename (std::string const &s)   { modified = ecommerceModified = true;    firstHitPagename = s; }
-    void    SetLastPurchaseNum (unsigned i)              { modified = ecommerceModified = true;    lastPurchaseNum = i; }
-
-    void    SetMerchandising (std::string const &s)      { modified = merchandisingModified = true;    merchandising = s; }
+    void    SetFirstHitTimeGMT (time_t t)                { modified = trafficModified = true;    firstHitTimeGMT = t;            Log (Mutation::FIRST_HIT_TIME, t); }
+    void    SetLastHitTimeGMT (time_t t)                 { modified = trafficModified = true;    lastHitTimeGMT = t;             Log (Mutation::LAST_HIT_TIME, t); }
+    void    SetLastHitTimeVisitorLocal (time_t t)        { modified = trafficModified = true;    lastHitTimeVisitorLocal = t;    Log (Mutation::LAST_HIT_TIME_LOCAL, t); }
+    void    SetLastVisitNum (unsigned i)                 { modified = trafficModified = true;    lastVisitNum = i;               Log (Mutation::LAST_VISIT_NUM, 0, i); }
+
+    void    SetLastPurchaseTimeGMT (time_t t)            { modified = ecommerceModified = true;    lastPurchaseTimeGMT = t;      Log (Mutation::LAST_PURCHASE_TIME, t); }
+    void    SetFirstHitReferrer (std::string const &s)   { modified = ecommerceModified = true;    firstHitReferrer = s;         Log (Mutation::FIRST_HIT_REFERRER, 0, 0, &s); }
+    void    SetFirstHitUrl (std::string const &s)        { modified = ecommerceModified = true;    firstHitPageUrl = s;          Log (Mutation::FIRST_HIT_URL, 0, 0, &s); }
+    void    SetFirstHitPagename (std::string const &s)   { modified = ecommerceModified = true;    firstHitPagename = s;         Log (Mutation::FIRST_HIT_PAGENAME, 0, 0, &s); }
+    void    SetLastPurchaseNum (unsigned i)              { modified = ecommerceModified = true;    lastPurchaseNum = i;          Log (Mutation::LAST_PURCHASE_NUM, 0, i); }
+    // rather than SetLastPurchaseNum (GetLastPurchaseNum () + n), so a
+    // replay counts this hit's purchases on top of another writer's
+    void    AddLastPurchaseNum (unsigned n)              { modified = ecommerceModified = true;    lastPurchaseNum += n;         Log (Mutation::ADD_PURCHASE_NUM, 0, n); }
+
+    void    SetMerchandising (std::string const &s)      { modified = merchandisingModified = true;    merchandising = s;        Log (Mutation::MERCHANDISING, 0, 0, &s); }
 
     // The last N purchase IDs are actually stored in the cookie (N is currently 5)
     bool    SetPurchaseId (std::string const & purchase_id)
     {
+        Log (Mutation::PURCHASE_ID, 0, 0, &purchase_id);
         // returns false if purchase_id is already in the list, but move it to the end
         for (PID::iterator i=purchaseIds.begin(); i != purchaseIds.end(); ++i ) {
             if (*i == purchase_id) {
@@ -156,10 +292,10 @@ public:
     unsigned long long GetVisIdLow () const                  { return visid_low; }
     time_t    GetFirstHitTimeGMT () const                    { return firstHitTimeGMT; }
     time_t    GetLastHitTimeGMT () const                     { return lastHitTimeGMT; }
-    time_t    GetLastHitTimeVisitorLocal () const            { return lastHitTimeGMT; }
+    time_t    GetLastHitTimeVisitorLocal () const            { return lastHitTimeVisitorLocal; }
     unsigned GetLastVisitNum () const                        { return lastVisitNum; }
 
-    time_t    GetLastPurchaseTimeGMT () const                { return lastHitTimeGMT; }
+    time_t    GetLastPurchaseTimeGMT () const                { return lastPurchaseTimeGMT; }
     std::string const & GetFirstHitReferrer () const         { return firstHitReferrer; }
     std::string const & GetFirstHitUrl () const              { return firstHitPageUrl; }
     std::string const & GetFirstHitPagename () const         { return firstHitPagename; }
@@ -178,6 +314,9 @@ public:
         if (vid != VAR_NOT_SET) {
             relVar[vid].var.resize(0);
             relVar[vid].modified = true;
+            if (logging) {
+                Log (Mutation::CLEAR_VAR, 0)->relation_id = relation_id;
+            }
         }
     }
     
@@ -192,6 +331,9 @@ public:
             }
             return VAR_NOT_SET;
         }
+        if (logging) {
+            LogVar (relation_id, val, timestamp, revision, allocType, maxLinear);
+        }
         unsigned pos = FindRelationPos (relation_id);
         VarId vid = static_cast<VarId> (relVar.size());
 
@@ -241,6 +383,9 @@ public:
             return;
         }
         RelVarImpl &rv (relVar[id]);
+        if (logging) {
+            LogVar (rv.relation_id, val, timestamp, revision, ALLOC_TYPE_LINEAR, MAX_LINEAR_INFINITE);
+        }
         size_t sz = rv.var.size();
         rv.var.resize (sz+1);
 
@@ -308,6 +453,34 @@ public:
     }
     
 private:
+    // the entry added, NULL when the store doesn't want a log
+    Mutation *Log (Mutation::Kind kind, time_t t, unsigned n = 0, std::string const *s = 0)
+    {
+        if (!logging) {
+            return 0;
+        }
+        mutations.resize (mutations.size() + 1);
+        Mutation &m (mutations.back());
+        m.kind = kind;
+        m.time = t;
+        m.number = n;
+        if (s) {
+            m.value = *s;
+        }
+        m.relation_id = INVALID_RID;
+        m.revision = 0;
+        m.allocType = ALLOC_TYPE_LAST;
+        return &m;
+    }
+
+    void LogVar (RelationId relation_id, std::string const &val, time_t timestamp, unsigned char revision, AllocationType allocType, unsigned maxLinear)
+    {
+        Mutation *m = Log (Mutation::SET_VAR, timestamp, maxLinear, &val);
+        m->relation_id = relation_id;
+        m->revision = revision;
+        m->allocType = allocType;
+    }
+
     RelationId GetSetVar (unsigned pos) const
     {
         while (pos < relVarSort.size() && relVar[relVarSort[pos]].var.size() == 0) {
@@ -398,6 +571,12 @@ private:
     std::vector<RelVarImpl> relVar;
     std::vector<VarId> relVarSort;
 
+    unsigned long long cas;
+    time_t       expiry;
+    bool         logging;
+    typedef std::vector<Mutation> MutationLog;
+    MutationLog  mutations;
+
     VCookieStore &vstore;
 };
 
@@ -458,7 +637,7 @@ inline bool operator == (VCookie const &a, VCookie const &b)
             }
         }
         ar = a.GetNextSetVar (ar);
-        br = a.GetNextSetVar(br);
+        br = b.GetNextSetVar (br);
         if (ar != br) {
             return false;
         }
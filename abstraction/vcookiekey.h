@@ -0,0 +1,161 @@
+#ifndef VCOOKIE_KEY_HDR
+#define VCOOKIE_KEY_HDR
+
+#include "vcookie.h"
+
+#include <string>
+#include <string.h>
+
+// The document key for a visitor in a key-value store. The user,
+// visid_high and visid_low are packed big endian into RAW_SIZE bytes, so
+// the keys sort the same way VCookieId does. Stores that want printable
+// keys get that packing as hex or base64 (url alphabet, no padding).
+// Every key from one encoder has the same length: a fixed prefix (to
+// keep test runs apart in a shared bucket), then the encoded id. The key
+// is built in the encoder's own buffer and nothing is allocated, so keep
+// one encoder per store (per thread) and use the key before the next
+// Encode.
+class VCookieKey
+{
+public:
+    enum Encoding {
+        VC_KEY_BINARY,      // the RAW_SIZE bytes as they are
+        VC_KEY_HEX,         // two lower case digits a byte
+        VC_KEY_BASE64       // four characters for three bytes, [A-Za-z0-9_-]
+    };
+
+    static const size_t RAW_SIZE = 4 + 8 + 8;
+    static const size_t MAX_PREFIX = 64;
+    static const size_t MAX_SIZE = MAX_PREFIX + 2 * RAW_SIZE;
+
+    // a prefix longer than MAX_PREFIX is cut short
+    explicit VCookieKey (Encoding encoding = VC_KEY_BASE64, std::string const &prefix = "")
+    : encoding (encoding), prefixLength (prefix.size () < MAX_PREFIX ? prefix.size () : MAX_PREFIX),
+      length (prefixLength + EncodedSize (encoding))
+    {
+        memcpy (buffer, prefix.data (), prefixLength);
+    }
+
+    const char *Encode (unsigned user, unsigned long long visidHigh, unsigned long long visidLow)
+    {
+        unsigned char raw[RAW_SIZE];
+        for (unsigned i = 0; i < 4; ++i) {
+            raw[i] = (unsigned char) (user >> (24 - 8 * i));
+        }
+        for (unsigned i = 0; i < 8; ++i) {
+            raw[4 + i] = (unsigned char) (visidHigh >> (56 - 8 * i));
+            raw[12 + i] = (unsigned char) (visidLow >> (56 - 8 * i));
+        }
+
+        char *out = buffer + prefixLength;
+        switch (encoding) {
+        case VC_KEY_BINARY:
+            memcpy (out, raw, RAW_SIZE);
+            break;
+        case VC_KEY_HEX: {
+            static const char digits[] = "0123456789abcdef";
+            for (unsigned i = 0; i < RAW_SIZE; ++i) {
+                *out++ = digits[raw[i] >> 4];
+                *out++ = digits[raw[i] & 0xf];
+            }
+            break;
+        }
+        case VC_KEY_BASE64: {
+            static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+            unsigned i = 0;
+            for (; i + 3 <= RAW_SIZE; i += 3) {
+                unsigned bits = (raw[i] << 16) | (raw[i + 1] << 8) | raw[i + 2];
+                *out++ = digits[bits >> 18];
+                *out++ = digits[(bits >> 12) & 0x3f];
+                *out++ = digits[(bits >> 6) & 0x3f];
+                *out++ = digits[bits & 0x3f];
+            }
+            // RAW_SIZE is 2 mod 3: three characters for the last two bytes
+            unsigned bits = (raw[i] << 16) | (raw[i + 1] << 8);
+            *out++ = digits[bits >> 18];
+            *out++ = digits[(bits >> 12) & 0x3f];
+            *out++ = digits[(bits >> 6) & 0x3f];
+            break;
+        }
+        }
+        return buffer;
+    }
+
+    const char *Encode (VCookie const &vcookie)
+    {
+        return Encode (vcookie.GetUser (), vcookie.GetVisIdHigh (), vcookie.GetVisIdLow ());
+    }
+
+    // the last key encoded, Size () bytes, not NUL terminated
+    const char *Data () const                   { return buffer; }
+    size_t Size () const                        { return length; }
+    Encoding GetEncoding () const               { return encoding; }
+
+    static size_t EncodedSize (Encoding encoding)
+    {
+        switch (encoding) {
+        case VC_KEY_HEX:    return 2 * RAW_SIZE;
+        case VC_KEY_BASE64: return (RAW_SIZE * 4 + 2) / 3;
+        default:            return RAW_SIZE;
+        }
+    }
+
+    // "binary", "hex" or "base64"; false for anything else
+    static bool ParseEncoding (std::string const &name, Encoding &encoding)
+    {
+        if (name == "binary") {
+            encoding = VC_KEY_BINARY;
+        }
+        else if (name == "hex") {
+            encoding = VC_KEY_HEX;
+        }
+        else if (name == "base64") {
+            encoding = VC_KEY_BASE64;
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+
+    // The vbucket a Couchbase client maps the key to: CRC-32 of the key,
+    // bits 16..30 of it, modulo the number of vbuckets (a power of two,
+    // 1024 on a default cluster). Shows how evenly keys spread over the
+    // cluster without one to ask.
+    static unsigned VBucket (const char *key, size_t length, unsigned vbuckets)
+    {
+        static const CrcTable crcTable;
+        const unsigned *table = crcTable.entries;
+
+        unsigned crc = 0xffffffffU;
+        for (size_t i = 0; i < length; ++i) {
+            crc = table[(crc ^ (unsigned char) key[i]) & 0xff] ^ (crc >> 8);
+        }
+        crc ^= 0xffffffffU;
+        return ((crc >> 16) & 0x7fff) & (vbuckets - 1);
+    }
+
+private:
+    // a function static, built once however many threads get there first
+    struct CrcTable {
+        unsigned entries[256];
+
+        CrcTable ()
+        {
+            for (unsigned n = 0; n < 256; ++n) {
+                unsigned c = n;
+                for (unsigned k = 0; k < 8; ++k) {
+                    c = c & 1 ? 0xedb88320U ^ (c >> 1) : c >> 1;
+                }
+                entries[n] = c;
+            }
+        }
+    };
+
+    Encoding encoding;
+    size_t prefixLength;
+    size_t length;
+    char buffer[MAX_SIZE];
+};
+
+#endif // VCOOKIE_KEY_HDR
@@ -13,6 +13,25 @@
 
 const unsigned char VC_SERIAL_VERSION = 0;
 
+bool VCookieStore::SubmitLoad (VCookie &vcookie, VCookieCompletion done, void *context)
+{
+    bool found = LoadVCookie (vcookie);
+    vcookie.Loaded (found);
+    if (done != NULL) {
+        done (found, vcookie, context);
+    }
+    return true;
+}
+
+bool VCookieStore::SubmitSave (VCookie &vcookie, VCookieCompletion done, void *context)
+{
+    bool saved = SaveVCookie (vcookie);
+    if (done != NULL) {
+        done (saved, vcookie, context);
+    }
+    return true;
+}
+
 namespace {
     template<typename T>
     void AddItem (std::vector<char> &buffer, T val)
@@ -73,8 +92,22 @@ namespace {
     }
 } // end anonymous namespace
 
+#if !defined(VC_NO_STAGE_TIMING)
+__thread VCStageSink *VCStageSink::threadSink = 0;
+#endif
+
+const char *VCStageSink::StageName (VCStage stage)
+{
+    static const char *names[VC_STAGE_COUNT] = {
+        "parse", "key", "get", "deserialize", "mutate", "serialize", "set"
+    };
+    return stage < VC_STAGE_COUNT ? names[stage] : "unknown";
+}
+
 void VCookieStore::Serialize (VCookie const &vcookie, std::vector<char> &buffer, bool saveLastHitTime)
 {
+    VC_STAGE_TIMER (stageTimer, VC_STAGE_SERIALIZE);
+
     buffer.resize(0);
     buffer.reserve (1000);
 
@@ -139,6 +172,8 @@ void VCookieStore::Serialize (VCookie const &vcookie, std::vector<char> &buffer,
 
 bool VCookieStore::Deserialize(VCookie &vcookie, const std::vector<char> &buffer)
 {
+    VC_STAGE_TIMER (stageTimer, VC_STAGE_DESERIALIZE);
+
     const char *b = &buffer[0];
     const char *e = b + buffer.size();
     
@@ -3,11 +3,19 @@
 
 #include "time.h"
 #include <vector>
+#include <map>
+#include <string>
+
+#include "vcstagetimer.h"
 
 class VCookie;
 
 typedef void (*VCookieProcessedCallback)(bool success, const VCookie &cookie);
 
+// A submitted load or save has finished. For a load, success means the
+// cookie was found (and has been filled in), as with LoadVCookie.
+typedef void (*VCookieCompletion)(bool success, VCookie &cookie, void *context);
+
 class VCookieStore {
 public:
     virtual ~VCookieStore () {}
@@ -50,6 +58,34 @@ public:
         }
     }
 
+    /**
+     * Non-blocking loads and saves, so one thread can keep many
+     * operations in flight to a store that is across a network.
+     *
+     * Submit starts the operation and returns false only if it couldn't
+     * be started. Its completion runs later, on the calling thread,
+     * inside Poll, Wait or another call on this store. The cookie must
+     * stay alive until then. A cookie being loaded should be created as
+     * a new visitor (so its constructor doesn't load it); the store
+     * marks it as found or new before the completion runs.
+     *
+     * Engines without a network to wait on don't override these: the
+     * operation is done, and its completion run, inside Submit.
+     */
+    virtual bool SubmitLoad (VCookie &vcookie, VCookieCompletion done, void *context);
+    virtual bool SubmitSave (VCookie &vcookie, VCookieCompletion done, void *context);
+
+    // run the completions of whatever has finished, without blocking;
+    // returns how many ran
+    virtual unsigned Poll () { return 0; }
+
+    // block until at least count completions have run (or nothing is
+    // left in flight), 0 waits for everything; returns how many ran
+    virtual unsigned Wait (unsigned count = 0) { return 0; }
+
+    // submitted operations whose completions haven't run yet
+    virtual unsigned Outstanding () const { return 0; }
+
     virtual bool SaveVCookie (VCookie const &vcookie) = 0;
 
     // Only VCookie::VCookie should ever call LoadVCookie
@@ -77,6 +113,20 @@ public:
     virtual unsigned long long GetVCookieCount () const = 0;
     virtual bool GetVCookie (VCookie &vcookie, unsigned long long index) const = 0;
 
+    // Counters the engine keeps about itself (item count, bytes held,
+    // ops sent, ...), for the results file. Adds to whatever is already
+    // in stats, so the caller can sum the stores of several threads.
+    // Engines with nothing to report leave stats alone. The harness also
+    // calls it every so often during a run for the live metrics, from
+    // the thread using the store, so it should be cheap.
+    virtual void GetStats (std::map<std::string, unsigned long long> &stats) const {}
+
+    // True if saves check that nobody else saved the visitor since it was
+    // loaded, and merge with what they saved if they did. The merge makes
+    // the hit's changes again, so each VCookie made with this store keeps
+    // a log of them until it is saved (see VCookie::ReplayLog).
+    virtual bool KeepsMutationLog () const { return false; }
+
     // If a VCookie implementation uses Key/Value pairs, it can use
     // these serialization functions for the value portion The key
     // would be the userid/visid. We will likely optimize these in the
@@ -0,0 +1,93 @@
+#ifndef VCOOKIE_STAGE_TIMER_HDR
+#define VCOOKIE_STAGE_TIMER_HDR
+
+// Per-stage timing of a hit: where does the time go between reading the
+// hit and the cookie being stored. The caller installs a sink for its
+// thread (the test harness keeps a histogram per stage); stores and the
+// codec mark their stages with VC_STAGE_TIMER (and VC_STAGE_STOP to end
+// one before the end of its scope) and report to it. A thread
+// without a sink pays one thread-local load per stage.
+//
+// Build with -DVC_NO_STAGE_TIMING to compile all of it out.
+
+enum VCStage {
+    VC_STAGE_PARSE = 0,         // next hit from the replay file / generator
+    VC_STAGE_KEY,               // build the store key for the visitor
+    VC_STAGE_GET,               // engine fetch of the serialized cookie
+    VC_STAGE_DESERIALIZE,
+    VC_STAGE_MUTATE,            // apply the hit to the cookie
+    VC_STAGE_SERIALIZE,
+    VC_STAGE_SET,               // engine write of the serialized cookie
+    VC_STAGE_COUNT
+};
+
+class VCStageSink {
+public:
+    virtual ~VCStageSink () {}
+
+    // current time in ns, any clock the sink likes
+    virtual unsigned long long StageClock () = 0;
+
+    // a stage finished, started and ended are StageClock () values
+    virtual void StageDone (VCStage stage, unsigned long long started, unsigned long long ended) = 0;
+
+    static const char *StageName (VCStage stage);
+
+#if !defined(VC_NO_STAGE_TIMING)
+    // sink for the calling thread, NULL to stop timing
+    static void SetThreadSink (VCStageSink *sink) { threadSink = sink; }
+    static VCStageSink *ThreadSink () { return threadSink; }
+
+private:
+    static __thread VCStageSink *threadSink;
+#else
+    static void SetThreadSink (VCStageSink *) {}
+    static VCStageSink *ThreadSink () { return 0; }
+#endif
+};
+
+#if !defined(VC_NO_STAGE_TIMING)
+
+// times the enclosing scope as one stage
+class VCStageTimer {
+public:
+    explicit VCStageTimer (VCStage _stage) : stage (_stage), sink (VCStageSink::ThreadSink ()), started (0)
+    {
+        if (sink) {
+            started = sink->StageClock ();
+        }
+    }
+    ~VCStageTimer ()
+    {
+        Stop ();
+    }
+
+    // end the stage before the end of the scope
+    void Stop ()
+    {
+        if (sink) {
+            sink->StageDone (stage, started, sink->StageClock ());
+            sink = 0;
+        }
+    }
+
+private:
+    VCStageTimer (VCStageTimer const &);
+    VCStageTimer &operator= (VCStageTimer const &);
+
+    VCStage stage;
+    VCStageSink *sink;
+    unsigned long long started;
+};
+
+#define VC_STAGE_TIMER(name, stage)     VCStageTimer name (stage)
+#define VC_STAGE_STOP(name)             name.Stop ()
+
+#else
+
+#define VC_STAGE_TIMER(name, stage)
+#define VC_STAGE_STOP(name)
+
+#endif // VC_NO_STAGE_TIMING
+
+#endif // VCOOKIE_STAGE_TIMER_HDR
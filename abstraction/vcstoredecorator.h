@@ -0,0 +1,61 @@
+#ifndef VCOOKIE_STORE_DECORATOR_HDR
+#define VCOOKIE_STORE_DECORATOR_HDR
+
+#include "vcookiestore.h"
+
+// Base for stores that wrap another one (see VC_REGISTER_DECORATOR):
+// every call goes straight through to the inner store, which it owns.
+// Override what the decorator changes.
+class VCStoreDecorator: public VCookieStore
+{
+public:
+    explicit VCStoreDecorator (VCookieStore *inner) : inner (inner) {}
+    virtual ~VCStoreDecorator () { delete inner; }
+
+    virtual void SaveVCookies (std::vector<const VCookie*> &cookies, VCookieProcessedCallback callback)
+    {
+        inner->SaveVCookies (cookies, callback);
+    }
+    virtual void LoadVCookies (std::vector<VCookie*> &cookies, VCookieProcessedCallback callback)
+    {
+        inner->LoadVCookies (cookies, callback);
+    }
+
+    virtual bool SubmitLoad (VCookie &vcookie, VCookieCompletion done, void *context)
+    {
+        return inner->SubmitLoad (vcookie, done, context);
+    }
+    virtual bool SubmitSave (VCookie &vcookie, VCookieCompletion done, void *context)
+    {
+        return inner->SubmitSave (vcookie, done, context);
+    }
+    virtual unsigned Poll ()                                    { return inner->Poll (); }
+    virtual unsigned Wait (unsigned count = 0)                  { return inner->Wait (count); }
+    virtual unsigned Outstanding () const                       { return inner->Outstanding (); }
+
+    virtual bool SaveVCookie (VCookie const &vcookie)           { return inner->SaveVCookie (vcookie); }
+    virtual bool LoadVCookie (VCookie &vcookie)                 { return inner->LoadVCookie (vcookie); }
+    virtual unsigned long long DeleteOldVCookies (time_t t)     { return inner->DeleteOldVCookies (t); }
+
+    virtual bool DeleteVCookie (VCookie &vcookie)               { return inner->DeleteVCookie (vcookie); }
+    virtual unsigned long long GetVCookieCount () const         { return inner->GetVCookieCount (); }
+    virtual bool GetVCookie (VCookie &vcookie, unsigned long long index) const
+    {
+        return inner->GetVCookie (vcookie, index);
+    }
+
+    virtual void GetStats (std::map<std::string, unsigned long long> &stats) const
+    {
+        inner->GetStats (stats);
+    }
+    virtual bool KeepsMutationLog () const                      { return inner->KeepsMutationLog (); }
+
+protected:
+    VCookieStore *inner;
+
+private:
+    VCStoreDecorator (VCStoreDecorator const &);
+    VCStoreDecorator &operator= (VCStoreDecorator const &);
+};
+
+#endif // VCOOKIE_STORE_DECORATOR_HDR
@@ -0,0 +1,220 @@
+#include "hdrHistogram.h"
+
+#include <math.h>
+#include <string.h>
+
+#include <sstream>
+
+using namespace std;
+
+namespace {
+	const char *FORMAT_TAG = "hdr1";
+}
+
+
+hdrHistogram::hdrHistogram(unsigned _subBits) :
+	subBits(_subBits < 2 ? 2 : (_subBits > 16 ? 16 : _subBits)),
+	subCount(1U << subBits),
+	counts(subCount + (64 - subBits) * (subCount >> 1), 0),
+	totalCount(0), minValue(~0ULL), maxValue(0)
+{
+}
+
+void hdrHistogram::Reset(void)
+{
+	memset(&counts[0], 0, counts.size() * sizeof(counts[0]));
+	totalCount = 0;
+	minValue = ~0ULL;
+	maxValue = 0;
+}
+
+void hdrHistogram::Add(const hdrHistogram &other)
+{
+	if (other.subBits != subBits || other.totalCount == 0)
+		return;
+
+	for (unsigned i = 0; i < counts.size(); i++)
+		counts[i] += other.counts[i];
+
+	totalCount += other.totalCount;
+	if (other.minValue < minValue)
+		minValue = other.minValue;
+	if (other.maxValue > maxValue)
+		maxValue = other.maxValue;
+}
+
+void hdrHistogram::Add(const hdrSnapshot_t &snapshot)
+{
+	if (snapshot.counts.empty())
+		return;
+
+	for (unsigned i = 0; i < snapshot.counts.size(); i++)
+	{
+		if (snapshot.counts[i].first < counts.size())
+		{
+			counts[snapshot.counts[i].first] += snapshot.counts[i].second;
+			totalCount += snapshot.counts[i].second;
+		}
+	}
+
+	if (snapshot.min < minValue)
+		minValue = snapshot.min;
+	if (snapshot.max > maxValue)
+		maxValue = snapshot.max;
+}
+
+void hdrHistogram::AddShared(const hdrHistogram &other)
+{
+	if (other.subBits != subBits)
+		return;
+
+	// the total is worked out from the buckets read, so it matches them
+	unsigned long long added = 0;
+	for (unsigned i = 0; i < counts.size(); i++)
+	{
+		unsigned long long count = __atomic_load_n(&other.counts[i], __ATOMIC_RELAXED);
+		counts[i] += count;
+		added += count;
+	}
+	if (added == 0)
+		return;
+
+	totalCount += added;
+	unsigned long long otherMin = __atomic_load_n(&other.minValue, __ATOMIC_RELAXED),
+			otherMax = __atomic_load_n(&other.maxValue, __ATOMIC_RELAXED);
+	if (otherMin < minValue)
+		minValue = otherMin;
+	if (otherMax > maxValue)
+		maxValue = otherMax;
+}
+
+void hdrHistogram::Subtract(const hdrHistogram &earlier)
+{
+	if (earlier.subBits != subBits)
+		return;
+
+	for (unsigned i = 0; i < counts.size(); i++)
+		counts[i] -= earlier.counts[i] < counts[i] ? earlier.counts[i] : counts[i];
+
+	totalCount -= earlier.totalCount < totalCount ? earlier.totalCount : totalCount;
+}
+
+void hdrHistogram::Snapshot(hdrSnapshot_t &snapshot) const
+{
+	snapshot.counts.clear();
+	snapshot.min = Min();
+	snapshot.max = maxValue;
+
+	if (totalCount == 0)
+		return;
+
+	for (unsigned i = 0; i < counts.size(); i++)
+		if (counts[i])
+			snapshot.counts.push_back(make_pair(i, counts[i]));
+}
+
+unsigned long long hdrHistogram::HighestEquivalent(unsigned index) const
+{
+	if (index < subCount)
+		return index;
+
+	unsigned half = subCount >> 1;
+	unsigned shift = (index - subCount) / half + 1;
+	unsigned long long mantissa = (index - subCount) % half + half;
+
+	return ((mantissa + 1) << shift) - 1;
+}
+
+unsigned long long hdrHistogram::ValueAtPercentile(double percentile) const
+{
+	if (totalCount == 0)
+		return 0;
+
+	if (percentile > 100)
+		percentile = 100;
+
+	// the smallest count that covers the percentile, at least the first value
+	unsigned long long target = (unsigned long long) ceil(percentile / 100 * totalCount);
+	if (target == 0)
+		target = 1;
+
+	unsigned long long seen = 0;
+	for (unsigned i = 0; i < counts.size(); i++)
+	{
+		seen += counts[i];
+		if (seen >= target)
+		{
+			unsigned long long value = HighestEquivalent(i);
+			return value < maxValue ? value : maxValue;
+		}
+	}
+
+	return maxValue;
+}
+
+// hdr1 <subBits> <count> <min> <max> <index>:<count> ...
+void hdrHistogram::Write(ostream &os) const
+{
+	os << FORMAT_TAG << " " << subBits << " " << totalCount << " " << Min() << " " << maxValue;
+	for (unsigned i = 0; i < counts.size(); i++)
+		if (counts[i])
+			os << " " << i << ":" << counts[i];
+	os << "\n";
+}
+
+bool hdrHistogram::Read(istream &is)
+{
+	string line;
+	if (!getline(is, line))
+		return false;
+
+	istringstream in(line);
+	string tag;
+	unsigned bits;
+	unsigned long long count, min, max;
+	if (!(in >> tag >> bits >> count >> min >> max) || tag != FORMAT_TAG)
+		return false;
+
+	// take on the file's resolution if we're still empty
+	if (bits != subBits)
+	{
+		if (totalCount != 0)
+			return false;
+		*this = hdrHistogram(bits);
+		if (subBits != bits)
+			return false;
+	}
+
+	hdrSnapshot_t snapshot;
+	snapshot.min = min;
+	snapshot.max = max;
+
+	unsigned index;
+	char colon;
+	unsigned long long bucketCount;
+	while (in >> index >> colon >> bucketCount)
+	{
+		if (colon != ':' || index >= counts.size())
+			return false;
+		snapshot.counts.push_back(make_pair(index, bucketCount));
+	}
+
+	if (count)
+		Add(snapshot);
+
+	return true;
+}
+
+
+string PercentileSummary(const hdrHistogram &histogram)
+{
+	ostringstream os;
+
+	os << " p50 = " << histogram.ValueAtPercentile(50)
+		<< "; p90 = " << histogram.ValueAtPercentile(90)
+		<< "; p99 = " << histogram.ValueAtPercentile(99)
+		<< "; p99.9 = " << histogram.ValueAtPercentile(99.9)
+		<< "; max = " << histogram.Max();
+
+	return os.str();
+}
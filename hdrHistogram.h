@@ -0,0 +1,115 @@
+#ifndef HDR_HISTOGRAM_H
+#define HDR_HISTOGRAM_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <istream>
+#include <ostream>
+
+/*
+ * Latency histograms
+ *
+ * Log-linear buckets in the style of HdrHistogram: values below 2^subBits
+ * are counted exactly, above that every power of two is split into
+ * 2^(subBits-1) equal buckets, so the relative error is at most
+ * 2^-(subBits-1) (under 1% with the default of 8) over the whole range of
+ * an unsigned long long.  Recording is an index calculation and an
+ * increment, nothing is allocated after construction.
+ *
+ * Each worker records into its own histograms; they are merged by the
+ * parent once the workers are joined, so nothing is shared while running.
+ * The exception is the live metrics endpoint: its histograms are recorded
+ * with RecordShared() by their one worker and read with AddShared() by the
+ * endpoint, without locks, so a scrape may see a sample half way through
+ * being counted but never holds up the worker.
+ *
+ * Write()/Read() use a sparse text form, one histogram per line, so
+ * results from several machines can be merged afterwards.
+ */
+
+// the non-empty buckets of a histogram, used for the per-interval records
+typedef struct
+{
+	std::vector<std::pair<unsigned, unsigned long long> >	counts;	// bucket index, count
+	unsigned long long	min;
+	unsigned long long	max;
+} hdrSnapshot_t;
+
+
+class hdrHistogram
+{
+	public:
+		hdrHistogram(unsigned subBits = 8);
+
+		void Record(unsigned long long value)
+		{
+			counts[Index(value)]++;
+			totalCount++;
+			if (value < minValue)
+				minValue = value;
+			if (value > maxValue)
+				maxValue = value;
+		}
+
+		// Record() for a histogram another thread reads with AddShared()
+		void RecordShared(unsigned long long value)
+		{
+			unsigned index = Index(value);
+			__atomic_store_n(&counts[index], counts[index] + 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&totalCount, totalCount + 1, __ATOMIC_RELAXED);
+			if (value < minValue)
+				__atomic_store_n(&minValue, value, __ATOMIC_RELAXED);
+			if (value > maxValue)
+				__atomic_store_n(&maxValue, value, __ATOMIC_RELAXED);
+		}
+
+		void Reset(void);
+
+		// merge (histograms must have the same subBits)
+		void Add(const hdrHistogram &other);
+		void Add(const hdrSnapshot_t &snapshot);
+		void AddShared(const hdrHistogram &other);		// other is being recorded with RecordShared()
+
+		// take out the counts of an earlier copy of this histogram, leaving
+		// what was recorded since (min and max stay those of the whole run)
+		void Subtract(const hdrHistogram &earlier);
+
+		// copy out the non-empty buckets
+		void Snapshot(hdrSnapshot_t &snapshot) const;
+
+		unsigned long long Count(void) const { return totalCount; }
+		unsigned long long Min(void) const { return totalCount ? minValue : 0; }
+		unsigned long long Max(void) const { return maxValue; }
+
+		// highest value equivalent to the value at the percentile (0-100), never above Max()
+		unsigned long long ValueAtPercentile(double percentile) const;
+
+		// sparse text form, a single line ending in a newline
+		void Write(std::ostream &os) const;
+		bool Read(std::istream &is);		// false if the line doesn't parse
+
+	private:
+		unsigned Index(unsigned long long value) const
+		{
+			if (value < subCount)
+				return (unsigned) value;
+
+			unsigned shift = 64 - __builtin_clzll(value) - subBits;
+			return subCount + (shift - 1) * (subCount >> 1) + (unsigned)((value >> shift) - (subCount >> 1));
+		}
+		unsigned long long HighestEquivalent(unsigned index) const;
+
+		unsigned			subBits;
+		unsigned			subCount;		// 2^subBits
+		std::vector<unsigned long long>	counts;
+		unsigned long long	totalCount;
+		unsigned long long	minValue;
+		unsigned long long	maxValue;
+};	// class hdrHistogram
+
+
+// " p50 = 1; p90 = 2; p99 = 3; p99.9 = 4; max = 5" for the harness output
+std::string PercentileSummary(const hdrHistogram &histogram);
+
+#endif // HDR_HISTOGRAM_H
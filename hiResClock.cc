@@ -0,0 +1,89 @@
+#include "hiResClock.h"
+
+#if defined(HI_RES_CLOCK_TSC)
+	#include <cpuid.h>
+#endif
+
+bool				hiResClock::useTSC = false;
+unsigned long long	hiResClock::tscBase = 0;
+unsigned long long	hiResClock::nsBase = 0;
+double				hiResClock::nsPerTick = 0;
+
+namespace {
+	const unsigned long long NS_PER_SECOND = 1000000000ULL;
+
+	// long enough to average out the clock_gettime jitter (~1 part in 10^6)
+	const unsigned long long CALIBRATION_NS = 50 * 1000 * 1000;
+
+	unsigned long long MonotonicNS(void)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		return now.tv_sec * NS_PER_SECOND + now.tv_nsec;
+	}
+
+#if defined(HI_RES_CLOCK_TSC)
+	// a TSC reading paired with CLOCK_MONOTONIC, taken from the tightest
+	// of a few tries so a preemption between the two doesn't skew it
+	void ClockPair(unsigned long long &tsc, unsigned long long &ns)
+	{
+		unsigned long long best = ~0ULL;
+
+		for (unsigned i = 0; i < 16; i++)
+		{
+			unsigned long long before = __rdtsc();
+			unsigned long long mono = MonotonicNS();
+			unsigned long long after = __rdtsc();
+
+			// the first try always counts, so tsc and ns are always set
+			if (i == 0 || after - before < best)
+			{
+				best = after - before;
+				tsc = before + (after - before) / 2;
+				ns = mono;
+			}
+		}
+	}
+#endif
+}
+
+
+bool hiResClock::InvariantTSC(void)
+{
+#if defined(HI_RES_CLOCK_TSC)
+	unsigned eax, ebx, ecx, edx;
+
+	// advanced power management leaf, EDX bit 8 = invariant TSC
+	if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) && eax >= 0x80000007 &&
+			__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+		return (edx & (1U << 8)) != 0;
+#endif
+	return false;
+}
+
+void hiResClock::Calibrate(bool allowTSC)
+{
+	useTSC = false;
+
+#if defined(HI_RES_CLOCK_TSC)
+	if (!allowTSC || !InvariantTSC())
+		return;
+
+	unsigned long long tscStart, nsStart, tscEnd, nsEnd;
+	ClockPair(tscStart, nsStart);
+
+	// spin rather than sleep, so a slow wakeup doesn't stretch the sample
+	while (MonotonicNS() - nsStart < CALIBRATION_NS)
+		;
+	ClockPair(tscEnd, nsEnd);
+
+	if (tscEnd <= tscStart || nsEnd <= nsStart)
+		return;
+
+	nsPerTick = (double)(nsEnd - nsStart) / (tscEnd - tscStart);
+	tscBase = tscEnd;
+	nsBase = nsEnd;
+	useTSC = true;
+#endif
+}
@@ -0,0 +1,60 @@
+#ifndef HI_RES_CLOCK_H
+#define HI_RES_CLOCK_H
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+	#define HI_RES_CLOCK_TSC	1
+#endif
+
+/*
+ * Clock for the hot path timers
+ *
+ * On x86 with an invariant TSC (constant rate, keeps ticking in deep
+ * C-states) time is read with rdtsc and scaled to nanoseconds using a
+ * rate calibrated once against CLOCK_MONOTONIC, which costs a few ns
+ * instead of a clock_gettime call.  Otherwise CLOCK_MONOTONIC_RAW is
+ * used.  Either way the clock never jumps with NTP.
+ *
+ * Times are nanoseconds from an arbitrary (non-zero) start: only
+ * differences mean anything, and they drift away from CLOCK_MONOTONIC
+ * (SleepUntil in the harness converts).
+ *
+ * Calibrate() must be called once before any thread uses NowNS().
+ */
+class hiResClock
+{
+	public:
+		// pick the source and calibrate, allowTSC = false forces CLOCK_MONOTONIC_RAW
+		static void Calibrate(bool allowTSC = true);
+
+		static unsigned long long NowNS(void)
+		{
+#if defined(HI_RES_CLOCK_TSC)
+			if (useTSC)
+				return nsBase + (unsigned long long)((__rdtsc() - tscBase) * nsPerTick);
+#endif
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+			return now.tv_sec * 1000000000ULL + now.tv_nsec;
+		}
+
+		static bool UsingTSC(void) { return useTSC; }
+		static double TicksPerNS(void) { return nsPerTick ? 1 / nsPerTick : 0; }
+
+		// name of the clock in use, for the run header
+		static const char *Source(void) { return useTSC ? "tsc" : "CLOCK_MONOTONIC_RAW"; }
+
+		// does the CPU say its TSC is invariant
+		static bool InvariantTSC(void);
+
+	private:
+		static bool					useTSC;
+		static unsigned long long	tscBase;		// TSC at calibration
+		static unsigned long long	nsBase;			// CLOCK_MONOTONIC at calibration
+		static double				nsPerTick;
+};	// class hiResClock
+
+#endif // HI_RES_CLOCK_H
@@ -0,0 +1,46 @@
+#ifndef HIT_SOURCE_H
+#define HIT_SOURCE_H
+
+#include <time.h>
+
+#include <string>
+#include <bitset>
+
+#include <boost/utility.hpp>
+
+const unsigned NUM_EVARS = 75;
+
+typedef struct
+{
+	unsigned		rsid;				// report suite for this hit
+
+	unsigned long	visid_high;
+	unsigned long	visid_low;
+	bool			visid_new;			// are we SURE this is a new visid
+	time_t			hit_time_gmt;
+	unsigned long	visit_num;
+	std::string		referrer;
+	std::string		page_url;
+	std::string		page_name;			// defaults to page URL
+	time_t			purchase_time_gmt;
+	std::string		purchaseid;
+	std::string		campaign;
+
+	std::string		evar[NUM_EVARS];
+	std::bitset<NUM_EVARS>	evar_linear;	// evars with linear allocation (default is first)
+} hitData_t;
+
+
+
+// Pure virtual base class used as an interface
+// set it as not copyable
+class hitSource : private boost::noncopyable
+{
+	public:
+		hitSource(void) { }
+		virtual ~hitSource(void) { }	// base dtor doesn't need to do anything
+
+		virtual bool NextHit(hitData_t &hit) = 0;
+};	// class hitSource
+
+#endif // HIT_SOURCE_H
@@ -0,0 +1,531 @@
+#include "memcachedMock.h"
+#include "memcachedProtocol.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <deque>
+
+using namespace std;
+
+namespace {
+	const char VERSION[] = "1.4.0-vcmock";
+
+	long long MonotonicUS(void)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+	}
+
+	bool SendAll(int fd, const string &data)
+	{
+		size_t sent = 0;
+		while (sent < data.length())
+		{
+			ssize_t n = send(fd, data.data() + sent, data.length() - sent, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			sent += n;
+		}
+		return true;
+	}
+
+	// xorshift64*: small, fast and the same everywhere
+	unsigned long long NextRandom(unsigned long long &state)
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 2685821657736338717ULL;
+	}
+
+	// in [0, 1)
+	double RandomFraction(unsigned long long &state)
+	{
+		return (NextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+	}
+
+	bool IsQuiet(unsigned char opcode)
+	{
+		switch (opcode)
+		{
+			case MC_GETQ: case MC_GETKQ: case MC_SETQ: case MC_ADDQ: case MC_REPLACEQ: case MC_DELETEQ:
+				return true;
+		}
+		return false;
+	}
+
+	// the opcode a quiet one is the quiet form of
+	unsigned char Loud(unsigned char opcode)
+	{
+		switch (opcode)
+		{
+			case MC_GETQ:		return MC_GET;
+			case MC_GETKQ:		return MC_GETK;
+			case MC_SETQ:		return MC_SET;
+			case MC_ADDQ:		return MC_ADD;
+			case MC_REPLACEQ:	return MC_REPLACE;
+			case MC_DELETEQ:	return MC_DELETE;
+		}
+		return opcode;
+	}
+
+	void Respond(string &out, const unsigned char *request, unsigned short status, unsigned long long cas,
+		const string &extras = string(), const string &key = string(), const char *value = NULL, size_t valueLength = 0)
+	{
+		unsigned char header[MC_HEADER_SIZE];
+		memset(header, 0, sizeof(header));
+		header[MC_HEADER_MAGIC] = MC_RESPONSE;
+		header[MC_HEADER_OPCODE] = request[MC_HEADER_OPCODE];
+		McPut(header + MC_HEADER_KEYLEN, 2, key.length());
+		header[MC_HEADER_EXTLEN] = (unsigned char) extras.length();
+		McPut(header + MC_HEADER_STATUS, 2, status);
+		McPut(header + MC_HEADER_BODYLEN, 4, extras.length() + key.length() + valueLength);
+		memcpy(header + MC_HEADER_OPAQUE, request + MC_HEADER_OPAQUE, 4);
+		McPut(header + MC_HEADER_CAS, 8, cas);
+
+		out.append((const char *) header, sizeof(header));
+		out += extras;
+		out += key;
+		if (valueLength)
+			out.append(value, valueLength);
+	}
+}
+
+
+memcachedMock::memcachedMock(const faults_t &_faults) :
+	faults(_faults), listener(-1), port(0), running(false), nextCas(1), requests(0), injected(0)
+{
+	wakePipe[0] = wakePipe[1] = -1;
+	pthread_mutex_init(&lock, NULL);
+}
+
+memcachedMock::~memcachedMock(void)
+{
+	Stop();
+	pthread_mutex_destroy(&lock);
+}
+
+bool memcachedMock::Listen(unsigned _port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	struct sockaddr_in addr;
+	socklen_t length = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 64) < 0 ||
+		getsockname(fd, (struct sockaddr *) &addr, &length) < 0)
+	{
+		int err = errno;
+		close(fd);
+		errno = err;
+		return false;
+	}
+
+	listener = fd;
+	port = ntohs(addr.sin_port);
+	return true;
+}
+
+bool memcachedMock::Start(void)
+{
+	if (running || listener < 0 || pipe2(wakePipe, O_CLOEXEC) < 0)
+		return false;
+
+	running = pthread_create(&acceptThread, NULL, RunAccept, this) == 0;
+	return running;
+}
+
+void memcachedMock::Stop(void)
+{
+	if (running)
+	{
+		// never read, so every thread's poll sees it
+		char c = 0;
+		while (write(wakePipe[1], &c, 1) < 0 && errno == EINTR)
+			;
+		pthread_join(acceptThread, NULL);
+		running = false;
+
+		// the accept thread is gone, nothing adds to connections now
+		for (unsigned i = 0; i < connections.size(); i++)
+			pthread_join(connections[i], NULL);
+		connections.clear();
+		finished.clear();
+	}
+
+	if (listener >= 0)
+		close(listener);
+	listener = -1;
+
+	for (unsigned i = 0; i < 2; i++)
+	{
+		if (wakePipe[i] >= 0)
+			close(wakePipe[i]);
+		wakePipe[i] = -1;
+	}
+}
+
+unsigned long long memcachedMock::Requests(void)
+{
+	pthread_mutex_lock(&lock);
+	unsigned long long count = requests;
+	pthread_mutex_unlock(&lock);
+	return count;
+}
+
+unsigned long long memcachedMock::Injected(void)
+{
+	pthread_mutex_lock(&lock);
+	unsigned long long count = injected;
+	pthread_mutex_unlock(&lock);
+	return count;
+}
+
+void *memcachedMock::RunAccept(void *arg)
+{
+	((memcachedMock *) arg)->Accept();
+	return NULL;
+}
+
+void *memcachedMock::RunConnection(void *arg)
+{
+	connection_t *connection = (connection_t *) arg;
+	memcachedMock *mock = connection->mock;
+	mock->Serve(connection->fd, connection->seed);
+	close(connection->fd);
+	delete connection;
+
+	// for Accept to join, so a long run doesn't keep every thread it had
+	pthread_mutex_lock(&mock->lock);
+	mock->finished.push_back(pthread_self());
+	pthread_mutex_unlock(&mock->lock);
+	return NULL;
+}
+
+void memcachedMock::Accept(void)
+{
+	struct pollfd fds[2];
+	fds[0].fd = listener;
+	fds[0].events = POLLIN;
+	fds[1].fd = wakePipe[0];
+	fds[1].events = POLLIN;
+
+	for (unsigned accepted = 0; ; )
+	{
+		int ready = poll(fds, 2, -1);
+		if (ready < 0 && errno != EINTR)
+			break;
+		if (fds[1].revents)
+			break;		// Stop()
+		if (!(fds[0].revents & POLLIN))
+			continue;
+
+		Reap();
+
+		int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		// answers go out as soon as they're due, not when Nagle likes
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		// each connection its own faults, the same ones every run
+		connection_t *connection = new connection_t;
+		connection->mock = this;
+		connection->fd = fd;
+		connection->seed = faults.seed + accepted++;
+
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, RunConnection, connection) != 0)
+		{
+			close(fd);
+			delete connection;
+			continue;
+		}
+		pthread_mutex_lock(&lock);
+		connections.push_back(thread);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+void memcachedMock::Reap(void)
+{
+	vector<pthread_t> ended;
+
+	pthread_mutex_lock(&lock);
+	ended.swap(finished);
+	for (unsigned i = 0; i < ended.size(); i++)
+	{
+		for (unsigned j = 0; j < connections.size(); j++)
+		{
+			if (pthread_equal(connections[j], ended[i]))
+			{
+				connections[j] = connections.back();
+				connections.pop_back();
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	// they have nothing left to do but return
+	for (unsigned i = 0; i < ended.size(); i++)
+		pthread_join(ended[i], NULL);
+}
+
+void memcachedMock::Serve(int fd, unsigned seed)
+{
+	typedef struct
+	{
+		long long	dueUS;
+		string		bytes;
+	} pending_t;
+
+	unsigned long long random = seed * 2862933555777941757ULL + 3037000493ULL;
+	deque<pending_t> pending;
+	long long lastDueUS = 0;
+	string input;
+	char buffer[65536];
+	bool open = true;
+
+	struct pollfd fds[2];
+	fds[0].fd = fd;
+	fds[1].fd = wakePipe[0];
+	fds[1].events = POLLIN;
+
+	while (open || !pending.empty())
+	{
+		long long now = MonotonicUS();
+		while (!pending.empty() && pending.front().dueUS <= now)
+		{
+			if (!SendAll(fd, pending.front().bytes))
+				return;
+			pending.pop_front();
+		}
+		if (!open && pending.empty())
+			break;
+
+		// microseconds matter here, poll() only waits whole milliseconds
+		struct timespec wait;
+		if (!pending.empty())
+		{
+			long long us = pending.front().dueUS - now;
+			wait.tv_sec = us / 1000000;
+			wait.tv_nsec = (us % 1000000) * 1000;
+		}
+		fds[0].events = open ? POLLIN : 0;
+		int ready = ppoll(fds, 2, pending.empty() ? NULL : &wait, NULL);
+		if (ready < 0 && errno != EINTR)
+			return;
+		if (fds[1].revents)
+			return;		// Stop()
+		if (ready <= 0 || !(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+
+		ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;		// the client is gone, nobody to answer
+		input.append(buffer, n);
+
+		now = MonotonicUS();
+		size_t used = 0;
+		while (open && input.length() - used >= MC_HEADER_SIZE)
+		{
+			const unsigned char *request = (const unsigned char *) input.data() + used;
+			size_t length = MC_HEADER_SIZE + McGet(request + MC_HEADER_BODYLEN, 4);
+			if (request[MC_HEADER_MAGIC] != MC_REQUEST)
+				return;		// not a client we understand
+			if (input.length() - used < length)
+				break;
+
+			bool inject = faults.errorRate > 0 && RandomFraction(random) < faults.errorRate;
+			string response;
+			Handle(request, response, inject);
+			if (request[MC_HEADER_OPCODE] == MC_QUIT)
+				open = false;
+			used += length;
+
+			if (response.empty())
+				continue;
+
+			// in order, as a real connection answers
+			long long due = now + faults.latencyUS;
+			if (faults.jitterUS)
+				due += NextRandom(random) % (faults.jitterUS + 1);
+			if (due < lastDueUS)
+				due = lastDueUS;
+			lastDueUS = due;
+
+			if (pending.empty() || pending.back().dueUS != due)
+			{
+				pending.push_back(pending_t());
+				pending.back().dueUS = due;
+			}
+			pending.back().bytes += response;
+		}
+		input.erase(0, used);
+	}
+}
+
+void memcachedMock::Handle(const unsigned char *request, string &response, bool inject)
+{
+	unsigned char opcode = request[MC_HEADER_OPCODE];
+	size_t keyLength = McGet(request + MC_HEADER_KEYLEN, 2);
+	size_t extrasLength = request[MC_HEADER_EXTLEN];
+	size_t bodyLength = McGet(request + MC_HEADER_BODYLEN, 4);
+	unsigned long long cas = McGet(request + MC_HEADER_CAS, 8);
+
+	if (extrasLength + keyLength > bodyLength)
+	{
+		Respond(response, request, MC_EINVAL, 0);
+		return;
+	}
+	const unsigned char *extras = request + MC_HEADER_SIZE;
+	string key((const char *) extras + extrasLength, keyLength);
+	const char *value = (const char *) extras + extrasLength + keyLength;
+	size_t valueLength = bodyLength - extrasLength - keyLength;
+
+	bool quiet = IsQuiet(opcode);
+	time_t now = time(NULL);
+
+	pthread_mutex_lock(&lock);
+	requests++;
+
+	// a failure is always answered, a quiet success never is
+	unsigned short status = MC_SUCCESS;
+	map<string, item_t>::iterator item = items.find(key);
+	if (item != items.end() && item->second.expires && item->second.expires <= now)
+	{
+		items.erase(item);
+		item = items.end();
+	}
+
+	switch (Loud(opcode))
+	{
+		case MC_GET:
+		case MC_GETK:
+		case MC_SET:
+		case MC_ADD:
+		case MC_REPLACE:
+		case MC_DELETE:
+			if (inject)
+			{
+				injected++;
+				status = MC_ETMPFAIL;
+				break;
+			}
+			switch (Loud(opcode))
+			{
+				case MC_GET:
+				case MC_GETK:
+					if (item == items.end())
+					{
+						// the one quiet failure: a quiet get says nothing on a miss
+						if (!quiet)
+							status = MC_KEY_ENOENT;
+						break;
+					}
+					{
+						string flags(4, '\0');
+						McPut((unsigned char *) &flags[0], 4, item->second.flags);
+						Respond(response, request, MC_SUCCESS, item->second.cas, flags,
+							Loud(opcode) == MC_GETK ? key : string(),
+							item->second.value.empty() ? NULL : &item->second.value[0], item->second.value.size());
+					}
+					break;
+
+				case MC_SET:
+				case MC_ADD:
+				case MC_REPLACE:
+				{
+					if (extrasLength != 8)
+					{
+						status = MC_EINVAL;
+						break;
+					}
+					bool exists = item != items.end();
+					if (Loud(opcode) == MC_ADD && exists)
+						status = MC_KEY_EEXISTS;
+					else if (Loud(opcode) == MC_REPLACE && !exists)
+						status = MC_KEY_ENOENT;
+					else if (cas && !exists)
+						status = MC_KEY_ENOENT;
+					else if (cas && item->second.cas != cas)
+						status = MC_KEY_EEXISTS;
+					if (status != MC_SUCCESS)
+						break;
+
+					item_t &stored = items[key];
+					stored.value.assign(value, value + valueLength);
+					stored.flags = (unsigned) McGet(extras, 4);
+					stored.cas = nextCas++;
+					unsigned expiry = (unsigned) McGet(extras + 4, 4);
+					stored.expires = expiry == 0 ? 0 : expiry <= MC_RELATIVE_EXPIRY_MAX ? now + expiry : (time_t) expiry;
+					if (!quiet)
+						Respond(response, request, MC_SUCCESS, stored.cas);
+					break;
+				}
+
+				case MC_DELETE:
+					if (item == items.end())
+						status = MC_KEY_ENOENT;
+					else if (cas && item->second.cas != cas)
+						status = MC_KEY_EEXISTS;
+					else
+					{
+						items.erase(item);
+						if (!quiet)
+							Respond(response, request, MC_SUCCESS, 0);
+					}
+					break;
+			}
+			break;
+
+		case MC_FLUSH:
+			items.clear();
+			Respond(response, request, MC_SUCCESS, 0);
+			break;
+
+		case MC_NOOP:
+		case MC_QUIT:
+			Respond(response, request, MC_SUCCESS, 0);
+			break;
+
+		case MC_VERSION:
+			Respond(response, request, MC_SUCCESS, 0, string(), string(), VERSION, sizeof(VERSION) - 1);
+			break;
+
+		default:
+			status = MC_UNKNOWN_COMMAND;
+			break;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (status != MC_SUCCESS)
+		Respond(response, request, status, 0);
+}
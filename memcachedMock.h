@@ -0,0 +1,107 @@
+#ifndef MEMCACHED_MOCK_H
+#define MEMCACHED_MOCK_H
+
+#include <pthread.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/utility.hpp>
+
+/*
+ * Stand-in memcached server for testing network engines without a cluster
+ *
+ * Speaks enough of the memcached binary protocol for the memcached engine
+ * (VCMemcachedStore) and any other plain memcached client: get, getk,
+ * set, add, replace, delete (and their quiet forms), noop, version,
+ * flush and quit, with CAS and expiry handled as memcached does.  It
+ * doesn't serve the REST bucket configuration libcouchbase bootstraps
+ * from, so the couchbase engine can't use it.
+ *
+ * Faults are injected to order: each response is held back latency plus
+ * up to jitter microseconds after its request arrives (pipelined requests
+ * wait at the same time, responses keep their order as on a real
+ * connection), and errorRate of the requests are answered with a
+ * temporary failure instead of being done.  The same seed gives the same
+ * faults for the same requests.
+ *
+ * Runs in the process that starts it (testharness memcached-mock=,
+ * storetest) or on its own (vcmock).  A thread accepts on 127.0.0.1 and
+ * a thread serves each connection; the items are shared, behind one lock.
+ */
+
+class memcachedMock : private boost::noncopyable
+{
+	public:
+		typedef struct
+		{
+			unsigned	latencyUS;		// before each response
+			unsigned	jitterUS;		// up to this much more, uniformly
+			double		errorRate;		// of requests answered with a temporary failure
+			unsigned	seed;
+		} faults_t;
+
+		memcachedMock(const faults_t &faults);
+		~memcachedMock(void);
+
+		// listen on 127.0.0.1:port, 0 for any free port; false (and errno) if it can't
+		bool Listen(unsigned port);
+
+		// the port listened on
+		unsigned Port(void) const { return port; }
+
+		// start the accept thread
+		bool Start(void);
+
+		// stop and join every thread, close the sockets
+		void Stop(void);
+
+		// requests served, and the ones answered with an injected failure
+		unsigned long long Requests(void);
+		unsigned long long Injected(void);
+
+	private:
+		typedef struct
+		{
+			std::vector<char>	value;
+			unsigned			flags;
+			unsigned long long	cas;
+			time_t				expires;	// 0 never
+		} item_t;
+
+		typedef struct
+		{
+			memcachedMock	*mock;
+			int				fd;
+			unsigned		seed;
+		} connection_t;
+
+		static void *RunAccept(void *arg);
+		static void *RunConnection(void *arg);
+		void Accept(void);
+		void Serve(int fd, unsigned seed);
+
+		// join the connection threads that have ended since the last time
+		void Reap(void);
+
+		// the response to one request (empty for a quiet one that succeeded)
+		void Handle(const unsigned char *request, std::string &response, bool inject);
+
+		faults_t		faults;
+		int				listener;
+		unsigned		port;
+		int				wakePipe[2];	// written by Stop to end every thread
+		pthread_t		acceptThread;
+		bool			running;
+
+		pthread_mutex_t	lock;			// everything below
+		std::vector<pthread_t>	connections;	// each closes its socket as it ends
+		std::vector<pthread_t>	finished;		// ended, not joined yet
+		std::map<std::string, item_t>	items;
+		unsigned long long	nextCas;
+		unsigned long long	requests;
+		unsigned long long	injected;
+};	// class memcachedMock
+
+#endif // MEMCACHED_MOCK_H
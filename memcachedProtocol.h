@@ -0,0 +1,80 @@
+#ifndef MEMCACHED_PROTOCOL_H
+#define MEMCACHED_PROTOCOL_H
+
+#include <stddef.h>
+
+/*
+ * The parts of the memcached binary protocol the memcached engine and the
+ * stand-in server (memcachedMock.h) use.  Every packet is a 24 byte
+ * header, then extras, key and value; numbers are big endian.
+ */
+
+enum mcMagic {
+	MC_REQUEST	= 0x80,
+	MC_RESPONSE	= 0x81
+};
+
+enum mcOpcode {
+	MC_GET		= 0x00,
+	MC_SET		= 0x01,
+	MC_ADD		= 0x02,
+	MC_REPLACE	= 0x03,
+	MC_DELETE	= 0x04,
+	MC_QUIT		= 0x07,
+	MC_FLUSH	= 0x08,
+	MC_GETQ		= 0x09,
+	MC_NOOP		= 0x0a,
+	MC_VERSION	= 0x0b,
+	MC_GETK		= 0x0c,
+	MC_GETKQ	= 0x0d,
+	MC_SETQ		= 0x11,
+	MC_ADDQ		= 0x12,
+	MC_REPLACEQ	= 0x13,
+	MC_DELETEQ	= 0x14
+};
+
+enum mcStatus {
+	MC_SUCCESS			= 0x00,
+	MC_KEY_ENOENT		= 0x01,
+	MC_KEY_EEXISTS		= 0x02,
+	MC_E2BIG			= 0x03,
+	MC_EINVAL			= 0x04,
+	MC_UNKNOWN_COMMAND	= 0x81,
+	MC_ETMPFAIL			= 0x86
+};
+
+// offsets into the header
+enum mcHeader {
+	MC_HEADER_MAGIC		= 0,
+	MC_HEADER_OPCODE	= 1,
+	MC_HEADER_KEYLEN	= 2,	// 2 bytes
+	MC_HEADER_EXTLEN	= 4,
+	MC_HEADER_DATATYPE	= 5,
+	MC_HEADER_STATUS	= 6,	// 2 bytes, the vbucket in a request
+	MC_HEADER_BODYLEN	= 8,	// 4 bytes: extras, key and value
+	MC_HEADER_OPAQUE	= 12,	// 4 bytes, echoed in the response
+	MC_HEADER_CAS		= 16,	// 8 bytes
+	MC_HEADER_SIZE		= 24
+};
+
+// expirations up to this many seconds are relative, longer ones absolute
+const unsigned MC_RELATIVE_EXPIRY_MAX = 30 * 24 * 60 * 60;
+
+inline unsigned long long McGet(const unsigned char *p, size_t bytes)
+{
+	unsigned long long value = 0;
+	for (size_t i = 0; i < bytes; i++)
+		value = (value << 8) | p[i];
+	return value;
+}
+
+inline void McPut(unsigned char *p, size_t bytes, unsigned long long value)
+{
+	for (size_t i = bytes; i > 0; i--)
+	{
+		p[i - 1] = (unsigned char) value;
+		value >>= 8;
+	}
+}
+
+#endif // MEMCACHED_PROTOCOL_H
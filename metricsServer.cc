@@ -0,0 +1,269 @@
+#include "metricsServer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <sstream>
+
+using namespace std;
+
+namespace {
+	const int SAMPLE_MS = 1000;
+
+	// a scraper that connects and says nothing doesn't get to hold the thread
+	const int REQUEST_TIMEOUT_MS = 1000;
+	const size_t MAX_REQUEST = 4096;
+
+	long long MonotonicMS(void)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+	}
+
+	void SendAll(int fd, const string &data)
+	{
+		size_t sent = 0;
+		while (sent < data.length())
+		{
+			ssize_t n = send(fd, data.data() + sent, data.length() - sent, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return;
+			sent += n;
+		}
+	}
+}
+
+
+metricsServer::metricsServer(metricsSource &_source) : source(_source), running(false)
+{
+	wakePipe[0] = wakePipe[1] = -1;
+}
+
+metricsServer::~metricsServer(void)
+{
+	Stop();
+}
+
+bool metricsServer::ListenTCP(unsigned port)
+{
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+
+	int on = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	// loopback only, the endpoint is for the machine running the test
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+	{
+		int err = errno;
+		close(fd);
+		errno = err;
+		return false;
+	}
+
+	listeners.push_back(fd);
+	return true;
+}
+
+bool metricsServer::ListenUnix(const string &path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	if (path.length() >= sizeof(addr.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+
+	// left behind by an earlier run that didn't get to clean up
+	unlink(path.c_str());
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+	{
+		int err = errno;
+		close(fd);
+		errno = err;
+		return false;
+	}
+
+	listeners.push_back(fd);
+	unixPath = path;
+	return true;
+}
+
+bool metricsServer::Start(void)
+{
+	if (running || listeners.empty() || pipe2(wakePipe, O_CLOEXEC) < 0)
+		return false;
+
+	running = pthread_create(&thread, NULL, Run, this) == 0;
+	return running;
+}
+
+void metricsServer::Stop(void)
+{
+	if (running)
+	{
+		char c = 0;
+		while (write(wakePipe[1], &c, 1) < 0 && errno == EINTR)
+			;
+		pthread_join(thread, NULL);
+		running = false;
+	}
+
+	for (unsigned i = 0; i < listeners.size(); i++)
+		close(listeners[i]);
+	listeners.clear();
+
+	if (!unixPath.empty())
+		unlink(unixPath.c_str());
+	unixPath.clear();
+
+	for (unsigned i = 0; i < 2; i++)
+	{
+		if (wakePipe[i] >= 0)
+			close(wakePipe[i]);
+		wakePipe[i] = -1;
+	}
+}
+
+void *metricsServer::Run(void *arg)
+{
+	((metricsServer *) arg)->Loop();
+	return NULL;
+}
+
+void metricsServer::Loop(void)
+{
+	vector<struct pollfd> fds(listeners.size() + 1);
+	for (unsigned i = 0; i < listeners.size(); i++)
+	{
+		fds[i].fd = listeners[i];
+		fds[i].events = POLLIN;
+	}
+	fds.back().fd = wakePipe[0];
+	fds.back().events = POLLIN;
+
+	long long nextSample = MonotonicMS() + SAMPLE_MS;
+	for (;;)
+	{
+		long long wait = nextSample - MonotonicMS();
+		int ready = poll(&fds[0], fds.size(), wait > 0 ? (int) wait : 0);
+
+		if (ready < 0 && errno != EINTR)
+			break;
+		if (fds.back().revents)
+			break;		// Stop()
+
+		if (MonotonicMS() >= nextSample)
+		{
+			source.Sample();
+			nextSample += SAMPLE_MS;
+		}
+
+		for (unsigned i = 0; ready > 0 && i < listeners.size(); i++)
+		{
+			if (!(fds[i].revents & POLLIN))
+				continue;
+
+			int fd = accept4(listeners[i], NULL, NULL, SOCK_CLOEXEC);
+			if (fd >= 0)
+			{
+				Serve(fd);
+				close(fd);
+			}
+		}
+	}
+}
+
+// one HTTP/1.0 request per connection, GET /metrics (or /) only
+void metricsServer::Serve(int fd)
+{
+	string request;
+	char buf[1024];
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	long long deadline = MonotonicMS() + REQUEST_TIMEOUT_MS;
+
+	while (request.find("\r\n\r\n") == string::npos && request.find("\n\n") == string::npos &&
+			request.length() < MAX_REQUEST)
+	{
+		long long wait = deadline - MonotonicMS();
+		if (wait <= 0 || poll(&pfd, 1, (int) wait) <= 0)
+			return;
+
+		ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n <= 0)
+			return;
+		request.append(buf, n);
+	}
+
+	istringstream line(request);
+	string method, path;
+	line >> method >> path;
+
+	string status = "200 OK", body;
+	if (method != "GET" && method != "HEAD")
+		status = "405 Method Not Allowed";
+	else if (path != "/metrics" && path != "/")
+		status = "404 Not Found";
+	else
+	{
+		ostringstream os;
+		source.WriteMetrics(os);
+		body = os.str();
+	}
+
+	ostringstream response;
+	response << "HTTP/1.0 " << status << "\r\n"
+		<< "Content-Type: text/plain; version=0.0.4\r\n"
+		<< "Content-Length: " << body.length() << "\r\n"
+		<< "Connection: close\r\n\r\n";
+	if (method != "HEAD")
+		response << body;
+
+	SendAll(fd, response.str());
+}
+
+void metricsServer::Describe(ostream &os, const char *name, const char *type, const char *help)
+{
+	os << "# HELP " << name << " " << help << "\n"
+		<< "# TYPE " << name << " " << type << "\n";
+}
+
+void metricsServer::Value(ostream &os, const char *name, double value, const char *labels)
+{
+	// counters keep every digit
+	char text[32];
+	snprintf(text, sizeof(text), "%.15g", value);
+
+	os << name;
+	if (labels)
+		os << "{" << labels << "}";
+	os << " " << text << "\n";
+}
@@ -0,0 +1,82 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <pthread.h>
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include <boost/utility.hpp>
+
+/*
+ * Live metrics endpoint for long runs (metrics-port=, metrics-socket=)
+ *
+ * Serves the Prometheus text format over HTTP on 127.0.0.1 and/or a Unix
+ * socket, so a soak test can be watched (or scraped) while it runs:
+ *
+ *	curl http://127.0.0.1:9100/metrics
+ *	curl --unix-socket /tmp/harness.sock http://localhost/metrics
+ *
+ * One thread does everything: it calls the source's Sample() once a
+ * second and answers each request with WriteMetrics(), so the source
+ * needs no locking of its own.  The source reads the workers' numbers
+ * with relaxed atomic loads; the workers never wait on a scrape.
+ */
+
+class metricsSource
+{
+	public:
+		virtual ~metricsSource(void) {}
+
+		// called once a second on the server thread (rates, windows)
+		virtual void Sample(void) = 0;
+
+		// the response body, on the server thread
+		virtual void WriteMetrics(std::ostream &os) = 0;
+};	// class metricsSource
+
+
+class metricsServer : private boost::noncopyable
+{
+	public:
+		metricsServer(metricsSource &source);
+		~metricsServer(void);
+
+		// listen on 127.0.0.1:port; false (and errno) if it can't
+		bool ListenTCP(unsigned port);
+
+		// listen on a Unix socket, replacing a stale one at path
+		bool ListenUnix(const std::string &path);
+
+		// start the server thread
+		bool Start(void);
+
+		// stop and join the server thread, close the sockets
+		void Stop(void);
+
+		// the text format: HELP and TYPE lines, then a sample per label set
+		static void Describe(std::ostream &os, const char *name, const char *type, const char *help);
+		static void Value(std::ostream &os, const char *name, double value, const char *labels = NULL);
+
+		// a metric with a single sample
+		static void Metric(std::ostream &os, const char *name, const char *type, const char *help, double value)
+		{
+			Describe(os, name, type, help);
+			Value(os, name, value);
+		}
+
+	private:
+		static void *Run(void *arg);
+		void Loop(void);
+		void Serve(int fd);
+
+		metricsSource	&source;
+		std::vector<int>	listeners;
+		std::string		unixPath;		// unlinked on Stop
+		int				wakePipe[2];	// written by Stop to end the loop
+		pthread_t		thread;
+		bool			running;
+};	// class metricsServer
+
+#endif // METRICS_SERVER_H
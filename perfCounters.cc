@@ -0,0 +1,132 @@
+#include "perfCounters.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+namespace {
+	const char *NAMES[perfCounters::COUNT] = {
+		"cycles", "instructions", "llcMisses", "branchMisses", "dtlbMisses"
+	};
+
+	// glibc has no wrapper
+	int PerfEventOpen(struct perf_event_attr *attr, int groupFd)
+	{
+		return syscall(__NR_perf_event_open, attr, 0, -1, groupFd, PERF_FLAG_FD_CLOEXEC);
+	}
+
+	void Describe(unsigned counter, struct perf_event_attr &attr)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+
+		switch (counter)
+		{
+			case perfCounters::CYCLES:
+				attr.config = PERF_COUNT_HW_CPU_CYCLES;
+				break;
+			case perfCounters::INSTRUCTIONS:
+				attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+				break;
+			case perfCounters::LLC_MISSES:
+				attr.config = PERF_COUNT_HW_CACHE_MISSES;
+				break;
+			case perfCounters::BRANCH_MISSES:
+				attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+				break;
+			case perfCounters::DTLB_MISSES:
+				attr.type = PERF_TYPE_HW_CACHE;
+				attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+						(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+				break;
+		}
+
+		// user space of this thread only: allowed at perf_event_paranoid <= 2
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	}
+}
+
+
+perfCounters::perfCounters(void) : opened(0)
+{
+	for (unsigned i = 0; i < COUNT; i++)
+	{
+		fds[i] = -1;
+		slots[i] = 0;
+	}
+}
+
+perfCounters::~perfCounters(void)
+{
+	Close();
+}
+
+bool perfCounters::Open(void)
+{
+	Close();
+
+	for (unsigned i = 0; i < COUNT; i++)
+	{
+		struct perf_event_attr attr;
+		Describe(i, attr);
+
+		// the leader starts disabled so the whole group starts together
+		if (i == CYCLES)
+			attr.disabled = 1;
+
+		fds[i] = PerfEventOpen(&attr, i == CYCLES ? -1 : fds[CYCLES]);
+		if (fds[i] < 0)
+		{
+			if (i == CYCLES)
+				return false;		// errno from the open
+			continue;				// this one isn't offered, go on without it
+		}
+		slots[i] = opened++;
+	}
+
+	ioctl(fds[CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(fds[CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return true;
+}
+
+void perfCounters::Close(void)
+{
+	// members first, then the leader
+	for (unsigned i = COUNT; i-- > 0; )
+	{
+		if (fds[i] >= 0)
+			close(fds[i]);
+		fds[i] = -1;
+	}
+	opened = 0;
+}
+
+bool perfCounters::Read(reading_t &reading) const
+{
+	if (!IsOpen())
+		return false;
+
+	// nr, time enabled, time running, then a value per open counter
+	unsigned long long buffer[3 + COUNT];
+	ssize_t bytes = read(fds[CYCLES], buffer, sizeof(buffer));
+	if (bytes < (ssize_t)((3 + opened) * sizeof(buffer[0])) || buffer[0] != opened)
+		return false;
+
+	reading.enabledNS = buffer[1];
+	reading.runningNS = buffer[2];
+	for (unsigned i = 0; i < COUNT; i++)
+		reading.value[i] = fds[i] >= 0 ? buffer[3 + slots[i]] : 0;
+
+	return true;
+}
+
+const char *perfCounters::Name(unsigned counter)
+{
+	return counter < COUNT ? NAMES[counter] : "unknown";
+}
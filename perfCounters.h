@@ -0,0 +1,64 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <boost/utility.hpp>
+
+/*
+ * Hardware performance counters for the calling thread (Linux perf_event_open)
+ *
+ * Opens one counter group per thread: cycles as the leader with
+ * instructions, last level cache misses, branch misses and dTLB load
+ * misses as members, so they are scheduled onto the PMU together and one
+ * read() returns a consistent set.  Only user space is counted, which is
+ * what perf_event_paranoid = 2 still allows for our own threads.
+ *
+ * Any member the CPU (or the hypervisor) doesn't offer is left out; if
+ * the cycles leader itself can't be opened there are no counters and
+ * Open() says why.  A read costs a system call (~1us), so the harness
+ * only reads on a sample of hits (perf-sample=).
+ */
+
+class perfCounters : private boost::noncopyable
+{
+	public:
+		enum {
+			CYCLES = 0,
+			INSTRUCTIONS,
+			LLC_MISSES,
+			BRANCH_MISSES,
+			DTLB_MISSES,
+			COUNT
+		};
+
+		// one reading of every counter, 0 for those not open
+		typedef struct
+		{
+			unsigned long long	value[COUNT];
+			unsigned long long	enabledNS;		// time the group was enabled
+			unsigned long long	runningNS;		// and actually on the PMU
+		} reading_t;
+
+		perfCounters(void);
+		~perfCounters(void);
+
+		// open the group for the calling thread and start counting,
+		// false (with errno set) if no counters are available
+		bool Open(void);
+		void Close(void);
+
+		bool IsOpen(void) const { return fds[CYCLES] >= 0; }
+		bool Has(unsigned counter) const { return fds[counter] >= 0; }
+
+		// false if the read failed (the reading is left alone)
+		bool Read(reading_t &reading) const;
+
+		// "cycles", "instructions", ...
+		static const char *Name(unsigned counter);
+
+	private:
+		int			fds[COUNT];
+		unsigned	slots[COUNT];		// position of each open counter in a group read
+		unsigned	opened;
+};	// class perfCounters
+
+#endif // PERF_COUNTERS_H
@@ -0,0 +1,583 @@
+#include "replayReader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include <zlib.h>
+#if defined(HAVE_ZSTD)
+	#include <zstd.h>
+#endif
+
+using namespace std;
+
+namespace {
+	const unsigned long long NS_PER_SECOND = 1000000000ULL;
+
+	// raw read size for the compressed side of the decoders
+	const size_t COMPRESSED_CHUNK = 256 * 1024;
+
+	// lines longer than a buffer get split, so don't let the buffers get silly small
+	const size_t MIN_BUFFER_SIZE = 64 * 1024;
+
+	// read-ahead is requested in chunks this big, so at most window/chunk are in flight
+	const size_t PREFETCH_CHUNK = 1024 * 1024;
+
+	unsigned long long ElapsedNS(const struct timespec &from)
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		return (now.tv_sec - from.tv_sec) * NS_PER_SECOND + now.tv_nsec - from.tv_nsec;
+	}
+
+	bool EndsWith(const string &str, const string &suffix)
+	{
+		return str.length() >= suffix.length() &&
+				str.compare(str.length() - suffix.length(), suffix.length(), suffix) == 0;
+	}
+
+
+	// uncompressed files are passed straight through
+	class plainDecoder : public inputDecoder
+	{
+		public:
+			plainDecoder(int fd) : inputDecoder(fd) {}
+
+			virtual ssize_t Read(char *buf, size_t len)
+			{
+				return ReadRaw(buf, len);
+			}
+	};
+
+
+	// gzip (and zlib) files, including multi-member files such as
+	// those produced by concatenating gzip output
+	class gzipDecoder : public inputDecoder
+	{
+		public:
+			gzipDecoder(int fd) : inputDecoder(fd), in(COMPRESSED_CHUNK), eof(false), error(false)
+			{
+				memset(&stream, 0, sizeof(stream));
+				inflateInit2(&stream, 15 + 32);		// 32 = detect gzip or zlib header
+			}
+			~gzipDecoder(void)
+			{
+				inflateEnd(&stream);
+			}
+
+			virtual ssize_t Read(char *buf, size_t len)
+			{
+				if (error)
+					return -1;
+
+				stream.next_out = (Bytef *) buf;
+				stream.avail_out = len;
+
+				while (stream.avail_out > 0)
+				{
+					if (stream.avail_in == 0)
+					{
+						if (eof)
+							break;
+
+						ssize_t n = ReadRaw(&in[0], in.size());
+						if (n < 0)
+						{
+							error = true;
+							return -1;
+						}
+						if (n == 0)
+						{
+							eof = true;
+							break;
+						}
+						stream.next_in = (Bytef *) &in[0];
+						stream.avail_in = n;
+					}
+
+					int ret = inflate(&stream, Z_NO_FLUSH);
+					if (ret == Z_STREAM_END)
+					{
+						// another gzip member may follow
+						inflateReset(&stream);
+					}
+					else if (ret != Z_OK && ret != Z_BUF_ERROR)
+					{
+						cerr << "gzip: " << (stream.msg ? stream.msg : "decompression failed") << "\n";
+						error = true;
+						return -1;
+					}
+				}
+
+				return len - stream.avail_out;
+			}
+
+		private:
+			z_stream		stream;
+			vector<char>	in;
+			bool			eof;
+			bool			error;
+	};
+
+
+#if defined(HAVE_ZSTD)
+	class zstdDecoder : public inputDecoder
+	{
+		public:
+			zstdDecoder(int fd) : inputDecoder(fd), in(COMPRESSED_CHUNK), eof(false), error(false)
+			{
+				stream = ZSTD_createDStream();
+				ZSTD_initDStream(stream);
+				input.src = &in[0];
+				input.size = 0;
+				input.pos = 0;
+			}
+			~zstdDecoder(void)
+			{
+				ZSTD_freeDStream(stream);
+			}
+
+			virtual ssize_t Read(char *buf, size_t len)
+			{
+				if (error)
+					return -1;
+
+				ZSTD_outBuffer output = { buf, len, 0 };
+
+				while (output.pos < output.size)
+				{
+					if (input.pos == input.size)
+					{
+						if (eof)
+							break;
+
+						ssize_t n = ReadRaw(&in[0], in.size());
+						if (n < 0)
+						{
+							error = true;
+							return -1;
+						}
+						if (n == 0)
+						{
+							eof = true;
+							break;
+						}
+						input.size = n;
+						input.pos = 0;
+					}
+
+					size_t ret = ZSTD_decompressStream(stream, &output, &input);
+					if (ZSTD_isError(ret))
+					{
+						cerr << "zstd: " << ZSTD_getErrorName(ret) << "\n";
+						error = true;
+						return -1;
+					}
+				}
+
+				return output.pos;
+			}
+
+		private:
+			ZSTD_DStream	*stream;
+			ZSTD_inBuffer	input;
+			vector<char>	in;
+			bool			eof;
+			bool			error;
+	};
+#endif
+} // end anonymous namespace
+
+
+/*
+ * bufferRing
+ */
+
+bufferRing::bufferRing(unsigned count, size_t size) :
+	buffers(count), closed(false), cancelled(false), consumerWaitNS(0), fullCount(0)
+{
+	for (unsigned i = 0; i < count; i++)
+	{
+		buffers[i].data = new char[size + 1];
+		buffers[i].capacity = size;
+		buffers[i].length = 0;
+		empty.push_back(&buffers[i]);
+	}
+
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&emptyAvailable, NULL);
+	pthread_cond_init(&fullAvailable, NULL);
+}
+
+bufferRing::~bufferRing(void)
+{
+	for (unsigned i = 0; i < buffers.size(); i++)
+		delete [] buffers[i].data;
+
+	pthread_cond_destroy(&fullAvailable);
+	pthread_cond_destroy(&emptyAvailable);
+	pthread_mutex_destroy(&mutex);
+}
+
+inputBuffer_t *bufferRing::AcquireEmpty(void)
+{
+	inputBuffer_t *buffer = NULL;
+
+	pthread_mutex_lock(&mutex);
+	while (empty.empty() && !cancelled)
+		pthread_cond_wait(&emptyAvailable, &mutex);
+
+	if (!cancelled)
+	{
+		buffer = empty.front();
+		empty.pop_front();
+		buffer->length = 0;
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return buffer;
+}
+
+void bufferRing::Publish(inputBuffer_t *buffer)
+{
+	pthread_mutex_lock(&mutex);
+	full.push_back(buffer);
+	__atomic_store_n(&fullCount, full.size(), __ATOMIC_RELAXED);
+	pthread_cond_signal(&fullAvailable);
+	pthread_mutex_unlock(&mutex);
+}
+
+void bufferRing::Close(void)
+{
+	pthread_mutex_lock(&mutex);
+	closed = true;
+	pthread_cond_broadcast(&fullAvailable);
+	pthread_mutex_unlock(&mutex);
+}
+
+inputBuffer_t *bufferRing::AcquireFull(void)
+{
+	inputBuffer_t *buffer = NULL;
+
+	pthread_mutex_lock(&mutex);
+	if (full.empty() && !closed)
+	{
+		// the parser is starved: input is the bottleneck right now
+		struct timespec waitStart;
+		clock_gettime(CLOCK_MONOTONIC, &waitStart);
+
+		while (full.empty() && !closed)
+			pthread_cond_wait(&fullAvailable, &mutex);
+
+		consumerWaitNS += ElapsedNS(waitStart);
+	}
+
+	if (!full.empty())
+	{
+		buffer = full.front();
+		full.pop_front();
+		__atomic_store_n(&fullCount, full.size(), __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return buffer;
+}
+
+void bufferRing::Release(inputBuffer_t *buffer)
+{
+	pthread_mutex_lock(&mutex);
+	empty.push_back(buffer);
+	pthread_cond_signal(&emptyAvailable);
+	pthread_mutex_unlock(&mutex);
+}
+
+void bufferRing::Cancel(void)
+{
+	pthread_mutex_lock(&mutex);
+	cancelled = true;
+	pthread_cond_broadcast(&emptyAvailable);
+	pthread_mutex_unlock(&mutex);
+}
+
+
+/*
+ * inputDecoder
+ */
+
+inputDecoder::~inputDecoder(void)
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+ssize_t inputDecoder::ReadRaw(char *buf, size_t len)
+{
+	ssize_t n;
+
+	if (prefetchBytes)
+		Prefetch();
+
+	struct timespec readStart;
+	clock_gettime(CLOCK_MONOTONIC, &readStart);
+	do
+		n = read(fd, buf, len);
+	while (n < 0 && errno == EINTR);
+	ioWaitNS += ElapsedNS(readStart);
+
+	if (n > 0)
+		bytesIn += n;
+
+	return n;
+}
+
+void inputDecoder::StartPrefetch(size_t window)
+{
+	struct stat st;
+
+	// only regular files have a page cache to fill (not pipes, /dev/stdin, ...)
+	if (window == 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return;
+
+	// larger kernel read-ahead, and pages are dropped sooner once we are past them
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	fileSize = st.st_size;
+	prefetchBytes = window < PREFETCH_CHUNK ? PREFETCH_CHUNK : window;
+}
+
+// keep up to prefetchBytes requested ahead of the read position
+// WILLNEED only queues the reads, it doesn't wait for them
+void inputDecoder::Prefetch(void)
+{
+	unsigned long long limit = bytesIn + prefetchBytes;
+	if (limit > fileSize)
+		limit = fileSize;
+
+	while (prefetchedTo < limit)
+	{
+		posix_fadvise(fd, prefetchedTo, PREFETCH_CHUNK, POSIX_FADV_WILLNEED);
+		prefetchedTo += PREFETCH_CHUNK;
+	}
+}
+
+inputDecoder *inputDecoder::Open(const string &filename, size_t prefetchBytes)
+{
+	inputDecoder *decoder = OpenDecoder(filename);
+
+	if (decoder != NULL)
+		decoder->StartPrefetch(prefetchBytes);
+
+	return decoder;
+}
+
+inputDecoder *inputDecoder::OpenDecoder(const string &filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		cerr << "Unable to open replay file " << filename << ": " << strerror(errno) << "\n";
+		return NULL;
+	}
+
+	if (EndsWith(filename, ".gz"))
+		return new gzipDecoder(fd);
+
+	if (EndsWith(filename, ".zst"))
+	{
+#if defined(HAVE_ZSTD)
+		return new zstdDecoder(fd);
+#else
+		cerr << "Unable to read replay file " << filename << ": built without zstd support (-DHAVE_ZSTD)\n";
+		close(fd);
+		return NULL;
+#endif
+	}
+
+	return new plainDecoder(fd);
+}
+
+
+/*
+ * replayReader
+ */
+
+replayReader::replayReader(const vector<string> &files, unsigned bufferCount, size_t bufferSize,
+		size_t prefetch) :
+	filenames(files), prefetchBytes(prefetch),
+	ring(bufferCount < 2 ? 2 : bufferCount, bufferSize < MIN_BUFFER_SIZE ? MIN_BUFFER_SIZE : bufferSize),
+	threadStarted(false), current(NULL), pos(0),
+	bytesIn(0), bytesOut(0), decodeNS(0), ioWaitNS(0), producerWaitNS(0)
+{
+	bytesOutPerSecond.reserve(60*60);		// preallocate space for 1 hour of records
+	ioWaitPerSecond.reserve(60*60);
+	clock_gettime(CLOCK_MONOTONIC, &clockStart);
+
+	// start decompressing right away so the ring is full by the time the workers start
+	int err = pthread_create(&thread, NULL, ReaderThread, this);
+	if (err)
+		cerr << "ERROR creating replay reader thread: " << err << "\n";
+	else
+		threadStarted = true;
+}
+
+replayReader::~replayReader(void)
+{
+	Stop();
+}
+
+void replayReader::Stop(void)
+{
+	// unblock the reader thread in case the workers stopped early
+	ring.Cancel();
+
+	if (threadStarted)
+	{
+		pthread_join(thread, NULL);
+		threadStarted = false;
+	}
+}
+
+void *replayReader::ReaderThread(void *arg)
+{
+	((replayReader *) arg)->Run();
+
+	return NULL;
+}
+
+// add decompressed bytes to the per-second throughput record
+void replayReader::CountOutput(size_t bytes)
+{
+	unsigned long second = ElapsedNS(clockStart) / NS_PER_SECOND;
+
+	if (bytesOutPerSecond.size() <= second)
+		bytesOutPerSecond.resize(second + 1, 0);
+	bytesOutPerSecond[second] += bytes;
+
+	bytesOut += bytes;
+}
+
+// add time blocked on the file to the per-second I/O wait record
+void replayReader::CountIOWait(unsigned long long ns)
+{
+	unsigned long second = ElapsedNS(clockStart) / NS_PER_SECOND;
+
+	if (ioWaitPerSecond.size() <= second)
+		ioWaitPerSecond.resize(second + 1, 0);
+	ioWaitPerSecond[second] += ns;
+
+	ioWaitNS += ns;
+}
+
+void replayReader::Run(void)
+{
+	vector<char>	carry;		// partial line left over from the previous buffer
+	bool			cancelled = false;
+
+	for (vector<string>::const_iterator file = filenames.begin();
+			file != filenames.end() && !cancelled;
+			file++)
+	{
+		inputDecoder *decoder = inputDecoder::Open(*file, prefetchBytes);
+		if (decoder == NULL)
+			continue;
+
+		bool eof = false;
+		while (!eof)
+		{
+			struct timespec waitStart;
+			clock_gettime(CLOCK_MONOTONIC, &waitStart);
+			inputBuffer_t *buffer = ring.AcquireEmpty();
+			producerWaitNS += ElapsedNS(waitStart);
+
+			if (buffer == NULL)
+			{
+				cancelled = true;
+				break;
+			}
+
+			// start with whatever was left over from the last block
+			if (!carry.empty())
+				memcpy(buffer->data, &carry[0], carry.size());
+			buffer->length = carry.size();
+			carry.clear();
+
+			struct timespec decodeStart;
+			clock_gettime(CLOCK_MONOTONIC, &decodeStart);
+			while (buffer->length < buffer->capacity)
+			{
+				unsigned long long ioWaitBefore = decoder->IOWaitNS();
+				ssize_t n = decoder->Read(buffer->data + buffer->length, buffer->capacity - buffer->length);
+				CountIOWait(decoder->IOWaitNS() - ioWaitBefore);
+				if (n <= 0)
+				{
+					if (n < 0)
+						cerr << "Error reading replay file " << *file << ", skipping the rest of it\n";
+					eof = true;
+					break;
+				}
+				CountOutput(n);
+				buffer->length += n;
+			}
+			decodeNS += ElapsedNS(decodeStart);
+
+			if (eof)
+			{
+				// make sure the last line of a file is terminated (room was reserved for this)
+				if (buffer->length > 0 && buffer->data[buffer->length - 1] != '\n')
+					buffer->data[buffer->length++] = '\n';
+			}
+			else
+			{
+				// hold back the partial line at the end of the block
+				char *lastNewline = (char *) memrchr(buffer->data, '\n', buffer->length);
+				if (lastNewline != NULL)
+				{
+					char *tail = lastNewline + 1;
+					carry.assign(tail, buffer->data + buffer->length);
+					buffer->length = tail - buffer->data;
+				}
+				// else a single line longer than a buffer: pass it on split
+			}
+
+			if (buffer->length > 0)
+				ring.Publish(buffer);
+			else
+				ring.Release(buffer);
+		}
+
+		bytesIn += decoder->BytesIn();
+		delete decoder;
+	}
+
+	ring.Close();
+}
+
+bool replayReader::NextLine(string &line)
+{
+	while (current == NULL || pos >= current->length)
+	{
+		if (current != NULL)
+			ring.Release(current);
+
+		current = ring.AcquireFull();
+		pos = 0;
+
+		if (current == NULL)
+			return false;
+	}
+
+	const char *start = current->data + pos;
+	const char *newline = (const char *) memchr(start, '\n', current->length - pos);
+	size_t len = newline ? newline - start : current->length - pos;
+
+	line.assign(start, len);
+	pos += len + 1;
+
+	return true;
+}
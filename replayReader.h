@@ -0,0 +1,177 @@
+#ifndef REPLAY_READER_H
+#define REPLAY_READER_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+
+#include <boost/utility.hpp>
+
+/*
+ * Input side of the test harness
+ *
+ * A dedicated reader thread opens each replay file in turn, decompresses it
+ * if necessary (.gz always, .zst when built with -DHAVE_ZSTD) and fills a
+ * ring of large buffers.  The parser (dwfileHitSource) takes lines out of
+ * the full buffers, so decompression overlaps with hit processing.
+ *
+ * Every buffer handed to the parser ends on a line boundary; a partial line
+ * at the end of a block is carried over to the start of the next block.
+ *
+ * To keep a cold page cache from stalling the reader, each file is opened
+ * for sequential access and a bounded window ahead of the read position is
+ * handed to the kernel (POSIX_FADV_WILLNEED) in fixed size chunks, so the
+ * disk reads are in flight while the previous block is decompressed.  Time
+ * blocked in read(2) is recorded per second as I/O wait.
+ */
+
+// one block of decompressed replay data
+typedef struct
+{
+	char	*data;
+	size_t	capacity;		// usable bytes (one extra byte is allocated for a trailing newline)
+	size_t	length;			// bytes of valid data
+} inputBuffer_t;
+
+
+// bounded set of buffers passed between the reader thread and the parser
+// this class is explicitly not copyable
+class bufferRing : private boost::noncopyable
+{
+	public:
+		bufferRing(unsigned count, size_t size);
+		~bufferRing(void);
+
+		// producer side
+		inputBuffer_t *AcquireEmpty(void);		// blocks while every buffer is full, NULL once cancelled
+		void Publish(inputBuffer_t *buffer);
+		void Close(void);						// no more data will be published
+
+		// consumer side
+		inputBuffer_t *AcquireFull(void);		// blocks until data arrives, NULL once closed and drained
+		void Release(inputBuffer_t *buffer);
+		void Cancel(void);						// consumer is done, unblock the producer
+
+		// wall clock ns the consumer spent waiting for a full buffer
+		unsigned long long ConsumerWaitNS(void) const { return consumerWaitNS; }
+
+		// buffers waiting for the parser, safe to read from any thread
+		unsigned FullCount(void) const { return __atomic_load_n(&fullCount, __ATOMIC_RELAXED); }
+		unsigned Count(void) const { return buffers.size(); }
+
+	private:
+		std::vector<inputBuffer_t>	buffers;
+		std::deque<inputBuffer_t *>	empty;
+		std::deque<inputBuffer_t *>	full;
+		bool			closed;
+		bool			cancelled;
+		unsigned long long	consumerWaitNS;
+		unsigned		fullCount;		// full.size(), for readers outside the mutex
+
+		pthread_mutex_t	mutex;
+		pthread_cond_t	emptyAvailable;
+		pthread_cond_t	fullAvailable;
+};	// class bufferRing
+
+
+// source of raw (decompressed) bytes for a single replay file
+class inputDecoder : private boost::noncopyable
+{
+	public:
+		virtual ~inputDecoder(void);
+
+		// read up to len decompressed bytes, returns 0 at end of file, -1 on error
+		virtual ssize_t Read(char *buf, size_t len) = 0;
+
+		// compressed bytes consumed from the file so far
+		unsigned long long BytesIn(void) const { return bytesIn; }
+
+		// wall clock ns spent blocked in read(2) so far
+		unsigned long long IOWaitNS(void) const { return ioWaitNS; }
+
+		// pick a decoder from the file extension, NULL if the file can't be opened
+		// prefetchBytes is how far ahead of the read position to ask the kernel for data (0 = off)
+		static inputDecoder *Open(const std::string &filename, size_t prefetchBytes);
+
+	protected:
+		inputDecoder(int _fd) : fd(_fd), bytesIn(0), ioWaitNS(0), prefetchBytes(0), prefetchedTo(0), fileSize(0) {}
+
+		// read raw bytes from the file, counting them
+		ssize_t ReadRaw(char *buf, size_t len);
+
+		int					fd;
+		unsigned long long	bytesIn;
+		unsigned long long	ioWaitNS;
+
+	private:
+		static inputDecoder *OpenDecoder(const std::string &filename);
+		void StartPrefetch(size_t window);
+		void Prefetch(void);
+
+		// read-ahead window, bytesIn is the read position
+		size_t				prefetchBytes;
+		unsigned long long	prefetchedTo;
+		unsigned long long	fileSize;
+};	// class inputDecoder
+
+
+// runs the reader thread and hands out lines to the parser
+class replayReader : private boost::noncopyable
+{
+	public:
+		replayReader(const std::vector<std::string> &files, unsigned bufferCount, size_t bufferSize,
+				size_t prefetchBytes);
+		~replayReader(void);
+
+		// stop and join the reader thread, unconsumed input is discarded
+		void Stop(void);
+
+		// next line without the trailing newline, false when all files are exhausted
+		// NOT thread safe: callers serialize access (dwfileHitSource holds its read mutex)
+		bool NextLine(std::string &line);
+
+		// reader statistics, only meaningful once the reader has been stopped
+		unsigned long long BytesIn(void) const { return bytesIn; }			// compressed bytes read
+		unsigned long long BytesOut(void) const { return bytesOut; }		// decompressed bytes produced
+		unsigned long long DecodeNS(void) const { return decodeNS; }		// time spent reading and decompressing
+		unsigned long long IOWaitNS(void) const { return ioWaitNS; }		// part of DecodeNS blocked in read(2)
+		unsigned long long ProducerWaitNS(void) const { return producerWaitNS; }	// time the ring was full
+		unsigned long long ConsumerWaitNS(void) const { return ring.ConsumerWaitNS(); }
+		const std::vector<unsigned long> &BytesOutPerSecond(void) const { return bytesOutPerSecond; }
+		const std::vector<unsigned long> &IOWaitPerSecond(void) const { return ioWaitPerSecond; }	// in ns
+
+		// decompressed buffers waiting for the parser, and the ring size (any thread, any time)
+		unsigned QueuedBuffers(void) const { return ring.FullCount(); }
+		unsigned BufferCount(void) const { return ring.Count(); }
+
+	private:
+		static void *ReaderThread(void *arg);
+		void Run(void);
+		void CountOutput(size_t bytes);
+		void CountIOWait(unsigned long long ns);
+
+		std::vector<std::string>	filenames;
+		size_t			prefetchBytes;
+		bufferRing		ring;
+		pthread_t		thread;
+		bool			threadStarted;
+
+		// consumer state
+		inputBuffer_t	*current;
+		size_t			pos;
+
+		// producer statistics
+		unsigned long long	bytesIn;
+		unsigned long long	bytesOut;
+		unsigned long long	decodeNS;
+		unsigned long long	ioWaitNS;
+		unsigned long long	producerWaitNS;
+		struct timespec		clockStart;
+		std::vector<unsigned long>	bytesOutPerSecond;
+		std::vector<unsigned long>	ioWaitPerSecond;
+};	// class replayReader
+
+#endif // REPLAY_READER_H
@@ -0,0 +1,256 @@
+#include "runResults.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+
+#include <fstream>
+#include <sstream>
+
+using namespace std;
+
+namespace {
+	const unsigned RESULTS_VERSION = 1;
+
+	// the percentiles written for every latency
+	const double PERCENTILES[] = { 50, 90, 99, 99.9 };
+	const char *PERCENTILE_NAMES[] = { "p50", "p90", "p99", "p99_9" };
+	const unsigned PERCENTILE_COUNT = sizeof(PERCENTILES) / sizeof(PERCENTILES[0]);
+
+	string ToText(double value)
+	{
+		ostringstream os;
+		os.precision(15);		// whole seconds since the epoch stay whole
+		os << value;
+		return os.str();
+	}
+
+	// CSV field, quoted only when it has to be
+	string CSVField(const string &s)
+	{
+		if (s.find_first_of(",\"\n") == string::npos)
+			return s;
+
+		string out = "\"";
+		for (string::size_type i = 0; i < s.length(); i++)
+		{
+			if (s[i] == '"')
+				out += '"';
+			out += s[i];
+		}
+		return out + "\"";
+	}
+
+	void CSVRow(ostream &os, const char *section, const string &name, const string &second, const string &value)
+	{
+		os << section << "," << CSVField(name) << "," << second << "," << CSVField(value) << "\n";
+	}
+
+	// first "model name" line of /proc/cpuinfo
+	string CPUModel(void)
+	{
+		ifstream in("/proc/cpuinfo");
+		string line;
+		while (getline(in, line))
+		{
+			if (line.compare(0, 10, "model name") == 0)
+			{
+				string::size_type colon = line.find(':');
+				if (colon != string::npos)
+					return line.substr(line.find_first_not_of(" \t", colon + 1));
+			}
+		}
+		return "unknown";
+	}
+}
+
+
+string JSONQuote(const string &s)
+{
+	string out = "\"";
+	for (string::size_type i = 0; i < s.length(); i++)
+	{
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\')
+		{
+			out += '\\';
+			out += c;
+		}
+		else if (c < 0x20)
+		{
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			out += escaped;
+		}
+		else
+			out += c;
+	}
+	return out + "\"";
+}
+
+
+void runResults::Config(const string &name, const string &value)
+{
+	config.push_back(make_pair(name, value));
+}
+
+void runResults::Run(const string &name, const string &value)
+{
+	run.push_back(make_pair(name, value));
+	runIsNumber.push_back(false);
+}
+
+void runResults::Run(const string &name, double value)
+{
+	run.push_back(make_pair(name, ToText(value)));
+	runIsNumber.push_back(true);
+}
+
+void runResults::Series(const string &name, const vector<unsigned long> &values)
+{
+	series.push_back(make_pair(name, values));
+}
+
+void runResults::Latency(const string &name, const hdrHistogram &histogram)
+{
+	latency.push_back(make_pair(name, histogram));
+}
+
+void runResults::StoreStats(const map<string, unsigned long long> &stats)
+{
+	storeStats = stats;
+}
+
+void runResults::CollectEnvironment(void)
+{
+	char hostname[256];
+	if (gethostname(hostname, sizeof(hostname)) == 0)
+	{
+		hostname[sizeof(hostname) - 1] = 0;
+		environment.push_back(make_pair("hostname", string(hostname)));
+	}
+
+	environment.push_back(make_pair("cpu_model", CPUModel()));
+	environment.push_back(make_pair("cpus", ToText(sysconf(_SC_NPROCESSORS_ONLN))));
+
+	struct utsname un;
+	if (uname(&un) == 0)
+		environment.push_back(make_pair("kernel",
+				string(un.sysname) + " " + un.release + " " + un.version + " " + un.machine));
+
+#if defined(__VERSION__)
+	environment.push_back(make_pair("compiler", string(__VERSION__)));
+#endif
+#if defined(BUILD_FLAGS)
+	environment.push_back(make_pair("build_flags", string(BUILD_FLAGS)));
+#endif
+#if defined(__OPTIMIZE__)
+	environment.push_back(make_pair("optimized", string("yes")));
+#else
+	environment.push_back(make_pair("optimized", string("no")));
+#endif
+}
+
+bool runResults::Write(const string &filename, const string &format) const
+{
+	bool csv = format == "csv" ||
+			(format.empty() && filename.length() >= 4 && filename.compare(filename.length() - 4, 4, ".csv") == 0);
+
+	ofstream out(filename.c_str());
+	if (csv)
+		WriteCSV(out);
+	else
+		WriteJSON(out);
+	out.close();
+
+	return !out.fail();
+}
+
+void runResults::WriteJSON(ostream &os) const
+{
+	os << "{\n";
+	os << "  \"version\": " << RESULTS_VERSION << ",\n";
+
+	os << "  \"run\": {";
+	for (unsigned i = 0; i < run.size(); i++)
+		os << (i ? ", " : " ") << JSONQuote(run[i].first) << ": "
+			<< (runIsNumber[i] ? run[i].second : JSONQuote(run[i].second));
+	os << " },\n";
+
+	os << "  \"config\": {";
+	for (unsigned i = 0; i < config.size(); i++)
+		os << (i ? ",\n    " : "\n    ") << JSONQuote(config[i].first) << ": " << JSONQuote(config[i].second);
+	os << "\n  },\n";
+
+	os << "  \"environment\": {";
+	for (unsigned i = 0; i < environment.size(); i++)
+		os << (i ? ",\n    " : "\n    ") << JSONQuote(environment[i].first) << ": " << JSONQuote(environment[i].second);
+	os << "\n  },\n";
+
+	os << "  \"per_second\": {";
+	for (unsigned i = 0; i < series.size(); i++)
+	{
+		os << (i ? ",\n    " : "\n    ") << JSONQuote(series[i].first) << ": [";
+		const vector<unsigned long> &values = series[i].second;
+		for (unsigned j = 0; j < values.size(); j++)
+			os << (j ? ", " : "") << values[j];
+		os << "]";
+	}
+	os << "\n  },\n";
+
+	os << "  \"latency_ns\": {";
+	for (unsigned i = 0; i < latency.size(); i++)
+	{
+		const hdrHistogram &h = latency[i].second;
+		os << (i ? ",\n    " : "\n    ") << JSONQuote(latency[i].first) << ": { \"count\": " << h.Count()
+			<< ", \"min\": " << h.Min();
+		for (unsigned p = 0; p < PERCENTILE_COUNT; p++)
+			os << ", \"" << PERCENTILE_NAMES[p] << "\": " << h.ValueAtPercentile(PERCENTILES[p]);
+		os << ", \"max\": " << h.Max();
+
+		// the buckets in the histogram-file form, so results can be merged later
+		ostringstream buckets;
+		h.Write(buckets);
+		string text = buckets.str();
+		os << ", \"hdr\": " << JSONQuote(text.substr(0, text.length() - 1)) << " }";
+	}
+	os << "\n  },\n";
+
+	os << "  \"store\": {";
+	for (map<string, unsigned long long>::const_iterator s = storeStats.begin(); s != storeStats.end(); s++)
+		os << (s == storeStats.begin() ? " " : ", ") << JSONQuote(s->first) << ": " << s->second;
+	os << " }\n";
+
+	os << "}\n";
+}
+
+void runResults::WriteCSV(ostream &os) const
+{
+	os << "section,name,second,value\n";
+
+	for (unsigned i = 0; i < run.size(); i++)
+		CSVRow(os, "run", run[i].first, "", run[i].second);
+	for (unsigned i = 0; i < config.size(); i++)
+		CSVRow(os, "config", config[i].first, "", config[i].second);
+	for (unsigned i = 0; i < environment.size(); i++)
+		CSVRow(os, "environment", environment[i].first, "", environment[i].second);
+
+	for (unsigned i = 0; i < series.size(); i++)
+		for (unsigned j = 0; j < series[i].second.size(); j++)
+			CSVRow(os, "per_second", series[i].first, ToText(j), ToText(series[i].second[j]));
+
+	for (unsigned i = 0; i < latency.size(); i++)
+	{
+		const hdrHistogram &h = latency[i].second;
+		const string &name = latency[i].first;
+
+		CSVRow(os, "latency_ns", name + ".count", "", ToText(h.Count()));
+		CSVRow(os, "latency_ns", name + ".min", "", ToText(h.Min()));
+		for (unsigned p = 0; p < PERCENTILE_COUNT; p++)
+			CSVRow(os, "latency_ns", name + "." + PERCENTILE_NAMES[p], "", ToText(h.ValueAtPercentile(PERCENTILES[p])));
+		CSVRow(os, "latency_ns", name + ".max", "", ToText(h.Max()));
+	}
+
+	for (map<string, unsigned long long>::const_iterator s = storeStats.begin(); s != storeStats.end(); s++)
+		CSVRow(os, "store", s->first, "", ToText(s->second));
+}
@@ -0,0 +1,71 @@
+#ifndef RUN_RESULTS_H
+#define RUN_RESULTS_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <utility>
+#include <ostream>
+
+#include "hdrHistogram.h"
+
+/*
+ * Machine readable results of a run (results-file=)
+ *
+ * main collects the config, the per-second series it already prints,
+ * the latency histograms, the store's own counters and a description of
+ * the machine, then writes them as one JSON document or as CSV in long
+ * form (section,name,second,value), so nothing has to scrape the console
+ * output.
+ *
+ * Live progress for long runs is streamed separately, one JSON object per
+ * interval (results-stream=, see the harness).
+ */
+
+class runResults
+{
+	public:
+		runResults(void) {}
+
+		// one config option, in the order given
+		void Config(const std::string &name, const std::string &value);
+
+		// about the run: engine, host, start time, ...
+		void Run(const std::string &name, const std::string &value);
+		void Run(const std::string &name, double value);
+
+		// a value for each second of the run
+		void Series(const std::string &name, const std::vector<unsigned long> &values);
+
+		// a latency distribution (the percentile summary is written, and the buckets)
+		void Latency(const std::string &name, const hdrHistogram &histogram);
+
+		// counters reported by the store (VCookieStore::GetStats)
+		void StoreStats(const std::map<std::string, unsigned long long> &stats);
+
+		// CPU model, kernel, compiler, ...
+		void CollectEnvironment(void);
+
+		// format is "json" or "csv", empty picks from the file name; false if it couldn't be written
+		bool Write(const std::string &filename, const std::string &format) const;
+
+		void WriteJSON(std::ostream &os) const;
+		void WriteCSV(std::ostream &os) const;
+
+	private:
+		typedef std::vector<std::pair<std::string, std::string> >	textList_t;
+
+		textList_t		config;
+		textList_t		run;				// values already formatted, numbers unquoted
+		std::vector<bool>	runIsNumber;
+		textList_t		environment;
+		std::vector<std::pair<std::string, std::vector<unsigned long> > >	series;
+		std::vector<std::pair<std::string, hdrHistogram> >	latency;
+		std::map<std::string, unsigned long long>	storeStats;
+};	// class runResults
+
+
+// JSON string literal for s, shared with the workload profile (--profile)
+std::string JSONQuote(const std::string &s);
+
+#endif // RUN_RESULTS_H
@@ -0,0 +1,17 @@
+// the engines and decorators that need nothing outside this tree, registered
+// by name (VCCouchbaseStore.cc, VCMemcachedStore.cc, VCStoreCache.cc and
+// VCStoreWriteBehind.cc register their own)
+
+#include "abstraction/vcengineregistry.h"
+#include "VCStoreInMemory.h"
+#include "VCStoreNOP.h"
+#include "VCStoreCounting.h"
+
+VC_REGISTER_ENGINE(VCStoreNOP, "nop", 0,
+	"does nothing, loads always miss: the harness's own overhead");
+
+VC_REGISTER_ENGINE(VCStoreInMemory, "memory", VC_ENGINE_PERSISTS | VC_ENGINE_ENUMERATES | VC_ENGINE_PURGES,
+	"std::map of serialized cookies, one per thread");
+
+VC_REGISTER_DECORATOR(VCStoreCounting, "counting", VCStoreCounting::Create, NULL,
+	"counts the calls that reach the store under it, in the store stats");
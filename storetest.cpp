@@ -0,0 +1,1551 @@
+/*
+ * Conformance tests and standard benchmarks for every storage engine
+ *
+ * Runs the same checks and the same workloads against each engine linked
+ * in (see abstraction/vcengineregistry.h), so engines are compared on
+ * equal terms in one run:
+ *
+ *	./storetest                       every engine, tests then benchmarks
+ *	./storetest --engine memory --no-bench
+ *	./storetest --engine memory --decorator counting
+ *	./storetest --plugin ./couchbase_engine.so --engine couchbase --set couchbase.host=cb1:8091
+ *	./storetest --engine memcached --mock-error-rate 0.05
+ *	./storetest --list
+ *
+ * The tests an engine can't pass by design (NOP keeps nothing, Couchbase
+ * can't enumerate or purge) are skipped according to the capabilities it
+ * registered with.  Each test and each scenario gets a new store.
+ *
+ * Without --engine or --decorator, the decorators that keep cookies of
+ * their own are tested over the in-memory engine too (cache+memory,
+ * writebehind+memory), and each decorator's own tests (admission,
+ * expiry...) are run.  They run with --decorator as well, for the
+ * decorators it names.
+ *
+ * Unless --set memcached.host= says where a server is, the memcached
+ * engine is tested against a stand-in server (memcachedMock.h) started
+ * in this process, with the faults the --mock options ask for.
+ *
+ * Exits 1 if any test failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/wait.h>
+
+#include "abstraction/vcookiestore.h"
+#include "abstraction/vcookie.h"
+#include "abstraction/vcengineregistry.h"
+#include "abstraction/vcstoredecorator.h"
+#include "hdrHistogram.h"
+#include "hiResClock.h"
+#include "memcachedMock.h"
+
+#include <iostream>
+#include <sstream>
+#include <set>
+#include <algorithm>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/tuple/tuple.hpp>
+#include <boost/tuple/tuple_comparison.hpp>
+
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+using namespace std;
+
+namespace {
+	typedef struct
+	{
+		vector<string>	engines;
+		vector<string>	decorators;		// over every engine, innermost first
+		vector<string>	plugins;
+		vector<string>	settings;		// <engine or decorator>.<option>=<value>
+		bool			list;
+		bool			noTests;
+		bool			noBench;
+		double			seconds;		// per scenario
+		unsigned		visitors;		// preloaded before each scenario
+		unsigned		seed;
+		unsigned		window;			// pipelined scenario
+		vector<unsigned>	batchSizes;	// a batch scenario for each
+		memcachedMock::faults_t	mock;	// of the stand-in memcached server
+	} options_t;
+
+	options_t options;
+
+	const time_t BASE_TIME = 1350000000;
+
+	// an engine with decorators over it
+	typedef struct
+	{
+		string			name;			// "counting+memory"
+		string			engine;
+		vector<string>	decorators;		// innermost first
+		unsigned		capabilities;	// the engine's, decorators don't change them
+		VCStackOptions	options;
+	} storeStack_t;
+
+	// tested too when no --engine or --decorator is given, so the decorators
+	// that keep cookies of their own are held to the same checks
+	const char *const DECORATED_STACKS[][2] = {
+		// decorator, engine
+		{ "cache",		"memory" },
+		{ "writebehind",	"memory" },
+	};
+
+	VCookieStore *NewStore(const storeStack_t &stack)
+	{
+		return VCEngineRegistry::Create(stack.engine, stack.decorators, stack.options);
+	}
+
+
+	// a cookie with something in every field, different for each seed
+	void FillVCookie(VCookie &vc, unsigned seed)
+	{
+		ostringstream text;
+		text << seed;
+		time_t t = BASE_TIME + seed;
+
+		vc.SetFirstHitTimeGMT(t - 100000);
+		vc.SetLastHitTimeGMT(t);
+		vc.SetLastHitTimeVisitorLocal(t - 7*60*60);
+		vc.SetLastVisitNum(seed % 1000 + 1);
+
+		vc.SetLastPurchaseTimeGMT(t - 10000);
+		vc.SetFirstHitReferrer("http://www.example.com/ref/" + text.str());
+		vc.SetFirstHitUrl("http://www.acme.com/a/b/d/" + text.str() + ".html");
+		vc.SetFirstHitPagename("Page " + text.str());
+		vc.SetLastPurchaseNum(seed % 7);
+		vc.SetMerchandising("merch;" + text.str());
+
+		for (unsigned i = 0; i < 1 + seed % 6; i++)
+		{
+			ostringstream pid;
+			pid << "pid" << seed << "." << i;
+			vc.SetPurchaseId(pid.str());
+		}
+
+		for (unsigned i = 0; i < 4 + seed % 8; i++)
+		{
+			ostringstream value;
+			value << "var" << i << "." << seed;
+			VCookie::RelationId rid = (VCookie::RelationId)((seed + i * 7) % 75);
+			vc.SetVar(rid, value.str(), t + i, (unsigned char) i, i % 3 ? ALLOC_TYPE_LAST : ALLOC_TYPE_LINEAR, 5);
+		}
+	}
+
+
+	/*
+	 * Conformance tests
+	 */
+
+	#define CHECK(condition) \
+		do { if (!(condition)) { failure = #condition; return false; } } while (0)
+
+	// callbacks from the batch calls are plain functions, they count here
+	struct
+	{
+		unsigned				calls;
+		unsigned				successes;
+		set<const VCookie *>	seen;
+	} tally;
+
+	void Tally(bool success, const VCookie &vcookie)
+	{
+		tally.calls++;
+		if (success)
+			tally.successes++;
+		tally.seen.insert(&vcookie);
+	}
+
+	void ResetTally(void)
+	{
+		tally.calls = tally.successes = 0;
+		tally.seen.clear();
+	}
+
+	// a visitor no test saves
+	bool TestMissing(VCookieStore &store, unsigned capabilities, string &failure)
+	{
+		VCookie vc(1, 0xdead, 0xbeef, false, store);
+		CHECK(vc.IsNewCookie());
+		CHECK(!vc.IsModified());
+		CHECK(!store.DeleteVCookie(vc));
+		return true;
+	}
+
+	bool TestRoundTrip(VCookieStore &store, unsigned capabilities, string &failure)
+	{
+		VCookie saved(12345, 6789, 9876, true, store);
+		FillVCookie(saved, 1);
+		CHECK(saved.Store());
+
+		VCookie loaded(12345, 6789, 9876, false, store);
+		CHECK(!loaded.IsNewCookie());
+		CHECK(!loaded.IsModified());
+		CHECK(loaded == saved);
+		CHECK(loaded.GetLastHitTimeVisitorLocal() == saved.GetLastHitTimeVisitorLocal());
+		CHECK(loaded.GetLastPurchaseTimeGMT() == saved.GetLastPurchaseTimeGMT());
+		return true;
+	}
+
+	bool TestOverwrite(VCookieStore &store, unsigned capabilities, string &failure)
+	{
+		VCookie first(12345, 6789, 9876, true, store);
+		FillVCookie(first, 1);
+		CHECK(first.Store());
+
+		VCookie second(12345, 6789, 9876, true, store);
+		FillVCookie(second, 2);
+		CHECK(second.Store());
+
+		VCookie loaded(12345, 6789, 9876, false, store);
+		CHECK(loaded == second);
+		CHECK(loaded != first);
+		if (capabilities & VC_ENGINE_ENUMERATES)
+			CHECK(store.GetVCookieCount() == 1);
+		return true;
+	}
+
+	// ids that share all but one part must not collide
+	bool TestDistinctKeys(VCookieStore &store, unsigned capabilities, string &failure)
+	{
+		const unsigned long long ids[][3] = {
+			{ 1, 2, 3 }, { 1, 2, 4 }, { 1, 3, 3 }, { 2, 2, 3 }, { 1, 3, 2 }, { 2, 1, 3 },
+			{ 3, 1, 1 }, { 1, 0, 0 }, { 0, 0, 1 }, { 1, 0x123456789abcdefULL, 0xfedcba9876543210ULL }
+		};
+		const unsigned count = sizeof(ids) / sizeof(ids[0]);
+
+		for (unsigned i = 0; i < count; i++)
+		{
+			VCookie vc((unsigned) ids[i][0], ids[i][1], ids[i][2], true, store);
+			FillVCookie(vc, i);
+			CHECK(vc.Store());
+		}
+
+		for (unsigned i = 0; i < count; i++)
+		{
+			VCookie vc((unsigned) ids[i][0], ids[i][1], ids[i][2], false, store);
+			CHECK(!vc.IsNewCookie());
+			CHECK(vc.GetLastVisitNum() == i % 1000 + 1);
+		}
+		if (capabilities & VC_ENGINE_ENUMERATES)
+			CHECK(store.GetVCookieCount() == count);
+		return true;
+	}
+
+	bool TestDelete(VCookieStore &store, unsigned capabilities, string &failure)
+	{
+		{
+			VCookie vc(12345, 6789, 9876, true, store);
+			FillVCookie(vc, 1);
+			CHECK(vc.Store());
+		}
+
+		VCookie vc(12345, 6789, 9876, false, store);
+		CHECK(!vc.IsNewCookie());
+		CHECK(store.DeleteVCookie(vc));
+		CHECK(!store.DeleteVCookie(vc));
+
+		VCookie gone(12345, 6789, 9876, false, store);
+		CHECK(gone.IsNewCookie());
+		if (capabilities & VC_ENGINE_ENUMERATES)
+			CHECK(store.GetVCookieCount() == 0);
+		return true;
+	}
+
+	bool TestDeleteOld(VCookieStore &store, unsigned capabilities, string &failure)
+	{
+		// every other cookie is older than the cut
+		for (unsigned i = 0; i < 100; i++)
+		{
+			VCookie vc(12345, 6789 + i, 9876 - i, true, store);
+			vc.SetLastHitTimeGMT(BASE_TIME + (i % 2 ? 1000 : -1000) + i);
+			CHECK(vc.Store());
+		}
+
+		CHECK(store.DeleteOldVCookies(BASE_TIME) == 50);
+		CHECK(store.DeleteOldVCookies(BASE_TIME) == 0);
+
+		for (unsigned i = 0; i < 100; i++)
+		{
+			VCookie vc(12345, 6789 + i, 9876 - i, false, store);
+			CHECK(vc.IsNewCookie() == (i % 2 == 0));
+		}
+		if (capabilities & VC_ENGINE_ENUMERATES)
+			CHECK(store.GetVCookieCount() == 50);
+		return true;
+	}
+
+	bool TestEnumerate(VCookieStore &store, unsigned capabilities, string &failure)
+	{
+		const unsigned count = 20;
+		for (unsigned i = 0; i < count; i++)
+		{
+			VCookie vc(100 + i % 3, i, count - i, true, store);
+			FillVCookie(vc, i);
+			CHECK(vc.Store());
+		}
+		CHECK(store.GetVCookieCount() == count);
+
+		set<boost::tuple<unsigned, unsigned long long, unsigned long long> > found;
+		for (unsigned i = 0; i < count; i++)
+		{
+			VCookie vc(0, 0, 0, true, store);
+			CHECK(store.GetVCookie(vc, i));
+			found.insert(boost::make_tuple(vc.GetUser(), vc.GetVisIdHigh(), vc.GetVisIdLow()));
+			CHECK(vc.GetLastVisitNum() == vc.GetVisIdHigh() % 1000 + 1);
+
+			VCookie loaded(vc.GetUser(), vc.GetVisIdHigh(), vc.GetVisIdLow(), false, store);
+			CHECK(loaded == vc);
+		}
+		CHECK(found.size() == count);
+
+		VCookie vc(0, 0, 0, true, store);
+		CHECK(!store.GetVCookie(vc, count));
+		return true;
+	}
+
+	// every engine must call back once per cookie, with the cookie it was given
+	bool TestBatchSave(VCookieStore &store, unsigned capabilities, string &failure)
+	{
+		const unsigned count = 50;
+		vector<VCookie *> owned;
+		vector<const VCookie *> batch;
+		for (unsigned i = 0; i < count; i++)
+		{
+			owned.push_back(new VCookie(500, i, i * 3, true, store));
+			FillVCookie(*owned.back(), i);
+			batch.push_back(owned.back());
+		}
+
+		ResetTally();
+		store.SaveVCookies(batch, Tally);
+
+		bool ok = true;
+		if (tally.calls != count || tally.seen.size() != count || tally.successes != count)
+		{
+			failure = "tally.calls == count && tally.seen.size() == count && tally.successes == count";
+			ok = false;
+		}
+
+		for (unsigned i = 0; ok && (capabilities & VC_ENGINE_PERSISTS) && i < count; i++)
+		{
+			VCookie loaded(500, i, i * 3, false, store);
+			if (loaded != *owned[i])
+			{
+				failure = "loaded == *owned[i]";
+				ok = false;
+			}
+		}
+
+		for (unsigned i = 0; i < count; i++)
+			delete owned[i];
+		return ok;
+	}
+
+	// the last cookie in the batch was never saved
+	bool TestBatchLoad(VCookieStore &store, unsigned capabilities, string &failure)
+	{
+		const unsigned count = 50;
+		vector<VCookie *> saved, owned;
+		for (unsigned i = 0; i < count; i++)
+		{
+			saved.push_back(new VCookie(600, i, i * 5, true, store));
+			FillVCookie(*saved.back(), i);
+			saved.back()->Store();
+		}
+
+		vector<VCookie *> batch;
+		for (unsigned i = 0; i <= count; i++)
+		{
+			owned.push_back(new VCookie(600, i, i * 5, true, store));
+			batch.push_back(owned.back());
+		}
+
+		ResetTally();
+		store.LoadVCookies(batch, Tally);
+
+		bool ok = true;
+		unsigned expected = capabilities & VC_ENGINE_PERSISTS ? count : 0;
+		if (tally.calls != count + 1 || tally.seen.size() != count + 1 || tally.successes != expected)
+		{
+			failure = "tally.calls == count + 1 && tally.seen.size() == count + 1 && tally.successes == expected";
+			ok = false;
+		}
+
+		for (unsigned i = 0; ok && (capabilities & VC_ENGINE_PERSISTS) && i < count; i++)
+		{
+			if (*owned[i] != *saved[i])
+			{
+				failure = "*owned[i] == *saved[i]";
+				ok = false;
+			}
+		}
+
+		for (unsigned i = 0; i < saved.size(); i++)
+			delete saved[i];
+		for (unsigned i = 0; i < owned.size(); i++)
+			delete owned[i];
+		return ok;
+	}
+
+	// completions of the Submit calls count here, context is the cookie's index
+	struct
+	{
+		unsigned		calls;
+		unsigned		successes;
+		vector<bool>	done;
+	} completions;
+
+	void Completed(bool success, VCookie &vcookie, void *context)
+	{
+		completions.calls++;
+		if (success)
+			completions.successes++;
+		completions.done[(size_t) context] = true;
+	}
+
+	void ResetCompletions(unsigned count)
+	{
+		completions.calls = completions.successes = 0;
+		completions.done.assign(count, false);
+	}
+
+	// cookies made for a test, deleted (and so saved if modified) with it
+	class ownedCookies : public vector<VCookie *>
+	{
+		public:
+			~ownedCookies(void)
+			{
+				for (unsigned i = 0; i < size(); i++)
+					delete (*this)[i];
+			}
+	};	// class ownedCookies
+
+	// every engine must complete each submitted save once, by the time Wait returns
+	bool TestSubmitSave(VCookieStore &store, unsigned capabilities, string &failure)
+	{
+		const unsigned count = 50;
+		ownedCookies cookies;
+		ResetCompletions(count);
+		for (unsigned i = 0; i < count; i++)
+		{
+			cookies.push_back(new VCookie(800, i, i * 7, true, store));
+			FillVCookie(*cookies.back(), i);
+			CHECK(store.SubmitSave(*cookies.back(), Completed, (void *)(size_t) i));
+		}
+		store.Wait();
+
+		CHECK(store.Outstanding() == 0);
+		CHECK(completions.calls == count);
+		CHECK(completions.successes == count);
+		CHECK(find(completions.done.begin(), completions.done.end(), false) == completions.done.end());
+
+		for (unsigned i = 0; (capabilities & VC_ENGINE_PERSISTS) && i < count; i++)
+		{
+			VCookie loaded(800, i, i * 7, false, store);
+			CHECK(loaded == *cookies[i]);
+		}
+		return true;
+	}
+
+	// the last cookie was never saved; completed with Poll rather than Wait
+	bool TestSubmitLoad(VCookieStore &store, unsigned capabilities, string &failure)
+	{
+		const unsigned count = 50;
+		ownedCookies saved, loaded;
+		for (unsigned i = 0; i < count; i++)
+		{
+			saved.push_back(new VCookie(900, i, i * 11, true, store));
+			FillVCookie(*saved.back(), i);
+			CHECK(saved.back()->Store());
+		}
+
+		ResetCompletions(count + 1);
+		for (unsigned i = 0; i <= count; i++)
+		{
+			loaded.push_back(new VCookie(900, i, i * 11, true, store));
+			CHECK(store.SubmitLoad(*loaded.back(), Completed, (void *)(size_t) i));
+		}
+		for (unsigned polls = 0; store.Outstanding() && polls < 1000000; polls++)
+			store.Poll();
+
+		CHECK(store.Outstanding() == 0);
+		CHECK(completions.calls == count + 1);
+		CHECK(completions.successes == (capabilities & VC_ENGINE_PERSISTS ? count : 0));
+		CHECK(find(completions.done.begin(), completions.done.end(), false) == completions.done.end());
+
+		CHECK(loaded[count]->IsNewCookie());
+		for (unsigned i = 0; i < count; i++)
+		{
+			CHECK(!loaded[i]->IsModified());
+			CHECK(loaded[i]->IsNewCookie() == !(capabilities & VC_ENGINE_PERSISTS));
+			if (capabilities & VC_ENGINE_PERSISTS)
+				CHECK(*loaded[i] == *saved[i]);
+		}
+		return true;
+	}
+
+	// the same visitor twice in a batch: each copy is called back once and
+	// loaded, whatever order the engine gets the answers in
+	bool TestBatchRepeats(VCookieStore &store, unsigned capabilities, string &failure)
+	{
+		const unsigned count = 10;
+		ownedCookies saved, loaded;
+		for (unsigned i = 0; i < count; i++)
+		{
+			saved.push_back(new VCookie(650, i, i * 7, true, store));
+			FillVCookie(*saved.back(), i);
+			saved.back()->Store();
+		}
+
+		vector<VCookie *> batch;
+		for (unsigned i = 0; i < 2 * count; i++)
+		{
+			loaded.push_back(new VCookie(650, i % count, (i % count) * 7, true, store));
+			batch.push_back(loaded.back());
+		}
+
+		ResetTally();
+		store.LoadVCookies(batch, Tally);
+
+		CHECK(tally.calls == 2 * count);
+		CHECK(tally.seen.size() == 2 * count);
+		CHECK(tally.successes == (capabilities & VC_ENGINE_PERSISTS ? 2 * count : 0));
+		for (unsigned i = 0; (capabilities & VC_ENGINE_PERSISTS) && i < 2 * count; i++)
+			CHECK(*loaded[i] == *saved[i % count]);
+		return true;
+	}
+
+	// two copies of a visitor loaded before either is saved: with an engine
+	// that merges, the second save keeps the first one's changes (passes
+	// trivially for the engines where the last save wins)
+	bool TestMergeWriters(VCookieStore &store, unsigned capabilities, string &failure)
+	{
+		if (!store.KeepsMutationLog())
+			return true;
+
+		{
+			VCookie vc(750, 1, 2, true, store);
+			FillVCookie(vc, 3);
+			CHECK(vc.Store());
+		}
+
+		VCookie a(750, 1, 2, false, store);
+		VCookie b(750, 1, 2, false, store);
+		CHECK(!a.IsNewCookie() && !b.IsNewCookie());
+		unsigned purchases = a.GetLastPurchaseNum();
+		unsigned elements = a.GetVarElementCount(70);
+
+		a.SetLastHitTimeGMT(BASE_TIME + 200);
+		a.AddLastPurchaseNum(1);
+		a.SetPurchaseId("a");
+		a.SetVar(70, "a", BASE_TIME + 200, 1, ALLOC_TYPE_LINEAR, MAX_LINEAR_INFINITE);
+		CHECK(a.Store());
+
+		b.SetLastHitTimeGMT(BASE_TIME + 100);
+		b.AddLastPurchaseNum(1);
+		b.SetPurchaseId("b");
+		b.SetVar(70, "b", BASE_TIME + 100, 1, ALLOC_TYPE_LINEAR, MAX_LINEAR_INFINITE);
+		CHECK(b.Store());
+
+		VCookie loaded(750, 1, 2, false, store);
+		CHECK(loaded == b);
+		CHECK(loaded.GetLastHitTimeGMT() == BASE_TIME + 200);
+		CHECK(loaded.GetLastPurchaseNum() == purchases + 2);
+		CHECK(loaded.GetVarElementCount(70) == elements + 2);
+		unsigned ids = loaded.GetPurchaseIdCount();
+		CHECK(loaded.GetPurchaseId(ids - 2) == "a" && loaded.GetPurchaseId(ids - 1) == "b");
+		return true;
+	}
+
+	typedef struct
+	{
+		const char	*name;
+		unsigned	needs;			// VCEngineCapability bits, skipped without them
+		bool		(*test)(VCookieStore &store, unsigned capabilities, string &failure);
+	} conformanceTest_t;
+
+	const conformanceTest_t TESTS[] = {
+		{ "missing",		0,						TestMissing },
+		{ "roundTrip",		VC_ENGINE_PERSISTS,		TestRoundTrip },
+		{ "overwrite",		VC_ENGINE_PERSISTS,		TestOverwrite },
+		{ "distinctKeys",	VC_ENGINE_PERSISTS,		TestDistinctKeys },
+		{ "delete",			VC_ENGINE_PERSISTS,		TestDelete },
+		{ "deleteOld",		VC_ENGINE_PURGES,		TestDeleteOld },
+		{ "enumerate",		VC_ENGINE_ENUMERATES,	TestEnumerate },
+		{ "batchSave",		0,						TestBatchSave },
+		{ "batchLoad",		0,						TestBatchLoad },
+		{ "batchRepeats",	0,						TestBatchRepeats },
+		{ "submitSave",		0,						TestSubmitSave },
+		{ "submitLoad",		0,						TestSubmitLoad },
+		{ "mergeWriters",	VC_ENGINE_PERSISTS,		TestMergeWriters },
+	};
+
+	// number of failures
+	unsigned RunTests(const storeStack_t &engine)
+	{
+		unsigned failed = 0;
+		for (unsigned i = 0; i < sizeof(TESTS) / sizeof(TESTS[0]); i++)
+		{
+			const conformanceTest_t &test = TESTS[i];
+			printf("%-20s %-14s ", engine.name.c_str(), test.name);
+
+			if ((engine.capabilities & test.needs) != test.needs)
+			{
+				printf("skip\n");
+				continue;
+			}
+
+			boost::scoped_ptr<VCookieStore> store(NewStore(engine));
+			string failure = "the store can't be created";
+			if (store && test.test(*store, engine.capabilities, failure))
+				printf("pass\n");
+			else
+			{
+				printf("FAIL: %s\n", failure.c_str());
+				failed++;
+			}
+			fflush(stdout);
+		}
+		return failed;
+	}
+
+
+	/*
+	 * Decorator tests
+	 *
+	 * What a decorator does beyond passing the conformance tests, each
+	 * test over a new in-memory store with the options it needs.
+	 */
+
+	// the decorator over the in-memory engine, or over inner if one is
+	// given (it's the decorator's then); settings are "<option>=<value>"
+	VCookieStore *NewDecorated(const string &decorator, const char *const settings[],
+		VCookieStore *inner = NULL)
+	{
+		VCStackOptions stack;
+		for (unsigned i = 0; settings[i] != NULL; i++)
+		{
+			string setting = settings[i];
+			size_t equals = setting.find('=');
+			stack[decorator][setting.substr(0, equals)] = setting.substr(equals + 1);
+		}
+
+		vector<string> decorators(1, decorator);
+		string error;
+		if (!VCEngineRegistry::Configure("memory", decorators, stack, error))
+		{
+			cerr << "error: " << error << "\n";
+			delete inner;
+			return NULL;
+		}
+		if (inner != NULL)
+			return VCEngineRegistry::Find(decorator)->decorate(inner, stack[decorator]);
+		return VCEngineRegistry::Create("memory", decorators, stack);
+	}
+
+	// between a decorator and the in-memory engine: counts the visitors
+	// the decorator saves, and fails them while told to
+	class innerProbe: public VCStoreDecorator
+	{
+	public:
+		innerProbe() : VCStoreDecorator(VCEngineRegistry::Create("memory", vector<string>(),
+			VCStackOptions())), saved(0), failing(false) {}
+
+		virtual void SaveVCookies(vector<const VCookie*> &cookies, VCookieProcessedCallback callback)
+		{
+			for (vector<const VCookie*>::iterator ii = cookies.begin(); ii != cookies.end(); ++ii)
+			{
+				bool success = SaveVCookie(**ii);
+				if (callback != NULL)
+					callback(success, **ii);
+			}
+		}
+		virtual bool SaveVCookie(VCookie const &vcookie)
+		{
+			if (failing)
+				return false;
+			saved++;
+			return inner->SaveVCookie(vcookie);
+		}
+
+		unsigned	saved;
+		bool		failing;
+	}; // class innerProbe
+
+	unsigned long long Stat(const VCookieStore &store, const char *name)
+	{
+		map<string, unsigned long long> stats;
+		store.GetStats(stats);
+		return stats[name];
+	}
+
+	// a new visitor, saved without a load; padded so a small cache holds few
+	// of them, and the sketch sized by its memory is hardly ever wrong
+	bool SaveVisitor(VCookieStore &store, unsigned visitor, size_t padding = 8192)
+	{
+		VCookie vc(800, visitor, ~visitor, true, store);
+		FillVCookie(vc, visitor);
+		vc.SetMerchandising(string(padding, 'm'));
+		return vc.Store();
+	}
+
+	// true if the visitor was found
+	bool LoadVisitor(VCookieStore &store, unsigned visitor)
+	{
+		VCookie vc(800, visitor, ~visitor, false, store);
+		return !vc.IsNewCookie();
+	}
+
+	// visitors seen again and again stay cached through a scan of ones seen once
+	bool TestCacheScan(string &failure)
+	{
+		const char *const settings[] = { "memory-mb=1", NULL };
+		boost::scoped_ptr<VCookieStore> store(NewDecorated("cache", settings));
+		CHECK(store);
+
+		const unsigned HOT = 50, SCAN = 1000;
+		for (unsigned v = 0; v < HOT; v++)
+			CHECK(SaveVisitor(*store, v));
+		for (unsigned round = 0; round < 5; round++)
+			for (unsigned v = 0; v < HOT; v++)
+				CHECK(LoadVisitor(*store, v));
+
+		// many times what the cache holds
+		for (unsigned v = HOT; v < HOT + SCAN; v++)
+		{
+			CHECK(SaveVisitor(*store, v));
+			CHECK(LoadVisitor(*store, v));
+		}
+		CHECK(Stat(*store, "cache.rejections") > 0);
+		CHECK(Stat(*store, "cache.bytes") <= 1024 * 1024);
+
+		unsigned long long hits = Stat(*store, "cache.hits");
+		for (unsigned v = 0; v < HOT; v++)
+			CHECK(LoadVisitor(*store, v));
+		CHECK(Stat(*store, "cache.hits") - hits == HOT);
+		return true;
+	}
+
+	// a visitor leaving the window is compared once with the main part's
+	// next to go: a loser evicts nothing, a winner takes what room it needs
+	bool TestCacheAdmission(string &failure)
+	{
+		const char *const settings[] = { "memory-mb=1", NULL };
+		boost::scoped_ptr<VCookieStore> store(NewDecorated("cache", settings));
+		CHECK(store);
+
+		// more visitors than the cache holds, each loaded three times
+		const unsigned FULL = 200;
+		for (unsigned v = 0; v < FULL; v++)
+		{
+			CHECK(SaveVisitor(*store, v));
+			for (unsigned i = 0; i < 3; i++)
+				CHECK(LoadVisitor(*store, v));
+		}
+		CHECK(Stat(*store, "cache.entries") < FULL);
+		CHECK(Stat(*store, "cache.bytes") <= 1024 * 1024);
+
+		// bigger than the whole cache however often it's seen; the first
+		// load pushes what else was in the window out
+		CHECK(SaveVisitor(*store, 1000, 2 * 1024 * 1024));
+		CHECK(LoadVisitor(*store, 1000));
+		unsigned long long evictions = Stat(*store, "cache.evictions");
+		unsigned long long hits = Stat(*store, "cache.hits");
+		for (unsigned i = 0; i < 5; i++)
+			CHECK(LoadVisitor(*store, 1000));
+		CHECK(Stat(*store, "cache.evictions") == evictions);
+		CHECK(Stat(*store, "cache.hits") == hits);
+
+		// seen less often than the cached visitors: turned away
+		unsigned long long rejections = Stat(*store, "cache.rejections");
+		for (unsigned v = 2000; v < 2020; v++)
+		{
+			CHECK(SaveVisitor(*store, v));
+			CHECK(LoadVisitor(*store, v));
+		}
+		CHECK(Stat(*store, "cache.evictions") == evictions);
+		CHECK(Stat(*store, "cache.rejections") >= rejections + 19);
+
+		// seen more often: in, in place of a cached visitor, once the next
+		// visitor pushes it out of the window
+		CHECK(SaveVisitor(*store, 3000));
+		for (unsigned i = 0; i < 8; i++)
+			CHECK(LoadVisitor(*store, 3000));
+		CHECK(SaveVisitor(*store, 3001));
+		CHECK(LoadVisitor(*store, 3001));
+		CHECK(Stat(*store, "cache.evictions") > evictions);
+		hits = Stat(*store, "cache.hits");
+		CHECK(LoadVisitor(*store, 3000));
+		CHECK(Stat(*store, "cache.hits") == hits + 1);
+		return true;
+	}
+
+	void Sleep(unsigned ms)
+	{
+		struct timespec wait = { ms / 1000, (ms % 1000) * 1000 * 1000 };
+		nanosleep(&wait, NULL);
+	}
+
+	bool TestCacheMaxAge(string &failure)
+	{
+		const char *const settings[] = { "max-age-ms=50", NULL };
+		boost::scoped_ptr<VCookieStore> store(NewDecorated("cache", settings));
+		CHECK(store);
+
+		CHECK(SaveVisitor(*store, 1));
+		CHECK(LoadVisitor(*store, 1));
+		CHECK(LoadVisitor(*store, 1));
+		CHECK(Stat(*store, "cache.hits") == 1);
+
+		Sleep(100);
+
+		// too old to use, loaded from the engine again
+		CHECK(LoadVisitor(*store, 1));
+		CHECK(Stat(*store, "cache.hits") == 1);
+		CHECK(Stat(*store, "cache.expired") == 1);
+		CHECK(LoadVisitor(*store, 1));
+		CHECK(Stat(*store, "cache.hits") == 2);
+		return true;
+	}
+
+	// write=through caches what was saved, write=around drops it
+	bool TestCacheWriteAround(string &failure)
+	{
+		for (unsigned around = 0; around < 2; around++)
+		{
+			const char *const settings[] = { around ? "write=around" : "write=through", NULL };
+			boost::scoped_ptr<VCookieStore> store(NewDecorated("cache", settings));
+			CHECK(store);
+
+			CHECK(SaveVisitor(*store, 1));
+			CHECK(LoadVisitor(*store, 1));
+			{
+				VCookie vc(800, 1, ~1U, false, *store);
+				CHECK(!vc.IsNewCookie());
+				vc.SetLastVisitNum(999);
+				CHECK(vc.Store());
+			}
+			CHECK(Stat(*store, "cache.hits") == 1);
+			CHECK(Stat(*store, "cache.invalidations") == around);
+
+			VCookie loaded(800, 1, ~1U, false, *store);
+			CHECK(loaded.GetLastVisitNum() == 999);
+			CHECK(Stat(*store, "cache.hits") == 2 - around);
+		}
+		return true;
+	}
+
+	// saves of a visitor not written yet are one write
+	bool TestWriteBehindCoalescing(string &failure)
+	{
+		const char *const settings[] = { "max-dirty-ms=60000", NULL };
+		innerProbe *probe = new innerProbe;
+		boost::scoped_ptr<VCookieStore> store(NewDecorated("writebehind", settings, probe));
+		CHECK(store);
+
+		const unsigned VISITORS = 5, SAVES = 10;
+		for (unsigned i = 0; i < SAVES; i++)
+			for (unsigned v = 0; v < VISITORS; v++)
+				CHECK(SaveVisitor(*store, v, 0));
+		CHECK(Stat(*store, "writebehind.saves") == VISITORS * SAVES);
+		CHECK(Stat(*store, "writebehind.coalesced") == VISITORS * (SAVES - 1));
+		CHECK(Stat(*store, "writebehind.dirty") == VISITORS);
+		CHECK(probe->saved == 0);
+
+		// loads see what isn't written
+		CHECK(LoadVisitor(*store, 0));
+		CHECK(Stat(*store, "writebehind.loadHits") == 1);
+
+		// writes everything first
+		CHECK(store->GetVCookieCount() == VISITORS);
+		CHECK(probe->saved == VISITORS);
+		CHECK(Stat(*store, "writebehind.writes") == VISITORS);
+		CHECK(Stat(*store, "writebehind.dirty") == 0);
+		return true;
+	}
+
+	bool TestWriteBehindMaxDirty(string &failure)
+	{
+		const char *const settings[] = { "max-dirty-ms=60000", "max-dirty=3", "flush-batch=1", NULL };
+		innerProbe *probe = new innerProbe;
+		boost::scoped_ptr<VCookieStore> store(NewDecorated("writebehind", settings, probe));
+		CHECK(store);
+
+		for (unsigned v = 0; v < 3; v++)
+			CHECK(SaveVisitor(*store, v, 0));
+		CHECK(probe->saved == 0);
+
+		// the oldest goes
+		CHECK(SaveVisitor(*store, 3, 0));
+		CHECK(probe->saved == 1);
+		CHECK(Stat(*store, "writebehind.writes") == 1);
+		CHECK(Stat(*store, "writebehind.dirty") == 3);
+		CHECK(!LoadVisitor(*probe, 3));
+		CHECK(LoadVisitor(*probe, 0));
+		return true;
+	}
+
+	bool TestWriteBehindMaxDirtyMB(string &failure)
+	{
+		const char *const settings[] = { "max-dirty-ms=60000", "max-dirty-mb=1", NULL };
+		innerProbe *probe = new innerProbe;
+		boost::scoped_ptr<VCookieStore> store(NewDecorated("writebehind", settings, probe));
+		CHECK(store);
+
+		// 8KB each, a hundred fit
+		const unsigned VISITORS = 200;
+		for (unsigned v = 0; v < 100; v++)
+			CHECK(SaveVisitor(*store, v));
+		CHECK(probe->saved == 0);
+
+		for (unsigned v = 100; v < VISITORS; v++)
+		{
+			CHECK(SaveVisitor(*store, v));
+			CHECK(Stat(*store, "writebehind.dirtyBytes") <= 1024 * 1024);
+		}
+		CHECK(probe->saved > 0);
+		CHECK(probe->saved + Stat(*store, "writebehind.dirty") == VISITORS);
+		return true;
+	}
+
+	bool TestWriteBehindMaxDirtyMS(string &failure)
+	{
+		const char *const settings[] = { "max-dirty-ms=50", NULL };
+		innerProbe *probe = new innerProbe;
+		boost::scoped_ptr<VCookieStore> store(NewDecorated("writebehind", settings, probe));
+		CHECK(store);
+
+		for (unsigned v = 0; v < 3; v++)
+			CHECK(SaveVisitor(*store, v, 0));
+		CHECK(probe->saved == 0);
+
+		// written by the next call after they're due
+		Sleep(100);
+		store->Poll();
+		CHECK(probe->saved == 3);
+		CHECK(Stat(*store, "writebehind.dirty") == 0);
+		return true;
+	}
+
+	// a write that fails stays dirty and is tried again max-dirty-ms later
+	bool TestWriteBehindRetry(string &failure)
+	{
+		const char *const settings[] = { "max-dirty-ms=50", NULL };
+		innerProbe *probe = new innerProbe;
+		boost::scoped_ptr<VCookieStore> store(NewDecorated("writebehind", settings, probe));
+		CHECK(store);
+
+		probe->failing = true;
+		CHECK(SaveVisitor(*store, 1, 0));
+		CHECK(SaveVisitor(*store, 2, 0));
+		Sleep(100);
+		store->Poll();
+		CHECK(Stat(*store, "writebehind.failures") == 2);
+		CHECK(Stat(*store, "writebehind.writes") == 0);
+		CHECK(Stat(*store, "writebehind.dirty") == 2);
+		CHECK(LoadVisitor(*store, 1));
+
+		probe->failing = false;
+		store->Poll();
+		CHECK(probe->saved == 0);
+		Sleep(100);
+		store->Poll();
+		CHECK(probe->saved == 2);
+		CHECK(Stat(*store, "writebehind.dirty") == 0);
+		CHECK(LoadVisitor(*probe, 1));
+		CHECK(LoadVisitor(*probe, 2));
+		return true;
+	}
+
+	// a store that dies with saves not written leaves them in its journal,
+	// the next one writes them
+	bool TestWriteBehindJournal(string &failure)
+	{
+		const char *tmp = getenv("TMPDIR");
+		ostringstream journal;
+		journal << (tmp != NULL ? tmp : "/tmp") << "/storetest-journal." << getpid();
+		string setting = "journal=" + journal.str();
+		const char *const settings[] = { "max-dirty-ms=60000", setting.c_str(), NULL };
+
+		// the same <journal>.<n> in both, they count stores from here
+		const unsigned VISITORS = 20;
+		pid_t child = fork();
+		CHECK(child != -1);
+		if (child == 0)
+		{
+			VCookieStore *store = NewDecorated("writebehind", settings);
+			bool saved = store != NULL;
+			for (unsigned v = 0; saved && v < VISITORS; v++)
+				saved = SaveVisitor(*store, v, 0) && SaveVisitor(*store, v, 0);
+			saved = saved && Stat(*store, "writebehind.writes") == 0;
+			_exit(saved ? 0 : 1);	// without deleting the store
+		}
+		int status;
+		CHECK(waitpid(child, &status, 0) == child);
+		CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+		{
+			innerProbe *probe = new innerProbe;
+			boost::scoped_ptr<VCookieStore> store(NewDecorated("writebehind", settings, probe));
+			CHECK(store);
+			CHECK(Stat(*store, "writebehind.recovered") == VISITORS);
+			CHECK(probe->saved == VISITORS);
+			for (unsigned v = 0; v < VISITORS; v++)
+			{
+				VCookie vc(800, v, ~v, false, *probe);
+				CHECK(!vc.IsNewCookie());
+				CHECK(vc.GetLastVisitNum() == v % 1000 + 1);
+			}
+		}
+
+		// with nothing left to write, deleting the store removed it
+		string directory = journal.str().substr(0, journal.str().rfind('/'));
+		string prefix = journal.str().substr(directory.size() + 1) + ".";
+		DIR *dir = opendir(directory.c_str());
+		CHECK(dir != NULL);
+		bool left = false;
+		while (struct dirent *file = readdir(dir))
+			left = left || strncmp(file->d_name, prefix.c_str(), prefix.size()) == 0;
+		closedir(dir);
+		CHECK(!left);
+		return true;
+	}
+
+	typedef struct
+	{
+		const char	*name;
+		const char	*decorator;
+		bool		(*test)(string &failure);
+	} decoratorTest_t;
+
+	const decoratorTest_t DECORATOR_TESTS[] = {
+		{ "scan",			"cache",	TestCacheScan },
+		{ "admission",		"cache",	TestCacheAdmission },
+		{ "maxAge",			"cache",	TestCacheMaxAge },
+		{ "writeAround",	"cache",	TestCacheWriteAround },
+		{ "coalescing",		"writebehind",	TestWriteBehindCoalescing },
+		{ "maxDirty",		"writebehind",	TestWriteBehindMaxDirty },
+		{ "maxDirtyMB",		"writebehind",	TestWriteBehindMaxDirtyMB },
+		{ "maxDirtyMS",		"writebehind",	TestWriteBehindMaxDirtyMS },
+		{ "retry",			"writebehind",	TestWriteBehindRetry },
+		{ "journal",		"writebehind",	TestWriteBehindJournal },
+	};
+
+	// number of failures; only the decorators named, all of them if none are
+	unsigned RunDecoratorTests(const vector<string> &decorators)
+	{
+		unsigned failed = 0;
+		for (unsigned i = 0; i < sizeof(DECORATOR_TESTS) / sizeof(DECORATOR_TESTS[0]); i++)
+		{
+			const decoratorTest_t &test = DECORATOR_TESTS[i];
+			if (!VCEngineRegistry::Find(test.decorator) || (!decorators.empty() &&
+					find(decorators.begin(), decorators.end(), test.decorator) == decorators.end()))
+				continue;
+
+			string name = VCEngineRegistry::StackName("memory", vector<string>(1, test.decorator));
+			printf("%-20s %-14s ", name.c_str(), test.name);
+
+			string failure = "the store can't be created";
+			if (test.test(failure))
+				printf("pass\n");
+			else
+			{
+				printf("FAIL: %s\n", failure.c_str());
+				failed++;
+			}
+			fflush(stdout);
+		}
+		return failed;
+	}
+
+
+	/*
+	 * Benchmark scenarios
+	 *
+	 * A hit loads its visitor and, for an update, touches the traffic
+	 * fields and a variable and saves it again, which is what the harness
+	 * does to a store.  New visitors aren't known to be new, they cost a
+	 * load that misses.  Hit times advance one second per hit so the
+	 * purge scenario always has something to purge.
+	 */
+
+	typedef struct
+	{
+		const char	*name;
+		unsigned	updatePercent;		// of the hits to existing visitors
+		unsigned	newPercent;			// of all hits
+		unsigned	purgeEvery;			// hits between purges, 0 = never
+	} scenario_t;
+
+	const scenario_t SCENARIOS[] = {
+		{ "readHeavy",		5,		2,		0 },
+		{ "writeHeavy",		80,		5,		0 },
+		{ "newVisitors",	50,		70,		0 },
+		{ "purgeUnderLoad",	50,		20,		10000 },
+	};
+
+	// small and fast, the same sequence for every engine
+	class lcg
+	{
+		public:
+			lcg(unsigned seed) : state(seed * 2862933555777941757ULL + 3037000493ULL) {}
+			unsigned Next(unsigned range)
+			{
+				state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+				return (unsigned)((state >> 33) % range);
+			}
+		private:
+			unsigned long long	state;
+	};	// class lcg
+
+	void Hit(VCookieStore &store, unsigned long long visitor, bool update, time_t now)
+	{
+		VCookie vc(700 + (unsigned)(visitor % 5), visitor, ~visitor, false, store);
+		if (vc.IsNewCookie())
+		{
+			FillVCookie(vc, (unsigned) visitor);
+			vc.SetLastHitTimeGMT(now);
+		}
+		else if (update)
+		{
+			vc.SetLastHitTimeGMT(now);
+			vc.SetLastVisitNum(vc.GetLastVisitNum() + 1);
+			vc.SetVar((VCookie::RelationId)(now % 75), "updated", now, 1, ALLOC_TYPE_LAST);
+		}
+		// saved (if changed) as it goes out of scope
+	}
+
+	void RunScenario(const storeStack_t &engine, const scenario_t &scenario)
+	{
+		boost::scoped_ptr<VCookieStore> store(NewStore(engine));
+		if (!store)
+		{
+			printf("%-20s %-16s the store can't be created\n", engine.name.c_str(), scenario.name);
+			return;
+		}
+
+		// every visitor has hit once in the last 'visitors' seconds
+		time_t now = BASE_TIME;
+		for (unsigned long long v = 0; v < options.visitors; v++)
+			Hit(*store, v, false, now++);
+
+		lcg random(options.seed);
+		unsigned long long nextVisitor = options.visitors;
+		unsigned long long hits = 0, purged = 0;
+		hdrHistogram latency, purgeLatency;
+
+		unsigned long long start = hiResClock::NowNS();
+		unsigned long long end = start + (unsigned long long)(options.seconds * 1e9);
+		unsigned long long last = start;
+
+		while (last < end)
+		{
+			bool newVisitor = random.Next(100) < scenario.newPercent;
+			unsigned long long visitor = newVisitor ? nextVisitor++ : random.Next((unsigned) nextVisitor);
+			bool update = random.Next(100) < scenario.updatePercent;
+
+			Hit(*store, visitor, update, now++);
+			hits++;
+
+			unsigned long long done = hiResClock::NowNS();
+			latency.Record(done - last);
+			last = done;
+
+			if (scenario.purgeEvery && hits % scenario.purgeEvery == 0)
+			{
+				// keep the most recent visitors' worth of hits
+				purged += store->DeleteOldVCookies(now - options.visitors);
+
+				done = hiResClock::NowNS();
+				purgeLatency.Record(done - last);
+				last = done;
+			}
+		}
+
+		double seconds = (last - start) / 1e9;
+		printf("%-20s %-16s %12.0f %10llu %10llu %10llu %10llu",
+			engine.name.c_str(), scenario.name, hits / seconds,
+			latency.ValueAtPercentile(50), latency.ValueAtPercentile(99),
+			latency.ValueAtPercentile(99.9), latency.Max());
+		if (scenario.purgeEvery)
+			printf("  purges = %llu; purged = %llu; purgeP99NS = %llu",
+				purgeLatency.Count(), purged, purgeLatency.ValueAtPercentile(99));
+		printf("\n");
+		fflush(stdout);
+	}
+
+	// a load in flight in the pipelined scenario
+	typedef struct
+	{
+		VCookie				*vcookie;
+		unsigned long long	submittedNS;
+		hdrHistogram		*latency;
+		unsigned long long	*hits;
+	} pipelinedLoad_t;
+
+	void PipelinedLoadDone(bool success, VCookie &vcookie, void *context)
+	{
+		pipelinedLoad_t *load = (pipelinedLoad_t *) context;
+		load->latency->Record(hiResClock::NowNS() - load->submittedNS);
+		(*load->hits)++;
+
+		delete load->vcookie;		// loaded, not modified: nothing to save
+		delete load;
+	}
+
+	// returning visitors' loads only, keeping up to window= in flight with
+	// SubmitLoad; latency is from submit to completion.  Engines that
+	// complete inside Submit come out much as in readHeavy.
+	void RunPipelined(const storeStack_t &engine)
+	{
+		boost::scoped_ptr<VCookieStore> store(NewStore(engine));
+		if (!store)
+		{
+			printf("%-20s %-16s the store can't be created\n", engine.name.c_str(), "pipelinedReads");
+			return;
+		}
+
+		time_t now = BASE_TIME;
+		for (unsigned long long v = 0; v < options.visitors; v++)
+			Hit(*store, v, false, now++);
+
+		lcg random(options.seed);
+		unsigned long long hits = 0;
+		hdrHistogram latency;
+
+		unsigned long long start = hiResClock::NowNS();
+		unsigned long long end = start + (unsigned long long)(options.seconds * 1e9);
+		unsigned long long last = start;
+
+		while (last < end)
+		{
+			if (store->Outstanding() < options.window)
+			{
+				unsigned long long visitor = random.Next(options.visitors);
+
+				pipelinedLoad_t *load = new pipelinedLoad_t;
+				load->vcookie = new VCookie(700 + (unsigned)(visitor % 5), visitor, ~visitor, true, *store);
+				load->submittedNS = hiResClock::NowNS();
+				load->latency = &latency;
+				load->hits = &hits;
+				if (!store->SubmitLoad(*load->vcookie, PipelinedLoadDone, load))
+				{
+					delete load->vcookie;
+					delete load;
+				}
+			}
+			else
+				store->Wait(1);
+
+			last = hiResClock::NowNS();
+		}
+		store->Wait();
+		last = hiResClock::NowNS();
+
+		double seconds = (last - start) / 1e9;
+		printf("%-20s %-16s %12.0f %10llu %10llu %10llu %10llu  window = %u\n",
+			engine.name.c_str(), "pipelinedReads", hits / seconds,
+			latency.ValueAtPercentile(50), latency.ValueAtPercentile(99),
+			latency.ValueAtPercentile(99.9), latency.Max(), options.window);
+		fflush(stdout);
+	}
+
+	// returning visitors in batches of batchSize: one LoadVCookies, a
+	// change to every cookie, one SaveVCookies.  Latency is per batch.
+	void RunBatched(const storeStack_t &engine, unsigned batchSize)
+	{
+		ostringstream name;
+		name << "batch/" << batchSize;
+
+		boost::scoped_ptr<VCookieStore> store(NewStore(engine));
+		if (!store)
+		{
+			printf("%-20s %-16s the store can't be created\n", engine.name.c_str(), name.str().c_str());
+			return;
+		}
+
+		time_t now = BASE_TIME;
+		for (unsigned long long v = 0; v < options.visitors; v++)
+			Hit(*store, v, false, now++);
+
+		lcg random(options.seed);
+		unsigned long long hits = 0;
+		hdrHistogram latency;
+
+		unsigned long long start = hiResClock::NowNS();
+		unsigned long long end = start + (unsigned long long)(options.seconds * 1e9);
+		unsigned long long last = start;
+
+		while (last < end)
+		{
+			ownedCookies cookies;
+			vector<VCookie *> loads;
+			vector<const VCookie *> saves;
+			for (unsigned i = 0; i < batchSize; i++)
+			{
+				unsigned long long visitor = random.Next(options.visitors);
+				cookies.push_back(new VCookie(700 + (unsigned)(visitor % 5), visitor, ~visitor, true, *store));
+				loads.push_back(cookies.back());
+			}
+
+			store->LoadVCookies(loads, NULL);
+			for (unsigned i = 0; i < batchSize; i++)
+			{
+				VCookie &vc = *cookies[i];
+				vc.SetLastHitTimeGMT(now);
+				vc.SetLastVisitNum(vc.GetLastVisitNum() + 1);
+				vc.SetVar((VCookie::RelationId)(now % 75), "updated", now, 1, ALLOC_TYPE_LAST);
+				now++;
+				saves.push_back(&vc);
+			}
+			store->SaveVCookies(saves, NULL);
+
+			// saved, nothing for the destructors to do
+			for (unsigned i = 0; i < batchSize; i++)
+				cookies[i]->Saved();
+			hits += batchSize;
+
+			unsigned long long done = hiResClock::NowNS();
+			latency.Record(done - last);
+			last = done;
+		}
+
+		double seconds = (last - start) / 1e9;
+		printf("%-20s %-16s %12.0f %10llu %10llu %10llu %10llu  per batch\n",
+			engine.name.c_str(), name.str().c_str(), hits / seconds,
+			latency.ValueAtPercentile(50), latency.ValueAtPercentile(99),
+			latency.ValueAtPercentile(99.9), latency.Max());
+		fflush(stdout);
+	}
+
+	void RunBenchmarks(const storeStack_t &engine)
+	{
+		for (unsigned i = 0; i < sizeof(SCENARIOS) / sizeof(SCENARIOS[0]); i++)
+			RunScenario(engine, SCENARIOS[i]);
+		RunPipelined(engine);
+		for (unsigned i = 0; i < options.batchSizes.size(); i++)
+			RunBatched(engine, options.batchSizes[i]);
+	}
+
+	int Configure(int ac, char *av[])
+	{
+		string batchSizes;
+		po::options_description commandLine("Options");
+		commandLine.add_options()
+			("help", "display help")
+			("engine", po::value< vector<string> >(&options.engines)->composing(),
+					"engine to test, may be repeated (default every engine)")
+			("decorator", po::value< vector<string> >(&options.decorators)->composing(),
+					"wrap every engine in this decorator, may be repeated (innermost first)")
+			("plugin", po::value< vector<string> >(&options.plugins)->composing(),
+					"shared object to load more engines from, may be repeated")
+			("set", po::value< vector<string> >(&options.settings)->composing(),
+					"an engine or decorator option, as <name>.<option>=<value>")
+			("list", po::bool_switch(&options.list), "list the engines and decorators and exit")
+			("no-tests", po::bool_switch(&options.noTests), "skip the conformance tests")
+			("no-bench", po::bool_switch(&options.noBench), "skip the benchmark scenarios")
+			("seconds", po::value<double>(&options.seconds)->default_value(2), "length of each scenario")
+			("visitors", po::value<unsigned>(&options.visitors)->default_value(100000),
+					"visitors stored before each scenario")
+			("seed", po::value<unsigned>(&options.seed)->default_value(1), "seed for the visitor sequence")
+			("window", po::value<unsigned>(&options.window)->default_value(64),
+					"loads kept in flight in the pipelined scenario")
+			("batch-sizes", po::value<string>(&batchSizes)->default_value("1,16,128"),
+					"cookies per batch in the batch scenarios, comma separated")
+			("mock-latency-us", po::value<unsigned>(&options.mock.latencyUS)->default_value(0),
+					"stand-in memcached server: delay before each response")
+			("mock-jitter-us", po::value<unsigned>(&options.mock.jitterUS)->default_value(0),
+					"stand-in memcached server: up to this much more delay")
+			("mock-error-rate", po::value<double>(&options.mock.errorRate)->default_value(0),
+					"stand-in memcached server: fraction of requests failed temporarily")
+			;
+
+		po::variables_map vm;
+		try {
+			po::store(po::parse_command_line(ac, av, commandLine), vm);
+			po::notify(vm);
+		}
+		catch (std::exception &e) {
+			cerr << "error: " << e.what() << "\n";
+			return 1;
+		}
+
+		if (vm.count("help"))
+		{
+			cout << commandLine << "\n";
+			exit(0);
+		}
+
+		istringstream sizes(batchSizes);
+		string size;
+		while (getline(sizes, size, ','))
+		{
+			unsigned n = strtoul(size.c_str(), NULL, 10);
+			if (n == 0)
+			{
+				cerr << "error: bad batch size \"" << size << "\"\n";
+				return 1;
+			}
+			options.batchSizes.push_back(n);
+		}
+		return 0;
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (Configure(argc, argv))
+		return 1;
+
+	for (unsigned i = 0; i < options.plugins.size(); i++)
+	{
+		string error;
+		if (!VCEngineRegistry::LoadPlugin(options.plugins[i], error))
+		{
+			cerr << "error: can't load " << options.plugins[i] << ": " << error << "\n";
+			return 1;
+		}
+	}
+
+	if (options.list)
+	{
+		for (unsigned decorators = 0; decorators < 2; decorators++)
+		{
+			vector<string> names = VCEngineRegistry::Names(decorators);
+			for (unsigned i = 0; i < names.size(); i++)
+			{
+				const VCEngineRegistry::Engine *engine = VCEngineRegistry::Find(names[i]);
+				printf("%-12s %-10s %s\n", engine->name.c_str(), decorators ? "decorator" : "engine",
+					engine->description.c_str());
+			}
+		}
+		return 0;
+	}
+
+	VCStackOptions settings;
+	for (unsigned i = 0; i < options.settings.size(); i++)
+	{
+		const string &setting = options.settings[i];
+		size_t dot = setting.find('.'), equals = setting.find('=');
+		if (dot == string::npos || equals == string::npos || equals < dot)
+		{
+			cerr << "error: --set " << setting << " isn't <name>.<option>=<value>\n";
+			return 1;
+		}
+		settings[setting.substr(0, dot)][setting.substr(dot + 1, equals - dot - 1)] = setting.substr(equals + 1);
+	}
+
+	// without --engine or --decorator: every engine, then DECORATED_STACKS
+	bool everything = options.engines.empty() && options.decorators.empty();
+	if (options.engines.empty())
+		options.engines = VCEngineRegistry::Names();
+
+	vector<storeStack_t> stacks;
+	for (unsigned i = 0; i < options.engines.size(); i++)
+	{
+		storeStack_t stack;
+		stack.engine = options.engines[i];
+		stack.decorators = options.decorators;
+		stacks.push_back(stack);
+	}
+	for (unsigned i = 0; everything && i < sizeof(DECORATED_STACKS) / sizeof(DECORATED_STACKS[0]); i++)
+	{
+		storeStack_t stack;
+		stack.decorators.push_back(DECORATED_STACKS[i][0]);
+		stack.engine = DECORATED_STACKS[i][1];
+		if (VCEngineRegistry::Find(stack.decorators[0]) && VCEngineRegistry::Find(stack.engine))
+			stacks.push_back(stack);
+	}
+
+	boost::scoped_ptr<memcachedMock> mock;
+	if (find(options.engines.begin(), options.engines.end(), "memcached") != options.engines.end()
+		&& (settings.find("memcached") == settings.end() || !settings["memcached"].count("host")))
+	{
+		options.mock.seed = options.seed;
+		mock.reset(new memcachedMock(options.mock));
+		if (!mock->Listen(0) || !mock->Start())
+		{
+			cerr << "error: can't start the stand-in memcached server: " << strerror(errno) << "\n";
+			return 1;
+		}
+		ostringstream host;
+		host << "127.0.0.1:" << mock->Port();
+		settings["memcached"]["host"] = host.str();
+	}
+
+	vector<storeStack_t> engines;
+	for (unsigned i = 0; i < stacks.size(); i++)
+	{
+		storeStack_t &stack = stacks[i];
+		stack.name = VCEngineRegistry::StackName(stack.engine, stack.decorators);
+
+		// only the settings for this stack, the others are for other engines
+		const VCEngineRegistry::Engine *engine = VCEngineRegistry::Find(stack.engine);
+		stack.capabilities = engine ? engine->capabilities : 0;
+
+		// an engine the decorators can't go over isn't tested with them
+		unsigned needs = 0;
+		for (unsigned d = 0; d < stack.decorators.size(); d++)
+		{
+			const VCEngineRegistry::Engine *decorator = VCEngineRegistry::Find(stack.decorators[d]);
+			if (decorator)
+				needs |= decorator->capabilities;
+		}
+		if (engine && (stack.capabilities & needs) != needs)
+		{
+			printf("%-20s skipped, the decorators need more than %s does\n", stack.name.c_str(), stack.engine.c_str());
+			continue;
+		}
+		for (VCStackOptions::const_iterator s = settings.begin(); s != settings.end(); s++)
+			if (s->first == stack.engine || find(stack.decorators.begin(), stack.decorators.end(), s->first) != stack.decorators.end())
+				stack.options.insert(*s);
+
+		string error;
+		if (!VCEngineRegistry::Configure(stack.engine, stack.decorators, stack.options, error))
+		{
+			cerr << "error: " << error << " (--list shows what there is)\n";
+			return 1;
+		}
+		engines.push_back(stack);
+	}
+
+	unsigned failed = 0;
+	if (!options.noTests)
+	{
+		for (unsigned i = 0; i < engines.size(); i++)
+			failed += RunTests(engines[i]);
+		if (everything || !options.decorators.empty())
+			failed += RunDecoratorTests(options.decorators);
+		printf("%u test%s failed\n", failed, failed == 1 ? "" : "s");
+	}
+
+	if (!options.noBench)
+	{
+		hiResClock::Calibrate();
+
+		printf("\n%-20s %-16s %12s %10s %10s %10s %10s\n",
+			"engine", "scenario", "hits/s", "p50NS", "p99NS", "p99.9NS", "maxNS");
+		for (unsigned i = 0; i < engines.size(); i++)
+			RunBenchmarks(engines[i]);
+	}
+
+	if (mock)
+	{
+		mock->Stop();
+		printf("\nstand-in memcached server: %llu requests, %llu failures injected\n",
+			mock->Requests(), mock->Injected());
+	}
+
+	return failed ? 1 : 0;
+}
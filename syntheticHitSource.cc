@@ -0,0 +1,392 @@
+#include "syntheticHitSource.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <iostream>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+namespace {
+	// size of the pre-generated page url/name/referrer pools
+	const unsigned PAGE_POOL_SIZE = 1024;
+
+	// first report suite id handed out
+	const unsigned FIRST_RSID = 100;
+
+	// evar values are padded out of a block of random characters
+	const unsigned MAX_EVAR_LENGTH = 255;
+	const unsigned FILLER_OFFSETS = 256;
+
+	// splitmix64 finalizer, a cheap bijective scramble
+	unsigned long long Mix(unsigned long long x)
+	{
+		x += 0x9e3779b97f4a7c15ULL;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+
+	// log1p(x)/x, accurate near 0
+	double Helper1(double x)
+	{
+		if (fabs(x) > 1e-8)
+			return log1p(x) / x;
+		return 1.0 - x * (0.5 - x * (1.0 / 3.0 - 0.25 * x));
+	}
+
+	// expm1(x)/x, accurate near 0
+	double Helper2(double x)
+	{
+		if (fabs(x) > 1e-8)
+			return expm1(x) / x;
+		return 1.0 + x * 0.5 * (1.0 + x * (1.0 / 3.0) * (1.0 + 0.25 * x));
+	}
+
+	// r is taken as a 32 bit fraction of the range
+	unsigned LengthBetween(unsigned min, unsigned max, unsigned long long r)
+	{
+		if (max <= min)
+			return min;
+		return min + (((r & 0xffffffffULL) * (max - min + 1)) >> 32);
+	}
+
+	// a printable string of exactly len characters starting with prefix
+	string MakeString(const string &prefix, unsigned len, fastRandom &random)
+	{
+		static const char letters[] = "abcdefghijklmnopqrstuvwxyz0123456789/-_";
+
+		string s = prefix;
+		while (s.length() < len)
+			s += letters[random.NextBelow(sizeof(letters) - 1)];
+
+		return s;
+	}
+} // end anonymous namespace
+
+
+void SyntheticDefaults(syntheticConfig_t &config)
+{
+	config.reportSuites = 10;
+	config.visitors = 1000000;
+	config.zipfSkew = 0.9;
+	config.newVisitorRatio = 0.05;
+	SyntheticUniformEvars(config, 4, 1000);
+	config.linearEvarFraction = 0.1;
+	config.purchaseRate = 0.01;
+	config.evarLengthMin = 4;
+	config.evarLengthMax = 32;
+	config.urlLengthMin = 20;
+	config.urlLengthMax = 120;
+	config.hitsPerSecond = 10000;
+	config.startTime = 1350000000;		// fixed, so runs are reproducible
+}
+
+
+void SyntheticUniformEvars(syntheticConfig_t &config, double evarsPerHit, unsigned long cardinality)
+{
+	double frequency = min(1.0, max(0.0, evarsPerHit / NUM_EVARS));
+
+	for (unsigned i = 0; i < NUM_EVARS; i++)
+	{
+		config.evarFrequency[i] = frequency;
+		config.evarCardinality[i] = cardinality;
+	}
+}
+
+bool SyntheticFromProfile(syntheticConfig_t &config, const string &filename)
+{
+	using boost::property_tree::ptree;
+
+	ptree profile;
+	try {
+		read_json(filename, profile);
+	}
+	catch (std::exception &e) {
+		cerr << "Unable to read workload profile " << filename << ": " << e.what() << "\n";
+		return false;
+	}
+
+	config.reportSuites = profile.get("report_suites", config.reportSuites);
+	config.visitors = profile.get("visitors", config.visitors);
+	config.zipfSkew = profile.get("zipf_skew", config.zipfSkew);
+	config.newVisitorRatio = profile.get("new_visitor_ratio", config.newVisitorRatio);
+	config.purchaseRate = profile.get("purchase_rate", config.purchaseRate);
+	config.evarLengthMin = profile.get("evar_length.min", config.evarLengthMin);
+	config.evarLengthMax = profile.get("evar_length.max", config.evarLengthMax);
+	config.urlLengthMin = profile.get("url_length.min", config.urlLengthMin);
+	config.urlLengthMax = profile.get("url_length.max", config.urlLengthMax);
+	config.hitsPerSecond = profile.get("time_span.hits_per_second", config.hitsPerSecond);
+	config.startTime = profile.get("time_span.first", config.startTime);
+
+	if (profile.get_child_optional("evars"))
+	{
+		BOOST_FOREACH(const ptree::value_type &evar, profile.get_child("evars"))
+		{
+			unsigned i = evar.second.get("evar", 0u);
+			if (i < 1 || i > NUM_EVARS)
+				continue;
+
+			config.evarFrequency[i - 1] = evar.second.get("frequency", config.evarFrequency[i - 1]);
+			config.evarCardinality[i - 1] = evar.second.get("cardinality", config.evarCardinality[i - 1]);
+		}
+	}
+
+	return true;
+}
+
+
+/*
+ * fastRandom
+ */
+
+fastRandom::fastRandom(unsigned long long seed)
+{
+	// both halves of the state must not be zero
+	s0 = Mix(seed);
+	s1 = Mix(s0 ^ 0x6a09e667f3bcc909ULL);
+	if (s0 == 0 && s1 == 0)
+		s1 = 1;
+}
+
+
+/*
+ * zipfGenerator
+ */
+
+zipfGenerator::zipfGenerator(unsigned long _n, double _skew) :
+	n(_n < 1 ? 1 : _n), skew(_skew)
+{
+	if (skew > 0)
+	{
+		hIntegralX1 = HIntegral(1.5) - 1.0;
+		hIntegralN = HIntegral(n + 0.5);
+		s = 2.0 - HIntegralInverse(HIntegral(2.5) - H(2.0));
+	}
+}
+
+double zipfGenerator::H(double x) const
+{
+	return exp(-skew * log(x));
+}
+
+double zipfGenerator::HIntegral(double x) const
+{
+	double logX = log(x);
+	return Helper2((1.0 - skew) * logX) * logX;
+}
+
+double zipfGenerator::HIntegralInverse(double x) const
+{
+	double t = x * (1.0 - skew);
+	if (t < -1.0)
+		t = -1.0;	// limit value to the range [-1, +inf), rounding errors only
+	return exp(Helper1(t) * x);
+}
+
+unsigned long zipfGenerator::Next(fastRandom &random) const
+{
+	if (skew <= 0)
+		return 1 + random.NextBelow(n);
+
+	for (;;)
+	{
+		double u = hIntegralN + random.NextDouble() * (hIntegralX1 - hIntegralN);
+		double x = HIntegralInverse(u);
+
+		unsigned long k = (unsigned long)(x + 0.5);
+		if (k < 1)
+			k = 1;
+		else if (k > n)
+			k = n;
+
+		// accept right away most of the time, otherwise do the full test
+		if (k - x <= s || u >= HIntegral(k + 0.5) - H(k))
+			return k;
+	}
+}
+
+
+/*
+ * syntheticHitSource
+ */
+
+syntheticHitSource::syntheticHitSource(const syntheticConfig_t &_config, unsigned long seed, unsigned _stream) :
+	config(_config),
+	random(Mix(seed) ^ Mix(_stream + 1)),
+	popularity(_config.visitors, _config.zipfSkew),
+	stream(_stream),
+	seedMix(Mix(seed ^ 0x5bd1e995ULL)),
+	hitCount(0),
+	newVisitorCount(0),
+	purchaseCount(0)
+{
+	if (config.reportSuites == 0)
+		config.reportSuites = 1;
+	if (config.hitsPerSecond <= 0)
+		config.hitsPerSecond = 1;
+
+	evarMaxFrequency = 0;
+	for (unsigned i = 0; i < NUM_EVARS; i++)
+		evarMaxFrequency = max(evarMaxFrequency, min(1.0, config.evarFrequency[i]));
+
+	// everything below must be the same in every stream, so it is derived from the seed only
+	fastRandom shared(seed);
+
+	// pick which evars are linear, the same ones for every stream
+	vector<unsigned> order(NUM_EVARS);
+	for (unsigned i = 0; i < NUM_EVARS; i++)
+		order[i] = i;
+	for (unsigned i = NUM_EVARS - 1; i > 0; i--)
+		swap(order[i], order[shared.NextBelow(i + 1)]);
+
+	unsigned linearCount = (unsigned)(config.linearEvarFraction * NUM_EVARS + 0.5);
+	for (unsigned i = 0; i < linearCount && i < NUM_EVARS; i++)
+		linear.set(order[i]);
+
+	for (unsigned i = 0; i < sizeof(filler); i++)
+		filler[i] = 'a' + shared.NextBelow(26);
+
+	// page pools, so the hot loop never formats urls
+	urls.reserve(PAGE_POOL_SIZE);
+	pageNames.reserve(PAGE_POOL_SIZE);
+	referrers.reserve(PAGE_POOL_SIZE);
+	for (unsigned i = 0; i < PAGE_POOL_SIZE; i++)
+	{
+		char prefix[64];
+
+		snprintf(prefix, sizeof(prefix), "http://www.example.com/p%u/", i);
+		urls.push_back(MakeString(prefix, LengthBetween(config.urlLengthMin, config.urlLengthMax, shared.Next()), shared));
+
+		snprintf(prefix, sizeof(prefix), "page %u ", i);
+		pageNames.push_back(MakeString(prefix, LengthBetween(config.urlLengthMin, config.urlLengthMax, shared.Next()) / 2, shared));
+
+		snprintf(prefix, sizeof(prefix), "http://ref%u.example.net/", i);
+		referrers.push_back(MakeString(prefix, LengthBetween(config.urlLengthMin, config.urlLengthMax, shared.Next()), shared));
+	}
+}
+
+// the value string is a pure function of (evar, valueId) so cardinality is exact
+void syntheticHitSource::SetEvar(string &value, unsigned evar, unsigned long long valueId) const
+{
+	char buf[MAX_EVAR_LENGTH + 32];
+
+	unsigned long long h = Mix(((unsigned long long) evar << 48) ^ valueId ^ seedMix);
+	unsigned len = LengthBetween(config.evarLengthMin, config.evarLengthMax, h >> 32);
+	if (len > MAX_EVAR_LENGTH)
+		len = MAX_EVAR_LENGTH;
+
+	// "v<evar>-<hex value id>-", formatted by hand because snprintf
+	// costs more than everything else in a hit put together
+	static const char hex[] = "0123456789abcdef";
+	unsigned prefix = 0;
+	buf[prefix++] = 'v';
+	if (evar + 1 >= 10)
+		buf[prefix++] = '0' + (evar + 1) / 10;
+	buf[prefix++] = '0' + (evar + 1) % 10;
+	buf[prefix++] = '-';
+	int shift = 60;
+	while (shift > 0 && (valueId >> shift) == 0)
+		shift -= 4;
+	for (; shift >= 0; shift -= 4)
+		buf[prefix++] = hex[(valueId >> shift) & 0xf];
+	buf[prefix++] = '-';
+
+	if (prefix > len)
+		len = prefix;		// never truncate the unique part
+
+	// pad from the filler at an offset derived from the hash
+	if (len > prefix)
+		memcpy(buf + prefix, filler + (h & (FILLER_OFFSETS - 1)), len - prefix);
+
+	value.assign(buf, len);
+}
+
+bool syntheticHitSource::NextHit(hitData_t &hit)
+{
+	hit.hit_time_gmt = config.startTime + (time_t)(hitCount / config.hitsPerSecond);
+	hitCount++;
+
+	if (random.NextDouble() < config.newVisitorRatio)
+	{
+		// a visitor outside the returning population, unique to this stream
+		unsigned long long id = Mix(((unsigned long long)(stream + 1) << 40) ^ ++newVisitorCount ^ ~seedMix);
+
+		hit.rsid = FIRST_RSID + random.NextBelow(config.reportSuites);
+		hit.visid_high = id;
+		hit.visid_low = Mix(id);
+		hit.visid_new = true;
+		hit.visit_num = 1;
+	}
+	else
+	{
+		// everything about a returning visitor is derived from its popularity rank
+		unsigned long long id = Mix(popularity.Next(random) ^ seedMix);
+
+		hit.rsid = FIRST_RSID + (id >> 32) % config.reportSuites;
+		hit.visid_high = id;
+		hit.visid_low = Mix(id);
+		hit.visid_new = false;
+		hit.visit_num = 1 + (hit.visid_low >> 48) % 20;
+	}
+
+	unsigned page = random.NextBelow(PAGE_POOL_SIZE);
+	hit.page_url = urls[page];
+	hit.page_name = pageNames[page];
+	hit.referrer = referrers[random.NextBelow(PAGE_POOL_SIZE)];
+	hit.campaign.clear();
+
+	if (random.NextDouble() < config.purchaseRate)
+	{
+		char pid[64];
+		snprintf(pid, sizeof(pid), "P%u-%llu", stream, ++purchaseCount);
+
+		hit.purchaseid = pid;
+		hit.purchase_time_gmt = hit.hit_time_gmt;
+	}
+	else
+	{
+		hit.purchaseid.clear();
+		hit.purchase_time_gmt = 0;
+	}
+
+	for (unsigned i = 0; i < NUM_EVARS; i++)
+		if (!hit.evar[i].empty())
+			hit.evar[i].clear();
+	hit.evar_linear = linear;
+
+	if (evarMaxFrequency <= 0)
+		return true;
+
+	// rather than rolling the dice for each of the 75 evars, skip ahead
+	// geometrically using the highest frequency, then thin each candidate
+	// down to its own frequency
+	double logMiss = evarMaxFrequency < 1.0 ? log(1.0 - evarMaxFrequency) : 0;
+	unsigned i = 0;
+	for (;;)
+	{
+		if (logMiss < 0)
+		{
+			// clamped before converting: with a tiny frequency (or a draw
+			// near 1) the skip can be far past what an unsigned holds
+			double skip = log(1.0 - random.NextDouble()) / logMiss;
+			i += skip < NUM_EVARS - i ? (unsigned)skip : NUM_EVARS - i;
+		}
+		if (i >= NUM_EVARS)
+			break;
+
+		if (config.evarFrequency[i] >= evarMaxFrequency ||
+				random.NextDouble() * evarMaxFrequency < config.evarFrequency[i])
+			SetEvar(hit.evar[i], i, random.NextBelow(config.evarCardinality[i] ? config.evarCardinality[i] : 1));
+
+		i++;
+	}
+
+	return true;
+}
@@ -0,0 +1,137 @@
+#ifndef SYNTHETIC_HIT_SOURCE_H
+#define SYNTHETIC_HIT_SOURCE_H
+
+#include <string>
+#include <vector>
+
+#include "hitSource.h"
+
+/*
+ * Synthetic workload
+ *
+ * Generates hits without a replay file, deterministically from a seed, so
+ * runs can be reproduced and shared without handing out DW exports.
+ * Visitor popularity follows a Zipf distribution over a fixed population;
+ * a configurable fraction of hits come from brand new visitors.
+ *
+ * Each worker thread gets its own source (seeded from the run seed and the
+ * thread number), so generation needs no locking.
+ */
+
+typedef struct
+{
+	unsigned		reportSuites;		// number of distinct report suites (userid)
+	unsigned long	visitors;			// returning visitor population
+	double			zipfSkew;			// popularity skew of the visitor population (0 = uniform)
+	double			newVisitorRatio;	// fraction of hits from brand new visitors
+	double			evarFrequency[NUM_EVARS];	// probability each evar is set in a hit
+	unsigned long	evarCardinality[NUM_EVARS];	// distinct values per evar
+	double			linearEvarFraction;	// fraction of the evars that use linear allocation
+	double			purchaseRate;		// fraction of hits with a purchase
+	unsigned		evarLengthMin;		// evar value length range
+	unsigned		evarLengthMax;
+	unsigned		urlLengthMin;		// referrer/url/page name length range
+	unsigned		urlLengthMax;
+	double			hitsPerSecond;		// virtual arrival rate, drives hit_time_gmt
+	time_t			startTime;			// hit_time_gmt of the first hit
+} syntheticConfig_t;
+
+
+// sets up a config with the defaults
+void SyntheticDefaults(syntheticConfig_t &config);
+
+// the same evar frequency and cardinality for every evar
+void SyntheticUniformEvars(syntheticConfig_t &config, double evarsPerHit, unsigned long cardinality);
+
+// take the workload shape from a JSON profile written by the harness' --profile mode
+// fields missing from the file are left alone, returns false if the file can't be read
+bool SyntheticFromProfile(syntheticConfig_t &config, const std::string &filename);
+
+
+// small, fast random number generator (xorshift128+)
+class fastRandom
+{
+	public:
+		fastRandom(unsigned long long seed);
+
+		unsigned long long Next(void)
+		{
+			unsigned long long x = s0;
+			const unsigned long long y = s1;
+			s0 = y;
+			x ^= x << 23;
+			s1 = x ^ y ^ (x >> 17) ^ (y >> 26);
+			return s1 + y;
+		}
+
+		// uniform in [0, 1)
+		double NextDouble(void)
+		{
+			return (Next() >> 11) * (1.0 / 9007199254740992.0);
+		}
+
+		// uniform in [0, n)
+		unsigned long long NextBelow(unsigned long long n)
+		{
+			return n ? Next() % n : 0;
+		}
+
+	private:
+		unsigned long long s0, s1;
+};	// class fastRandom
+
+
+// Zipf distributed ranks in [1, n] using rejection-inversion sampling
+// (Hormann & Derflinger), constant time per sample and no tables
+class zipfGenerator
+{
+	public:
+		zipfGenerator(unsigned long n, double skew);
+
+		unsigned long Next(fastRandom &random) const;
+
+	private:
+		double H(double x) const;
+		double HIntegral(double x) const;
+		double HIntegralInverse(double x) const;
+
+		unsigned long	n;
+		double			skew;
+		double			hIntegralX1;
+		double			hIntegralN;
+		double			s;
+};	// class zipfGenerator
+
+
+class syntheticHitSource : public hitSource
+{
+	public:
+		// stream distinguishes the sources of different threads
+		syntheticHitSource(const syntheticConfig_t &config, unsigned long seed, unsigned stream);
+		virtual ~syntheticHitSource(void) {}
+
+		virtual bool NextHit(hitData_t &hit);
+
+	private:
+		void SetEvar(std::string &value, unsigned evar, unsigned long long valueId) const;
+
+		syntheticConfig_t	config;
+		fastRandom			random;
+		zipfGenerator		popularity;
+		unsigned			stream;
+		unsigned long long	seedMix;		// scrambles visitor ranks into visitor ids
+
+		char				filler[512];		// padding for evar values
+		double				evarMaxFrequency;	// for skipping over unset evars
+		std::bitset<NUM_EVARS>	linear;
+
+		std::vector<std::string>	urls;		// pre-generated page URLs/names/referrers
+		std::vector<std::string>	pageNames;
+		std::vector<std::string>	referrers;
+
+		unsigned long long	hitCount;
+		unsigned long long	newVisitorCount;
+		unsigned long long	purchaseCount;
+};	// class syntheticHitSource
+
+#endif // SYNTHETIC_HIT_SOURCE_H
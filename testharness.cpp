@@ -1,27 +1,29 @@
 #include <pthread.h>
+#include <sys/prctl.h>
 
 #include <time.h>
 
 #include "abstraction/vcookiestore.h"
 #include "abstraction/vcookie.h"
-
-#define _TOSTRING(x) #x
-#define TOSTRING(x) _TOSTRING(x)
-#define _APPEND_H(x) x.h
-#define APPEND_H(x) _APPEND_H(x)
-
-// change for different storage engine
-#if !defined(STORAGE_ENGINE)
-	#define STORAGE_ENGINE	VCStoreInMemory
-#endif
-
-#include TOSTRING(APPEND_H(STORAGE_ENGINE))
+#include "abstraction/vcengineregistry.h"
+#include "hdrHistogram.h"
+#include "hiResClock.h"
+#include "hitSource.h"
+#include "metricsServer.h"
+#include "memcachedMock.h"
+#include "perfCounters.h"
+#include "replayReader.h"
+#include "runResults.h"
+#include "syntheticHitSource.h"
+#include "workloadProfile.h"
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <iterator>
 
 #include <map>
+#include <deque>
 
 #include <boost/cerrno.hpp>
 #include <boost/utility.hpp>
@@ -67,7 +69,45 @@ pid_t parentPid;
 pthread_mutex_t	fileReadMutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t	consoleMutex = PTHREAD_MUTEX_INITIALIZER;
 
-class hitSource;
+class hiResTimer;
+
+/*
+ * running totals of a thread, read by the results-stream writer and the
+ * metrics endpoint while the thread is still going
+ * each thread is the only writer of its own, so plain relaxed loads and
+ * stores are enough, and each has a cache line to itself
+ */
+typedef struct
+{
+	unsigned long long	hits;
+	unsigned long long	readNS;
+	unsigned long long	writeNS;
+	unsigned long long	hitNS;
+	unsigned long long	storeCookies;	// from the store's GetStats, every LIVE_STORE_HITS hits
+	unsigned long long	storeBytes;
+	unsigned long long	purged;			// cookies removed by purge-age
+	unsigned long long	purgeRuns;
+	unsigned long long	purgeNS;
+} __attribute__((aligned(64))) liveCounters_t;
+
+// how often (in hits) a worker refreshes its store numbers and checks for a purge
+const unsigned LIVE_STORE_HITS = 1024;
+
+// add to a counter only this thread writes
+inline void LiveAdd(unsigned long long &counter, unsigned long long n)
+{
+	__atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+inline void LiveSet(unsigned long long &counter, unsigned long long n)
+{
+	__atomic_store_n(&counter, n, __ATOMIC_RELAXED);
+}
+
+inline unsigned long long LiveGet(const unsigned long long &counter)
+{
+	return __atomic_load_n(&counter, __ATOMIC_RELAXED);
+}
 
 /*
  * parameters passed to each thread
@@ -80,6 +120,18 @@ typedef struct
 	vector<unsigned long>	*aggregateRate;	// parents accumulated rates
 	vector<unsigned long>	*aggregateReadTimer;
 	vector<unsigned long>	*aggregateWriteTimer;
+	hiResTimer		*readTimer;		// owned by the parent, which merges the
+	hiResTimer		*writeTimer;	// histograms once the thread is joined
+	hiResTimer		*hitTimer;
+	hiResTimer		*lateTimer;		// open-loop: how late each request started
+	hiResTimer		*batchTimer;	// batch-size > 1: load, apply and save of each batch
+	struct batchCounters_t	*batch;		// batch-size > 1
+	class stageTimers	*stages;		// per-stage breakdown of each hit
+	class perfPhases	*perf;			// hardware counters per phase, NULL unless perf-counters
+	vector<unsigned long>	*aggregateBacklog;
+	liveCounters_t	*live;			// for the results stream and metrics endpoint
+	hdrHistogram	*liveHitLatency;	// metrics endpoint only, else NULL
+	map<string, unsigned long long>	*storeStats;	// every thread's store stats summed
 } threadParam_t;
 
 /*
@@ -94,30 +146,122 @@ struct options_t
 	unsigned long randomSeed;
 	string configFile;
 	float	replayRate;
+	bool	openLoop;
 	vector<string> replayFiles;
+	unsigned inputBuffers;
+	unsigned inputBufferKB;
+	unsigned inputPrefetchMB;
+	unsigned linearDepth;
+	syntheticConfig_t synthetic;
+	string syntheticProfile;
+	string profileFile;
+	unsigned profileSample;
+	unsigned profileVisitorsMB;
+	string histogramFile;
+	vector<string> mergeHistograms;
+	string mergeOutput;
+	bool noTSC;
+	bool timerSelftest;
+	string resultsFile;
+	string resultsFormat;
+	string resultsStream;
+	unsigned resultsInterval;
+	unsigned metricsPort;
+	string metricsSocket;
+	unsigned metricsWindow;
+	unsigned mockPort;						// stand-in memcached server, 0 = none
+	memcachedMock::faults_t mockFaults;
+	unsigned long purgeAge;
+	unsigned purgeInterval;
+	bool perfCounters;
+	unsigned perfSample;
+	unsigned batchSize;
+	string engine;
+	vector<string> engineDecorators;		// innermost first
+	vector<string> enginePlugins;
+	VCStackOptions engineOptions;			// engine.<name>.<option>= from the config
+	bool listEngines;
 } options;
 
+// collected for the results-file
+runResults results;
+
 
-// little helper function to subtract two timespec values
-// returns difference in nanoseconds
-unsigned long operator-(struct timespec &left, struct timespec &right)
+// sleep until a hiResClock time in nanoseconds
+void SleepUntil(unsigned long long wakeNS)
 {
-	// if left is less than right, return 0
-	if (left.tv_sec < right.tv_sec ||
-			(left.tv_sec == right.tv_sec && left.tv_nsec < right.tv_nsec))
-		return 0L;
-	
-	return ((left.tv_sec - right.tv_sec) * NANOSECOND) +
-			left.tv_nsec - right.tv_nsec;
+	// hiResClock doesn't line up with any kernel clock, so turn what's left
+	// into an absolute CLOCK_MONOTONIC deadline, and check again on waking
+	// (signals, or the two clocks having drifted a little)
+	unsigned long long nowNS;
+	while ((nowNS = hiResClock::NowNS()) < wakeNS)
+	{
+		struct timespec wake;
+		clock_gettime(CLOCK_MONOTONIC, &wake);
+
+		unsigned long long ns = wake.tv_nsec + (wakeNS - nowNS);
+		wake.tv_sec += ns / NANOSECOND;
+		wake.tv_nsec = ns % NANOSECOND;
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+	}
 }
 
+
+// the replay epoch shared by all the workers: the first hit any thread
+// sees pins virtual (hit) time to the local monotonic clock, so the threads
+// agree on where playback is instead of each starting their own clock
+class replayClock : private boost::noncopyable
+{
+	public:
+		replayClock(void) : started(false), firstHitNS(0), startNS(0)
+		{
+			pthread_mutex_init(&mutex, NULL);
+		}
+		~replayClock(void)
+		{
+			pthread_mutex_destroy(&mutex);
+		}
+
+		// returns the epoch, setting it from the caller's hit if nobody has yet
+		void Epoch(unsigned long long hitNS, unsigned long long &_firstHitNS, unsigned long long &_startNS)
+		{
+			pthread_mutex_lock(&mutex);
+			if (!started)
+			{
+				firstHitNS = hitNS;
+				startNS = hiResClock::NowNS();
+				started = true;
+			}
+			_firstHitNS = firstHitNS;
+			_startNS = startNS;
+			pthread_mutex_unlock(&mutex);
+		}
+
+	private:
+		bool				started;
+		unsigned long long	firstHitNS;		// virtual time of the first hit
+		unsigned long long	startNS;		// hiResClock when it was seen
+		pthread_mutex_t		mutex;
+} playbackClock;
+
+
 // use this to control the rate of generation of requests
 // this class is explicitly not copyable at the moment
 class rateControl : private boost::noncopyable
 {
 	public:
-		rateControl(unsigned long _eventsPerSecond) : mode(EVENT_BASED), eventsPerSecond(_eventsPerSecond) { Start(); }
-		rateControl(float _replayRate) : mode(HIT_BASED), firstHitTime(0), replayRate(_replayRate) { }
+		rateControl(unsigned long _eventsPerSecond) : 
+			eventsCount(0), mode(EVENT_BASED), startNS(0), eventsPerSecond(_eventsPerSecond),
+			clock(NULL), epochSet(false), firstHitNS(0), startClockNS(0), replayRate(1),
+			second(0), hitsThisSecond(0), hitsLastSecond(0) { 
+			backlogPerSecond.reserve(60*60);	// preallocate space for 1 hour of records
+			Start(); 
+		}
+		rateControl(float _replayRate, replayClock &_clock) : 
+			eventsCount(0), mode(HIT_BASED), startNS(0), eventsPerSecond(0),
+			clock(&_clock), epochSet(false), firstHitNS(0), startClockNS(0), replayRate(_replayRate),
+			second(0), hitsThisSecond(0), hitsLastSecond(0) { }
 		~rateControl(void) {}
 		
 	private:
@@ -131,89 +275,115 @@ class rateControl : private boost::noncopyable
 		} mode;
 		
 		// for EVENT_BASED clocks
-		struct timespec clockPrev;			// the previous clock value
+		unsigned long long	startNS;		// hiResClock when we started
 		unsigned long	eventsPerSecond;	// 0 = no limits
+		vector<unsigned long>	backlogPerSecond;	// most requests we were behind schedule each second
 
 		// for HIT_BASED clocks
-		time_t			firstHitTime;		// virtual time we started (for playback rate)
-		time_t			startClockTime;		// what local clock time we started
+		replayClock		*clock;				// epoch shared with the other threads
+		bool			epochSet;
+		unsigned long long	firstHitNS;		// virtual time we started (for playback rate)
+		unsigned long long	startClockNS;	// what local clock time we started
 		float			replayRate;			// multiplier for how fast to play back (1=100%)
+
+		// hit times only have 1 second resolution: spread the hits of each
+		// second evenly, guessing the count from this thread's previous second
+		time_t			second;
+		unsigned long	hitsThisSecond;
+		unsigned long	hitsLastSecond;
 	
 		
 	public:
 		// start the timer
 		void Start(void)
 		{
-			clock_gettime(CLOCK_REALTIME, &clockPrev);
+			startNS = hiResClock::NowNS();
 			eventsCount = 0;
 		}
 		
 		// increment the count of events and sleep until caller
 		// should run again based on rate previously set
-		void IncrementAndWait(unsigned long howMany, time_t hit_time_gmt)
+		// returns when the request was meant to start (hiResClock ns),
+		// in the past if we are running behind
+		unsigned long long IncrementAndWait(unsigned long howMany, time_t hit_time_gmt)
 		{
 			eventsCount += howMany;
 			
 			if (mode == HIT_BASED)
 			{
-				if (firstHitTime == 0)
+				// place the hit within its second
+				if (hit_time_gmt != second)
 				{
-					firstHitTime = hit_time_gmt;
-					startClockTime = time(NULL);
-					return;		// no delay for the first hit
+					// only a run of consecutive seconds gives a usable count
+					hitsLastSecond = (hit_time_gmt == second + 1) ? hitsThisSecond : 0;
+					hitsThisSecond = 0;
+					second = hit_time_gmt;
 				}
-				
-				// calculate the time for the next hit based on our virtual
-				// clock and the replay rate
-				
-				// how many seconds have actually elapsed since we started
-				// times the replay rate
-				// plus the time of the first hit
-				// equals the current 'virtual' time
-				// if that is less than the next hit time, we need to wait
-				// because our virtual clock hasn't caught up to the next hit yet
-				time_t	virtualTime;
-				while((virtualTime = ((int)((time(NULL) - startClockTime) * replayRate) + firstHitTime)) < hit_time_gmt)
+				unsigned long long offsetNS = 0;
+				if (hitsLastSecond)
+				{
+					// more hits than last second bunch up at the end of this one
+					unsigned long slot = hitsThisSecond < hitsLastSecond ? hitsThisSecond : hitsLastSecond - 1;
+					offsetNS = slot * (unsigned long long) NANOSECOND / hitsLastSecond;
+				}
+				hitsThisSecond += howMany;
+
+				unsigned long long hitNS = hit_time_gmt * (unsigned long long) NANOSECOND + offsetNS;
+
+				if (!epochSet)
 				{
-					// how many real seconds do we need to wait?
-					long	sleepSeconds = (int)((hit_time_gmt - virtualTime) / replayRate);
-					if (sleepSeconds > 1)
-						usleep(MICROSECOND * (sleepSeconds-1));	// 2 or more: sleep for 1 less
-					else
-						pthread_yield();	// just yield and loop for the last fractional second
+					clock->Epoch(hitNS, firstHitNS, startClockNS);
+					epochSet = true;
 				}
+				
+				// the hit is due once the local clock has moved
+				// (hit time - first hit time) / replay rate past the start
+				// hits from before the epoch were due at the start
+				unsigned long long dueNS = startClockNS;
+				if (hitNS > firstHitNS)
+					dueNS += (unsigned long long)((hitNS - firstHitNS) / replayRate);
+
+				if (dueNS > hiResClock::NowNS())
+					SleepUntil(dueNS);
+
+				return dueNS;
 			}
 			else
 			{
 				// run "wide open" with no restrictions
 				if (eventsPerSecond == 0)
-					return;
+					return hiResClock::NowNS();
 
-				struct timespec clockNow;
-				clock_gettime(CLOCK_REALTIME, &clockNow);
-				
-				// while nanoseconds per event * number of events so far 
+				// nanoseconds per event * number of events so far 
 				//		(how much time we should have spent for this many events)
-				// is greater than the elapsed time
-				// we should wait
-				while ((NANOSECOND / eventsPerSecond) * eventsCount 
-						> clockNow - clockPrev)
+				// sleep until then if we are ahead
+				unsigned long long intervalNS = NANOSECOND / eventsPerSecond;
+				unsigned long long dueNS = startNS + intervalNS * eventsCount;
+				unsigned long long nowNS = hiResClock::NowNS();
+				if (dueNS > nowNS)
+					SleepUntil(dueNS);
+				else
 				{
-					// calculate the time remaining before we go again in microseconds
-					unsigned long uSecDiff = 
-							((NANOSECOND / eventsPerSecond) * eventsCount 
-							- (clockNow - clockPrev)) / 1000;	// NANOSECOND / 1000 = MICROSECOND
-
-					if (uSecDiff)
-						usleep(uSecDiff);	// sleep so we don't waste cycles reading the clock
-					else
-						pthread_yield();	// let others run
-
-					clock_gettime(CLOCK_REALTIME, &clockNow);
+					// behind: count the requests that should have started by now
+					unsigned long second = (nowNS - startNS) / NANOSECOND;
+					unsigned long backlog = (nowNS - dueNS) / intervalNS;
+
+					if (backlogPerSecond.size() <= second)
+						backlogPerSecond.resize(second + 1, 0);
+					if (backlog > backlogPerSecond[second])
+						backlogPerSecond[second] = backlog;
 				}
+
+				return dueNS;
 			}
 		}
 
+		// the most requests we were behind each second (request-rate only)
+		const vector<unsigned long> &BacklogPerSecond(void) const
+		{
+			return backlogPerSecond;
+		}
+
 		// getter
 		unsigned long EventsPerSecond(void) const
 		{
@@ -242,8 +412,8 @@ class rateMonitor : private boost::noncopyable
 		~rateMonitor(void) {}
 		
 	private:
-		struct timespec clockPrev;			// the previous clock value
-											// if clockPrev.tv_sec == 0, clock not set
+		unsigned long long	clockPrev;		// the previous clock value (hiResClock ns)
+											// if clockPrev == 0, clock not set
 		vector<unsigned long>	eventsPerSecond;
 		unsigned long	eventsCount;		// events this second
 	
@@ -251,24 +421,23 @@ class rateMonitor : private boost::noncopyable
 		// start the timer
 		void Start(void)
 		{
-			clock_gettime(CLOCK_REALTIME, &clockPrev);
+			clockPrev = hiResClock::NowNS();
 			eventsCount = 0;
 		}
 		
 		// increment the count of events
 		void Increment(unsigned long howMany = 1)
 		{
-			if (clockPrev.tv_sec == 0)
+			if (clockPrev == 0)
 				Start();
 
-			struct timespec clockNow;
-			clock_gettime(CLOCK_REALTIME, &clockNow);
+			unsigned long long clockNow = hiResClock::NowNS();
 
 			// has it been more than a second
-			if (clockNow - clockPrev > NANOSECOND)
+			if (clockNow > clockPrev + NANOSECOND)
 			{
 				// create 1 entry for each full second
-				while (clockNow - clockPrev > NANOSECOND)
+				while (clockNow > clockPrev + NANOSECOND)
 				{
 					// add a new entry to the vector with the current count per second
 					// multiply the event count * 1B, 
@@ -280,7 +449,7 @@ class rateMonitor : private boost::noncopyable
 					eventsCount = 0;
 					
 					// increment seconds on start clock
-					clockPrev.tv_sec += 1;
+					clockPrev += NANOSECOND;
 				}
 			}
 			
@@ -290,8 +459,7 @@ class rateMonitor : private boost::noncopyable
 		// stop the clock and tally up the final second(s) if any
 		void Stop(void)
 		{
-			struct timespec clockNow;
-			clock_gettime(CLOCK_REALTIME, &clockNow);
+			unsigned long long clockNow = hiResClock::NowNS();
 
 			// the following code is a little tricky
 			// in reality we will EITHER execute the code in the WHILE
@@ -299,7 +467,7 @@ class rateMonitor : private boost::noncopyable
 			// OR maybe neither (unlikely, but possible), but never both!
 			
 			// create 1 entry for each full second
-			while (clockNow - clockPrev > NANOSECOND)
+			while (clockNow > clockPrev + NANOSECOND)
 			{
 				// add a new entry to the vector with the current count per second
 				eventsPerSecond.push_back(eventsCount);
@@ -308,18 +476,18 @@ class rateMonitor : private boost::noncopyable
 				eventsCount = 0;
 
 				// increment seconds on start clock
-				clockPrev.tv_sec += 1;
+				clockPrev += NANOSECOND;
 			}
 			
 			// add 1 more entry for the last partial second (if > 5% of a second)
-			if (eventsCount > 0 && clockNow - clockPrev > NANOSECOND / 20)
+			if (eventsCount > 0 && clockNow > clockPrev + NANOSECOND / 20)
 				// multiply the event count * 1B, 
 				//	then divide by the clock difference in nanoseconds
 				// this preserves the maximum accuracy when using integer math
 				eventsPerSecond.push_back((eventsCount * NANOSECOND) / (clockNow - clockPrev));
 				
 			eventsCount = 0;
-			clockPrev.tv_sec = 0;	// flag that clock is not set
+			clockPrev = 0;	// flag that clock is not set
 		}
 		
 		// return the rate of events per second
@@ -332,147 +500,270 @@ class rateMonitor : private boost::noncopyable
 
 
 // use high resolution timing to accumulate time
+// every sample also goes into a latency histogram, kept for the whole run
+// and per second
 // this class is explicitly not copyable at the moment
 class hiResTimer : private boost::noncopyable
 {
 	public:
 		hiResTimer(void) : eventsCount(0), ns(0) {
+			clockPrev = 0;					// clock not set until the first Start
 			nsPerSecond.reserve(60*60);		// preallocate space for 1 hour of records
+			intervals.reserve(60*60);
 		}
 		~hiResTimer(void) {}
 		
 	private:
-		struct timespec clockStart;			// start of this timing block
-		struct timespec clockPrev;			// the previous clock value for seconds
-											// if clockPrev.tv_sec == 0, clock not set
+		unsigned long long	clockStart;		// start of this timing block (hiResClock ns)
+		unsigned long long	clockPrev;		// the previous clock value for seconds
+											// if clockPrev == 0, clock not set
 		unsigned long	eventsCount;		// events this second
 		unsigned long	ns;					// cumulative count of ns this second
 		
 		vector<unsigned long>	nsPerSecond;	// each entry is the average number of nanoseconds counted in that second
+
+		hdrHistogram	histogram;			// every completed second
+		hdrHistogram	interval;			// this second
+		vector<hdrSnapshot_t>	intervals;	// the non-empty buckets of each completed second
+
+		// close out any full seconds up to clockNow
+		void NextSeconds(unsigned long long clockNow)
+		{
+			// create 1 entry for each full second
+			while (clockNow > clockPrev + NANOSECOND)
+			{
+				// add a new entry to the vector with the average ns
+				nsPerSecond.push_back(ns / (eventsCount == 0 ? 1 : eventsCount));
+				
+				// reset event count to 0 for next second
+				eventsCount = 0;
+				
+				// reset ns to 0 as well
+				ns = 0;
+
+				// keep the second's latencies, then start over
+				intervals.push_back(hdrSnapshot_t());
+				if (interval.Count())
+				{
+					interval.Snapshot(intervals.back());
+					histogram.Add(interval);
+					interval.Reset();
+				}
+				
+				// increment seconds on start clock
+				clockPrev += NANOSECOND;
+			}
+		}
 		
 	public:
 		// start the timer
 		void Start(void)
 		{
-			if (clockPrev.tv_sec == 0)
-				clock_gettime(CLOCK_REALTIME, &clockPrev);
-			clock_gettime(CLOCK_REALTIME, &clockStart);
+			clockStart = hiResClock::NowNS();
+			if (clockPrev == 0)
+				clockPrev = clockStart;
+		}
+
+		// start the timer from an earlier hiResClock time (in ns)
+		// so a request is timed from when it should have started
+		void StartAt(unsigned long long ns)
+		{
+			if (clockPrev == 0)
+				clockPrev = hiResClock::NowNS();
+			clockStart = ns;
 		}
 		
 		// increment the count of events and ns
 		// update the vector if more than 1s has elapsed
-		void Stop()
+		// returns the time this event took
+		unsigned long Stop()
+		{
+			unsigned long long clockNow = hiResClock::NowNS();
+			unsigned long elapsed = clockNow > clockStart ? clockNow - clockStart : 0;
+
+			Record(clockNow, elapsed);
+			return elapsed;
+		}
+
+		// count an event timed elsewhere, which ended at clockNow
+		void Record(unsigned long long clockNow, unsigned long elapsed)
 		{
-			struct timespec clockNow;
-			clock_gettime(CLOCK_REALTIME, &clockNow);
+			if (clockPrev == 0)
+				clockPrev = clockNow;
 
 			// has it been more than a second since the last update
-			if (clockNow - clockPrev > NANOSECOND)
-			{
-				// create 1 entry for each full second
-				while (clockNow - clockPrev > NANOSECOND)
-				{
-					// add a new entry to the vector with the average ns
-					nsPerSecond.push_back(ns / (eventsCount == 0 ? 1 : eventsCount));
-					
-					// reset event count to 0 for next second
-					eventsCount = 0;
-					
-					// reset ns to 0 as well
-					ns = 0;
-					
-					// increment seconds on start clock
-					clockPrev.tv_sec += 1;
-				}
-			}
+			if (clockNow > clockPrev + NANOSECOND)
+				NextSeconds(clockNow);
 			
 			// update number of events and ns sum for this second
 			eventsCount += 1;
-			ns += clockNow - clockStart;
+			ns += elapsed;
+			interval.Record(elapsed);
 		}
 
 		// return the average ns for each second
 		const vector<unsigned long> NsPerSecond(void)
 		{
-			// see if we need to update the last second
-			struct timespec clockNow;
-			clock_gettime(CLOCK_REALTIME, &clockNow);
+			// never started, nothing to report
+			if (clockPrev == 0)
+				return nsPerSecond;
 
-			// the following code is a little tricky
-			// in reality we will EITHER execute the code in the WHILE
-			// OR execute the code in the IF
-			// OR maybe neither, but never both!
-			
+			// see if we need to update the last second
 			// create 1 entry for each full second we may have missed
-			while (clockNow - clockPrev > NANOSECOND)
-			{
-				// add a new entry to the vector with the average ns
-				nsPerSecond.push_back(ns / (eventsCount == 0 ? 1 : eventsCount));
-				
-				// reset event count to 0 for next second
-				eventsCount = 0;
-				
-				// reset ns to 0 as well
-				ns = 0;
-				
-				// increment seconds on start clock
-				clockPrev.tv_sec += 1;
-			}
+			NextSeconds(hiResClock::NowNS());
 			
 			// add 1 more entry for the last partial second (if any)
+			// to a copy, so asking again doesn't add it twice
+			vector<unsigned long> result(nsPerSecond);
 			if (eventsCount > 0)
-				nsPerSecond.push_back(ns / eventsCount);
+				result.push_back(ns / eventsCount);
 				
-			return nsPerSecond;
+			return result;
+		}
+
+		// latencies of the whole run so far
+		hdrHistogram Histogram(void) const
+		{
+			hdrHistogram result(histogram);
+			result.Add(interval);
+
+			return result;
+		}
+
+		// latencies for each second, including the current partial second (if any)
+		vector<hdrSnapshot_t> Intervals(void) const
+		{
+			vector<hdrSnapshot_t> result(intervals);
+			if (interval.Count())
+			{
+				result.push_back(hdrSnapshot_t());
+				interval.Snapshot(result.back());
+			}
+
+			return result;
 		}
 };	// class hiResTimer
 
 
-typedef struct
+#if !defined(VC_NO_STAGE_TIMING)
+// times the stages of each hit (see abstraction/vcstagetimer.h)
+// one per worker thread, owned by the parent like the other timers
+class stageTimers : public VCStageSink
 {
-	unsigned		rsid;				// report suite for this hit
-	
-	unsigned long	visid_high;
-	unsigned long	visid_low;
-	bool			visid_new;			// are we SURE this is a new visid
-	time_t			hit_time_gmt;
-	unsigned long	visit_num;
-	string			referrer;
-	string			page_url;
-	string			page_name;			// defaults to page URL
-	time_t			purchase_time_gmt;
-	string			purchaseid;
-	string			campaign;
-	
-	string			evar[75];
-} hitData_t;
+	public:
+		virtual unsigned long long StageClock(void)
+		{
+			return hiResClock::NowNS();
+		}
+
+		virtual void StageDone(VCStage stage, unsigned long long started, unsigned long long ended)
+		{
+			timers[stage].Record(ended, ended > started ? ended - started : 0);
+		}
+
+		hiResTimer *Timer(unsigned stage) { return &timers[stage]; }
+
+	private:
+		hiResTimer	timers[VC_STAGE_COUNT];
+};	// class stageTimers
+#else
+class stageTimers {};
+#endif
+
 
+// the parts of a hit the hardware counters are split into
+enum perfPhase {
+	PERF_PHASE_LOAD = 0,		// VCookie constructor, the store's load
+	PERF_PHASE_MUTATE,			// ApplyHit
+	PERF_PHASE_STORE,			// VCookie::Store
+	PERF_PHASE_COUNT
+};
 
+const char *PERF_PHASE_NAMES[PERF_PHASE_COUNT] = { "load", "mutate", "store" };
 
-// Pure virtual base class used as an interface
-// set it as not copyable
-class hitSource : private boost::noncopyable
+// hardware counters for the phases of the sampled hits (see perfCounters.h)
+// opened by the worker thread, owned and summed by the parent
+class perfPhases : private boost::noncopyable
 {
 	public:
-		hitSource(void) { }
-		virtual ~hitSource(void);
-		
-		virtual bool NextHit(hitData_t &hit) = 0;
-};	// class hitSource
+		perfPhases(void) : marked(false), hits(0), enabledNS(0), runningNS(0)
+		{
+			memset(totals, 0, sizeof(totals));
+		}
+
+		// start counting the calling thread, false (errno) if there are no counters
+		bool Open(void) { return counters.Open(); }
+		void Close(void) { counters.Close(); }
+		bool IsOpen(void) const { return counters.IsOpen(); }
+
+		// start of a sampled hit
+		void Mark(void)
+		{
+			marked = counters.Read(last);
+		}
+
+		// everything since the mark (or the previous phase) belongs to phase
+		void Phase(perfPhase phase)
+		{
+			perfCounters::reading_t now;
+			if (!marked || !counters.Read(now))
+			{
+				marked = false;
+				return;
+			}
+
+			for (unsigned i = 0; i < perfCounters::COUNT; i++)
+				totals[phase][i] += now.value[i] - last.value[i];
+			last = now;
+		}
+
+		// end of a sampled hit
+		void Done(void)
+		{
+			if (!marked)
+				return;
+
+			hits++;
+			enabledNS = last.enabledNS;
+			runningNS = last.runningNS;
+			marked = false;
+		}
+
+		void Add(const perfPhases &other)
+		{
+			for (unsigned p = 0; p < PERF_PHASE_COUNT; p++)
+				for (unsigned i = 0; i < perfCounters::COUNT; i++)
+					totals[p][i] += other.totals[p][i];
+			hits += other.hits;
+			enabledNS += other.enabledNS;
+			runningNS += other.runningNS;
+		}
+
+		unsigned long long Hits(void) const { return hits; }
+		unsigned long long Total(unsigned phase, unsigned counter) const { return totals[phase][counter]; }
+
+		// share of the time the counters were actually on the PMU (< 1 when multiplexed)
+		double Coverage(void) const { return enabledNS ? (double) runningNS / enabledNS : 0; }
 
-// base dtor doesn't need to do anything
-hitSource::~hitSource(void) {}
+	private:
+		perfCounters	counters;
+		perfCounters::reading_t	last;
+		bool			marked;			// last is the start of the current phase
+
+		unsigned long long	totals[PERF_PHASE_COUNT][perfCounters::COUNT];
+		unsigned long long	hits;		// sampled hits with every phase counted
+		unsigned long long	enabledNS;
+		unsigned long long	runningNS;
+};	// class perfPhases
 
 
 // implementation of hitSource for data warehouse files
 class dwfileHitSource : public hitSource
 {
 	private:
-		ifstream	infile;
+		replayReader	reader;		// decompresses the files on its own thread
 		pthread_mutex_t	fileReadMutex;
 		map<string,int>	fieldMap;
-		vector<string> filenames;
-		vector<string>::iterator currFilename;
 
 		// precalculated field offsets
 		int		f_userid,
@@ -503,19 +794,11 @@ class dwfileHitSource : public hitSource
 			return h;
 		}
 		
-		void openNextFile()
-		{
-			if (infile.is_open())
-				infile.close();
-
-			if (currFilename < filenames.end())
-			{
-				infile.open((*currFilename++).c_str());
-			}
-		}
-		
 	public:
-		dwfileHitSource(vector<string> files, pthread_mutex_t &readMutex) : fileReadMutex(readMutex)
+		dwfileHitSource(vector<string> files, pthread_mutex_t &readMutex) : 
+			reader(files, options.inputBuffers, options.inputBufferKB * 1024UL,
+					options.inputPrefetchMB * 1024UL * 1024UL),
+			fileReadMutex(readMutex)
 		{
 			// setup hash map of field names to index
 			// assumes a specific format to the dw export file
@@ -545,42 +828,27 @@ class dwfileHitSource : public hitSource
 			f_purchaseid = fieldMap["post_purchaseid"];
 			f_campaign = fieldMap["post_campaign"];
 			f_evar1 = fieldMap["post_evar1"];
-
-			// setup files array and iterator
-			filenames = files;
-			currFilename = filenames.begin();
-			
-			// first file will be opened on call to NextHit
-			// openNextFile();
-		}
-		~dwfileHitSource(void) 
-		{ 
-			infile.close();
 		}
+		~dwfileHitSource(void) {}
 	
 		virtual bool NextHit(hitData_t &hit);
+
+		// the input stage, for reporting
+		replayReader &Reader(void) { return reader; }
 };	// class dwfileHitSource
 
 bool dwfileHitSource::NextHit(hitData_t &hit)
 {
+	string line;
+
 	pthread_mutex_lock(&fileReadMutex);
-	
-	// step to the next file if necessary
-	if (!infile.is_open() || infile.eof())
-		openNextFile();
+	bool haveLine = reader.NextLine(line);
+	pthread_mutex_unlock(&fileReadMutex);
 
-	// should be good now, if there is any data left at all
-	if (infile.is_open() && infile.good() && !infile.eof())
+	// there is data left, in this file or the next one
+	if (haveLine)
 	{
-		string line;
-		
-		getline(infile, line);
-
-		// I know unlocking inside a conditional is not the safest way, but
-		// it was much better than doing two tests.
-		pthread_mutex_unlock(&fileReadMutex);
-
-		if (infile.eof() && line.length() == 0)
+		if (line.length() == 0)
 			return NextHit(hit);
 
 		string slash = "\\\\";	// escaped version of a slash
@@ -633,10 +901,7 @@ bool dwfileHitSource::NextHit(hitData_t &hit)
 		return true;
 	}
 
-	// unlock here in the case that the file was closed, eof, etc.
-	pthread_mutex_unlock(&fileReadMutex);
-	
-	// fail: file not open, EOF, etc.
+	// fail: all files exhausted
 	return false;
 }
 
@@ -652,6 +917,77 @@ ostream& operator<<(ostream& os, const vector<T>& v)
     return os;
 }
 
+// an option's value as text, false for types we don't know (or no value)
+bool OptionText(const boost::any &value, string &text)
+{
+	ostringstream os;
+
+	#define OPTION_TYPE(T)	if (value.type() == typeid(T)) \
+			{ os << any_cast<T>(value); text = os.str(); return true; }
+	OPTION_TYPE(string);
+	OPTION_TYPE(int);
+	OPTION_TYPE(unsigned);
+	OPTION_TYPE(unsigned long);
+	OPTION_TYPE(float);
+	OPTION_TYPE(double);
+	#undef OPTION_TYPE
+
+	if (value.type() == typeid(bool))
+	{
+		text = any_cast<bool>(value) ? "true" : "false";
+		return true;
+	}
+	if (value.type() == typeid(vector<string>))
+	{
+		text = join(any_cast< vector<string> >(value), ",");
+		return true;
+	}
+	return false;
+}
+
+// engine.<name>.<option>= lines aren't declared (the engines and their
+// options aren't known until plugins are loaded), keep them for the
+// registry to check and turn anything else unknown away
+bool TakeEngineOptions(const po::parsed_options &parsed)
+{
+	for (unsigned i = 0; i < parsed.options.size(); i++)
+	{
+		const po::option &o = parsed.options[i];
+		if (!o.unregistered)
+			continue;
+
+		size_t dot = o.string_key.find('.', 7);
+		if (o.string_key.compare(0, 7, "engine.") || dot == string::npos || o.value.empty())
+		{
+			cout << "unrecognised option '" << o.string_key << "'\n";
+			return false;
+		}
+		options.engineOptions[o.string_key.substr(7, dot - 7)][o.string_key.substr(dot + 1)] = o.value[0];
+	}
+	return true;
+}
+
+// the engines and decorators linked in or loaded, and their options
+void ListEngines(void)
+{
+	for (unsigned decorators = 0; decorators < 2; decorators++)
+	{
+		cout << (decorators ? "\nDecorators (engine-decorator=):\n" : "Engines (engine=):\n");
+
+		vector<string> names = VCEngineRegistry::Names(decorators);
+		for (unsigned i = 0; i < names.size(); i++)
+		{
+			const VCEngineRegistry::Engine *engine = VCEngineRegistry::Find(names[i]);
+			cout << "  " << engine->name << "\t" << engine->description << "\n";
+
+			for (unsigned o = 0; o < engine->options.size(); o++)
+				cout << "    engine." << engine->name << "." << engine->options[o].name
+					<< " (= " << engine->options[o].defaultValue << ")\t"
+					<< engine->options[o].description << "\n";
+		}
+	}
+}
+
 int Configure(int ac, char* av[])
 {
     try {
@@ -663,6 +999,33 @@ int Configure(int ac, char* av[])
             ("help", "display help")
             ("verbose", po::value<int>(&options.verbose)->default_value(1), 
 					"how noisy to be (0=errors only, 5=very chatty)")
+            ("profile", po::value<string>(&options.profileFile),
+					"analyze the replay files and write a JSON workload profile here (no store is used)")
+            ("profile-sample", po::value<unsigned>(&options.profileSample)->default_value(16),
+					"build cookies for 1 in N visitors when profiling, to measure cookie sizes (0=off)")
+            ("profile-visitors-mb", po::value<unsigned>(&options.profileVisitorsMB)->default_value(256),
+					"memory for counting each visitor's hits when profiling, past it only a sample of the visitors is counted")
+            ("merge-histograms", po::value< vector<string> >(&options.mergeHistograms)->multitoken(),
+					"merge histogram-files from several runs and report their percentiles (no test is run)")
+            ("merge-output", po::value<string>(&options.mergeOutput),
+					"write the merged histograms here")
+            ("no-tsc", po::bool_switch(&options.noTSC),
+					"time with CLOCK_MONOTONIC_RAW even if the TSC is usable")
+            ("timer-selftest", po::bool_switch(&options.timerSelftest),
+					"report the cost of the timers and clocks (no test is run)")
+            ("list-engines", po::bool_switch(&options.listEngines),
+					"list the storage engines and decorators with their options (no test is run)")
+            ;
+
+        // on the command line or in the config file
+        po::options_description engine("Storage engine options (and engine.<engine>.<option>= in the config file)");
+        engine.add_options()
+            ("engine", po::value<string>(&options.engine)->default_value("memory"),
+					"storage engine to test")
+            ("engine-decorator", po::value< vector<string> >(&options.engineDecorators)->composing(),
+					"wrap the engine in this decorator (multiple allowed, innermost first)")
+            ("engine-plugin", po::value< vector<string> >(&options.enginePlugins)->composing(),
+					"shared object to load more engines from (multiple allowed)")
             ;
     
         // Declare a group of options that will be 
@@ -677,10 +1040,91 @@ int Configure(int ac, char* av[])
 					"requests per second (per thread), 0 = unlimited")
             ("replay-rate", po::value<float>(&options.replayRate)->default_value(0),
 					"rate multiplier for playback from replay file (0.5=50%, 2=200%, 1=100%)")
+            ("open-loop", po::value<bool>(&options.openLoop)->default_value(false),
+					"time requests from when the request-rate or replay-rate says they should start, not when they do")
             ("replay-file", 
 					po::value< vector<string> >(&options.replayFiles)
 					->composing(), 
-					"recorded requests file to replay (multiple allowed)")
+					"recorded requests file to replay (multiple allowed, .gz and .zst are decompressed)")
+            ("input-buffers", po::value<unsigned>(&options.inputBuffers)->default_value(8),
+					"number of buffers between the replay file reader thread and the parser")
+            ("input-buffer-kb", po::value<unsigned>(&options.inputBufferKB)->default_value(4096),
+					"size of each replay input buffer in KB")
+            ("input-prefetch-mb", po::value<unsigned>(&options.inputPrefetchMB)->default_value(64),
+					"how far ahead of the reader to prefetch replay files in MB, 0 = off")
+            ("linear-depth", po::value<unsigned>(&options.linearDepth)->default_value(5),
+					"values kept for evars with linear allocation")
+            ("random-seed", po::value<unsigned long>(&options.randomSeed)->default_value(1),
+					"seed for the synthetic hit generator")
+            ("histogram-file", po::value<string>(&options.histogramFile),
+					"write the run's read/write/hit latency histograms here (for --merge-histograms)")
+            ("results-file", po::value<string>(&options.resultsFile),
+					"write the config, environment, per-second series, latencies and store stats here")
+            ("results-format", po::value<string>(&options.resultsFormat),
+					"json or csv (default from the results-file extension, else json)")
+            ("results-stream", po::value<string>(&options.resultsStream),
+					"append live totals here as one JSON object per line while the test runs")
+            ("results-interval", po::value<unsigned>(&options.resultsInterval)->default_value(1),
+					"seconds between results-stream lines")
+            ("metrics-port", po::value<unsigned>(&options.metricsPort)->default_value(0),
+					"serve live Prometheus metrics on 127.0.0.1 at this port, 0 = off")
+            ("metrics-socket", po::value<string>(&options.metricsSocket),
+					"serve live Prometheus metrics on this Unix socket")
+            ("metrics-window", po::value<unsigned>(&options.metricsWindow)->default_value(10),
+					"seconds of hits the live latency percentiles cover")
+            ("memcached-mock", po::value<unsigned>(&options.mockPort)->default_value(0),
+					"run a stand-in memcached server on 127.0.0.1 at this port (engine=memcached uses it), 0 = off")
+            ("memcached-mock-latency-us", po::value<unsigned>(&options.mockFaults.latencyUS)->default_value(0),
+					"delay before each of the stand-in server's responses")
+            ("memcached-mock-jitter-us", po::value<unsigned>(&options.mockFaults.jitterUS)->default_value(0),
+					"up to this much more delay, uniformly")
+            ("memcached-mock-error-rate", po::value<double>(&options.mockFaults.errorRate)->default_value(0),
+					"fraction of requests the stand-in server fails with a temporary error")
+            ("purge-age", po::value<unsigned long>(&options.purgeAge)->default_value(0),
+					"purge cookies whose last hit is this many seconds before the current hit, 0 = never")
+            ("purge-interval", po::value<unsigned>(&options.purgeInterval)->default_value(60),
+					"seconds between purges (per thread) with purge-age")
+            ("perf-counters", po::value<bool>(&options.perfCounters)->default_value(false),
+					"count cycles, instructions, cache/branch/dTLB misses for the load, mutate and store of each hit")
+            ("perf-sample", po::value<unsigned>(&options.perfSample)->default_value(16),
+					"read the perf counters on 1 in N hits (each read is a system call)")
+            ("batch-size", po::value<unsigned>(&options.batchSize)->default_value(1),
+					"hits per batch: each visitor in a batch is loaded once (LoadVCookies) and saved once (SaveVCookies), 1 = a load and save per hit")
+            ;
+
+        // Synthetic workload, used when there is no replay file
+        syntheticConfig_t &syn = options.synthetic;
+        SyntheticDefaults(syn);
+        po::options_description synthetic("Synthetic workload options (used without replay-file)");
+        synthetic.add_options()
+            ("synthetic-report-suites", po::value<unsigned>(&syn.reportSuites)->default_value(syn.reportSuites),
+					"number of report suites")
+            ("synthetic-visitors", po::value<unsigned long>(&syn.visitors)->default_value(syn.visitors),
+					"returning visitor population")
+            ("synthetic-zipf", po::value<double>(&syn.zipfSkew)->default_value(syn.zipfSkew),
+					"Zipf skew of visitor popularity (0 = uniform)")
+            ("synthetic-new-visitors", po::value<double>(&syn.newVisitorRatio)->default_value(syn.newVisitorRatio),
+					"fraction of hits from new visitors")
+            ("synthetic-evars-per-hit", po::value<double>()->default_value(4),
+					"average number of evars set per hit")
+            ("synthetic-evar-cardinality", po::value<unsigned long>()->default_value(1000),
+					"distinct values per evar")
+            ("synthetic-linear-evars", po::value<double>(&syn.linearEvarFraction)->default_value(syn.linearEvarFraction),
+					"fraction of evars with linear allocation")
+            ("synthetic-purchase-rate", po::value<double>(&syn.purchaseRate)->default_value(syn.purchaseRate),
+					"fraction of hits with a purchase")
+            ("synthetic-evar-length-min", po::value<unsigned>(&syn.evarLengthMin)->default_value(syn.evarLengthMin),
+					"shortest evar value")
+            ("synthetic-evar-length-max", po::value<unsigned>(&syn.evarLengthMax)->default_value(syn.evarLengthMax),
+					"longest evar value")
+            ("synthetic-url-length-min", po::value<unsigned>(&syn.urlLengthMin)->default_value(syn.urlLengthMin),
+					"shortest url/referrer")
+            ("synthetic-url-length-max", po::value<unsigned>(&syn.urlLengthMax)->default_value(syn.urlLengthMax),
+					"longest url/referrer")
+            ("synthetic-hits-per-second", po::value<double>(&syn.hitsPerSecond)->default_value(syn.hitsPerSecond),
+					"virtual arrival rate of all threads together (drives hit times for replay-rate)")
+            ("synthetic-profile", po::value<string>(&options.syntheticProfile),
+					"JSON workload profile (from --profile) to take the shape from, explicit synthetic-* options win")
             ;
 
         // Hidden options will not be shown to the user.
@@ -691,13 +1135,13 @@ int Configure(int ac, char* av[])
 
         
         po::options_description cmdline_options;
-        cmdline_options.add(commandLine).add(hidden);
+        cmdline_options.add(commandLine).add(engine).add(hidden);
 
         po::options_description config_file_options;
-        config_file_options.add(config);
+        config_file_options.add(config).add(engine).add(synthetic);
 
         po::options_description visible("Allowed options");
-        visible.add(commandLine).add(config);
+        visible.add(commandLine).add(engine).add(config).add(synthetic);
         
         po::positional_options_description p;
         p.add("config-file", -1);
@@ -720,13 +1164,32 @@ int Configure(int ac, char* av[])
         }
 		notify(vm);
 
+		// merging histograms and the timer self test don't need a config
+		if (vm.count("merge-histograms") || options.timerSelftest)
+			return 0;
+
+		if (options.listEngines)
+		{
+			for (unsigned i = 0; i < options.enginePlugins.size(); i++)
+			{
+				string error;
+				if (!VCEngineRegistry::LoadPlugin(options.enginePlugins[i], error))
+					cout << "can't load engine-plugin " << options.enginePlugins[i] << ": " << error << "\n";
+			}
+			ListEngines();
+			exit(0);
+		}
+
 		if (vm.count("config-file"))
 		{
 			if (options.verbose >= 1)
 				cout << "Reading config from " << options.configFile << "\n";
 
 			ifstream ifs(options.configFile.c_str());
-			store(parse_config_file(ifs, config_file_options), vm);
+			po::parsed_options parsed = parse_config_file(ifs, config_file_options, true);
+			store(parsed, vm);
+			if (!TakeEngineOptions(parsed))
+				return 1;
 		}
 		else
 		{
@@ -734,15 +1197,103 @@ int Configure(int ac, char* av[])
 				cout << "Reading config from stdin\n";
 
 			// read from stdin for config file
-			store(parse_config_file(cin, config_file_options), vm);
+			po::parsed_options parsed = parse_config_file(cin, config_file_options, true);
+			store(parsed, vm);
+			if (!TakeEngineOptions(parsed))
+				return 1;
 		}
 		notify(vm);
+
+		for (unsigned i = 0; i < options.enginePlugins.size(); i++)
+		{
+			string error;
+			if (!VCEngineRegistry::LoadPlugin(options.enginePlugins[i], error))
+			{
+				cout << "can't load engine-plugin " << options.enginePlugins[i] << ": " << error << "\n";
+				return 1;
+			}
+		}
+
+		// the memcached engine talks to the stand-in server unless told otherwise
+		if (options.mockPort && options.engine == "memcached" && !options.engineOptions["memcached"].count("host"))
+		{
+			ostringstream host;
+			host << "127.0.0.1:" << options.mockPort;
+			options.engineOptions["memcached"]["host"] = host.str();
+		}
+		options.mockFaults.seed = options.randomSeed;
+
+		string engineError;
+		if (!VCEngineRegistry::Configure(options.engine, options.engineDecorators, options.engineOptions, engineError))
+		{
+			cout << engineError << " (--list-engines shows what there is)\n";
+			return 1;
+		}
+
+		SyntheticUniformEvars(syn, vm["synthetic-evars-per-hit"].as<double>(), 
+				vm["synthetic-evar-cardinality"].as<unsigned long>());
+
+		if (vm.count("synthetic-profile"))
+		{
+			syntheticConfig_t fromProfile = syn;
+			if (!SyntheticFromProfile(fromProfile, options.syntheticProfile))
+				return 1;
+
+			// anything given explicitly still wins over the profile
+			#define FROM_PROFILE(name, field)	if (vm[name].defaulted()) syn.field = fromProfile.field
+			FROM_PROFILE("synthetic-report-suites", reportSuites);
+			FROM_PROFILE("synthetic-visitors", visitors);
+			FROM_PROFILE("synthetic-zipf", zipfSkew);
+			FROM_PROFILE("synthetic-new-visitors", newVisitorRatio);
+			FROM_PROFILE("synthetic-purchase-rate", purchaseRate);
+			FROM_PROFILE("synthetic-evar-length-min", evarLengthMin);
+			FROM_PROFILE("synthetic-evar-length-max", evarLengthMax);
+			FROM_PROFILE("synthetic-url-length-min", urlLengthMin);
+			FROM_PROFILE("synthetic-url-length-max", urlLengthMax);
+			FROM_PROFILE("synthetic-hits-per-second", hitsPerSecond);
+			#undef FROM_PROFILE
+
+			syn.startTime = fromProfile.startTime;
+			for (unsigned i = 0; i < NUM_EVARS; i++)
+			{
+				if (vm["synthetic-evars-per-hit"].defaulted())
+					syn.evarFrequency[i] = fromProfile.evarFrequency[i];
+				if (vm["synthetic-evar-cardinality"].defaulted())
+					syn.evarCardinality[i] = fromProfile.evarCardinality[i];
+			}
+		}
     
         if (vm.count("include-path"))
         {
             cout << "Include paths are: " 
                  << vm["include-path"].as< vector<string> >() << "\n";
         }
+
+		if (options.resultsFormat.length() && options.resultsFormat != "json" && options.resultsFormat != "csv")
+		{
+			cout << "results-format must be json or csv\n";
+			return 1;
+		}
+
+		if (options.batchSize == 0)
+			options.batchSize = 1;
+		if (options.batchSize > 1 && options.perfCounters)
+		{
+			// the phases are a hit's, a batch has no single load or store to count
+			cout << "perf-counters count single hits, they are off with batch-size\n";
+			options.perfCounters = false;
+		}
+
+		// everything that was set, for the results-file
+		for (po::variables_map::const_iterator v = vm.begin(); v != vm.end(); v++)
+		{
+			string text;
+			if (OptionText(v->second.value(), text))
+				results.Config(v->first, text);
+		}
+		for (VCStackOptions::const_iterator e = options.engineOptions.begin(); e != options.engineOptions.end(); e++)
+			for (VCEngineOptions::const_iterator o = e->second.begin(); o != e->second.end(); o++)
+				results.Config("engine." + e->first + "." + o->first, o->second);
     }
     catch(std::exception& e)
     {
@@ -754,105 +1305,426 @@ int Configure(int ac, char* av[])
 
 
 /*
- * The actual worker process (forked as a child thread)
+ * Apply the changes a single hit makes to the visitor's cookie
  */
-void *WorkerThread(void *threadArg)
+void ApplyHit(VCookie &cookie, const hitData_t &hit)
 {
-	threadParam_t *threadParam = (threadParam_t *) threadArg;
-
-	pthread_mutex_lock(&consoleMutex);
-	cout << parentPid << ": " << "Child " << threadParam->pid << " is alive at " << time(NULL) << "\n";
-	cout << flush;
-	pthread_mutex_unlock(&consoleMutex);
-
-	hitSource	*hits = threadParam->hits;
+	if (cookie.IsNewCookie())
+	{
+		cookie.SetFirstHitTimeGMT(hit.hit_time_gmt);
+		cookie.SetFirstHitReferrer(hit.referrer);
+		cookie.SetFirstHitUrl(hit.page_url);
+		cookie.SetFirstHitPagename(hit.page_name);
+	}
+	cookie.SetLastHitTimeGMT(hit.hit_time_gmt);
+	
+	cookie.SetLastHitTimeVisitorLocal(hit.hit_time_gmt - 7*60*60);
+	cookie.SetLastVisitNum(hit.visit_num);
 
-	VCookieStore	*store = new STORAGE_ENGINE();		// change for different storage engine
-	//VCookieStore	*store = new VCStoreNOP();		// change for different storage engine
+	if (hit.purchase_time_gmt)
+		cookie.SetLastPurchaseTimeGMT(hit.purchase_time_gmt);
+		
+	//cookie.SetMerchandising ( "asl;dfkjasd;flkjasdf;lkjasdf;lkajsdf;lkasjdf;laksdjf;alksdjfa;lksdjfa;lksdjfa;lsdkfja;lsdkfjas;ldkfjas;ldfkja;lsdkfja;sldkfjals;dkfjas;ldkfjasl;kdfjasl;kdfjas;ldkfjas;ldkfjasl;dkfja;sldkfjasl;kdjfal;skdjfasl;kdjfals;dkfjasl;dkfjasl;kdjqert;lkajsdg;laketn;aksdbnvxc;kgnasd;tkjnasd;gkjncb;akjsdnta;skdjgnb;lkdgjans;ckvjnad;ksfgajsd;flkgjvnc;kajsdgfna;skdfnv;kcxbm,vna;skedjtrhnasd;kgjvnxcz;kjgadnskgljbzncvlkjsmdng;kjdfnlkagsdmng;dkljcmnga;sdkjfnav;lckxj,mfgna;ldskgj;zldsvmbn;zxlkfmnfd;kglb,mnzx;flkjads,mnf;alksd,mgnvbc;kxj,fmasjdn;lkfjasnd;vkjnasfx;");
+	
+	if (hit.purchaseid.length() > 0)
+	{
+		cookie.AddLastPurchaseNum(1);
+		cookie.SetPurchaseId(hit.purchaseid);
+	}
+
+	// evars
+	for (int i = 0; i < 75; i++)
+	{
+		// is this evar set in the hit?
+		if (hit.evar[i].length())
+		{
+			if (hit.evar_linear[i])
+			{
+				// linear: append unless it repeats the most recent value
+				unsigned count = cookie.GetVarElementCount(i);
+				VCookie::RelVar const * cVar = count ? cookie.GetVar(i, count - 1) : NULL;
 
-	hiResTimer	readTimer,
-				writeTimer;
+				if (!cVar || cVar->value != hit.evar[i])
+					cookie.SetVar(i, hit.evar[i], hit.hit_time_gmt, 1, ALLOC_TYPE_LINEAR, options.linearDepth);
+			}
+			else
+			{
+				// get the cookie version of this var (may be null)
+				VCookie::RelVar const * cVar = cookie.GetVar(i);
+				
+				// set if different from the cookie value
+				if (cVar && cVar->value != hit.evar[i])
+					cookie.SetVar(i, hit.evar[i], hit.hit_time_gmt, 1, ALLOC_TYPE_FIRST);
+			}
+		}
+		else
+		{
+			cookie.ClearVar(i);
+		}
+	}
+}
+
+
+/*
+ * Every LIVE_STORE_HITS hits: purge (every purge-interval, with purge-age)
+ * and update the live store size from its stats
+ */
+void StoreUpkeep(VCookieStore &store, time_t hitTime, liveCounters_t &live, unsigned long long &nextPurgeNS)
+{
+	// drop cookies that haven't been seen for purge-age (by hit time)
+	if (options.purgeAge && hiResClock::NowNS() >= nextPurgeNS)
+	{
+		unsigned long long purgeStart = hiResClock::NowNS();
+		unsigned long long purged = store.DeleteOldVCookies(hitTime - options.purgeAge);
+
+		LiveAdd(live.purged, purged);
+		LiveAdd(live.purgeRuns, 1);
+		LiveAdd(live.purgeNS, hiResClock::NowNS() - purgeStart);
+		nextPurgeNS += (unsigned long long) options.purgeInterval * NANOSECOND;
+	}
+
+	map<string, unsigned long long>	storeStats;
+	store.GetStats(storeStats);
+	LiveSet(live.storeCookies, storeStats["cookies"]);
+	LiveSet(live.storeBytes, storeStats["bytes"]);
+}
+
+
+/*
+ * Batch mode (batch-size > 1): read a batch of hits, load each visitor in
+ * it once with LoadVCookies, apply the hits in order, then save the
+ * changed cookies with SaveVCookies.  The read and write timers get each
+ * hit's share of its batch's load and save, so their averages stay per
+ * hit; the hit timer runs from a hit's arrival to its batch being saved,
+ * waiting for the batch to fill included; the batch timer times the load,
+ * apply and save of each batch.
+ */
+struct batchCounters_t
+{
+	unsigned long long	batches;
+	unsigned long long	visitors;	// distinct in their batch
+	unsigned long long	loads;		// visitors not known to be new
+	unsigned long long	saves;
+};
+
+// a visitor within a batch
+typedef struct batchVisitor_t
+{
+	unsigned			rsid;
+	unsigned long long	visid_high;
+	unsigned long long	visid_low;
+
+	bool operator<(const batchVisitor_t &b) const
+	{
+		if (rsid != b.rsid)
+			return rsid < b.rsid;
+		if (visid_high != b.visid_high)
+			return visid_high < b.visid_high;
+		return visid_low < b.visid_low;
+	}
+} batchVisitor_t;
+
+// LoadVCookies' answer for one of the batch's cookies (passed back const)
+void BatchLoaded(bool found, const VCookie &cookie)
+{
+	const_cast<VCookie &>(cookie).Loaded(found);
+}
+
+void BatchLoop(threadParam_t &param, VCookieStore &store, rateControl &controller, rateMonitor &monitor,
+	unsigned long long &nextPurgeNS)
+{
+	hiResTimer	&readTimer = *param.readTimer,
+				&writeTimer = *param.writeTimer,
+				&hitTimer = *param.hitTimer,
+				&lateTimer = *param.lateTimer,
+				&batchTimer = *param.batchTimer;
+	liveCounters_t	&live = *param.live;
+	batchCounters_t	&counters = *param.batch;
+
+	unsigned	batchSize = options.batchSize;
+	vector<hitData_t>	batch(batchSize);		// reused so the strings keep their buffers
+	vector<unsigned long long>	arrivedNS(batchSize);
+	vector<unsigned>	cookieOf(batchSize);	// index in cookies of each hit's visitor
+	vector<VCookie *>	cookies, loads;
+	vector<const VCookie *>	saves;
+	map<batchVisitor_t, unsigned>	visitors;
+
+	unsigned done = 0;
+	while (done < options.requests)
+	{
+		unsigned count = 0;
+		while (count < batchSize && done + count < options.requests)
+		{
+			VC_STAGE_TIMER(parseTimer, VC_STAGE_PARSE);
+			bool haveHit = param.hits->NextHit(batch[count]);
+			VC_STAGE_STOP(parseTimer);
+			if (!haveHit)
+				break;
+
+			monitor.Increment(1);
+			unsigned long long intendedNS = controller.IncrementAndWait(1, batch[count].hit_time_gmt);
+			if (options.openLoop)
+			{
+				lateTimer.StartAt(intendedNS);
+				lateTimer.Stop();
+				arrivedNS[count] = intendedNS;
+			}
+			else
+				arrivedNS[count] = hiResClock::NowNS();
+			count++;
+		}
+		if (count == 0)
+			break;	// ran out of hits
+
+		batchTimer.Start();
+
+		// one cookie per visitor, loaded unless the first of their hits says they're new
+		visitors.clear();
+		cookies.clear();
+		loads.clear();
+		for (unsigned k = 0; k < count; k++)
+		{
+			const hitData_t &hit = batch[k];
+			batchVisitor_t visitor = { hit.rsid, hit.visid_high, hit.visid_low };
+			map<batchVisitor_t, unsigned>::iterator v = visitors.find(visitor);
+			if (v == visitors.end())
+			{
+				v = visitors.insert(make_pair(visitor, (unsigned) cookies.size())).first;
+				cookies.push_back(new VCookie(hit.rsid, hit.visid_high, hit.visid_low, true, store));
+				if (!hit.visid_new)
+					loads.push_back(cookies.back());
+			}
+			cookieOf[k] = v->second;
+		}
+
+		unsigned long long loadStart = hiResClock::NowNS();
+		if (!loads.empty())
+			store.LoadVCookies(loads, BatchLoaded);
+		unsigned long long loadEnd = hiResClock::NowNS();
+
+		for (unsigned k = 0; k < count; k++)
+		{
+			VC_STAGE_TIMER(mutateTimer, VC_STAGE_MUTATE);
+			ApplyHit(*cookies[cookieOf[k]], batch[k]);
+		}
+
+		saves.clear();
+		for (unsigned c = 0; c < cookies.size(); c++)
+			if (cookies[c]->IsModified())
+				saves.push_back(cookies[c]);
+		unsigned long long saveStart = hiResClock::NowNS();
+		if (!saves.empty())
+			store.SaveVCookies(saves, NULL);
+		unsigned long long saveEnd = hiResClock::NowNS();
+
+		for (unsigned c = 0; c < cookies.size(); c++)
+		{
+			cookies[c]->Saved();	// or the destructor saves it again
+			delete cookies[c];
+		}
+		batchTimer.Stop();
+
+		unsigned long readNS = (unsigned long)(loadEnd - loadStart),
+					  writeNS = (unsigned long)(saveEnd - saveStart);
+		unsigned long long hitsNS = 0;
+		for (unsigned k = 0; k < count; k++)
+		{
+			readTimer.Record(loadEnd, readNS / count);
+			writeTimer.Record(saveEnd, writeNS / count);
+			hitTimer.StartAt(arrivedNS[k]);
+			unsigned long hitNS = hitTimer.Stop();
+			hitsNS += hitNS;
+			if (param.liveHitLatency)
+				param.liveHitLatency->RecordShared(hitNS);
+		}
+
+		LiveAdd(live.readNS, readNS);
+		LiveAdd(live.writeNS, writeNS);
+		LiveAdd(live.hitNS, hitsNS);
+		LiveAdd(live.hits, count);
+
+		counters.batches++;
+		counters.visitors += cookies.size();
+		counters.loads += loads.size();
+		counters.saves += saves.size();
+
+		// the upkeep runs as often as with single hits
+		if (done == 0 || done / LIVE_STORE_HITS != (done + count) / LIVE_STORE_HITS)
+			StoreUpkeep(store, batch[count - 1].hit_time_gmt, live, nextPurgeNS);
+		done += count;
+	}
+}
+
+
+/*
+ * The actual worker process (forked as a child thread)
+ */
+void *WorkerThread(void *threadArg)
+{
+	threadParam_t *threadParam = (threadParam_t *) threadArg;
+
+	pthread_mutex_lock(&consoleMutex);
+	cout << parentPid << ": " << "Child " << threadParam->pid << " is alive at " << time(NULL) << "\n";
+	cout << flush;
+	pthread_mutex_unlock(&consoleMutex);
+
+	hitSource	*hits = threadParam->hits;
+
+	// each thread has a store (and connection) of its own
+	VCookieStore	*store = VCEngineRegistry::Create(options.engine, options.engineDecorators, options.engineOptions);
+	if (!store)
+	{
+		pthread_mutex_lock(&consoleMutex);
+		cout << parentPid << ": Child " << threadParam->pid << " can't create the "
+			<< VCEngineRegistry::StackName(options.engine, options.engineDecorators) << " store\n";
+		pthread_mutex_unlock(&consoleMutex);
+		exit(EXIT_FAILURE);
+	}
+
+	hiResTimer	&readTimer = *threadParam->readTimer,
+				&writeTimer = *threadParam->writeTimer,
+				&hitTimer = *threadParam->hitTimer,		// end to end, read + update + write
+				&lateTimer = *threadParam->lateTimer;
+	liveCounters_t	&live = *threadParam->live;
+	hdrHistogram	*liveHitLatency = threadParam->liveHitLatency;
+	unsigned long long	nextPurgeNS = hiResClock::NowNS() + (unsigned long long) options.purgeInterval * NANOSECOND;
 
 	rateControl *controller;
 	if (options.replayRate > 0)
-		controller = new rateControl(options.replayRate);
+		controller = new rateControl(options.replayRate, playbackClock);
 	else
 		controller = new rateControl(options.requestRate);
 	rateMonitor monitor;
+
+	// the default 50us timer slack would make every paced request look late
+	if (options.openLoop)
+		prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+#if !defined(VC_NO_STAGE_TIMING)
+	// the store and codec report their stages to this thread's timers
+	VCStageSink::SetThreadSink(threadParam->stages);
+#endif
+
+	// hardware counters follow the thread, so each worker opens its own
+	perfPhases *perf = threadParam->perf;
+	if (perf && !perf->Open())
+	{
+		int err = errno;
+		static bool reported = false;
+
+		pthread_mutex_lock(&consoleMutex);
+		if (!reported)
+			cout << parentPid << ": perf counters unavailable (" << strerror(err) << "), continuing without them\n";
+		reported = true;
+		pthread_mutex_unlock(&consoleMutex);
+
+		perf = NULL;
+	}
+	unsigned perfSample = options.perfSample ? options.perfSample : 1;
 	
 	controller->Start(); monitor.Start();
-	for (unsigned i = 0; i < options.requests; i++)
+	if (options.batchSize > 1)
+		BatchLoop(*threadParam, *store, *controller, monitor, nextPurgeNS);
+
+	hitData_t	hit;		// reused so the strings keep their buffers
+	unsigned	requests = options.batchSize > 1 ? 0 : options.requests;	// else the batches did them
+	for (unsigned i = 0; i < requests; i++)
 	{
 		if (hits)
 		{
-			hitData_t	hit;
-			
-			if (hits->NextHit(hit))
+			VC_STAGE_TIMER(parseTimer, VC_STAGE_PARSE);
+			bool haveHit = hits->NextHit(hit);
+			VC_STAGE_STOP(parseTimer);
+
+			if (haveHit)
 			{
 				monitor.Increment(1);
-				controller->IncrementAndWait(1, hit.hit_time_gmt);
+				unsigned long long intendedNS = controller->IncrementAndWait(1, hit.hit_time_gmt);
 
-				readTimer.Start();
-				VCookie	cookie(hit.rsid, hit.visid_high, hit.visid_low, hit.visid_new, *store);
-				readTimer.Stop();
-				
-				if (cookie.IsNewCookie())
+				// open-loop: a stall in the store makes the following requests
+				// late, and that lateness counts against their latency too
+				if (options.openLoop)
 				{
-					cookie.SetFirstHitTimeGMT(hit.hit_time_gmt);
-					cookie.SetFirstHitReferrer(hit.referrer);
-					cookie.SetFirstHitUrl(hit.page_url);
-					cookie.SetFirstHitPagename(hit.page_name);
+					lateTimer.StartAt(intendedNS);
+					lateTimer.Stop();
+					hitTimer.StartAt(intendedNS);
 				}
-				cookie.SetLastHitTimeGMT(hit.hit_time_gmt);
-				
-				cookie.SetLastHitTimeVisitorLocal(hit.hit_time_gmt - 7*60*60);
-				cookie.SetLastVisitNum(hit.visit_num);
+				else
+					hitTimer.Start();
 
-				if (hit.purchase_time_gmt)
-					cookie.SetLastPurchaseTimeGMT(hit.purchase_time_gmt);
-					
-				//cookie.SetMerchandising ( "asl;dfkjasd;flkjasdf;lkjasdf;lkajsdf;lkasjdf;laksdjf;alksdjfa;lksdjfa;lksdjfa;lsdkfja;lsdkfjas;ldkfjas;ldfkja;lsdkfja;sldkfjals;dkfjas;ldkfjasl;kdfjasl;kdfjas;ldkfjas;ldkfjasl;dkfja;sldkfjasl;kdjfal;skdjfasl;kdjfals;dkfjasl;dkfjasl;kdjqert;lkajsdg;laketn;aksdbnvxc;kgnasd;tkjnasd;gkjncb;akjsdnta;skdjgnb;lkdgjans;ckvjnad;ksfgajsd;flkgjvnc;kajsdgfna;skdfnv;kcxbm,vna;skedjtrhnasd;kgjvnxcz;kjgadnskgljbzncvlkjsmdng;kjdfnlkagsdmng;dkljcmnga;sdkjfnav;lckxj,mfgna;ldskgj;zldsvmbn;zxlkfmnfd;kglb,mnzx;flkjads,mnf;alksd,mgnvbc;kxj,fmasjdn;lkfjasnd;vkjnasfx;");
-				
-				if (hit.purchaseid.length() > 0)
-				{
-					cookie.SetLastPurchaseNum(cookie.GetLastPurchaseNum() + 1);
-					cookie.SetPurchaseId(hit.purchaseid);
-				}
+				// the counter reads land inside this hit's hitTimer, not the read/write timers
+				bool perfHit = perf && i % perfSample == 0;
+				if (perfHit)
+					perf->Mark();
 
-				// evars
-				for (int i = 0; i < 75; i++)
-				{
-					// is this evar set in the hit?
-					if (hit.evar[i].length())
-					{
-						// get the cookie version of this var (may be null)
-						VCookie::RelVar const * cVar = cookie.GetVar(i);
-						
-						// set if different from the cookie value
-						if (cVar && cVar->value != hit.evar[i])
-							cookie.SetVar(i, hit.evar[i], hit.hit_time_gmt, 1, ALLOC_TYPE_FIRST);
-					}
-					else
-					{
-						cookie.ClearVar(i);
-					}
-				}
+				readTimer.Start();
+				VCookie	cookie(hit.rsid, hit.visid_high, hit.visid_low, hit.visid_new, *store);
+				unsigned long readNS = readTimer.Stop();
+				if (perfHit)
+					perf->Phase(PERF_PHASE_LOAD);
 				
+				VC_STAGE_TIMER(mutateTimer, VC_STAGE_MUTATE);
+				ApplyHit(cookie, hit);
+				VC_STAGE_STOP(mutateTimer);
+				if (perfHit)
+					perf->Phase(PERF_PHASE_MUTATE);
+
 				writeTimer.Start();
 				cookie.Store();
-				writeTimer.Stop();
+				unsigned long writeNS = writeTimer.Stop();
+				unsigned long hitNS = hitTimer.Stop();
+				if (perfHit)
+				{
+					perf->Phase(PERF_PHASE_STORE);
+					perf->Done();
+				}
+
+				LiveAdd(live.readNS, readNS);
+				LiveAdd(live.writeNS, writeNS);
+				LiveAdd(live.hitNS, hitNS);
+				LiveAdd(live.hits, 1);
+				if (liveHitLatency)
+					liveHitLatency->RecordShared(hitNS);
+
+				if (i % LIVE_STORE_HITS == 0)
+					StoreUpkeep(*store, hit.hit_time_gmt, live, nextPurgeNS);
 			}
 			else
 				break;	// ran out of hits
 		}
 	}
 	monitor.Stop();
+	VCStageSink::SetThreadSink(NULL);
+	if (perf)
+		perf->Close();
 	
 	pthread_mutex_lock(&consoleMutex);
 	cout << parentPid << ": " << "Child " << threadParam->pid << " is done at " << time(NULL) << "\n";
 	cout << parentPid << "-" << threadParam->pid << ": rate = " << monitor.EventsPerSecond() << "\n";
 	cout << parentPid << "-" << threadParam->pid << ": readAvgNS = " << readTimer.NsPerSecond() << "\n";
 	cout << parentPid << "-" << threadParam->pid << ": writeAvgNS = " << writeTimer.NsPerSecond() << "\n";
+	cout << parentPid << "-" << threadParam->pid << ": readLatencyNS" << PercentileSummary(readTimer.Histogram()) << "\n";
+	cout << parentPid << "-" << threadParam->pid << ": writeLatencyNS" << PercentileSummary(writeTimer.Histogram()) << "\n";
+	cout << parentPid << "-" << threadParam->pid << ": hitLatencyNS" << PercentileSummary(hitTimer.Histogram()) << "\n";
+	if (options.openLoop)
+	{
+		cout << parentPid << "-" << threadParam->pid << ": lateNS" << PercentileSummary(lateTimer.Histogram()) << "\n";
+		if (options.replayRate <= 0)
+			cout << parentPid << "-" << threadParam->pid << ": backlog = " << controller->BacklogPerSecond() << "\n";
+	}
+	if (options.batchSize > 1)
+	{
+		batchCounters_t &batch = *threadParam->batch;
+		cout << parentPid << "-" << threadParam->pid << ": batchLatencyNS" << PercentileSummary(threadParam->batchTimer->Histogram()) << "\n";
+		cout << parentPid << "-" << threadParam->pid << ": batches = " << batch.batches
+			<< "; visitors = " << batch.visitors
+			<< "; loads = " << batch.loads
+			<< "; saves = " << batch.saves << "\n";
+	}
+	if (options.purgeAge)
+		cout << parentPid << "-" << threadParam->pid << ": purged = " << live.purged
+			<< "; purgeRuns = " << live.purgeRuns
+			<< "; purgeMS = " << live.purgeNS / MICROSECOND << "\n";
 	cout << flush;
 	
 	// now add our results to the aggregate results for the parent
@@ -897,11 +1769,583 @@ void *WorkerThread(void *threadArg)
 				timer->push_back(monitor.EventsPerSecond()[i] * writeTimer.NsPerSecond()[i]);
 		}
 	}
+
+	// how far behind all the threads were together each second
+	vector<unsigned long> *backlog = threadParam->aggregateBacklog;
+	for (unsigned int i = 0; i < controller->BacklogPerSecond().size(); i++)
+	{
+		if (i < backlog->size())
+			(*backlog)[i] += controller->BacklogPerSecond()[i];
+		else
+			backlog->push_back(controller->BacklogPerSecond()[i]);
+	}
+
+	store->GetStats(*threadParam->storeStats);
 	pthread_mutex_unlock(&consoleMutex);
 
+	delete store;
+
+	pthread_exit((void *) 0);
+}
+
+
+/*
+ * Profiling mode: stream the replay files through the parser and
+ * describe the workload, no store involved
+ */
+typedef struct
+{
+	hitSource			*hits;
+	visitorHitCounter	*counter;	// shared by all threads
+	profileSampleStore	*sample;	// shared by all threads
+	workloadProfile		*profile;	// one per thread
+} profileParam_t;
+
+void *ProfileThread(void *threadArg)
+{
+	profileParam_t *param = (profileParam_t *) threadArg;
+
+	hitData_t	hit;
+	while (param->hits->NextHit(hit))
+	{
+		param->profile->Add(hit, *param->counter);
+
+		// replay the sampled visitors' hits for real to see how big their cookies get
+		if (options.profileSample && workloadProfile::VisitorHash(hit) % options.profileSample == 0)
+		{
+			param->sample->Lock();
+			{
+				VCookie	cookie(hit.rsid, hit.visid_high, hit.visid_low, hit.visid_new, *param->sample);
+				ApplyHit(cookie, hit);
+				cookie.Store();
+			}
+			param->sample->Unlock();
+		}
+	}
+
 	pthread_exit((void *) 0);
 }
 
+int RunProfile(void)
+{
+	if (options.replayFiles.size() == 0)
+	{
+		cout << "Profiling needs at least one replay-file\n";
+		return 1;
+	}
+
+	unsigned threads = options.threads ? options.threads : 1;
+
+	dwfileHitSource		hits(options.replayFiles, fileReadMutex);
+	visitorHitCounter	counter((unsigned long long) options.profileVisitorsMB * 1024 * 1024 / visitorHitCounter::BYTES_PER_VISITOR);
+	profileSampleStore	sample;
+
+	vector<workloadProfile>	profiles(threads);
+	vector<profileParam_t>	param(threads);
+	vector<pthread_t>		thread(threads);
+
+	for (unsigned i = 0; i < threads; i++)
+	{
+		param[i].hits = &hits;
+		param[i].counter = &counter;
+		param[i].sample = &sample;
+		param[i].profile = &profiles[i];
+
+		int err = pthread_create(&thread[i], NULL, ProfileThread, (void *) &param[i]);
+		if (err)
+		{
+			cout << parentPid << ": " << "ERROR creating threads: " << err << "\n";
+			exit(-1);
+		}
+	}
+
+	// merge everything into the first profile
+	for (unsigned i = 0; i < threads; i++)
+	{
+		pthread_join(thread[i], NULL);
+		if (i > 0)
+			profiles[0].Merge(profiles[i]);
+	}
+	profiles[0].VisitorHits(counter);
+	sample.CookieSizes(profiles[0]);
+
+	ofstream out(options.profileFile.c_str());
+	profiles[0].Write(out, options.replayFiles, options.profileSample);
+	out.close();
+
+	if (!out)
+	{
+		cout << "Unable to write workload profile " << options.profileFile << "\n";
+		return 1;
+	}
+
+	cout << parentPid << ": profiled " << profiles[0].Hits() << " hits into " << options.profileFile << "\n";
+	if (counter.SampleRate() > 1)
+		cout << parentPid << ": hits per visitor are from 1 in " << counter.SampleRate()
+			<< " visitors, raise profile-visitors-mb to count them all\n";
+	return 0;
+}
+
+
+/*
+ * Timer self test: what does it cost to time something
+ */
+
+// ns per call of f, averaged over count calls
+template <class F>
+double NsPerCall(F f, unsigned count)
+{
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (unsigned i = 0; i < count; i++)
+		f();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((end.tv_sec - start.tv_sec) * (double) NANOSECOND + end.tv_nsec - start.tv_nsec) / count;
+}
+
+struct readClock
+{
+	clockid_t	clock;
+	readClock(clockid_t _clock) : clock(_clock) {}
+	void operator()(void) const { struct timespec ts; clock_gettime(clock, &ts); }
+};
+
+struct readHiResClock
+{
+	void operator()(void) const { volatile unsigned long long ns = hiResClock::NowNS(); (void) ns; }
+};
+
+struct timeRegion
+{
+	hiResTimer	&timer;
+	timeRegion(hiResTimer &_timer) : timer(_timer) {}
+	void operator()(void) const { timer.Start(); timer.Stop(); }
+};
+
+struct countEvent
+{
+	rateMonitor	&monitor;
+	countEvent(rateMonitor &_monitor) : monitor(_monitor) {}
+	void operator()(void) const { monitor.Increment(1); }
+};
+
+int TimerSelftest(void)
+{
+	const unsigned COUNT = 1000000;
+
+	cout << "clock = " << hiResClock::Source();
+	if (hiResClock::UsingTSC())
+		cout << "; ticksPerNS = " << hiResClock::TicksPerNS();
+	cout << "; invariantTSC = " << (hiResClock::InvariantTSC() ? "yes" : "no") << "\n";
+
+	struct timespec monoStart, monoEnd;
+	clock_gettime(CLOCK_MONOTONIC, &monoStart);
+	unsigned long long clockStart = hiResClock::NowNS();
+
+	cout << "hiResClock::NowNS = " << NsPerCall(readHiResClock(), COUNT) << " ns\n";
+	cout << "CLOCK_MONOTONIC = " << NsPerCall(readClock(CLOCK_MONOTONIC), COUNT) << " ns\n";
+	cout << "CLOCK_MONOTONIC_RAW = " << NsPerCall(readClock(CLOCK_MONOTONIC_RAW), COUNT) << " ns\n";
+	cout << "CLOCK_REALTIME = " << NsPerCall(readClock(CLOCK_REALTIME), COUNT) << " ns\n";
+
+	// an empty timed region: the overhead added to every readAvgNS/writeAvgNS
+	// sample, and the smallest latency the histograms can report
+	hiResTimer timer;
+	cout << "timed region (Start + Stop) = " << NsPerCall(timeRegion(timer), COUNT) << " ns\n";
+	cout << "empty region latencyNS" << PercentileSummary(timer.Histogram()) << "\n";
+
+	rateMonitor monitor;
+	cout << "rateMonitor::Increment = " << NsPerCall(countEvent(monitor), COUNT) << " ns\n";
+
+	// how far the clock wandered from CLOCK_MONOTONIC over the test
+	clock_gettime(CLOCK_MONOTONIC, &monoEnd);
+	unsigned long long clockNS = hiResClock::NowNS() - clockStart;
+	double monoNS = (monoEnd.tv_sec - monoStart.tv_sec) * (double) NANOSECOND + monoEnd.tv_nsec - monoStart.tv_nsec;
+	cout << "drift from CLOCK_MONOTONIC = " << (clockNS - monoNS) / monoNS * 1e6 << " ppm over " 
+		<< monoNS / MICROSECOND << " ms\n";
+
+	return 0;
+}
+
+
+/*
+ * Latency histograms
+ */
+
+// merge the threads' histograms (they are all joined, so no locking)
+// p99 gets the 99th percentile of each second across all threads
+void MergeLatency(const vector<hiResTimer *> &timers, hdrHistogram &total, vector<unsigned long> &p99)
+{
+	vector<hdrHistogram> seconds;
+
+	for (unsigned i = 0; i < timers.size(); i++)
+	{
+		total.Add(timers[i]->Histogram());
+
+		vector<hdrSnapshot_t> intervals = timers[i]->Intervals();
+		if (seconds.size() < intervals.size())
+			seconds.resize(intervals.size());
+		for (unsigned j = 0; j < intervals.size(); j++)
+			seconds[j].Add(intervals[j]);
+	}
+
+	p99.clear();
+	for (unsigned i = 0; i < seconds.size(); i++)
+		p99.push_back(seconds[i].ValueAtPercentile(99));
+}
+
+// average ns of each second across the threads, weighted by their counts
+void MergeAverages(const vector<hiResTimer *> &timers, vector<unsigned long> &average)
+{
+	vector<unsigned long long> total, count;
+
+	for (unsigned i = 0; i < timers.size(); i++)
+	{
+		vector<unsigned long> nsPerSecond = timers[i]->NsPerSecond();
+		vector<hdrSnapshot_t> intervals = timers[i]->Intervals();
+
+		unsigned seconds = min(nsPerSecond.size(), intervals.size());
+		if (total.size() < seconds)
+		{
+			total.resize(seconds, 0);
+			count.resize(seconds, 0);
+		}
+
+		for (unsigned j = 0; j < seconds; j++)
+		{
+			unsigned long long events = 0;
+			for (unsigned k = 0; k < intervals[j].counts.size(); k++)
+				events += intervals[j].counts[k].second;
+
+			total[j] += nsPerSecond[j] * events;
+			count[j] += events;
+		}
+	}
+
+	average.clear();
+	for (unsigned i = 0; i < total.size(); i++)
+		average.push_back(count[i] ? total[i] / count[i] : 0);
+}
+
+// combine the histogram-files of several runs (e.g. one per machine)
+int MergeHistograms(void)
+{
+	const char *names[] = { "read", "write", "hit" };
+	const unsigned count = sizeof(names) / sizeof(names[0]);
+	hdrHistogram merged[count];
+
+	for (unsigned i = 0; i < options.mergeHistograms.size(); i++)
+	{
+		ifstream in(options.mergeHistograms[i].c_str());
+		if (!in)
+		{
+			cout << "Unable to read latency histograms from " << options.mergeHistograms[i] << "\n";
+			return 1;
+		}
+
+		string name;
+		while (in >> name)
+		{
+			unsigned which = find(names, names + count, name) - names;
+			hdrHistogram histogram;
+			if (which == count || !histogram.Read(in))
+			{
+				cout << "Bad latency histogram in " << options.mergeHistograms[i] << "\n";
+				return 1;
+			}
+			merged[which].Add(histogram);
+		}
+	}
+
+	cout << "Merged " << options.mergeHistograms.size() << " histogram files\n";
+	for (unsigned i = 0; i < count; i++)
+		cout << names[i] << "LatencyNS count = " << merged[i].Count() << ";" << PercentileSummary(merged[i]) << "\n";
+
+	if (!options.mergeOutput.empty())
+	{
+		ofstream out(options.mergeOutput.c_str());
+		for (unsigned i = 0; i < count; i++)
+		{
+			out << names[i] << " ";
+			merged[i].Write(out);
+		}
+		out.close();
+
+		if (!out)
+		{
+			cout << "Unable to write latency histograms to " << options.mergeOutput << "\n";
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * Writes the threads' live totals to the results-stream file as one JSON
+ * object per line (NDJSON) every interval while the test runs, so a
+ * dashboard can follow a long run; the last line has "final": true
+ */
+class resultsStreamer : private boost::noncopyable
+{
+	public:
+		resultsStreamer(const string &filename, unsigned intervalSeconds, const vector<liveCounters_t> &counters) :
+			filename(filename), interval(intervalSeconds ? intervalSeconds : 1), live(counters), 
+			stopping(false), running(false), startNS(0), prevNS(0)
+		{
+			memset(&prev, 0, sizeof(prev));
+			pthread_mutex_init(&mutex, NULL);
+
+			// timed waits on CLOCK_MONOTONIC, so setting the date doesn't matter
+			pthread_condattr_t attr;
+			pthread_condattr_init(&attr);
+			pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+			pthread_cond_init(&wake, &attr);
+			pthread_condattr_destroy(&attr);
+		}
+		~resultsStreamer(void)
+		{
+			Stop();
+			pthread_cond_destroy(&wake);
+			pthread_mutex_destroy(&mutex);
+		}
+
+		// open the file and start the writer thread
+		bool Start(void)
+		{
+			out.open(filename.c_str(), ios::out | ios::app);
+			if (!out)
+				return false;
+
+			startNS = prevNS = hiResClock::NowNS();
+			running = pthread_create(&thread, NULL, Run, this) == 0;
+			return running;
+		}
+
+		// write the last line and wait for the writer
+		void Stop(void)
+		{
+			if (!running)
+				return;
+
+			pthread_mutex_lock(&mutex);
+			stopping = true;
+			pthread_cond_signal(&wake);
+			pthread_mutex_unlock(&mutex);
+
+			pthread_join(thread, NULL);
+			running = false;
+			out.close();
+		}
+
+	private:
+		string			filename;
+		unsigned		interval;		// seconds
+		const vector<liveCounters_t>	&live;
+		ofstream		out;
+
+		pthread_t		thread;
+		pthread_mutex_t	mutex;
+		pthread_cond_t	wake;
+		bool			stopping;		// guarded by mutex
+		bool			running;
+
+		unsigned long long	startNS;
+		unsigned long long	prevNS;		// time of the previous line
+		liveCounters_t		prev;		// totals at the previous line
+
+		static void *Run(void *arg)
+		{
+			((resultsStreamer *) arg)->Loop();
+			return NULL;
+		}
+
+		void Loop(void)
+		{
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+			pthread_mutex_lock(&mutex);
+			while (!stopping)
+			{
+				deadline.tv_sec += interval;
+				while (!stopping && pthread_cond_timedwait(&wake, &mutex, &deadline) != ETIMEDOUT)
+					;
+
+				bool last = stopping;
+				pthread_mutex_unlock(&mutex);
+				WriteLine(last);
+				pthread_mutex_lock(&mutex);
+			}
+			pthread_mutex_unlock(&mutex);
+		}
+
+		void WriteLine(bool last)
+		{
+			liveCounters_t now;
+			memset(&now, 0, sizeof(now));
+			for (unsigned i = 0; i < live.size(); i++)
+			{
+				now.hits += __atomic_load_n(&live[i].hits, __ATOMIC_RELAXED);
+				now.readNS += __atomic_load_n(&live[i].readNS, __ATOMIC_RELAXED);
+				now.writeNS += __atomic_load_n(&live[i].writeNS, __ATOMIC_RELAXED);
+				now.hitNS += __atomic_load_n(&live[i].hitNS, __ATOMIC_RELAXED);
+			}
+			unsigned long long nowNS = hiResClock::NowNS();
+
+			// the interval's own numbers, not the run's so far
+			unsigned long long hits = now.hits - prev.hits;
+			double seconds = (double)(nowNS - prevNS) / NANOSECOND;
+
+			out << "{\"time\": " << time(NULL)
+				<< ", \"elapsed\": " << (double)(nowNS - startNS) / NANOSECOND
+				<< ", \"hits\": " << now.hits
+				<< ", \"intervalHits\": " << hits
+				<< ", \"rate\": " << (unsigned long long)(seconds > 0 ? hits / seconds : 0)
+				<< ", \"readAvgNS\": " << (hits ? (now.readNS - prev.readNS) / hits : 0)
+				<< ", \"writeAvgNS\": " << (hits ? (now.writeNS - prev.writeNS) / hits : 0)
+				<< ", \"hitAvgNS\": " << (hits ? (now.hitNS - prev.hitNS) / hits : 0);
+			if (last)
+				out << ", \"final\": true";
+			out << "}" << endl;		// flushed, so readers see whole lines
+
+			prev = now;
+			prevNS = nowNS;
+		}
+};	// class resultsStreamer
+
+
+/*
+ * What the metrics endpoint reports (metrics-port=, metrics-socket=)
+ * everything is read from the workers' live counters and shared
+ * histograms, without locks; Sample() and WriteMetrics() both run on the
+ * metrics server thread
+ */
+class harnessMetrics : public metricsSource
+{
+	public:
+		harnessMetrics(const vector<liveCounters_t> &counters, const vector<hdrHistogram *> &hitLatency, 
+				replayReader *reader, unsigned windowSeconds) :
+			live(counters), hitLatency(hitLatency), reader(reader), 
+			window(windowSeconds ? windowSeconds : 1), startTime(time(NULL)),
+			prevHits(0), prevNS(hiResClock::NowNS()), hitsPerSecond(0)
+		{
+		}
+
+		virtual void Sample(void)
+		{
+			unsigned long long hits = 0;
+			for (unsigned i = 0; i < live.size(); i++)
+				hits += LiveGet(live[i].hits);
+			unsigned long long nowNS = hiResClock::NowNS();
+
+			hitsPerSecond = nowNS > prevNS ? (double)(hits - prevHits) * NANOSECOND / (nowNS - prevNS) : 0;
+			prevHits = hits;
+			prevNS = nowNS;
+
+			// keep the whole-run histogram of each of the last window seconds,
+			// the oldest taken from the newest gives the window
+			hdrHistogram total;
+			for (unsigned i = 0; i < hitLatency.size(); i++)
+				total.AddShared(*hitLatency[i]);
+			history.push_back(total);
+			if (history.size() > window + 1)
+				history.pop_front();
+		}
+
+		virtual void WriteMetrics(ostream &os)
+		{
+			liveCounters_t sum;
+			memset(&sum, 0, sizeof(sum));
+			for (unsigned i = 0; i < live.size(); i++)
+			{
+				sum.hits += LiveGet(live[i].hits);
+				sum.readNS += LiveGet(live[i].readNS);
+				sum.writeNS += LiveGet(live[i].writeNS);
+				sum.hitNS += LiveGet(live[i].hitNS);
+				sum.storeCookies += LiveGet(live[i].storeCookies);
+				sum.storeBytes += LiveGet(live[i].storeBytes);
+				sum.purged += LiveGet(live[i].purged);
+				sum.purgeRuns += LiveGet(live[i].purgeRuns);
+				sum.purgeNS += LiveGet(live[i].purgeNS);
+			}
+
+			metricsServer::Metric(os, "vcookie_up_seconds", "gauge", "Seconds since the test started",
+					time(NULL) - startTime);
+			metricsServer::Metric(os, "vcookie_threads", "gauge", "Worker threads", live.size());
+			metricsServer::Metric(os, "vcookie_hits_total", "counter", "Hits processed", sum.hits);
+			metricsServer::Metric(os, "vcookie_hits_per_second", "gauge", "Hits processed in the last second", 
+					hitsPerSecond);
+			metricsServer::Metric(os, "vcookie_read_seconds_total", "counter", "Time spent loading cookies",
+					(double) sum.readNS / NANOSECOND);
+			metricsServer::Metric(os, "vcookie_write_seconds_total", "counter", "Time spent storing cookies",
+					(double) sum.writeNS / NANOSECOND);
+
+			// percentiles of the last window seconds, sum and count of the run
+			const char *name = "vcookie_hit_latency_seconds";
+			metricsServer::Describe(os, name, "summary", "Time to load, update and store a cookie for one hit");
+			if (!history.empty())
+			{
+				hdrHistogram recent(history.back());
+				recent.Subtract(history.front());
+
+				const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+				for (unsigned i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+				{
+					ostringstream labels;
+					labels << "quantile=\"" << quantiles[i] << "\"";
+					metricsServer::Value(os, name, 
+							(double) recent.ValueAtPercentile(quantiles[i] * 100) / NANOSECOND, labels.str().c_str());
+				}
+			}
+			metricsServer::Value(os, "vcookie_hit_latency_seconds_sum", (double) sum.hitNS / NANOSECOND);
+			metricsServer::Value(os, "vcookie_hit_latency_seconds_count", sum.hits);
+
+			metricsServer::Metric(os, "vcookie_store_cookies", "gauge", "Cookies held by the stores", 
+					sum.storeCookies);
+			metricsServer::Metric(os, "vcookie_store_bytes", "gauge", "Serialized cookie bytes held by the stores",
+					sum.storeBytes);
+			metricsServer::Metric(os, "vcookie_purged_total", "counter", "Cookies removed by purge-age", sum.purged);
+			metricsServer::Metric(os, "vcookie_purge_runs_total", "counter", "Purges run", sum.purgeRuns);
+			metricsServer::Metric(os, "vcookie_purge_seconds_total", "counter", "Time spent purging",
+					(double) sum.purgeNS / NANOSECOND);
+
+			if (reader)
+			{
+				metricsServer::Metric(os, "vcookie_input_queued_buffers", "gauge", 
+						"Decompressed replay buffers waiting for the parser", reader->QueuedBuffers());
+				metricsServer::Metric(os, "vcookie_input_buffers", "gauge", "Replay buffers in the ring", 
+						reader->BufferCount());
+			}
+
+			metricsServer::Metric(os, "process_resident_memory_bytes", "gauge", "Resident memory size in bytes", 
+					ResidentBytes());
+		}
+
+	private:
+		const vector<liveCounters_t>	&live;
+		const vector<hdrHistogram *>	&hitLatency;
+		replayReader	*reader;
+		unsigned		window;			// seconds
+		time_t			startTime;
+
+		unsigned long long	prevHits;
+		unsigned long long	prevNS;
+		double				hitsPerSecond;
+		deque<hdrHistogram>	history;	// whole-run hit latency at each of the last window+1 samples
+
+		static unsigned long long ResidentBytes(void)
+		{
+			unsigned long long size = 0, resident = 0;
+			ifstream statm("/proc/self/statm");
+			statm >> size >> resident;
+
+			return resident * sysconf(_SC_PAGESIZE);
+		}
+};	// class harnessMetrics
+
 
 /*
  * main
@@ -912,12 +2356,28 @@ int main(int argc, char *argv[])
 	char	hostname[256];
 	gethostname(hostname, sizeof(hostname));
 	
+	// the engine is known once the config (and any plugins) are read
+	if (Configure(argc, argv))
+		return 1;
+
 	cout << "Adobe Visitor Profile Storage Test Harness " << VERSION_STRING 
-		<< " using " << TOSTRING(STORAGE_ENGINE)
+		<< " using " << VCEngineRegistry::StackName(options.engine, options.engineDecorators)
 		<< " on " << hostname
 		<< "\n\n";
-	
-	Configure(argc, argv);
+
+	// before any thread reads the clock
+	hiResClock::Calibrate(!options.noTSC);
+
+	if (options.timerSelftest)
+		return TimerSelftest();
+
+	parentPid = getpid();	// get parent's pid
+
+	if (!options.profileFile.empty())
+		return RunProfile();
+
+	if (!options.mergeHistograms.empty())
+		return MergeHistograms();
 
 	cout << "Config:"
 		<< " threads = " << options.threads
@@ -926,36 +2386,126 @@ int main(int argc, char *argv[])
 		cout << "; replay multiplier = " << options.replayRate;
 	else
 		cout << "; request rate = " << options.requestRate;
+	if (options.openLoop)
+		cout << "; open loop";
+	cout << "; clock = " << hiResClock::Source();
 	cout << "\n\n";
 
+	if (options.openLoop && options.replayRate <= 0 && options.requestRate == 0)
+		cout << "open-loop has no schedule to keep with request-rate = 0, latencies are closed-loop\n\n";
+
 	vector<pthread_t> childThread(options.threads);
 	vector<threadParam_t> threadParam(options.threads);
 
 	// pthread_mutex_init(&fileReadMutex, NULL);	// initialized at definition
 	// pthread_mutex_init(&consoleMutex, NULL);	// initialized at definition
 
-	parentPid = getpid();	// get parent's pid
-
 	hitSource	*hits = NULL;
+	dwfileHitSource	*replay = NULL;
 
 	// place to accumulate the sum of the events per second across all threads
 	vector<unsigned long> aggregateRate;
 	// sum of total read and write times across all threads
 	vector<unsigned long> aggregateReadTimer;
 	vector<unsigned long> aggregateWriteTimer;
+	vector<unsigned long> aggregateBacklog;
+	// each thread's timers, for their latency histograms
+	vector<hiResTimer *> readTimers(options.threads), 
+						writeTimers(options.threads), 
+						hitTimers(options.threads),
+						lateTimers(options.threads),
+						batchTimers(options.threads);
+	vector<batchCounters_t> batchCounters(options.threads);
+	vector<stageTimers *> stages(options.threads);
+	vector<perfPhases *> perf(options.threads, (perfPhases *) NULL);
+	// running totals for the results-stream, and the stores' own counters
+	vector<liveCounters_t> live(options.threads);
+	map<string, unsigned long long> storeStats;
+	// only kept with the metrics endpoint, it costs a second histogram update per hit
+	bool serveMetrics = options.metricsPort || !options.metricsSocket.empty();
+	vector<hdrHistogram *> liveHitLatency;
 	
 	if (options.replayFiles.size() > 0)
 	{
-		hits = new dwfileHitSource(options.replayFiles, fileReadMutex);
+		hits = replay = new dwfileHitSource(options.replayFiles, fileReadMutex);
 	}
 	
+	// without a replay file each thread generates its own synthetic hits
+	vector<hitSource *> syntheticHits;
+	if (hits == NULL)
+	{
+		syntheticConfig_t config = options.synthetic;
+		config.hitsPerSecond /= options.threads ? options.threads : 1;
+
+		for (unsigned i = 0; i < options.threads; i++)
+			syntheticHits.push_back(new syntheticHitSource(config, options.randomSeed, i));
+	}
+
+	time_t startTime = time(NULL);
+	unsigned long long startNS = hiResClock::NowNS();
+
+	if (serveMetrics)
+		for (unsigned i = 0; i < options.threads; i++)
+			liveHitLatency.push_back(new hdrHistogram);
+
+	harnessMetrics metrics(live, liveHitLatency, replay ? &replay->Reader() : NULL, options.metricsWindow);
+	metricsServer server(metrics);
+	if (options.metricsPort)
+	{
+		if (server.ListenTCP(options.metricsPort))
+			cout << "Serving metrics at http://127.0.0.1:" << options.metricsPort << "/metrics\n";
+		else
+			cout << "Unable to serve metrics on port " << options.metricsPort << ": " << strerror(errno) << "\n";
+	}
+	if (!options.metricsSocket.empty())
+	{
+		if (server.ListenUnix(options.metricsSocket))
+			cout << "Serving metrics on " << options.metricsSocket << "\n";
+		else
+			cout << "Unable to serve metrics on " << options.metricsSocket << ": " << strerror(errno) << "\n";
+	}
+	if (serveMetrics)
+		server.Start();
+
+	// before the threads, their stores connect to it as they start
+	memcachedMock mock(options.mockFaults);
+	if (options.mockPort)
+	{
+		if (!mock.Listen(options.mockPort) || !mock.Start())
+		{
+			cout << "Unable to run the memcached stand-in on port " << options.mockPort << ": " << strerror(errno) << "\n";
+			return 1;
+		}
+		cout << "Stand-in memcached server on 127.0.0.1:" << options.mockPort << "\n";
+	}
+
+	resultsStreamer *streamer = NULL;
+	if (!options.resultsStream.empty())
+	{
+		streamer = new resultsStreamer(options.resultsStream, options.resultsInterval, live);
+		if (!streamer->Start())
+			cout << "Unable to stream results to " << options.resultsStream << "\n";
+	}
+
 	for (unsigned i = 0; i < options.threads; i++)
 	{
 		threadParam[i].pid = i+1;
-		threadParam[i].hits = hits;
+		threadParam[i].hits = hits ? hits : syntheticHits[i];
 		threadParam[i].aggregateRate = &aggregateRate;
 		threadParam[i].aggregateReadTimer = &aggregateReadTimer;
 		threadParam[i].aggregateWriteTimer = &aggregateWriteTimer;
+		threadParam[i].readTimer = readTimers[i] = new hiResTimer;
+		threadParam[i].writeTimer = writeTimers[i] = new hiResTimer;
+		threadParam[i].hitTimer = hitTimers[i] = new hiResTimer;
+		threadParam[i].lateTimer = lateTimers[i] = new hiResTimer;
+		threadParam[i].batchTimer = batchTimers[i] = new hiResTimer;
+		threadParam[i].batch = &batchCounters[i];
+		threadParam[i].stages = stages[i] = new stageTimers;
+		threadParam[i].perf = perf[i] = options.perfCounters ? new perfPhases : NULL;
+		threadParam[i].aggregateBacklog = &aggregateBacklog;
+		threadParam[i].live = &live[i];
+		threadParam[i].liveHitLatency = serveMetrics ? liveHitLatency[i] : NULL;
+		threadParam[i].storeStats = &storeStats;
 		
 		pthread_mutex_lock(&consoleMutex);
 		cout << parentPid << ": " << "Creating thread " << threadParam[i].pid << "\n";
@@ -984,6 +2534,17 @@ int main(int argc, char *argv[])
 		}
 	}
 	// all children finished at this point
+	unsigned long long runNS = hiResClock::NowNS() - startNS;
+	delete streamer;	// writes the final line
+	server.Stop();
+	if (options.mockPort)
+	{
+		mock.Stop();
+		cout << "\n" << parentPid << ": memcached stand-in requests = " << mock.Requests()
+			<< "; injected failures = " << mock.Injected() << "\n";
+	}
+	for (unsigned i = 0; i < liveHitLatency.size(); i++)
+		delete liveHitLatency[i];
 
 	// display aggregate rate of events per second
 	// no need for console mutex, single threaded at this point
@@ -1011,6 +2572,310 @@ int main(int argc, char *argv[])
 	cout << parentPid << ": aggregate readAvgNS = " << aggregateReadTimer << "\n";
 	cout << parentPid << ": aggregate writeAvgNS = " << aggregateWriteTimer << "\n";
 
+	if (!storeStats.empty())
+	{
+		cout << parentPid << ": store";
+		for (map<string, unsigned long long>::const_iterator stat = storeStats.begin(); stat != storeStats.end(); stat++)
+			cout << (stat == storeStats.begin() ? " " : "; ") << stat->first << " = " << stat->second;
+		cout << "\n";
+	}
+
+	// what optimistic concurrency costs: conflicts and retries per checked save
+	double casConflictRate = 0, casRetryRate = 0;
+	map<string, unsigned long long>::const_iterator casWrites = storeStats.find("cas.writes");
+	bool casChecked = casWrites != storeStats.end() && casWrites->second;
+	if (casChecked)
+	{
+		casConflictRate = (double) storeStats["cas.conflicts"] / storeStats["cas.writes"];
+		casRetryRate = (double) storeStats["cas.retries"] / storeStats["cas.writes"];
+		cout << parentPid << ": aggregate casConflictRate = " << casConflictRate
+			<< "; casRetryRate = " << casRetryRate
+			<< "; casFailures = " << storeStats["cas.failures"] << "\n";
+	}
+
+	// how much of the load traffic a cache decorator kept off the engine
+	double cacheHitRate = 0;
+	bool cached = storeStats.find("cache.entries") != storeStats.end();
+	if (cached)
+	{
+		unsigned long long cacheLookups = storeStats["cache.hits"] + storeStats["cache.misses"];
+		if (cacheLookups)
+			cacheHitRate = (double) storeStats["cache.hits"] / cacheLookups;
+		cout << parentPid << ": aggregate cacheHitRate = " << cacheHitRate
+			<< "; cacheEvictions = " << storeStats["cache.evictions"]
+			<< "; cacheRejections = " << storeStats["cache.rejections"]
+			<< "; cacheMB = " << storeStats["cache.bytes"] / (1024.0 * 1024) << "\n";
+	}
+
+	// what a write-behind decorator saved the engine: saves per write (the
+	// visitors still dirty when the stats were taken are written as the
+	// stores close), and the writes per second it didn't have to do
+	double coalescingRatio = 0, writeIopsSaved = 0;
+	bool writeBehind = storeStats.find("writebehind.saves") != storeStats.end();
+	if (writeBehind)
+	{
+		unsigned long long saves = storeStats["writebehind.saves"];
+		unsigned long long writes = storeStats["writebehind.writes"] + storeStats["writebehind.dirty"];
+		if (writes)
+			coalescingRatio = (double) saves / writes;
+		if (runNS && saves > writes)
+			writeIopsSaved = (saves - writes) / ((double) runNS / NANOSECOND);
+		cout << parentPid << ": aggregate coalescingRatio = " << coalescingRatio
+			<< "; writeIopsSaved = " << writeIopsSaved
+			<< "; writeFailures = " << storeStats["writebehind.failures"] << "\n";
+	}
+
+	// latency percentiles over all threads, for the run and for each second
+	hdrHistogram readLatency, writeLatency, hitLatency;
+	vector<unsigned long> readP99, writeP99, hitP99;
+	MergeLatency(readTimers, readLatency, readP99);
+	MergeLatency(writeTimers, writeLatency, writeP99);
+	MergeLatency(hitTimers, hitLatency, hitP99);
+
+	cout << parentPid << ": aggregate readLatencyNS" << PercentileSummary(readLatency) << "\n";
+	cout << parentPid << ": aggregate writeLatencyNS" << PercentileSummary(writeLatency) << "\n";
+	cout << parentPid << ": aggregate hitLatencyNS" << PercentileSummary(hitLatency) << "\n";
+	cout << parentPid << ": aggregate readP99NS = " << readP99 << "\n";
+	cout << parentPid << ": aggregate writeP99NS = " << writeP99 << "\n";
+	cout << parentPid << ": aggregate hitP99NS = " << hitP99 << "\n";
+
+	results.Series("rate", aggregateRate);
+	results.Series("readAvgNS", aggregateReadTimer);
+	results.Series("writeAvgNS", aggregateWriteTimer);
+	results.Series("readP99NS", readP99);
+	results.Series("writeP99NS", writeP99);
+	results.Series("hitP99NS", hitP99);
+	results.Latency("read", readLatency);
+	results.Latency("write", writeLatency);
+	results.Latency("hit", hitLatency);
+
+	if (options.openLoop)
+	{
+		hdrHistogram lateness;
+		vector<unsigned long> lateP99;
+		MergeLatency(lateTimers, lateness, lateP99);
+
+		cout << parentPid << ": aggregate lateNS" << PercentileSummary(lateness) << "\n";
+		cout << parentPid << ": aggregate lateP99NS = " << lateP99 << "\n";
+		if (options.replayRate <= 0)
+			cout << parentPid << ": aggregate backlog = " << aggregateBacklog << "\n";
+
+		results.Series("lateP99NS", lateP99);
+		if (options.replayRate <= 0)
+			results.Series("backlog", aggregateBacklog);
+		results.Latency("late", lateness);
+	}
+
+	if (options.batchSize > 1)
+	{
+		hdrHistogram batchLatency;
+		vector<unsigned long> batchP99;
+		MergeLatency(batchTimers, batchLatency, batchP99);
+
+		batchCounters_t total = { 0, 0, 0, 0 };
+		for (unsigned i = 0; i < options.threads; i++)
+		{
+			total.batches += batchCounters[i].batches;
+			total.visitors += batchCounters[i].visitors;
+			total.loads += batchCounters[i].loads;
+			total.saves += batchCounters[i].saves;
+		}
+		double batches = total.batches ? (double) total.batches : 1;
+		unsigned long long hits = 0;
+		for (unsigned i = 0; i < options.threads; i++)
+			hits += live[i].hits;
+
+		cout << parentPid << ": aggregate batchLatencyNS" << PercentileSummary(batchLatency) << "\n";
+		cout << parentPid << ": aggregate batchP99NS = " << batchP99 << "\n";
+		cout << parentPid << ": aggregate batches = " << total.batches
+			<< "; hitsPerBatch = " << hits / batches
+			<< "; visitorsPerBatch = " << total.visitors / batches
+			<< "; loadsPerBatch = " << total.loads / batches
+			<< "; savesPerBatch = " << total.saves / batches << "\n";
+
+		results.Series("batchP99NS", batchP99);
+		results.Latency("batch", batchLatency);
+		results.Run("batch.batches", total.batches);
+		results.Run("batch.hitsPerBatch", hits / batches);
+		results.Run("batch.visitorsPerBatch", total.visitors / batches);
+		results.Run("batch.loadsPerBatch", total.loads / batches);
+		results.Run("batch.savesPerBatch", total.saves / batches);
+	}
+
+#if !defined(VC_NO_STAGE_TIMING)
+	// where the time goes within a hit
+	for (unsigned stage = 0; stage < VC_STAGE_COUNT; stage++)
+	{
+		vector<hiResTimer *> timers;
+		for (unsigned i = 0; i < options.threads; i++)
+			timers.push_back(stages[i]->Timer(stage));
+
+		hdrHistogram latency;
+		vector<unsigned long> p99, average;
+		MergeLatency(timers, latency, p99);
+		MergeAverages(timers, average);
+
+		const char *name = VCStageSink::StageName((VCStage) stage);
+		cout << parentPid << ": aggregate " << name << "StageAvgNS = " << average << "\n";
+		cout << parentPid << ": aggregate " << name << "StageNS count = " << latency.Count() << ";" 
+			<< PercentileSummary(latency) << "\n";
+
+		results.Series(string(name) + "StageAvgNS", average);
+		results.Latency(string(name) + "Stage", latency);
+	}
+#endif
+
+	if (options.perfCounters)
+	{
+		perfPhases total;
+		for (unsigned i = 0; i < options.threads; i++)
+			total.Add(*perf[i]);
+
+		// a phase per line, then the whole hit
+		for (unsigned phase = 0; total.Hits() && phase <= PERF_PHASE_COUNT; phase++)
+		{
+			unsigned long long counts[perfCounters::COUNT];
+			for (unsigned i = 0; i < perfCounters::COUNT; i++)
+			{
+				counts[i] = 0;
+				for (unsigned p = 0; p < PERF_PHASE_COUNT; p++)
+					if (phase == PERF_PHASE_COUNT || p == phase)
+						counts[i] += total.Total(p, i);
+			}
+			string name = phase < PERF_PHASE_COUNT ? PERF_PHASE_NAMES[phase] : "hit";
+			double ipc = counts[perfCounters::CYCLES] ? 
+					(double) counts[perfCounters::INSTRUCTIONS] / counts[perfCounters::CYCLES] : 0;
+
+			cout << parentPid << ": aggregate " << name << "Perf samples = " << total.Hits();
+			results.Run("perf." + name + ".samples", total.Hits());
+			for (unsigned i = 0; i < perfCounters::COUNT; i++)
+			{
+				double perHit = (double) counts[i] / total.Hits();
+				cout << "; " << perfCounters::Name(i) << "PerHit = " << perHit;
+				results.Run("perf." + name + "." + perfCounters::Name(i) + "PerHit", perHit);
+			}
+			cout << "; ipc = " << ipc << "\n";
+			results.Run("perf." + name + ".ipc", ipc);
+		}
+
+		// multiplexed with other users of the PMU: the counts are a sample of a sample
+		if (total.Hits() && total.Coverage() < 0.99)
+			cout << parentPid << ": perf counters were on the PMU " << (unsigned)(total.Coverage() * 100) 
+				<< "% of the time\n";
+		if (total.Hits())
+			results.Run("perf.coverage", total.Coverage());
+		else
+			results.Run("perf", "unavailable");
+	}
+
+	if (!options.histogramFile.empty())
+	{
+		ofstream out(options.histogramFile.c_str());
+		out << "read "; readLatency.Write(out);
+		out << "write "; writeLatency.Write(out);
+		out << "hit "; hitLatency.Write(out);
+		out.close();
+
+		if (!out)
+			cout << "Unable to write latency histograms to " << options.histogramFile << "\n";
+	}
+
+	for (unsigned i = 0; i < options.threads; i++)
+	{
+		delete readTimers[i];
+		delete writeTimers[i];
+		delete hitTimers[i];
+		delete lateTimers[i];
+		delete batchTimers[i];
+		delete stages[i];
+		delete perf[i];
+	}
+
+	if (replay)
+	{
+		// stop the reader (in case we didn't consume every file) before looking at its numbers
+		replayReader &reader = replay->Reader();
+		reader.Stop();
+
+		// decompression throughput is measured over the time the reader was
+		// actually reading/decompressing, not the time it sat on a full ring
+		unsigned long decodeMBps = reader.DecodeNS() ? 
+				(unsigned long)((reader.BytesOut() * 1000.0) / reader.DecodeNS()) : 0;
+
+		// I/O wait per second in ms, separate from the per-hit timers
+		vector<unsigned long> ioWaitMS(reader.IOWaitPerSecond());
+		for (unsigned i = 0; i < ioWaitMS.size(); i++)
+			ioWaitMS[i] /= MICROSECOND;
+
+		cout << parentPid << ": input decompressedBytes = " << reader.BytesOutPerSecond() << "\n";
+		cout << parentPid << ": input ioWaitMS = " << ioWaitMS << "\n";
+		cout << parentPid << ": input bytesIn = " << reader.BytesIn()
+			<< "; bytesOut = " << reader.BytesOut()
+			<< "; decompressMBps = " << decodeMBps
+			<< "; ioWaitMS = " << reader.IOWaitNS() / MICROSECOND
+			<< "; readerBlockedMS = " << reader.ProducerWaitNS() / MICROSECOND
+			<< "; parserStarvedMS = " << reader.ConsumerWaitNS() / MICROSECOND
+			<< "\n";
+
+		results.Series("inputDecompressedBytes", reader.BytesOutPerSecond());
+		results.Series("inputIOWaitMS", ioWaitMS);
+		results.Run("inputBytesIn", reader.BytesIn());
+		results.Run("inputBytesOut", reader.BytesOut());
+		results.Run("inputDecompressMBps", decodeMBps);
+		results.Run("inputIOWaitMS", reader.IOWaitNS() / MICROSECOND);
+		results.Run("inputReaderBlockedMS", reader.ProducerWaitNS() / MICROSECOND);
+		results.Run("inputParserStarvedMS", reader.ConsumerWaitNS() / MICROSECOND);
+
+		delete hits;
+		hits = replay = NULL;
+	}
+
+	for (unsigned i = 0; i < syntheticHits.size(); i++)
+		delete syntheticHits[i];
+
+	if (!options.resultsFile.empty())
+	{
+		results.Run("harness", VERSION_STRING);
+		results.Run("engine", VCEngineRegistry::StackName(options.engine, options.engineDecorators));
+		results.Run("host", hostname);
+		results.Run("startTime", startTime);
+		results.Run("seconds", (double) runNS / NANOSECOND);
+		results.Run("clock", hiResClock::Source());
+#if !defined(VC_NO_STAGE_TIMING)
+		results.Run("stageTiming", "on");
+#else
+		results.Run("stageTiming", "off");
+#endif
+		if (options.purgeAge)
+		{
+			unsigned long long purged = 0, purgeNS = 0;
+			for (unsigned i = 0; i < options.threads; i++)
+			{
+				purged += live[i].purged;
+				purgeNS += live[i].purgeNS;
+			}
+			results.Run("purged", purged);
+			results.Run("purgeMS", purgeNS / MICROSECOND);
+		}
+		if (casChecked)
+		{
+			results.Run("casConflictRate", casConflictRate);
+			results.Run("casRetryRate", casRetryRate);
+		}
+		if (cached)
+			results.Run("cacheHitRate", cacheHitRate);
+		if (writeBehind)
+		{
+			results.Run("coalescingRatio", coalescingRatio);
+			results.Run("writeIopsSaved", writeIopsSaved);
+		}
+		results.CollectEnvironment();
+		results.StoreStats(storeStats);
+
+		if (!results.Write(options.resultsFile, options.resultsFormat))
+			cout << "Unable to write results to " << options.resultsFile << "\n";
+	}
+
 	pthread_mutex_destroy(&fileReadMutex);
 	pthread_mutex_destroy(&consoleMutex);
 	// pthread_exit(NULL);	// already joined all threads, this should be unnecessary
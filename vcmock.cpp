@@ -0,0 +1,80 @@
+/*
+ * The stand-in memcached server (memcachedMock.h) on its own, for a
+ * harness on another machine or a client other than the memcached engine:
+ *
+ *	./vcmock --port 11211
+ *	./vcmock --port 11211 --latency-us 500 --jitter-us 200 --error-rate 0.01
+ *
+ * Runs until interrupted, then prints how many requests it served.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "memcachedMock.h"
+
+#include <iostream>
+
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+	unsigned port;
+	memcachedMock::faults_t faults;
+	po::options_description commandLine("Options");
+	commandLine.add_options()
+		("help", "display help")
+		("port", po::value<unsigned>(&port)->default_value(11211), "port to listen on (127.0.0.1), 0 for any free one")
+		("latency-us", po::value<unsigned>(&faults.latencyUS)->default_value(0), "delay before each response")
+		("jitter-us", po::value<unsigned>(&faults.jitterUS)->default_value(0), "up to this much more delay, uniformly")
+		("error-rate", po::value<double>(&faults.errorRate)->default_value(0), "fraction of requests answered with a temporary failure")
+		("seed", po::value<unsigned>(&faults.seed)->default_value(1), "seed for the jitter and the failures")
+		;
+
+	po::variables_map vm;
+	try {
+		po::store(po::parse_command_line(argc, argv, commandLine), vm);
+		po::notify(vm);
+	}
+	catch (std::exception &e) {
+		cerr << "error: " << e.what() << "\n";
+		return 1;
+	}
+
+	if (vm.count("help"))
+	{
+		cout << commandLine << "\n";
+		return 0;
+	}
+
+	// blocked before the mock's threads start, so they inherit it and the
+	// signal always reaches the sigwait below
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	memcachedMock mock(faults);
+	if (!mock.Listen(port) || !mock.Start())
+	{
+		cerr << "error: can't listen on port " << port << ": " << strerror(errno) << "\n";
+		return 1;
+	}
+	printf("listening on 127.0.0.1:%u\n", mock.Port());
+	fflush(stdout);
+
+	int signal;
+	sigwait(&signals, &signal);
+
+	mock.Stop();
+	printf("%llu requests, %llu failures injected\n", mock.Requests(), mock.Injected());
+	return 0;
+}
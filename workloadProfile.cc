@@ -0,0 +1,505 @@
+#include "workloadProfile.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "abstraction/vcookie.h"
+#include "runResults.h"
+
+using namespace std;
+
+namespace {
+	// counts up to this many hits per visitor get their own bucket, then powers of two
+	const unsigned EXACT_BUCKETS = 16;
+
+	const unsigned EVAR_HLL_PRECISION = 12;
+
+	// splitmix64 finalizer
+	unsigned long long Mix(unsigned long long x)
+	{
+		x += 0x9e3779b97f4a7c15ULL;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+
+	// FNV-1a, finished with Mix so the top bits are usable by the HLL
+	unsigned long long StringHash(const string &s)
+	{
+		unsigned long long h = 0xcbf29ce484222325ULL;
+		for (string::size_type i = 0; i < s.length(); i++)
+		{
+			h ^= (unsigned char) s[i];
+			h *= 0x100000001b3ULL;
+		}
+		return Mix(h);
+	}
+
+	unsigned BucketOf(unsigned long long hits)
+	{
+		if (hits <= EXACT_BUCKETS)
+			return hits - 1;
+
+		unsigned bucket = EXACT_BUCKETS;
+		for (unsigned long long max = 2 * EXACT_BUCKETS; hits > max; max *= 2)
+			bucket++;
+		return bucket;
+	}
+
+	void BucketRange(unsigned bucket, unsigned long long &min, unsigned long long &max)
+	{
+		if (bucket < EXACT_BUCKETS)
+		{
+			min = max = bucket + 1;
+			return;
+		}
+
+		min = EXACT_BUCKETS + 1;
+		max = 2 * EXACT_BUCKETS;
+		for (unsigned b = EXACT_BUCKETS; b < bucket; b++)
+		{
+			min = max + 1;
+			max *= 2;
+		}
+	}
+
+	void WriteLength(ostream &os, const char *name, const lengthStats_t &stats)
+	{
+		os << "  " << JSONQuote(name) << ": { \"min\": " << stats.min
+			<< ", \"max\": " << stats.max
+			<< ", \"mean\": " << (stats.count ? (double) stats.sum / stats.count : 0)
+			<< " },\n";
+	}
+
+	unsigned Percentile(const vector<unsigned> &sorted, double p)
+	{
+		if (sorted.empty())
+			return 0;
+		size_t i = (size_t)(p * (sorted.size() - 1) + 0.5);
+		return sorted[min(i, sorted.size() - 1)];
+	}
+} // end anonymous namespace
+
+
+/*
+ * hyperLogLog
+ */
+
+hyperLogLog::hyperLogLog(unsigned _precision) :
+	precision(_precision), registers(1u << _precision, 0)
+{
+}
+
+void hyperLogLog::Add(unsigned long long hash)
+{
+	unsigned index = hash >> (64 - precision);
+	unsigned long long rest = hash << precision;
+
+	// position of the first 1 bit in what's left
+	unsigned char rank = rest ? __builtin_clzll(rest) + 1 : 64 - precision + 1;
+	if (rank > registers[index])
+		registers[index] = rank;
+}
+
+void hyperLogLog::Merge(const hyperLogLog &other)
+{
+	for (size_t i = 0; i < registers.size() && i < other.registers.size(); i++)
+		registers[i] = max(registers[i], other.registers[i]);
+}
+
+double hyperLogLog::Estimate(void) const
+{
+	double m = registers.size();
+	double sum = 0;
+	unsigned zeros = 0;
+
+	for (size_t i = 0; i < registers.size(); i++)
+	{
+		sum += ldexp(1.0, -registers[i]);
+		if (registers[i] == 0)
+			zeros++;
+	}
+
+	double alpha = 0.7213 / (1.0 + 1.079 / m);
+	double estimate = alpha * m * m / sum;
+
+	// small range correction (linear counting)
+	if (estimate <= 2.5 * m && zeros > 0)
+		estimate = m * log(m / zeros);
+
+	return estimate;
+}
+
+
+/*
+ * visitorHitCounter
+ */
+
+visitorHitCounter::visitorHitCounter(unsigned long long _maxVisitors) :
+	maxVisitors(_maxVisitors ? _maxVisitors : 1), level(0), kept(0)
+{
+	for (unsigned i = 0; i < SHARDS; i++)
+		pthread_mutex_init(&shards[i].mutex, NULL);
+	pthread_mutex_init(&thinning, NULL);
+}
+
+visitorHitCounter::~visitorHitCounter(void)
+{
+	for (unsigned i = 0; i < SHARDS; i++)
+		pthread_mutex_destroy(&shards[i].mutex);
+	pthread_mutex_destroy(&thinning);
+}
+
+void visitorHitCounter::Add(unsigned long long hash)
+{
+	// the shard comes from the top 6 bits (SHARDS), the sample from the
+	// bottom ones, or a thinned sample would all land in one shard
+	shard_t &s = shards[hash >> 58];
+	bool added = false;
+
+	pthread_mutex_lock(&s.mutex);
+	if (Sampled(hash, level))
+	{
+		map<unsigned long long, unsigned>::iterator count = s.counts.find(hash);
+		if (count == s.counts.end())
+		{
+			s.counts.insert(make_pair(hash, 1u));
+			added = true;
+		}
+		else
+			count->second++;
+	}
+	pthread_mutex_unlock(&s.mutex);
+
+	if (added && __sync_add_and_fetch(&kept, 1) > maxVisitors)
+		Thin();
+}
+
+void visitorHitCounter::Thin(void)
+{
+	pthread_mutex_lock(&thinning);
+	while (kept > maxVisitors && level < 63)
+	{
+		// a visitor sampled at the new level was sampled at every one before
+		// it, so those kept have been counted since their first hit
+		level++;
+		for (unsigned i = 0; i < SHARDS; i++)
+		{
+			pthread_mutex_lock(&shards[i].mutex);
+			map<unsigned long long, unsigned> &counts = shards[i].counts;
+			for (map<unsigned long long, unsigned>::iterator count = counts.begin(); count != counts.end(); )
+			{
+				if (Sampled(count->first, level))
+					++count;
+				else
+				{
+					counts.erase(count++);
+					__sync_sub_and_fetch(&kept, 1);
+				}
+			}
+			pthread_mutex_unlock(&shards[i].mutex);
+		}
+	}
+	pthread_mutex_unlock(&thinning);
+}
+
+void visitorHitCounter::Histogram(vector<unsigned long long> &buckets) const
+{
+	buckets.clear();
+	for (unsigned i = 0; i < SHARDS; i++)
+	{
+		const map<unsigned long long, unsigned> &counts = shards[i].counts;
+		for (map<unsigned long long, unsigned>::const_iterator count = counts.begin(); count != counts.end(); ++count)
+		{
+			unsigned bucket = BucketOf(count->second);
+			if (buckets.size() <= bucket)
+				buckets.resize(bucket + 1, 0);
+			buckets[bucket]++;
+		}
+	}
+}
+
+
+/*
+ * lengthStats
+ */
+
+void lengthStats::Add(unsigned len)
+{
+	if (count == 0 || len < min)
+		min = len;
+	if (len > max)
+		max = len;
+	sum += len;
+	count++;
+}
+
+void lengthStats::Merge(const lengthStats &other)
+{
+	if (other.count == 0)
+		return;
+	if (count == 0 || other.min < min)
+		min = other.min;
+	if (other.max > max)
+		max = other.max;
+	sum += other.sum;
+	count += other.count;
+}
+
+
+/*
+ * workloadProfile
+ */
+
+workloadProfile::workloadProfile(void) :
+	hits(0), newVisitorHits(0), purchaseHits(0), evarsSet(0),
+	firstHitTime(0), lastHitTime(0), visitorSampleRate(1),
+	evarValues(NUM_EVARS, hyperLogLog(EVAR_HLL_PRECISION))
+{
+	for (unsigned i = 0; i < NUM_EVARS; i++)
+		evarCount[i] = 0;
+}
+
+unsigned long long workloadProfile::VisitorHash(const hitData_t &hit)
+{
+	return Mix(hit.rsid ^ Mix(hit.visid_high ^ Mix(hit.visid_low)));
+}
+
+void workloadProfile::Add(const hitData_t &hit, visitorHitCounter &counter)
+{
+	hits++;
+
+	if (firstHitTime == 0 || hit.hit_time_gmt < firstHitTime)
+		firstHitTime = hit.hit_time_gmt;
+	if (hit.hit_time_gmt > lastHitTime)
+		lastHitTime = hit.hit_time_gmt;
+
+	if (hit.visid_new)
+		newVisitorHits++;
+	if (hit.purchaseid.length() > 0)
+		purchaseHits++;
+
+	reportSuites.insert(hit.rsid);
+
+	unsigned long long visitor = VisitorHash(hit);
+	visitors.Add(visitor);
+	counter.Add(visitor);
+
+	urlLength.Add(hit.page_url.length());
+	urlLength.Add(hit.referrer.length());
+
+	for (unsigned i = 0; i < NUM_EVARS; i++)
+	{
+		if (hit.evar[i].length())
+		{
+			evarsSet++;
+			evarCount[i]++;
+			evarValues[i].Add(StringHash(hit.evar[i]));
+			evarLength.Add(hit.evar[i].length());
+		}
+	}
+}
+
+void workloadProfile::Merge(const workloadProfile &other)
+{
+	if (other.hits == 0)
+		return;
+
+	if (hits == 0 || other.firstHitTime < firstHitTime)
+		firstHitTime = other.firstHitTime;
+	if (other.lastHitTime > lastHitTime)
+		lastHitTime = other.lastHitTime;
+
+	hits += other.hits;
+	newVisitorHits += other.newVisitorHits;
+	purchaseHits += other.purchaseHits;
+	evarsSet += other.evarsSet;
+
+	visitors.Merge(other.visitors);
+	reportSuites.insert(other.reportSuites.begin(), other.reportSuites.end());
+
+	for (unsigned i = 0; i < NUM_EVARS; i++)
+	{
+		evarCount[i] += other.evarCount[i];
+		evarValues[i].Merge(other.evarValues[i]);
+	}
+
+	evarLength.Merge(other.evarLength);
+	urlLength.Merge(other.urlLength);
+
+	cookieSizes.insert(cookieSizes.end(), other.cookieSizes.begin(), other.cookieSizes.end());
+}
+
+void workloadProfile::VisitorHits(const visitorHitCounter &counter)
+{
+	counter.Histogram(hitsPerVisitor);
+	visitorSampleRate = counter.SampleRate();
+}
+
+// least squares fit of log(hits) against log(popularity rank) over the buckets
+double workloadProfile::ZipfSkew(void) const
+{
+	double rank = 0;
+	double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+	// most popular visitors first
+	for (size_t b = hitsPerVisitor.size(); b-- > 0; )
+	{
+		if (hitsPerVisitor[b] == 0)
+			continue;
+
+		unsigned long long min, max;
+		BucketRange(b, min, max);
+
+		// the visitors in this bucket occupy the next block of ranks
+		double visitors = (double) hitsPerVisitor[b] * visitorSampleRate;
+		double middleRank = rank + (visitors + 1) / 2.0;
+		rank += visitors;
+
+		double x = log(middleRank);
+		double y = log(sqrt((double) min * max));
+		n++;
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+	}
+
+	if (n < 2 || n * sxx - sx * sx == 0)
+		return 0;
+
+	double skew = -(n * sxy - sx * sy) / (n * sxx - sx * sx);
+	return skew < 0 ? 0 : skew;
+}
+
+void workloadProfile::Write(ostream &os, const vector<string> &sources, unsigned sampleRate) const
+{
+	double span = lastHitTime > firstHitTime ? (double)(lastHitTime - firstHitTime) : 1;
+
+	os << "{\n";
+	os << "  \"version\": 1,\n";
+
+	os << "  \"sources\": [";
+	for (size_t i = 0; i < sources.size(); i++)
+		os << (i ? ", " : " ") << JSONQuote(sources[i]);
+	os << " ],\n";
+
+	os << "  \"hits\": " << hits << ",\n";
+	os << "  \"time_span\": { \"first\": " << firstHitTime
+		<< ", \"last\": " << lastHitTime
+		<< ", \"seconds\": " << (lastHitTime - firstHitTime)
+		<< ", \"hits_per_second\": " << hits / span
+		<< " },\n";
+
+	os << "  \"report_suites\": " << reportSuites.size() << ",\n";
+	os << "  \"visitors\": " << (unsigned long long)(visitors.Estimate() + 0.5) << ",\n";
+	os << "  \"new_visitor_ratio\": " << (hits ? (double) newVisitorHits / hits : 0) << ",\n";
+	os << "  \"zipf_skew\": " << ZipfSkew() << ",\n";
+	os << "  \"purchase_rate\": " << (hits ? (double) purchaseHits / hits : 0) << ",\n";
+
+	// the counts of the visitors in a 1 in N sample are scaled up by N, with
+	// the standard error of doing that (0 when every visitor was counted)
+	unsigned long long sampled = 0;
+	for (size_t b = 0; b < hitsPerVisitor.size(); b++)
+		sampled += hitsPerVisitor[b];
+	os << "  \"hits_per_visitor_sample\": { \"one_in\": " << visitorSampleRate
+		<< ", \"visitors\": " << sampled << " },\n";
+
+	os << "  \"hits_per_visitor\": [";
+	bool first = true;
+	double rate = visitorSampleRate;
+	for (size_t b = 0; b < hitsPerVisitor.size(); b++)
+	{
+		if (hitsPerVisitor[b] == 0)
+			continue;
+
+		unsigned long long min, max;
+		BucketRange(b, min, max);
+		os << (first ? "\n" : ",\n")
+			<< "    { \"min\": " << min << ", \"max\": " << max
+			<< ", \"visitors\": " << hitsPerVisitor[b] * visitorSampleRate
+			<< ", \"error\": " << (unsigned long long)(sqrt(hitsPerVisitor[b] * rate * (rate - 1)) + 0.5) << " }";
+		first = false;
+	}
+	os << "\n  ],\n";
+
+	os << "  \"evars_per_hit\": " << (hits ? (double) evarsSet / hits : 0) << ",\n";
+	os << "  \"evars\": [";
+	for (unsigned i = 0; i < NUM_EVARS; i++)
+	{
+		os << (i ? ",\n" : "\n")
+			<< "    { \"evar\": " << i + 1
+			<< ", \"frequency\": " << (hits ? (double) evarCount[i] / hits : 0)
+			<< ", \"cardinality\": " << (evarCount[i] ? (unsigned long long)(evarValues[i].Estimate() + 0.5) : 0)
+			<< " }";
+	}
+	os << "\n  ],\n";
+
+	WriteLength(os, "evar_length", evarLength);
+	WriteLength(os, "url_length", urlLength);
+
+	vector<unsigned> sizes(cookieSizes);
+	sort(sizes.begin(), sizes.end());
+	unsigned long long total = 0;
+	for (size_t i = 0; i < sizes.size(); i++)
+		total += sizes[i];
+
+	os << "  \"cookie_size\": { \"sample_rate\": " << sampleRate
+		<< ", \"sampled_visitors\": " << sizes.size()
+		<< ", \"min\": " << (sizes.empty() ? 0 : sizes.front())
+		<< ", \"p50\": " << Percentile(sizes, 0.50)
+		<< ", \"p90\": " << Percentile(sizes, 0.90)
+		<< ", \"p99\": " << Percentile(sizes, 0.99)
+		<< ", \"max\": " << (sizes.empty() ? 0 : sizes.back())
+		<< ", \"mean\": " << (sizes.empty() ? 0 : (double) total / sizes.size())
+		<< " }\n";
+
+	os << "}\n";
+}
+
+
+/*
+ * profileSampleStore
+ */
+
+profileSampleStore::profileSampleStore(void)
+{
+	pthread_mutex_init(&mutex, NULL);
+}
+
+profileSampleStore::~profileSampleStore(void)
+{
+	pthread_mutex_destroy(&mutex);
+}
+
+profileSampleStore::key_t profileSampleStore::Key(VCookie const &vcookie)
+{
+	return key_t(vcookie.GetUser(), make_pair(vcookie.GetVisIdHigh(), vcookie.GetVisIdLow()));
+}
+
+bool profileSampleStore::SaveVCookie(VCookie const &vcookie)
+{
+	Serialize(vcookie, blobs[Key(vcookie)]);
+	return true;
+}
+
+bool profileSampleStore::LoadVCookie(VCookie &vcookie)
+{
+	map<key_t, vector<char> >::const_iterator blob = blobs.find(Key(vcookie));
+	if (blob == blobs.end())
+		return false;
+
+	return Deserialize(vcookie, blob->second);
+}
+
+bool profileSampleStore::DeleteVCookie(VCookie &vcookie)
+{
+	return blobs.erase(Key(vcookie)) > 0;
+}
+
+void profileSampleStore::CookieSizes(workloadProfile &profile) const
+{
+	for (map<key_t, vector<char> >::const_iterator blob = blobs.begin(); blob != blobs.end(); ++blob)
+		profile.AddCookieSize(blob->second.size());
+}
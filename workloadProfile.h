@@ -0,0 +1,190 @@
+#ifndef WORKLOAD_PROFILE_H
+#define WORKLOAD_PROFILE_H
+
+#include <pthread.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include <boost/utility.hpp>
+
+#include "hitSource.h"
+#include "abstraction/vcookiestore.h"
+
+/*
+ * Replay file profiling (the harness' --profile mode)
+ *
+ * Describes the shape of a workload for capacity planning without
+ * touching a store: distinct visitors, hits per visitor, evar usage,
+ * string lengths, time span and the size of the cookies the hits build.
+ * Distinct counts use HyperLogLog. Hits per visitor are counted exactly
+ * for every visitor while they fit in profile-visitors-mb, and past that
+ * for a sample of the visitors, picked by hash, that is halved each time
+ * it fills up again, so memory stays fixed however big the input is.
+ *
+ * The JSON written by Write() can be fed back to the synthetic hit
+ * generator (synthetic-profile=) to reproduce the same shape.
+ */
+
+// distinct count estimator, standard error about 1.04/sqrt(2^precision)
+class hyperLogLog
+{
+	public:
+		hyperLogLog(unsigned precision = 14);
+
+		void Add(unsigned long long hash);
+		void Merge(const hyperLogLog &other);
+		double Estimate(void) const;
+
+	private:
+		unsigned				precision;
+		std::vector<unsigned char>	registers;
+};	// class hyperLogLog
+
+
+// exact hits per visitor, shared by all threads; once more than maxVisitors
+// are kept only those with the low level bits of their hash clear stay, so a
+// kept visitor's count is never short, the others are 1 in SampleRate()
+class visitorHitCounter : private boost::noncopyable
+{
+	public:
+		// about what keeping one visitor costs: a map node and the malloc header
+		static const unsigned BYTES_PER_VISITOR = 64;
+
+		visitorHitCounter(unsigned long long maxVisitors);
+		~visitorHitCounter(void);
+
+		// count one more hit for the visitor
+		void Add(unsigned long long hash);
+
+		// how many kept visitors have had n hits, in buckets (see BucketOf)
+		void Histogram(std::vector<unsigned long long> &buckets) const;
+
+		unsigned long long SampleRate(void) const { return 1ULL << level; }
+		unsigned long long Kept(void) const { return kept; }
+
+	private:
+		static const unsigned SHARDS = 64;
+
+		typedef struct shard
+		{
+			pthread_mutex_t							mutex;
+			std::map<unsigned long long, unsigned>	counts;
+		} shard_t;
+
+		static bool Sampled(unsigned long long hash, unsigned level)
+		{
+			return (hash & ((1ULL << level) - 1)) == 0;
+		}
+
+		// halve the sample until the kept visitors fit again
+		void Thin(void);
+
+		shard_t					shards[SHARDS];
+		unsigned long long		maxVisitors;
+		volatile unsigned		level;
+		unsigned long long		kept;		// updated atomically
+		pthread_mutex_t			thinning;
+};	// class visitorHitCounter
+
+
+// running min/max/mean of a length
+typedef struct lengthStats
+{
+	unsigned long long	count;
+	unsigned long long	sum;
+	unsigned			min;
+	unsigned			max;
+
+	lengthStats(void) : count(0), sum(0), min(0), max(0) {}
+	void Add(unsigned len);
+	void Merge(const lengthStats &other);
+} lengthStats_t;
+
+
+// statistics gathered by one profiling thread, merged at the end
+class workloadProfile
+{
+	public:
+		workloadProfile(void);
+
+		// account for one hit, visitor counts are shared between the threads
+		void Add(const hitData_t &hit, visitorHitCounter &counter);
+
+		void Merge(const workloadProfile &other);
+
+		// cookie sizes come from the sampled visitors at the end of the run
+		void AddCookieSize(unsigned bytes) { cookieSizes.push_back(bytes); }
+
+		// so do the hits per visitor, once every thread is done
+		void VisitorHits(const visitorHitCounter &counter);
+
+		// JSON workload profile
+		void Write(std::ostream &os, const std::vector<std::string> &sources, unsigned sampleRate) const;
+
+		unsigned long long Hits(void) const { return hits; }
+
+		// hash used for visitor identity (also picks the cookie size sample)
+		static unsigned long long VisitorHash(const hitData_t &hit);
+
+	private:
+		double ZipfSkew(void) const;
+
+		unsigned long long	hits;
+		unsigned long long	newVisitorHits;
+		unsigned long long	purchaseHits;
+		unsigned long long	evarsSet;
+		time_t				firstHitTime;
+		time_t				lastHitTime;
+
+		hyperLogLog			visitors;
+		std::set<unsigned>	reportSuites;
+
+		// number of kept visitors by hits seen, 1 in visitorSampleRate of them
+		std::vector<unsigned long long>	hitsPerVisitor;
+		unsigned long long	visitorSampleRate;
+
+		unsigned long long	evarCount[NUM_EVARS];
+		std::vector<hyperLogLog>	evarValues;
+
+		lengthStats_t		evarLength;
+		lengthStats_t		urlLength;
+
+		std::vector<unsigned>	cookieSizes;
+};	// class workloadProfile
+
+
+// exact cookies for a sample of the visitors, so their sizes can be measured
+// (thread safe)
+class profileSampleStore : public VCookieStore
+{
+	public:
+		profileSampleStore(void);
+		virtual ~profileSampleStore(void);
+
+		virtual bool SaveVCookie(VCookie const &vcookie);
+		virtual bool LoadVCookie(VCookie &vcookie);
+		virtual unsigned long long DeleteOldVCookies(time_t t) { return 0; }
+		virtual bool DeleteVCookie(VCookie &vcookie);
+		virtual unsigned long long GetVCookieCount(void) const { return blobs.size(); }
+		virtual bool GetVCookie(VCookie &vcookie, unsigned long long index) const { return false; }
+
+		// serialized size of every sampled cookie
+		void CookieSizes(workloadProfile &profile) const;
+
+		// one visitor at a time: hold the lock across load, update and save
+		void Lock(void) { pthread_mutex_lock(&mutex); }
+		void Unlock(void) { pthread_mutex_unlock(&mutex); }
+
+	private:
+		typedef std::pair<unsigned, std::pair<unsigned long long, unsigned long long> > key_t;
+		static key_t Key(VCookie const &vcookie);
+
+		std::map<key_t, std::vector<char> >	blobs;
+		pthread_mutex_t	mutex;
+};	// class profileSampleStore
+
+#endif // WORKLOAD_PROFILE_H